@@ -0,0 +1,168 @@
+/*
+ * BlocklistOverlay.cpp - ブロックリストへの差分の実装
+ */
+
+#include "BlocklistOverlay.h"
+
+#define SLOT_EMPTY BLOCKLIST_OVERLAY_NONE
+#define SLOT_DELETED 3                                          // 取り消した差分（探索は継続）
+#define TABLE_MASK (BLOCKLIST_OVERLAY_TABLE_SIZE - 1)
+#define TABLE_LOAD_LIMIT (BLOCKLIST_OVERLAY_TABLE_SIZE * 3 / 4)  // 墓標を含む使用率の上限（探索長を抑える）
+#define NAME_SIZE_MAX 253
+
+BlocklistOverlay::BlocklistOverlay()
+  : slots(nullptr),
+    pool(nullptr),
+    poolUsed(0),
+    used(0),
+    addedCount(0),
+    removedCount(0) {
+}
+
+BlocklistOverlay::~BlocklistOverlay() {
+  free(slots);
+  free(pool);
+}
+
+bool BlocklistOverlay::allocate() {
+  if (slots) {
+    return true;
+  }
+  slots = (Slot*)calloc(BLOCKLIST_OVERLAY_TABLE_SIZE, sizeof(Slot));
+  pool = (char*)malloc(BLOCKLIST_OVERLAY_POOL_SIZE);
+  if (!slots || !pool) {
+    free(slots);
+    free(pool);
+    slots = nullptr;
+    pool = nullptr;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * すべての差分と墓標を捨てる（トライに統合した後）
+ */
+void BlocklistOverlay::clear() {
+  if (slots) {
+    memset(slots, 0, BLOCKLIST_OVERLAY_TABLE_SIZE * sizeof(Slot));
+  }
+  poolUsed = 0;
+  used = 0;
+  addedCount = 0;
+  removedCount = 0;
+}
+
+BlocklistOverlay::Slot* BlocklistOverlay::findSlot(uint32_t hash, const char* name, size_t len) const {
+  if (!slots) {
+    return nullptr;
+  }
+  for (uint32_t i = 0, index = hash & TABLE_MASK; i < BLOCKLIST_OVERLAY_TABLE_SIZE; i++, index = (index + 1) & TABLE_MASK) {
+    Slot& slot = slots[index];
+    if (slot.state == SLOT_EMPTY) {
+      return nullptr;
+    }
+    if (slot.state != SLOT_DELETED && slot.hash == hash && slot.nameLength == len &&
+        memcmp(pool + slot.nameOffset, name, len) == 0) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+bool BlocklistOverlay::set(uint32_t hash, const char* name, size_t len, BlocklistOverlayState state) {
+  Slot* slot = findSlot(hash, name, len);
+  if (slot) {
+    if (slot->state == BLOCKLIST_OVERLAY_ADDED) {
+      addedCount--;
+    } else {
+      removedCount--;
+    }
+    slot->state = state == BLOCKLIST_OVERLAY_NONE ? SLOT_DELETED : state;
+  } else {
+    if (state == BLOCKLIST_OVERLAY_NONE) {
+      return true;
+    }
+    if (len > NAME_SIZE_MAX || isFull() || !allocate()) {
+      return false;
+    }
+
+    // 最初の空きか墓標スロットに入れる（名前の領域は再利用しない）
+    uint32_t index = hash & TABLE_MASK;
+    while (slots[index].state != SLOT_EMPTY && slots[index].state != SLOT_DELETED) {
+      index = (index + 1) & TABLE_MASK;
+    }
+    slot = &slots[index];
+    if (slot->state == SLOT_EMPTY) {
+      used++;
+    }
+    memcpy(pool + poolUsed, name, len);
+    slot->hash = hash;
+    slot->nameOffset = poolUsed;
+    slot->nameLength = len;
+    slot->state = state;
+    poolUsed += len;
+  }
+
+  if (state == BLOCKLIST_OVERLAY_ADDED) {
+    addedCount++;
+  } else if (state == BLOCKLIST_OVERLAY_REMOVED) {
+    removedCount++;
+  }
+  return true;
+}
+
+BlocklistOverlayState BlocklistOverlay::find(uint32_t hash, const char* name, size_t len) const {
+  Slot* slot = findSlot(hash, name, len);
+  return slot ? (BlocklistOverlayState)slot->state : BLOCKLIST_OVERLAY_NONE;
+}
+
+bool BlocklistOverlay::mayContain(uint32_t hash) const {
+  if (getCount() == 0) {
+    return false;
+  }
+  for (uint32_t i = 0, index = hash & TABLE_MASK; i < BLOCKLIST_OVERLAY_TABLE_SIZE; i++, index = (index + 1) & TABLE_MASK) {
+    const Slot& slot = slots[index];
+    if (slot.state == SLOT_EMPTY) {
+      return false;
+    }
+    if (slot.state != SLOT_DELETED && slot.hash == hash) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlocklistOverlay::forEach(void (*callback)(uint32_t hash, const char* name, size_t len,
+                                                BlocklistOverlayState state, void* context), void* context) const {
+  if (getCount() == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < BLOCKLIST_OVERLAY_TABLE_SIZE; i++) {
+    const Slot& slot = slots[i];
+    if (slot.state == BLOCKLIST_OVERLAY_ADDED || slot.state == BLOCKLIST_OVERLAY_REMOVED) {
+      callback(slot.hash, pool + slot.nameOffset, slot.nameLength, (BlocklistOverlayState)slot.state, context);
+    }
+  }
+}
+
+uint16_t BlocklistOverlay::getCount() const {
+  return addedCount + removedCount;
+}
+
+uint16_t BlocklistOverlay::getAddedCount() const {
+  return addedCount;
+}
+
+uint16_t BlocklistOverlay::getRemovedCount() const {
+  return removedCount;
+}
+
+bool BlocklistOverlay::isFull() const {
+  return getCount() >= BLOCKLIST_OVERLAY_CAPACITY || used >= TABLE_LOAD_LIMIT ||
+         poolUsed + NAME_SIZE_MAX > BLOCKLIST_OVERLAY_POOL_SIZE;
+}
+
+size_t BlocklistOverlay::getSizeBytes() const {
+  return slots ? BLOCKLIST_OVERLAY_TABLE_SIZE * sizeof(Slot) + BLOCKLIST_OVERLAY_POOL_SIZE : 0;
+}
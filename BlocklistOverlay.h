@@ -0,0 +1,78 @@
+/*
+ * BlocklistOverlay.h - ブロックリストへの差分（追加・削除）
+ *
+ * DomainTrie は読み取り専用のバイト配列のため、1 ドメインの追加・削除のたびに
+ * 作り直すと全件の再構築が必要になります。差分はこの小さなハッシュ表に持ち、
+ * 照合時にトライと合わせて判定します。
+ *
+ * - ADDED: トライに無いドメインを追加（サブドメインを含めてブロック）
+ * - REMOVED: トライのドメインを無効化する墓標
+ * - 差分を取り消した（追加後に削除した等）エントリは表の墓標スロットになり、
+ *   名前の領域も含めて clear() まで再利用しない
+ *
+ * 表か名前の領域が埋まった場合は、トライに統合（圧縮）してから clear() します。
+ */
+
+#ifndef BLOCKLIST_OVERLAY_H
+#define BLOCKLIST_OVERLAY_H
+
+#include <Arduino.h>
+
+#define BLOCKLIST_OVERLAY_CAPACITY 256       // 有効な差分の最大件数
+#define BLOCKLIST_OVERLAY_TABLE_SIZE 512     // ハッシュ表のスロット数（2 のべき乗、墓標スロットを含む）
+#define BLOCKLIST_OVERLAY_POOL_SIZE 8192     // 名前を格納する領域（バイト）
+
+enum BlocklistOverlayState : uint8_t {
+  BLOCKLIST_OVERLAY_NONE = 0,     // 差分なし（トライのまま）
+  BLOCKLIST_OVERLAY_ADDED,
+  BLOCKLIST_OVERLAY_REMOVED
+};
+
+/**
+ * BlocklistOverlay クラス
+ *
+ * DNS タスクからのみ更新します。表と名前の領域は最初の差分で確保します。
+ * キーはサフィックスハッシュ（domainNameHash）で、名前を比較して一致を確定します。
+ */
+class BlocklistOverlay {
+public:
+  BlocklistOverlay();
+  ~BlocklistOverlay();
+
+  void clear();
+
+  // 名前は小文字化・検証済み。NONE を指定すると差分を取り消す。容量不足なら false
+  bool set(uint32_t hash, const char* name, size_t len, BlocklistOverlayState state);
+  BlocklistOverlayState find(uint32_t hash, const char* name, size_t len) const;
+  bool mayContain(uint32_t hash) const;         // 同じハッシュの差分があるか（照合の前段）
+
+  // 有効な差分を列挙する
+  void forEach(void (*callback)(uint32_t hash, const char* name, size_t len,
+                                BlocklistOverlayState state, void* context), void* context) const;
+
+  uint16_t getCount() const;
+  uint16_t getAddedCount() const;
+  uint16_t getRemovedCount() const;
+  bool isFull() const;                          // これ以上の差分を受け付けられない（要圧縮）
+  size_t getSizeBytes() const;
+
+private:
+  struct Slot {
+    uint32_t hash;
+    uint16_t nameOffset;
+    uint8_t nameLength;
+    uint8_t state;                              // BlocklistOverlayState または SLOT_EMPTY / SLOT_DELETED
+  };
+
+  Slot* slots;
+  char* pool;
+  uint16_t poolUsed;
+  uint16_t used;                                // 墓標を含む使用中スロット数
+  uint16_t addedCount;
+  uint16_t removedCount;
+
+  Slot* findSlot(uint32_t hash, const char* name, size_t len) const;
+  bool allocate();
+};
+
+#endif // BLOCKLIST_OVERLAY_H
@@ -0,0 +1,493 @@
+/*
+ * BlocklistParser.cpp - ブロックリストの逐次パーサーの実装
+ */
+
+#include "BlocklistParser.h"
+#include "Config.h"
+
+#define GZIP_FIRST_BYTE 0x1F
+
+BlocklistParser::BlocklistParser()
+  : started(false),
+    compressed(false),
+    headerUsed(0),
+    formatKnown(false),
+    binary(false),
+    failed(false),
+    error(nullptr),
+    payload(nullptr),
+    payloadSize(0),
+    payloadUsed(0),
+    expectedCrc(0),
+    lineUsed(0),
+    lineOverflow(false),
+    textFormatKnown(false),
+    adblock(false),
+    peakBytes(0) {
+  memset(formatDomains, 0, sizeof(formatDomains));
+}
+
+BlocklistParser::~BlocklistParser() {
+  abort();
+}
+
+void BlocklistParser::begin() {
+  abort();
+  started = false;
+  compressed = false;
+  headerUsed = 0;
+  formatKnown = false;
+  binary = false;
+  failed = false;
+  error = nullptr;
+  payloadSize = 0;
+  payloadUsed = 0;
+  expectedCrc = 0;
+  lineUsed = 0;
+  lineOverflow = false;
+  textFormatKnown = false;
+  adblock = false;
+  memset(formatDomains, 0, sizeof(formatDomains));
+  peakBytes = 0;
+}
+
+void BlocklistParser::abort() {
+  releaseBuffers();
+  inflater.end();
+}
+
+void BlocklistParser::releaseBuffers() {
+  builder.clear();
+  free(payload);
+  payload = nullptr;
+}
+
+/**
+ * 失敗を記録して作業領域を解放する
+ *
+ * 展開中の sink から呼ばれることがあるため、展開器の作業領域は feed() に戻ってから解放する。
+ */
+void BlocklistParser::fail(const char* reason) {
+  if (!failed) {
+    failed = true;
+    error = reason;
+  }
+  releaseBuffers();
+}
+
+bool BlocklistParser::feed(const uint8_t* data, size_t len) {
+  if (failed) {
+    return false;
+  }
+  if (len == 0) {
+    return true;
+  }
+
+  // gzip は先頭 1 バイトで判定し、展開した結果を同じ手順で解釈する
+  if (!started) {
+    started = true;
+    compressed = data[0] == GZIP_FIRST_BYTE;
+    if (compressed && !inflater.begin()) {
+      fail(inflater.getError());
+      return false;
+    }
+  }
+  if (!compressed) {
+    return feedDecoded(data, len);
+  }
+
+  if (!inflater.feed(data, len, feedInflated, this)) {
+    fail(inflater.getError());  // sink の失敗は feedDecoded 側で理由を記録済み
+    inflater.end();
+    return false;
+  }
+  return true;
+}
+
+bool BlocklistParser::feedInflated(const uint8_t* data, size_t len, void* context) {
+  return static_cast<BlocklistParser*>(context)->feedDecoded(data, len);
+}
+
+bool BlocklistParser::feedDecoded(const uint8_t* data, size_t len) {
+  if (failed) {
+    return false;
+  }
+
+  // 形式が決まるまでは先頭のマジック分を header に貯める
+  if (!formatKnown) {
+    size_t take = DOMAIN_TRIE_FILE_MAGIC_SIZE - headerUsed;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(header + headerUsed, data, take);
+    headerUsed += take;
+    data += take;
+    len -= take;
+    if (headerUsed < DOMAIN_TRIE_FILE_MAGIC_SIZE) {
+      return true;
+    }
+
+    formatKnown = true;
+    binary = memcmp(header, DOMAIN_TRIE_FILE_MAGIC, DOMAIN_TRIE_FILE_MAGIC_SIZE) == 0;
+    if (!binary) {
+      feedText(header, headerUsed);  // 貯めた分はテキストの先頭
+    }
+  }
+
+  if (binary) {
+    return feedBinary(data, len);
+  }
+  feedText(data, len);
+  return !failed;
+}
+
+bool BlocklistParser::feedBinary(const uint8_t* data, size_t len) {
+  // ファイルヘッダーの残り
+  if (headerUsed < DOMAIN_TRIE_FILE_HEADER_SIZE) {
+    size_t take = DOMAIN_TRIE_FILE_HEADER_SIZE - headerUsed;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(header + headerUsed, data, take);
+    headerUsed += take;
+    data += take;
+    len -= take;
+    if (headerUsed < DOMAIN_TRIE_FILE_HEADER_SIZE) {
+      return true;
+    }
+
+    if (!parseDomainTrieFileHeader(header, &payloadSize, &expectedCrc)) {
+      fail("バイナリブロックリストのヘッダーが不正です");
+      return false;
+    }
+    // バイト配列は受け取ったまま DomainTrie に渡す（解析処理なし）
+    payload = (uint8_t*)malloc(payloadSize);
+    if (!payload) {
+      fail("メモリ割り当てに失敗しました");
+      return false;
+    }
+    peakBytes = payloadSize;
+  }
+
+  if (len > payloadSize - payloadUsed) {
+    fail("バイナリブロックリストのサイズがヘッダーと一致しません");
+    return false;
+  }
+  memcpy(payload + payloadUsed, data, len);
+  payloadUsed += len;
+  return true;
+}
+
+void BlocklistParser::feedText(const uint8_t* data, size_t len) {
+  const char* text = (const char*)data;
+  const char* end = text + len;
+  while (text < end) {
+    const char* newline = (const char*)memchr(text, '\n', end - text);
+    size_t take = (newline ? newline : end) - text;
+
+    if (newline && lineUsed == 0 && !lineOverflow) {
+      parseLine(text, take);  // チャンク内で完結する行はコピーせずに解釈
+    } else {
+      // チャンクをまたぐ行は line に持ち越す
+      if (lineUsed + take < BLOCKLIST_LINE_SIZE) {
+        memcpy(line + lineUsed, text, take);
+        lineUsed += take;
+      } else {
+        lineOverflow = true;
+      }
+      if (newline) {
+        flushLine();
+      }
+    }
+
+    if (!newline) {
+      break;
+    }
+    text = newline + 1;
+  }
+}
+
+void BlocklistParser::flushLine() {
+  if (!lineOverflow) {
+    parseLine(line, lineUsed);
+  }
+  lineUsed = 0;
+  lineOverflow = false;
+}
+
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool startsWith(const char* text, size_t len, const char* prefix) {
+  size_t prefixLen = strlen(prefix);
+  return len >= prefixLen && memcmp(text, prefix, prefixLen) == 0;
+}
+
+static const char* findText(const char* text, size_t len, const char* needle) {
+  size_t needleLen = strlen(needle);
+  for (size_t i = 0; i + needleLen <= len; i++) {
+    if (memcmp(text + i, needle, needleLen) == 0) {
+      return text + i;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * 1 行を解釈してビルダーに追加する（text は変更しない）
+ */
+void BlocklistParser::parseLine(const char* text, size_t len) {
+  if (len >= BLOCKLIST_LINE_SIZE) {
+    return;  // どのドメインよりも長い行（チャンクの区切り方によらず同じ結果にする）
+  }
+
+  while (len > 0 && isBlank(text[0])) {
+    text++;
+    len--;
+  }
+  while (len > 0 && isBlank(text[len - 1])) {
+    len--;
+  }
+  if (len == 0) {
+    return;
+  }
+
+  // 形式は最初のコメント以外の行で判定する
+  if (!textFormatKnown && text[0] != '#') {
+    textFormatKnown = true;
+    adblock = text[0] == '[' || text[0] == '!' || text[0] == '|' || startsWith(text, len, "@@");
+  }
+  if (adblock) {
+    parseAdblockRule(text, len);
+    return;
+  }
+
+  // コメント行をスキップ
+  if (text[0] == '#' || text[0] == '!') {
+    return;
+  }
+  if (startsWith(text, len, "||")) {
+    parseAdblockRule(text, len);
+    return;
+  }
+
+  // 先頭の語を取り出す
+  size_t tokenEnd = 0;
+  while (tokenEnd < len && !isBlank(text[tokenEnd])) {
+    tokenEnd++;
+  }
+
+  // hosts 形式: ブロック用アドレスの後に続くホスト名をすべて追加
+  static const char* const HOSTS_ADDRESSES[] = {"0.0.0.0", "127.0.0.1", "::", "::1"};
+  for (size_t a = 0; a < sizeof(HOSTS_ADDRESSES) / sizeof(HOSTS_ADDRESSES[0]); a++) {
+    if (tokenEnd != strlen(HOSTS_ADDRESSES[a]) || memcmp(text, HOSTS_ADDRESSES[a], tokenEnd) != 0) {
+      continue;
+    }
+    size_t pos = tokenEnd;
+    while (pos < len) {
+      while (pos < len && isBlank(text[pos])) {
+        pos++;
+      }
+      if (pos == len || text[pos] == '#') {
+        break;
+      }
+      size_t start = pos;
+      while (pos < len && !isBlank(text[pos])) {
+        pos++;
+      }
+      addDomain(text + start, pos - start, BLOCKLIST_TEXT_HOSTS);
+    }
+    return;
+  }
+
+  // 1 行 1 ドメイン（後ろのコメントは許可）
+  size_t rest = tokenEnd;
+  while (rest < len && isBlank(text[rest])) {
+    rest++;
+  }
+  if (rest == len || text[rest] == '#') {
+    addDomain(text, tokenEnd, BLOCKLIST_TEXT_PLAIN);
+  }
+}
+
+/**
+ * Adblock Plus のルールからブロック対象のドメインを取り出す
+ */
+void BlocklistParser::parseAdblockRule(const char* text, size_t len) {
+  // コメント・ヘッダー・例外ルール・要素隠しルールをスキップ
+  if (text[0] == '!' || text[0] == '#' || text[0] == '[' || startsWith(text, len, "@@") ||
+      findText(text, len, "##") || findText(text, len, "#@#") || findText(text, len, "#?#")) {
+    return;
+  }
+
+  const char* caret = (const char*)memchr(text, '^', len);
+  const char* domain;
+  const char* end;
+  const char* stops;
+  if (startsWith(text, len, "||") && caret) {
+    domain = text + 2;            // ||domain^
+    end = caret;
+    stops = "/";
+  } else if (startsWith(text, len, "|http")) {
+    domain = findText(text, len, "://");  // |http://domain/path
+    if (!domain) {
+      return;
+    }
+    domain += 3;
+    end = text + len;
+    stops = "/?#";
+  } else if (caret && text[0] != '/') {
+    domain = text;                // domain^
+    end = caret;
+    stops = "/";
+  } else {
+    return;
+  }
+
+  // パスを含む場合はドメイン部分のみ
+  for (const char* p = domain; p < end; p++) {
+    if (strchr(stops, *p)) {
+      end = p;
+      break;
+    }
+  }
+  addDomain(domain, end - domain, BLOCKLIST_TEXT_ADBLOCK);
+}
+
+void BlocklistParser::addDomain(const char* domain, size_t len, BlocklistTextFormat format) {
+  if (isValidDomain(domain, len) && builder.add(domain, len)) {
+    formatDomains[format]++;
+  }
+}
+
+uint8_t* BlocklistParser::finish(size_t* outSize) {
+  if (failed) {
+    return nullptr;
+  }
+
+  // 展開中の作業メモリ（窓と入力バッファ）は構築前に解放する
+  size_t inflatePeak = 0;
+  if (compressed) {
+    inflatePeak = GzipInflater::getWorkspaceBytes() + (binary ? payloadSize : builder.getPeakBytes());
+    if (!inflater.finish()) {
+      fail(inflater.getError());
+      return nullptr;
+    }
+  }
+
+  if (!formatKnown) {
+    // マジックより短い入力はテキストとして扱う
+    formatKnown = true;
+    feedText(header, headerUsed);
+  }
+
+  uint8_t* blob = nullptr;
+  if (binary) {
+    if (headerUsed < DOMAIN_TRIE_FILE_HEADER_SIZE || payloadUsed != payloadSize) {
+      fail("バイナリブロックリストが途中で終わっています");
+      return nullptr;
+    }
+    if (domainTrieCrc32(payload, payloadSize) != expectedCrc) {
+      fail("バイナリブロックリストが破損しています（CRC 不一致）");
+      return nullptr;
+    }
+    if (!DomainTrie::isValidBlob(payload, payloadSize)) {
+      fail("バイナリブロックリストの構造が不正です");
+      return nullptr;
+    }
+    blob = payload;
+    payload = nullptr;
+    *outSize = payloadSize;
+    if (inflatePeak > peakBytes) {
+      peakBytes = inflatePeak;
+    }
+    return blob;
+  }
+
+  if (lineUsed > 0 || lineOverflow) {
+    flushLine();  // 改行で終わらない最終行
+  }
+  if (builder.getKeyCount() == 0) {
+    fail("有効なドメインがありません");
+    return nullptr;
+  }
+
+  // トライを構築（作業領域は構築完了時に解放される）
+  blob = builder.build(outSize);
+  peakBytes = builder.getPeakBytes();
+  if (inflatePeak > peakBytes) {
+    peakBytes = inflatePeak;
+  }
+  if (!blob) {
+    fail("ブロックリストの構築に失敗しました（メモリ不足）");
+  }
+  return blob;
+}
+
+bool BlocklistParser::isBinary() const {
+  return binary;
+}
+
+bool BlocklistParser::isCompressed() const {
+  return compressed;
+}
+
+BlocklistTextFormat BlocklistParser::getTextFormat() const {
+  if (adblock) {
+    return BLOCKLIST_TEXT_ADBLOCK;
+  }
+  return formatDomains[BLOCKLIST_TEXT_HOSTS] > formatDomains[BLOCKLIST_TEXT_PLAIN] ?
+         BLOCKLIST_TEXT_HOSTS : BLOCKLIST_TEXT_PLAIN;
+}
+
+const char* BlocklistParser::getFormatName(bool binary, BlocklistTextFormat format) {
+  if (binary) {
+    return "バイナリ";
+  }
+  switch (format) {
+    case BLOCKLIST_TEXT_HOSTS:
+      return "hosts";
+    case BLOCKLIST_TEXT_ADBLOCK:
+      return "Adblock Plus";
+    default:
+      return "ドメインリスト";
+  }
+}
+
+bool BlocklistParser::hasFailed() const {
+  return failed;
+}
+
+size_t BlocklistParser::getPeakBytes() const {
+  return peakBytes;
+}
+
+const char* BlocklistParser::getError() const {
+  return error ? error : "";
+}
+
+bool BlocklistParser::isValidDomain(const char* domain, size_t len) {
+  if (len < DOMAIN_NAME_MIN_LENGTH || len > DOMAIN_NAME_MAX_LENGTH) {
+    return false;
+  }
+
+  if (domain[0] == '.' || domain[len - 1] == '.') {
+    return false;
+  }
+
+  bool hasDot = false;
+  for (size_t i = 0; i < len; i++) {
+    char c = domain[i];
+    if (c == '.') {
+      if (domain[i + 1] == '.') {
+        return false;
+      }
+      hasDot = true;
+    } else if (!isalnum((unsigned char)c) && c != '-' && c != '_') {
+      return false;
+    }
+  }
+
+  return hasDot;
+}
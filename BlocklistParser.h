@@ -0,0 +1,108 @@
+/*
+ * BlocklistParser.h - ブロックリストの逐次パーサー
+ *
+ * 任意の大きさに区切られたバイト列を順に受け取り、DomainTrie のバイト配列を組み立てます。
+ * アップロード中のチャンクやファイルのブロック読み込みをそのまま渡せるため、
+ * 全体をメモリやフラッシュに置いてから読み直す必要がありません。
+ *
+ * gzip（先頭 0x1F 0x8B）は GzipInflater で展開しながら、展開結果を以下と同じ手順で解釈します。
+ * 形式は先頭のマジックで判定します:
+ * - コンパイル済み（"MRBL"）: ヘッダーの payloadSize 分を確保して受け取り、CRC を検証
+ * - テキスト: 最初の有効な行で次のどちらかを判定
+ *   - ドメインリスト: 1 行 1 ドメイン、または hosts 形式（0.0.0.0 / 127.0.0.1 / :: / ::1 の後に
+ *     ホスト名を並べた行）。# 以降はコメント。||domain^ の行も受け付ける
+ *   - Adblock Plus（先頭が [Adblock ... ] / ! / || など）: ||domain^・|http://domain・domain^ の
+ *     ルールからドメインを取り出す（tools/convert_adblock_to_domains.py と同じ規則）。
+ *     例外（@@）・要素隠し（##）・ドメインを特定できないルールは読み捨てる
+ *
+ * テキストは受け取ったチャンクの中でそのまま区切って解釈し、チャンクをまたぐ行だけを
+ * 固定長の line に持ち越します（行ごとのメモリ確保なし）。小文字化はビルダーへのコピー時に行います。
+ */
+
+#ifndef BLOCKLIST_PARSER_H
+#define BLOCKLIST_PARSER_H
+
+#include <Arduino.h>
+#include "DomainTrie.h"
+#include "GzipInflater.h"
+
+#define BLOCKLIST_LINE_SIZE 320          // 1 行の最大長（超える行は読み捨てる）
+#define BLOCKLIST_READ_CHUNK_SIZE 4096   // ファイルから読み込むときのブロックサイズ（読み込み中のみ確保）
+
+// テキストの形式（最も多くのドメインを取り出した形式）
+enum BlocklistTextFormat : uint8_t {
+  BLOCKLIST_TEXT_PLAIN = 0,
+  BLOCKLIST_TEXT_HOSTS,
+  BLOCKLIST_TEXT_ADBLOCK,
+  BLOCKLIST_TEXT_FORMAT_COUNT
+};
+
+/**
+ * BlocklistParser クラス
+ *
+ * begin() → feed() × n → finish() の順に呼びます。
+ * 途中で失敗した場合は以降の feed() を無視し、finish() が nullptr を返します。
+ */
+class BlocklistParser {
+public:
+  BlocklistParser();
+  ~BlocklistParser();
+
+  void begin();
+  bool feed(const uint8_t* data, size_t len);   // false: 形式不正・メモリ不足
+  uint8_t* finish(size_t* outSize);             // 成功時は malloc された DomainTrie のバイト配列
+  void abort();                                 // 作業領域を解放する
+
+  bool isBinary() const;
+  bool isCompressed() const;                    // gzip で圧縮されていたか
+  BlocklistTextFormat getTextFormat() const;
+  static const char* getFormatName(bool binary, BlocklistTextFormat format);  // 表示用
+  bool hasFailed() const;
+  size_t getPeakBytes() const;                  // 構築中の作業メモリ最大値
+  const char* getError() const;                 // 失敗の理由（表示用）
+
+  static bool isValidDomain(const char* domain, size_t len);
+
+private:
+  DomainTrieBuilder builder;
+  GzipInflater inflater;                        // 作業領域は gzip を受け取ったときだけ確保
+  bool started;
+  bool compressed;
+  uint8_t header[DOMAIN_TRIE_FILE_HEADER_SIZE]; // 形式判定・ファイルヘッダー用
+  size_t headerUsed;
+  bool formatKnown;
+  bool binary;
+  bool failed;
+  const char* error;
+
+  // コンパイル済み形式
+  uint8_t* payload;
+  uint32_t payloadSize;
+  uint32_t payloadUsed;
+  uint32_t expectedCrc;
+
+  // テキスト形式（チャンクをまたぐ行だけ line に持ち越す）
+  char line[BLOCKLIST_LINE_SIZE];
+  size_t lineUsed;
+  bool lineOverflow;
+  bool textFormatKnown;                         // 最初の有効な行を見たか
+  bool adblock;                                 // Adblock Plus のフィルタリスト
+  uint32_t formatDomains[BLOCKLIST_TEXT_FORMAT_COUNT];
+  size_t peakBytes;
+
+  bool feedDecoded(const uint8_t* data, size_t len);
+  static bool feedInflated(const uint8_t* data, size_t len, void* context);
+  bool feedBinary(const uint8_t* data, size_t len);
+  void feedText(const uint8_t* data, size_t len);
+  void flushLine();
+  void parseLine(const char* text, size_t len);
+  void parseAdblockRule(const char* text, size_t len);
+  void addDomain(const char* domain, size_t len, BlocklistTextFormat format);
+  void fail(const char* reason);
+  void releaseBuffers();
+
+  BlocklistParser(const BlocklistParser&) = delete;
+  BlocklistParser& operator=(const BlocklistParser&) = delete;
+};
+
+#endif // BLOCKLIST_PARSER_H
@@ -0,0 +1,117 @@
+/*
+ * BloomFilter.cpp - ブロックリスト照合前の確率的プレフィルタの実装
+ */
+
+#include "BloomFilter.h"
+#include <math.h>
+
+// murmur3 の finalizer。入力ハッシュ（FNV-1a）の偏りを均して
+// double hashing の 2 つのハッシュ値を作る
+static uint32_t mixHash(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85EBCA6B;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35;
+  h ^= h >> 16;
+  return h;
+}
+
+// 除算を使わずに [0, range) へ写像する
+static uint32_t reduceRange(uint32_t x, uint32_t range) {
+  return (uint32_t)(((uint64_t)x * range) >> 32);
+}
+
+BloomFilter::BloomFilter()
+  : bits(nullptr),
+    bitCount(0),
+    entryCount(0),
+    hashCount(0) {
+}
+
+BloomFilter::~BloomFilter() {
+  reset();
+}
+
+bool BloomFilter::init(uint32_t entries, uint8_t bitsPerEntry) {
+  reset();
+  if (entries == 0 || bitsPerEntry == 0) {
+    return true;  // 無効（すべて「登録の可能性あり」として扱う）
+  }
+
+  // 32 ビット単位に切り上げ
+  uint32_t words = ((uint64_t)entries * bitsPerEntry + 31) / 32;
+  bits = (uint32_t*)calloc(words, sizeof(uint32_t));
+  if (!bits) {
+    return false;
+  }
+
+  bitCount = words * 32;
+  entryCount = entries;
+  hashCount = (uint8_t)lroundf(bitsPerEntry * 0.6931f);
+  if (hashCount < 1) {
+    hashCount = 1;
+  } else if (hashCount > BLOOM_FILTER_MAX_HASHES) {
+    hashCount = BLOOM_FILTER_MAX_HASHES;
+  }
+  return true;
+}
+
+void BloomFilter::reset() {
+  if (bits) {
+    free(bits);
+  }
+  bits = nullptr;
+  bitCount = 0;
+  entryCount = 0;
+  hashCount = 0;
+}
+
+void BloomFilter::add(uint32_t hash) {
+  if (!bits) {
+    return;
+  }
+  hash = mixHash(hash);
+  uint32_t step = mixHash(hash ^ 0x9E3779B9) | 1;
+  for (uint8_t i = 0; i < hashCount; i++) {
+    uint32_t pos = reduceRange(hash, bitCount);
+    bits[pos >> 5] |= 1u << (pos & 31);
+    hash += step;
+  }
+}
+
+bool BloomFilter::mayContain(uint32_t hash) const {
+  if (!bits) {
+    return true;
+  }
+  hash = mixHash(hash);
+  uint32_t step = mixHash(hash ^ 0x9E3779B9) | 1;
+  for (uint8_t i = 0; i < hashCount; i++) {
+    uint32_t pos = reduceRange(hash, bitCount);
+    if ((bits[pos >> 5] & (1u << (pos & 31))) == 0) {
+      return false;
+    }
+    hash += step;
+  }
+  return true;
+}
+
+bool BloomFilter::isActive() const {
+  return bits != nullptr;
+}
+
+size_t BloomFilter::getSizeBytes() const {
+  return bitCount / 8;
+}
+
+uint8_t BloomFilter::getHashCount() const {
+  return hashCount;
+}
+
+float BloomFilter::getEstimatedFalsePositiveRate() const {
+  if (!bits) {
+    return 1.0f;
+  }
+  // (1 - e^(-k n / m))^k
+  float fill = 1.0f - expf(-(float)hashCount * entryCount / bitCount);
+  return powf(fill, hashCount);
+}
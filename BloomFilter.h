@@ -0,0 +1,48 @@
+/*
+ * BloomFilter.h - ブロックリスト照合前の確率的プレフィルタ
+ *
+ * ブロックリストに登録されたドメイン（サフィックス）のハッシュを保持し、
+ * 「確実に未登録」であるクエリを数回のビット参照だけで判定します。
+ * 偽陽性（未登録なのに「登録の可能性あり」）は後段の DomainTrie で除外されます。
+ */
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <Arduino.h>
+
+#define BLOOM_FILTER_MAX_HASHES 8  // ハッシュ関数の最大数
+
+/**
+ * BloomFilter クラス
+ *
+ * 1 エントリあたりのビット数でメモリ量と偽陽性率を決めます
+ * （ハッシュ関数の数は ビット数 × ln2 に自動設定）。
+ */
+class BloomFilter {
+public:
+  BloomFilter();
+  ~BloomFilter();
+
+  bool init(uint32_t entries, uint8_t bitsPerEntry);  // bitsPerEntry = 0 で無効
+  void reset();
+
+  void add(uint32_t hash);
+  bool mayContain(uint32_t hash) const;
+
+  bool isActive() const;
+  size_t getSizeBytes() const;
+  uint8_t getHashCount() const;
+  float getEstimatedFalsePositiveRate() const;  // 1 サフィックスあたりの理論値
+
+private:
+  uint32_t* bits;
+  uint32_t bitCount;
+  uint32_t entryCount;
+  uint8_t hashCount;
+
+  BloomFilter(const BloomFilter&) = delete;
+  BloomFilter& operator=(const BloomFilter&) = delete;
+};
+
+#endif // BLOOM_FILTER_H
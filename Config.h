@@ -26,6 +26,7 @@ extern const unsigned long STATUS_PRINT_INTERVAL;    // ステータス表示間
 extern const unsigned long STA_CONNECTION_TIMEOUT;   // STA接続タイムアウト（ミリ秒）
 extern const unsigned long CONFIG_SAVE_DELAY;        // 設定保存後の再起動遅延（ミリ秒）
 extern const unsigned long NAT_ENABLE_DELAY;         // NAT有効化前の遅延（ミリ秒）
+extern const unsigned long STATS_HISTORY_UPDATE_INTERVAL; // クエリ数・空きヒープの推移の記録間隔（ミリ秒）
 
 // ===== メモリ管理設定 =====
 extern const uint32_t MIN_FREE_HEAP_WARNING;  // メモリ不足警告閾値（バイト）
@@ -67,6 +68,7 @@ extern const uint16_t HTTP_STATUS_SEE_OTHER;         // 303 See Other
 extern const uint16_t HTTP_STATUS_BAD_REQUEST;       // 400 Bad Request
 extern const uint16_t HTTP_STATUS_NOT_FOUND;         // 404 Not Found
 extern const uint16_t HTTP_STATUS_INTERNAL_ERROR;    // 500 Internal Server Error
+extern const uint16_t HTTP_STATUS_SERVICE_UNAVAILABLE; // 503 Service Unavailable
 
 // ===== 単位換算定数 =====
 extern const uint32_t BYTES_TO_KB_DIVISOR;           // バイトから KB への変換（1024）
@@ -75,26 +77,90 @@ extern const uint8_t PERCENTAGE_MULTIPLIER;          // パーセント計算用
 
 // ===== DNS 設定 =====
 extern const IPAddress DEFAULT_UPSTREAM_DNS;         // デフォルト上流DNSサーバー（Google DNS 8.8.8.8）
-extern const uint16_t DNS_FORWARD_TIMEOUT;           // DNS 転送タイムアウト（ミリ秒）
-extern const unsigned long DNS_POLLING_INTERVAL;     // DNS ポーリング間隔（ミリ秒）
+extern const IPAddress DEFAULT_UPSTREAM_DNS_SECONDARY; // デフォルト予備DNSサーバー（Cloudflare 1.1.1.1）
+extern const uint16_t DNS_FORWARD_TIMEOUT;           // DNS 転送タイムアウトの上限・未計測時の値（ミリ秒）
+extern const uint32_t DNS_TASK_STACK_SIZE;           // DNS タスクのスタックサイズ（バイト）
+extern const uint8_t DNS_TASK_PRIORITY;              // DNS タスクの優先度（loop() は 1）
+extern const uint8_t DNS_MAX_PACKETS_PER_LOOP;       // handleClient() 1 回で処理するクエリ数の上限
+extern const uint32_t DNS_LOOP_BUDGET_US;            // handleClient() 1 回でクエリ処理に使う時間の上限（マイクロ秒）
+extern const uint32_t DNS_TCP_IDLE_TIMEOUT;          // 応答待ちの無い TCP 接続を閉じるまでの時間（ミリ秒）
+extern const uint16_t DNS_UPSTREAM_TCP_CONNECT_TIMEOUT;  // 上流への TCP のハンドシェイクを失敗とみなすまでの時間（ミリ秒、待たずに UDP で問い合わせる）
+extern const uint32_t DNS_UPSTREAM_TCP_BACKOFF_MIN;  // 上流 TCP の失敗後、次の接続まで待つ最初の時間（ミリ秒）
+extern const uint32_t DNS_UPSTREAM_TCP_BACKOFF_MAX;  // 同・上限（失敗が続くたびに倍にする）
+extern const uint16_t DNS_UPSTREAM_MIN_TIMEOUT;      // RTT から求めるタイムアウトの下限（ミリ秒）
+extern const uint8_t DNS_UPSTREAM_MAX_FAILURES;      // 連続タイムアウトでリゾルバを候補から外す回数
+extern const unsigned long DNS_UPSTREAM_RETRY_INTERVAL; // 候補から外したリゾルバを再び試すまでの時間（ミリ秒）
+extern const unsigned long DNS_UPSTREAM_PROBE_INTERVAL; // 選ばれていないリゾルバに RTT 計測のため 1 回送るまでの時間（ミリ秒）
+extern const unsigned long DNS_STATUS_PUBLISH_INTERVAL; // 統計・リゾルバの状態を Web UI に公開する間隔（ミリ秒）
+extern const unsigned long DNS_TRAFFIC_PUBLISH_INTERVAL; // 上位ドメイン・クライアント別集計を Web UI に公開する間隔（ミリ秒）
+extern const char* PREF_KEY_DNS_UPSTREAMS;
+extern const char* PREF_KEY_DNS_UPSTREAM_RACE;
+extern const char* PREF_KEY_DNS_UPSTREAM_TCP;
 
 // ===== DNS パケット定数 =====
 extern const uint8_t DNS_COMPRESSION_POINTER_MASK;   // DNS 圧縮ポインタマスク（0xC0）
 extern const uint8_t DNS_LABEL_MAX_LENGTH;           // DNS ラベル最大長（63）
-extern const uint8_t DNS_RESPONSE_FLAGS_BYTE2;       // DNS 応答フラグ byte 2（0x81）
 extern const uint8_t DNS_RESPONSE_FLAGS_BYTE3;       // DNS 応答フラグ byte 3（0x80）
 extern const uint16_t DNS_COMPRESSION_POINTER_QUERY; // DNS 圧縮ポインタ Query セクション先頭（0xC00C）
 extern const uint16_t DNS_TYPE_A;                    // DNS Type A レコード（0x0001）
+extern const uint16_t DNS_TYPE_AAAA;                 // DNS Type AAAA レコード（0x001C）
+extern const uint16_t DNS_TYPE_SOA;                  // DNS Type SOA レコード（0x0006）
+extern const uint16_t DNS_TYPE_OPT;                  // DNS Type OPT 疑似レコード（41、EDNS）
 extern const uint16_t DNS_CLASS_IN;                  // DNS Class IN（0x0001）
 extern const uint32_t DNS_TTL_SECONDS;               // DNS TTL（秒）
 extern const uint8_t DNS_IPV4_ADDRESS_LENGTH;        // IPv4 アドレス長（4バイト）
+extern const uint8_t DNS_IPV6_ADDRESS_LENGTH;        // IPv6 アドレス長（16バイト）
+extern const uint8_t DNS_RCODE_SERVFAIL;             // DNS RCODE SERVFAIL（2）
+extern const uint8_t DNS_RCODE_NXDOMAIN;             // DNS RCODE NXDOMAIN（3）
+extern const uint8_t DNS_RCODE_REFUSED;              // DNS RCODE REFUSED（5）
 extern const IPAddress DNS_BLOCKED_IP;               // ブロック時の返信IPアドレス（0.0.0.0）
 
+// ===== ブロック応答ポリシー設定 =====
+extern const char* PREF_KEY_DNS_BLOCK_POLICY;
+extern const char* PREF_KEY_DNS_TTL_NULL_IP;
+extern const char* PREF_KEY_DNS_TTL_NODATA;
+extern const char* PREF_KEY_DNS_TTL_NXDOMAIN;
+extern const uint32_t DNS_NEGATIVE_TTL_SECONDS;      // NODATA / NXDOMAIN の既定 TTL（秒）
+extern const uint32_t DNS_BLOCK_TTL_MAX;             // 設定可能な TTL の上限（秒）
+extern const uint32_t DNS_SOA_SERIAL;                // 合成 SOA のシリアル
+extern const uint32_t DNS_SOA_REFRESH_SECONDS;       // 合成 SOA の REFRESH（秒）
+extern const uint32_t DNS_SOA_RETRY_SECONDS;         // 合成 SOA の RETRY（秒）
+extern const uint32_t DNS_SOA_EXPIRE_SECONDS;        // 合成 SOA の EXPIRE（秒）
+
+// ===== DNS キャッシュ設定 =====
+extern const size_t DNS_CACHE_ARENA_SIZE;            // 応答キャッシュのアリーナサイズ（バイト）
+extern const uint32_t DNS_CACHE_MAX_TTL;             // キャッシュ保持の上限（秒）
+extern const uint32_t DNS_CACHE_STALE_TTL;           // 期限切れ応答を返すときの TTL（秒、RFC 8767 推奨 30）
+extern const uint32_t DNS_CACHE_STALE_MAX;           // 期限切れ応答を保持する上限（秒）
+extern const uint16_t DNS_CACHE_PREFETCH_MIN_HITS;   // refresh-ahead の対象とする参照回数
+extern const uint8_t DNS_CACHE_PREFETCH_PERCENT;     // 残り TTL がこの割合（%）以下で更新
+
 // ===== ドメイン名検証定数 =====
 extern const size_t DOMAIN_NAME_MIN_LENGTH;          // ドメイン名最小長
 extern const size_t DOMAIN_NAME_MAX_LENGTH;          // ドメイン名最大長（253）
 
-// ===== ブロックリストメモリ設定 =====
-extern const size_t BLOCKLIST_BUFFER_SIZE;           // ブロックリスト文字列プールサイズ（バイト）
+// ===== ブロックリストファイル（名前付きリストごと、DNSBlocklistId の順） =====
+extern const char* const BLOCKLIST_TEXT_PATHS[];         // テキスト形式ブロックリスト
+extern const char* const BLOCKLIST_BINARY_PATHS[];       // コンパイル済みブロックリスト（優先）
+extern const char* const BLOCKLIST_GZIP_PATHS[];         // gzip 圧縮したまま保存したリスト（.bin の次に優先）
+extern const char* const BLOCKLIST_TEXT_BACKUP_PATHS[];  // 差し替え前のリスト（読み込めない場合に戻す）
+extern const char* const BLOCKLIST_BINARY_BACKUP_PATHS[];
+extern const char* const BLOCKLIST_GZIP_BACKUP_PATHS[];
+extern const char* BLOCKLIST_UPLOAD_PATH;            // アップロード中の一時ファイル
+extern const char* BLOCKLIST_JOURNAL_PATH;           // 追加・削除の追記ジャーナル（圧縮で消える）
+extern const char* BLOCKLIST_COMPACT_PATH;           // 差分を統合したリストの書き込み中ファイル
+extern const uint16_t BLOCKLIST_COMPACT_ENTRIES;     // ジャーナルがこの件数に達したら圧縮する
+extern const uint32_t BLOCKLIST_COMPACT_BACKOFF_MIN; // 圧縮に失敗した後、再試行するまでの時間（ミリ秒）
+extern const uint32_t BLOCKLIST_COMPACT_BACKOFF_MAX; // 同・上限（失敗が続くたびに倍にする）
+extern const unsigned long BLOCKLIST_SWAP_TIMEOUT;   // 差し替え・追加・削除を DNS タスクが処理するまで待つ時間（ミリ秒）
+extern const char* PREF_KEY_DNS_BLOCKLISTS;          // 有効なリストのビット
+
+// ===== プレフィルタ設定 =====
+extern const char* PREF_KEY_DNS_PREFILTER_BITS;
+extern const uint8_t DNS_PREFILTER_DEFAULT_BITS;     // 1 ドメインあたりのビット数（10 ≒ 偽陽性率 1%）
+
+// ===== ログ設定 =====
+extern const char* PREF_KEY_LOG_LEVEL;
+extern const uint8_t LOG_DRAIN_PER_LOOP;             // loop() 1 回で出力するログの最大件数
 
 #endif // CONFIG_H
@@ -0,0 +1,528 @@
+/*
+ * DNSCache.cpp - 上流 DNS 応答のキャッシュの実装
+ */
+
+#include "DNSCache.h"
+#include "Config.h"
+
+// Entry::flags
+#define DNS_CACHE_ENTRY_REFRESHING 0x01  // バックグラウンド更新を依頼済み
+#define DNS_CACHE_ENTRY_PREFETCHED 0x02  // refresh-ahead で保存され、まだ参照されていない
+
+// レコードごとに呼ばれる（record は TYPE フィールドの位置）
+typedef void (*DNSRecordVisitor)(uint8_t* record, uint16_t type, uint16_t rdLength, void* context);
+
+static uint16_t readUint16(const uint8_t* p) {
+  return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t readUint32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void writeUint32(uint8_t* p, uint32_t value) {
+  p[0] = (value >> 24) & 0xFF;
+  p[1] = (value >> 16) & 0xFF;
+  p[2] = (value >> 8) & 0xFF;
+  p[3] = value & 0xFF;
+}
+
+// 名前を読み飛ばす（圧縮ポインタは辿らない）
+static bool skipName(const uint8_t* msg, size_t len, size_t* pos) {
+  while (*pos < len) {
+    uint8_t labelLen = msg[*pos];
+    if ((labelLen & DNS_COMPRESSION_POINTER_MASK) == DNS_COMPRESSION_POINTER_MASK) {
+      *pos += 2;
+      return *pos <= len;
+    }
+    if (labelLen & DNS_COMPRESSION_POINTER_MASK) {
+      return false;
+    }
+    *pos += 1 + labelLen;
+    if (labelLen == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 質問セクションを飛ばし、回答・権威・追加セクションの全レコードを訪問する
+static bool walkRecords(uint8_t* msg, size_t len, DNSRecordVisitor visitor, void* context) {
+  if (len < DNS_CACHE_HEADER_SIZE) {
+    return false;
+  }
+  uint16_t questions = readUint16(msg + 4);
+  uint32_t records = (uint32_t)readUint16(msg + 6) + readUint16(msg + 8) + readUint16(msg + 10);
+
+  size_t pos = DNS_CACHE_HEADER_SIZE;
+  for (uint16_t i = 0; i < questions; i++) {
+    if (!skipName(msg, len, &pos) || pos + 4 > len) {
+      return false;
+    }
+    pos += 4;  // QTYPE + QCLASS
+  }
+
+  for (uint32_t i = 0; i < records; i++) {
+    if (!skipName(msg, len, &pos) || pos + 10 > len) {
+      return false;
+    }
+    uint16_t type = readUint16(msg + pos);
+    uint16_t rdLength = readUint16(msg + pos + 8);
+    if (pos + 10 + rdLength > len) {
+      return false;
+    }
+    visitor(msg + pos, type, rdLength, context);
+    pos += 10 + rdLength;
+  }
+  return true;
+}
+
+struct MinTTLContext {
+  uint32_t minTtl;
+  uint32_t count;
+};
+
+static void visitMinTTL(uint8_t* record, uint16_t type, uint16_t rdLength, void* context) {
+  MinTTLContext* ctx = (MinTTLContext*)context;
+  if (type == DNS_TYPE_OPT) {
+    return;  // OPT の TTL フィールドは拡張フラグ
+  }
+  uint32_t ttl = readUint32(record + 4);
+  // 否定応答の SOA は MINIMUM（RDATA の末尾 4 バイト）も上限になる
+  if (type == DNS_TYPE_SOA && rdLength >= 4) {
+    uint32_t minimum = readUint32(record + 10 + rdLength - 4);
+    if (minimum < ttl) {
+      ttl = minimum;
+    }
+  }
+  if (ctx->count == 0 || ttl < ctx->minTtl) {
+    ctx->minTtl = ttl;
+  }
+  ctx->count++;
+}
+
+static void visitAgeTTL(uint8_t* record, uint16_t type, uint16_t /*rdLength*/, void* context) {
+  uint32_t elapsed = *(uint32_t*)context;
+  if (type == DNS_TYPE_OPT) {
+    return;
+  }
+  uint32_t ttl = readUint32(record + 4);
+  writeUint32(record + 4, ttl > elapsed ? ttl - elapsed : 0);
+}
+
+static void visitSetTTL(uint8_t* record, uint16_t type, uint16_t /*rdLength*/, void* context) {
+  if (type == DNS_TYPE_OPT) {
+    return;
+  }
+  writeUint32(record + 4, *(uint32_t*)context);
+}
+
+bool dnsResponseMinTTL(const uint8_t* response, size_t len, uint32_t* minTtl) {
+  MinTTLContext ctx = {0, 0};
+  // 読み取りのみ（visitMinTTL は書き込まない）
+  if (!walkRecords((uint8_t*)response, len, visitMinTTL, &ctx) || ctx.count == 0) {
+    return false;
+  }
+  *minTtl = ctx.minTtl;
+  return true;
+}
+
+void dnsResponseAgeTTL(uint8_t* response, size_t len, uint32_t elapsed) {
+  if (elapsed > 0) {
+    walkRecords(response, len, visitAgeTTL, &elapsed);
+  }
+}
+
+void dnsResponseSetTTL(uint8_t* response, size_t len, uint32_t ttl) {
+  walkRecords(response, len, visitSetTTL, &ttl);
+}
+
+struct FindOptContext {
+  const uint8_t* msg;
+  size_t offset;
+  bool found;
+};
+
+static void visitFindOpt(uint8_t* record, uint16_t type, uint16_t /*rdLength*/, void* context) {
+  FindOptContext* ctx = (FindOptContext*)context;
+  // OPT の名前はルート（1 バイト）なので、レコードの先頭は TYPE の 1 バイト前
+  if (type == DNS_TYPE_OPT && !ctx->found && record > ctx->msg && record[-1] == 0) {
+    ctx->offset = record - 1 - ctx->msg;
+    ctx->found = true;
+  }
+}
+
+bool dnsFindOpt(const uint8_t* msg, size_t len, size_t* optOffset) {
+  if (len < DNS_CACHE_HEADER_SIZE || readUint16(msg + 10) == 0) {
+    return false;  // 追加セクションが空
+  }
+  FindOptContext ctx = {msg, 0, false};
+  if (!walkRecords((uint8_t*)msg, len, visitFindOpt, &ctx) || !ctx.found) {
+    return false;
+  }
+  *optOffset = ctx.offset;
+  return true;
+}
+
+size_t dnsRemoveOpt(uint8_t* msg, size_t len, size_t optOffset) {
+  size_t optLength = 1 + DNS_EDNS_OPT_FIXED_SIZE + readUint16(msg + optOffset + 9);
+  if (optOffset + optLength != len) {
+    return len;  // 後ろに別のレコードがある場合は変更しない
+  }
+  uint16_t additional = readUint16(msg + 10) - 1;
+  msg[10] = additional >> 8;
+  msg[11] = additional & 0xFF;
+  return optOffset;
+}
+
+DNSCache::DNSCache()
+  : arena(nullptr),
+    chunkNext(nullptr),
+    chunkCount(0),
+    freeChunk(DNS_CACHE_NONE),
+    freeChunkCount(0),
+    entries(nullptr),
+    entryCount(0),
+    usedEntries(0),
+    freeEntry(DNS_CACHE_NONE),
+    lruHead(DNS_CACHE_NONE),
+    lruTail(DNS_CACHE_NONE),
+    buckets(nullptr),
+    bucketMask(0) {
+}
+
+DNSCache::~DNSCache() {
+  reset();
+}
+
+bool DNSCache::init(size_t arenaBytes) {
+  reset();
+  size_t chunks = arenaBytes / DNS_CACHE_CHUNK_SIZE;
+  if (chunks == 0) {
+    return true;  // 無効
+  }
+  if (chunks >= DNS_CACHE_NONE) {
+    chunks = DNS_CACHE_NONE - 1;
+  }
+
+  size_t entryTotal = chunks / DNS_CACHE_CHUNKS_PER_ENTRY;
+  if (entryTotal == 0) {
+    entryTotal = 1;
+  }
+  size_t bucketTotal = 1;
+  while (bucketTotal < entryTotal) {
+    bucketTotal <<= 1;
+  }
+
+  arena = (uint8_t*)malloc(chunks * DNS_CACHE_CHUNK_SIZE);
+  chunkNext = (uint16_t*)malloc(chunks * sizeof(uint16_t));
+  entries = (Entry*)malloc(entryTotal * sizeof(Entry));
+  buckets = (uint16_t*)malloc(bucketTotal * sizeof(uint16_t));
+  if (!arena || !chunkNext || !entries || !buckets) {
+    reset();
+    return false;
+  }
+
+  chunkCount = chunks;
+  entryCount = entryTotal;
+  bucketMask = bucketTotal - 1;
+  clear();
+  return true;
+}
+
+void DNSCache::reset() {
+  free(arena);
+  free(chunkNext);
+  free(entries);
+  free(buckets);
+  arena = nullptr;
+  chunkNext = nullptr;
+  entries = nullptr;
+  buckets = nullptr;
+  chunkCount = 0;
+  entryCount = 0;
+  bucketMask = 0;
+  freeChunk = DNS_CACHE_NONE;
+  freeChunkCount = 0;
+  usedEntries = 0;
+  freeEntry = DNS_CACHE_NONE;
+  lruHead = DNS_CACHE_NONE;
+  lruTail = DNS_CACHE_NONE;
+}
+
+void DNSCache::clear() {
+  if (!arena) {
+    return;
+  }
+  for (uint16_t i = 0; i < chunkCount; i++) {
+    chunkNext[i] = (i + 1 < chunkCount) ? i + 1 : DNS_CACHE_NONE;
+  }
+  freeChunk = 0;
+  freeChunkCount = chunkCount;
+
+  for (uint16_t i = 0; i < entryCount; i++) {
+    entries[i].hashNext = (i + 1 < entryCount) ? i + 1 : DNS_CACHE_NONE;
+  }
+  freeEntry = 0;
+  usedEntries = 0;
+
+  for (uint32_t i = 0; i <= bucketMask; i++) {
+    buckets[i] = DNS_CACHE_NONE;
+  }
+  lruHead = DNS_CACHE_NONE;
+  lruTail = DNS_CACHE_NONE;
+}
+
+bool DNSCache::store(uint32_t key, const uint8_t* response, size_t len, unsigned long now,
+                     uint32_t* evictions, bool prefetched) {
+  if (!arena || len < DNS_CACHE_HEADER_SIZE) {
+    return false;
+  }
+
+  // 切り詰められた応答（TC=1）と NOERROR / NXDOMAIN 以外は保存しない
+  uint8_t rcode = response[3] & 0x0F;
+  if ((response[2] & DNS_CACHE_FLAG_TC) || (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN)) {
+    return false;
+  }
+
+  uint32_t ttl;
+  if (!dnsResponseMinTTL(response, len, &ttl) || ttl == 0) {
+    return false;
+  }
+  if (ttl > DNS_CACHE_MAX_TTL) {
+    ttl = DNS_CACHE_MAX_TTL;
+  }
+
+  uint16_t needed = (len + DNS_CACHE_CHUNK_SIZE - 1) / DNS_CACHE_CHUNK_SIZE;
+  if (needed > chunkCount) {
+    return false;
+  }
+
+  // 同じ質問の古い応答を置き換える
+  uint16_t existing = find(key);
+  if (existing != DNS_CACHE_NONE) {
+    remove(existing);
+  }
+
+  // 空きが足りるまで LRU の末尾から追い出す
+  while (freeChunkCount < needed || freeEntry == DNS_CACHE_NONE) {
+    remove(lruTail);
+    (*evictions)++;
+  }
+
+  uint16_t index = freeEntry;
+  Entry& entry = entries[index];
+  freeEntry = entry.hashNext;
+
+  // チャンクを確保してコピー
+  uint16_t first = freeChunk;
+  uint16_t chunk = first;
+  size_t copied = 0;
+  for (uint16_t i = 0; i < needed; i++) {
+    size_t n = len - copied < DNS_CACHE_CHUNK_SIZE ? len - copied : DNS_CACHE_CHUNK_SIZE;
+    memcpy(arena + (size_t)chunk * DNS_CACHE_CHUNK_SIZE, response + copied, n);
+    copied += n;
+    if (i + 1 < needed) {
+      chunk = chunkNext[chunk];
+    }
+  }
+  freeChunk = chunkNext[chunk];
+  chunkNext[chunk] = DNS_CACHE_NONE;
+  freeChunkCount -= needed;
+
+  entry.key = key;
+  entry.storedAt = now;
+  entry.ttl = ttl;
+  entry.length = len;
+  entry.hits = 0;
+  entry.flags = prefetched ? DNS_CACHE_ENTRY_PREFETCHED : 0;
+  entry.firstChunk = first;
+
+  uint16_t bucket = (key ^ (key >> 16)) & bucketMask;
+  entry.hashNext = buckets[bucket];
+  buckets[bucket] = index;
+  lruPushFront(index);
+  usedEntries++;
+  return true;
+}
+
+size_t DNSCache::lookup(uint32_t key, uint8_t* out, size_t outSize, unsigned long now, uint8_t* hitFlags) {
+  *hitFlags = 0;
+  uint16_t index = find(key);
+  if (index == DNS_CACHE_NONE) {
+    return 0;
+  }
+
+  Entry& entry = entries[index];
+  uint32_t elapsed = (now - entry.storedAt) / MILLISECONDS_TO_SECONDS_DIVISOR;
+  if (elapsed >= entry.ttl) {
+    // 期限切れ: serve-stale の保持期間を過ぎていれば削除
+    if (elapsed - entry.ttl >= DNS_CACHE_STALE_MAX) {
+      remove(index);
+    }
+    return 0;
+  }
+
+  size_t len = copyOut(index, out, outSize);
+  if (len == 0) {
+    return 0;
+  }
+  dnsResponseAgeTTL(out, len, elapsed);
+
+  if (entry.hits < 0xFFFF) {
+    entry.hits++;
+  }
+  if (entry.flags & DNS_CACHE_ENTRY_PREFETCHED) {
+    entry.flags &= ~DNS_CACHE_ENTRY_PREFETCHED;
+    *hitFlags |= DNS_CACHE_HIT_PREFETCHED;
+  }
+
+  // よく参照され、残り TTL が DNS_CACHE_PREFETCH_PERCENT % 以下なら更新を促す（1 回のみ）
+  uint32_t remaining = entry.ttl - elapsed;
+  if (entry.hits >= DNS_CACHE_PREFETCH_MIN_HITS && !(entry.flags & DNS_CACHE_ENTRY_REFRESHING) &&
+      remaining * PERCENTAGE_MULTIPLIER <= entry.ttl * DNS_CACHE_PREFETCH_PERCENT) {
+    entry.flags |= DNS_CACHE_ENTRY_REFRESHING;
+    *hitFlags |= DNS_CACHE_HIT_REFRESH;
+  }
+
+  touch(index);
+  return len;
+}
+
+size_t DNSCache::lookupStale(uint32_t key, uint8_t* out, size_t outSize, unsigned long now) {
+  uint16_t index = find(key);
+  if (index == DNS_CACHE_NONE) {
+    return 0;
+  }
+
+  Entry& entry = entries[index];
+  uint32_t elapsed = (now - entry.storedAt) / MILLISECONDS_TO_SECONDS_DIVISOR;
+  if (elapsed >= entry.ttl && elapsed - entry.ttl >= DNS_CACHE_STALE_MAX) {
+    remove(index);
+    return 0;
+  }
+
+  size_t len = copyOut(index, out, outSize);
+  if (len == 0) {
+    return 0;
+  }
+  if (elapsed >= entry.ttl) {
+    dnsResponseSetTTL(out, len, DNS_CACHE_STALE_TTL);
+  } else {
+    dnsResponseAgeTTL(out, len, elapsed);
+  }
+  touch(index);
+  return len;
+}
+
+void DNSCache::refreshFailed(uint32_t key) {
+  uint16_t index = find(key);
+  if (index != DNS_CACHE_NONE) {
+    entries[index].flags &= ~DNS_CACHE_ENTRY_REFRESHING;
+  }
+}
+
+bool DNSCache::isActive() const {
+  return arena != nullptr;
+}
+
+size_t DNSCache::getCapacityBytes() const {
+  return (size_t)chunkCount * DNS_CACHE_CHUNK_SIZE;
+}
+
+size_t DNSCache::getUsedBytes() const {
+  return (size_t)(chunkCount - freeChunkCount) * DNS_CACHE_CHUNK_SIZE;
+}
+
+uint16_t DNSCache::getEntryCount() const {
+  return usedEntries;
+}
+
+uint16_t DNSCache::find(uint32_t key) const {
+  if (!arena) {
+    return DNS_CACHE_NONE;
+  }
+  uint16_t index = buckets[(key ^ (key >> 16)) & bucketMask];
+  while (index != DNS_CACHE_NONE && entries[index].key != key) {
+    index = entries[index].hashNext;
+  }
+  return index;
+}
+
+size_t DNSCache::copyOut(uint16_t index, uint8_t* out, size_t outSize) const {
+  const Entry& entry = entries[index];
+  if (entry.length > outSize) {
+    return 0;
+  }
+
+  uint16_t chunk = entry.firstChunk;
+  size_t copied = 0;
+  while (copied < entry.length) {
+    size_t n = entry.length - copied < DNS_CACHE_CHUNK_SIZE ? entry.length - copied : DNS_CACHE_CHUNK_SIZE;
+    memcpy(out + copied, arena + (size_t)chunk * DNS_CACHE_CHUNK_SIZE, n);
+    copied += n;
+    chunk = chunkNext[chunk];
+  }
+  return entry.length;
+}
+
+void DNSCache::remove(uint16_t index) {
+  Entry& entry = entries[index];
+
+  // バケットから外す
+  uint16_t* link = &buckets[(entry.key ^ (entry.key >> 16)) & bucketMask];
+  while (*link != index) {
+    link = &entries[*link].hashNext;
+  }
+  *link = entry.hashNext;
+
+  lruUnlink(index);
+
+  // チャンクを空きリストに戻す
+  uint16_t last = entry.firstChunk;
+  uint16_t count = 1;
+  while (chunkNext[last] != DNS_CACHE_NONE) {
+    last = chunkNext[last];
+    count++;
+  }
+  chunkNext[last] = freeChunk;
+  freeChunk = entry.firstChunk;
+  freeChunkCount += count;
+
+  entry.hashNext = freeEntry;
+  freeEntry = index;
+  usedEntries--;
+}
+
+void DNSCache::touch(uint16_t index) {
+  if (lruHead != index) {
+    lruUnlink(index);
+    lruPushFront(index);
+  }
+}
+
+void DNSCache::lruUnlink(uint16_t index) {
+  Entry& entry = entries[index];
+  if (entry.lruPrev != DNS_CACHE_NONE) {
+    entries[entry.lruPrev].lruNext = entry.lruNext;
+  } else {
+    lruHead = entry.lruNext;
+  }
+  if (entry.lruNext != DNS_CACHE_NONE) {
+    entries[entry.lruNext].lruPrev = entry.lruPrev;
+  } else {
+    lruTail = entry.lruPrev;
+  }
+}
+
+void DNSCache::lruPushFront(uint16_t index) {
+  Entry& entry = entries[index];
+  entry.lruPrev = DNS_CACHE_NONE;
+  entry.lruNext = lruHead;
+  if (lruHead != DNS_CACHE_NONE) {
+    entries[lruHead].lruPrev = index;
+  } else {
+    lruTail = index;
+  }
+  lruHead = index;
+}
@@ -0,0 +1,139 @@
+/*
+ * DNSCache.h - 上流 DNS 応答のキャッシュ
+ *
+ * 上流から受け取った応答をワイヤー形式のまま固定サイズのアリーナに保存し、
+ * 同じ質問（名前・タイプ・クラス）には上流へ問い合わせずに返します。
+ *
+ * アリーナは DNS_CACHE_CHUNK_SIZE バイトのチャンクに分割され、
+ * 1 件の応答は連結したチャンクに格納されます（起動後の malloc なし）。
+ * 空きが足りない場合は最も長く参照されていないエントリから追い出します（LRU）。
+ * 返送時には経過秒数だけ各レコードの TTL を減らします。
+ *
+ * 期限切れのエントリは DNS_CACHE_STALE_MAX 秒まで残し、上流が応答しない場合に
+ * 短い TTL で返せるようにします（serve-stale、RFC 8767）。
+ * よく参照されるエントリは期限直前に更新を促します（refresh-ahead）。
+ */
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <Arduino.h>
+
+#define DNS_CACHE_CHUNK_SIZE 64          // アリーナの割り当て単位（バイト）
+#define DNS_CACHE_CHUNKS_PER_ENTRY 2     // エントリ表の大きさの目安（平均チャンク数）
+#define DNS_CACHE_NONE 0xFFFF            // 無効なインデックス
+#define DNS_CACHE_HEADER_SIZE 12         // DNS ヘッダー
+#define DNS_CACHE_FLAG_TC 0x02           // ヘッダー byte 2: 切り詰め（TC）
+#define DNS_EDNS_OPT_FIXED_SIZE 10       // OPT レコードの名前（ルート 1 バイト）を除く固定部
+
+// lookup() の結果フラグ
+#define DNS_CACHE_HIT_REFRESH 0x01       // 期限が近く、バックグラウンドで更新すべき
+#define DNS_CACHE_HIT_PREFETCHED 0x02    // 先行更新で保存された応答への最初のヒット
+
+/**
+ * DNSCache クラス
+ *
+ * キーは質問のハッシュ（DNSFilterManager::hashQuestion）。
+ * ハッシュの衝突は呼び出し側で質問セクションを比較して除外します。
+ */
+class DNSCache {
+public:
+  DNSCache();
+  ~DNSCache();
+
+  bool init(size_t arenaBytes);  // 0 で無効
+  void reset();                  // アリーナを解放
+  void clear();                  // エントリのみ削除
+
+  // 応答を保存（TTL 0・切り詰め・エラー応答は保存しない）。追い出した件数を evictions に加算
+  // prefetched: refresh-ahead による保存
+  bool store(uint32_t key, const uint8_t* response, size_t len, unsigned long now,
+             uint32_t* evictions, bool prefetched = false);
+
+  // 有効期限内の応答を out にコピーし TTL を経過分減らす。見つからなければ 0
+  // hitFlags には DNS_CACHE_HIT_* を返す
+  size_t lookup(uint32_t key, uint8_t* out, size_t outSize, unsigned long now, uint8_t* hitFlags);
+
+  // 期限切れ（DNS_CACHE_STALE_MAX 秒以内）も含めて応答を返す。期限切れの場合 TTL は DNS_CACHE_STALE_TTL
+  size_t lookupStale(uint32_t key, uint8_t* out, size_t outSize, unsigned long now);
+
+  // バックグラウンド更新が失敗したので、次のヒットで再度更新を促す
+  void refreshFailed(uint32_t key);
+
+  bool isActive() const;
+  size_t getCapacityBytes() const;
+  size_t getUsedBytes() const;     // 使用中チャンクのバイト数
+  uint16_t getEntryCount() const;
+
+private:
+  struct Entry {
+    uint32_t key;
+    unsigned long storedAt;        // 保存時刻（millis）
+    uint32_t ttl;                  // 保存時の最小 TTL（秒）
+    uint16_t length;               // 応答のバイト数
+    uint16_t hits;                 // 保存後の参照回数
+    uint8_t flags;                 // DNS_CACHE_ENTRY_*
+    uint16_t firstChunk;           // 先頭チャンク
+    uint16_t lruPrev;              // LRU リスト（先頭が最新）
+    uint16_t lruNext;
+    uint16_t hashNext;             // 同じバケットの次のエントリ
+  };
+
+  uint8_t* arena;
+  uint16_t* chunkNext;             // チャンクの連結（空きリストと兼用）
+  uint16_t chunkCount;
+  uint16_t freeChunk;              // 空きチャンクリストの先頭
+  uint16_t freeChunkCount;
+
+  Entry* entries;
+  uint16_t entryCount;             // エントリ表の大きさ
+  uint16_t usedEntries;
+  uint16_t freeEntry;              // 空きエントリリストの先頭（hashNext で連結）
+  uint16_t lruHead;
+  uint16_t lruTail;
+
+  uint16_t* buckets;
+  uint16_t bucketMask;
+
+  uint16_t find(uint32_t key) const;
+  size_t copyOut(uint16_t index, uint8_t* out, size_t outSize) const;
+  void remove(uint16_t index);
+  void touch(uint16_t index);
+  void lruUnlink(uint16_t index);
+  void lruPushFront(uint16_t index);
+
+  DNSCache(const DNSCache&) = delete;
+  DNSCache& operator=(const DNSCache&) = delete;
+};
+
+/**
+ * 応答内の全レコード（OPT を除く）の最小 TTL を求める
+ *
+ * 否定応答の SOA は RFC 2308 に従い MINIMUM も考慮します。
+ * 解析できない場合、またはレコードが無い場合は false。
+ */
+bool dnsResponseMinTTL(const uint8_t* response, size_t len, uint32_t* minTtl);
+
+/**
+ * 応答内の全レコード（OPT を除く）の TTL から elapsed 秒を引く（0 未満にはしない）
+ */
+void dnsResponseAgeTTL(uint8_t* response, size_t len, uint32_t elapsed);
+
+/**
+ * 応答内の全レコード（OPT を除く）の TTL を ttl に置き換える
+ */
+void dnsResponseSetTTL(uint8_t* response, size_t len, uint32_t ttl);
+
+/**
+ * メッセージ内の EDNS OPT レコードを探し、先頭（ルート名）のオフセットを返す
+ *
+ * UDP ペイロードサイズは optOffset + 3 の 2 バイト（CLASS フィールド）。
+ */
+bool dnsFindOpt(const uint8_t* msg, size_t len, size_t* optOffset);
+
+/**
+ * 最後のレコードである OPT を取り除き、新しい長さを返す（最後でなければ変更しない）
+ */
+size_t dnsRemoveOpt(uint8_t* msg, size_t len, size_t optOffset);
+
+#endif // DNS_CACHE_H
@@ -4,379 +4,3057 @@
 
 #include "DNSFilterManager.h"
 #include "Config.h"
+#include "Logger.h"
+#include <ESP.h>
+#include <new>
+#include <lwip/sockets.h>
+#ifndef ARDUINO_ARCH_ESP32
+#include <thread>   // ホスト（Linux）ビルドでは std::thread で DNS タスクを動かす
+#endif
+
+static const char LOG_TAG[] = "DNSFilterManager";
 
 DNSFilterManager::DNSFilterManager()
-  : enabled(false),
+  : tcpServer(DNS_PORT, DNS_TCP_MAX_CONNECTIONS),
+    tcpConnectionLimit(0),
+    enabled(false),
     captivePortalEnabled(false),
-    blocklistBuffer(nullptr),
-    blocklistBufferSize(0),
-    blocklistBufferUsed(0),
-    upstreamDNS(DEFAULT_UPSTREAM_DNS) {
-  stats = {0, 0, 0, 0};
+    taskRunning(false),
+    taskStopped(true),
+    snapshotSeq(0),
+    snapshotPublishedAt(0),
+    enabledBlocklists(DNS_BLOCKLIST_ALL),
+    blocklistSwapSeq(0),
+    blocklistSwapDone(0),
+    prefilterBitsPerEntry(DNS_PREFILTER_DEFAULT_BITS),
+    blocklistEditSeq(0),
+    blocklistEditDone(0),
+    blocklistEditJournaled(0),
+    journalEntries(0),
+    compactionRequested(false),
+    compactionFailedAt(0),
+    compactionBackoffMs(0),
+    lastEditApplyUs(0),
+    compactions(0),
+    lastCompactionMs(0),
+    blockPolicy(DNS_BLOCK_POLICY_NULL_IP),
+    upstreamRacing(false),
+    upstreamTcpPreferred(false),
+    pendingCount(0),
+    queueBacklog(0),
+    publishedClients(nullptr),
+    publishedClientCount(0),
+    trafficSeq(0),
+    trafficDirty(false),
+    trafficPublishedAt(0) {
+  stats = DNSStats();
+  for (uint8_t list = 0; list < DNS_TOP_LIST_COUNT; list++) {
+    publishedTopCount[list] = 0;
+  }
+  loadInfo = BlocklistLoadInfo();
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    blocklistInfo[list] = DNSBlocklistInfo();
+  }
+  IPAddress defaultUpstreams[] = {DEFAULT_UPSTREAM_DNS, DEFAULT_UPSTREAM_DNS_SECONDARY};
+  upstreams.setConfigured(defaultUpstreams, sizeof(defaultUpstreams) / sizeof(defaultUpstreams[0]));
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    pending[i] = DNSPendingQuery();
+  }
+  for (int i = 0; i < DNS_MAX_QUERY_WAITERS; i++) {
+    waiters[i] = DNSQueryWaiter();
+  }
+  for (int i = 0; i < DNS_TCP_MAX_CONNECTIONS; i++) {
+    tcpConnections[i].active = false;
+    tcpConnections[i].serial = 0;
+    tcpConnections[i].unsent = nullptr;
+  }
+  blockTTL[DNS_BLOCK_POLICY_NULL_IP] = DNS_TTL_SECONDS;
+  blockTTL[DNS_BLOCK_POLICY_NODATA] = DNS_NEGATIVE_TTL_SECONDS;
+  blockTTL[DNS_BLOCK_POLICY_NXDOMAIN] = DNS_NEGATIVE_TTL_SECONDS;
+  publishSnapshot();
 }
 
 DNSFilterManager::~DNSFilterManager() {
   end();
-  if (blocklistBuffer) {
-    free(blocklistBuffer);
-    blocklistBuffer = nullptr;
-  }
+  delete[] publishedClients;
 }
 
 bool DNSFilterManager::begin() {
-  Serial.println("DNSFilterManager: DNS Proxy サーバーを起動中...");
+  LOG_INFO(LOG_TAG, "DNS Proxy サーバーを起動中...");
 
   // UDP ポート 53 でリッスン開始
   if (!udp.begin(DNS_PORT)) {
-    Serial.println("DNSFilterManager: UDP ポート 53 の起動に失敗しました");
+    LOG_ERROR(LOG_TAG, "UDP ポート 53 の起動に失敗しました");
+    return false;
+  }
+
+  LOG_INFO(LOG_TAG, "ポート %d でリッスン開始", DNS_PORT);
+
+  // 上流問い合わせ用ソケット（ローカルポートは OS が割り当てる）
+  if (!upstreamUdp.begin(0)) {
+    LOG_ERROR(LOG_TAG, "上流 DNS 用ソケットの作成に失敗しました");
+    udp.stop();
     return false;
   }
 
-  Serial.printf("DNSFilterManager: ポート %d でリッスン開始\n", DNS_PORT);
+  // TCP ポート 53（接続数は AP のクライアント数まで）
+  tcpConnectionLimit = AP_MAX_CONNECTIONS < DNS_TCP_MAX_CONNECTIONS ? AP_MAX_CONNECTIONS : DNS_TCP_MAX_CONNECTIONS;
+  tcpServer.begin();
+  tcpServer.setNoDelay(true);
+  LOG_INFO(LOG_TAG, "TCP ポート %d でリッスン開始（最大 %d 接続）", DNS_PORT, tcpConnectionLimit);
 
   // ブロックリストを読み込み
-  loadBlocklistFromFile();
+  if (loadBlocklists()) {
+    LOG_INFO(LOG_TAG, "起動からフィルタ利用可能まで %lu ms", (unsigned long)loadInfo.readyAtMs);
+  }
+  replayBlocklistJournal();
+
+  // クライアント別の集計（AP の最大接続数分）
+  if (!publishedClients) {
+    publishedClients = new (std::nothrow) DNSClientStats[AP_MAX_CONNECTIONS];
+    if (!publishedClients || !traffic.init(AP_MAX_CONNECTIONS)) {
+      LOG_WARN(LOG_TAG, "クライアント別集計の確保に失敗しました");
+    }
+  }
+
+  // 応答キャッシュ（ブロックリスト読み込み後の空きヒープから確保）
+  initCache();
 
   enabled = true;
+  publishSnapshot();
   return true;
 }
 
 void DNSFilterManager::end() {
+  stopTask();
   udp.stop();
+  upstreamUdp.stop();
+  for (uint8_t i = 0; i < DNS_TCP_MAX_CONNECTIONS; i++) {
+    closeTcpConnection(i);
+  }
+  tcpServer.end();
+  upstreamTcp.close();
+  clearPending();
   enabled = false;
 }
 
 void DNSFilterManager::handleClient() {
+  processPass();
+}
+
+/**
+ * DNS タスクを起動する
+ *
+ * loop() より高い優先度で動かし、Web サーバーの応答やブロックリストの
+ * アップロード、NAT 有効化待ちの delay() の間も名前解決を止めない。
+ */
+bool DNSFilterManager::startTask() {
+  if (taskRunning) {
+    return true;
+  }
+  taskRunning = true;
+  taskStopped = false;
+
+#ifdef ARDUINO_ARCH_ESP32
+  if (xTaskCreate(taskEntry, "dns", DNS_TASK_STACK_SIZE, this, DNS_TASK_PRIORITY, nullptr) != pdPASS) {
+    LOG_ERROR(LOG_TAG, "DNS タスクの作成に失敗しました");
+    taskRunning = false;
+    taskStopped = true;
+    return false;
+  }
+#else
+  std::thread(taskEntry, this).detach();
+#endif
+
+  LOG_INFO(LOG_TAG, "DNS タスクを起動しました（優先度 %d）", DNS_TASK_PRIORITY);
+  return true;
+}
+
+/**
+ * DNS タスクを停止し、終了を待つ（以降は handleClient() で処理する）
+ */
+void DNSFilterManager::stopTask() {
+  if (!taskRunning) {
+    return;
+  }
+  taskRunning = false;
+  while (!taskStopped) {
+    delay(1);
+  }
+  applyCommands();  // 停止前に受け付けたコマンドを反映
+}
+
+bool DNSFilterManager::isTaskRunning() const {
+  return taskRunning;
+}
+
+void DNSFilterManager::taskEntry(void* arg) {
+  DNSFilterManager* self = static_cast<DNSFilterManager*>(arg);
+  while (self->taskRunning) {
+    // WiFiUDP はノンブロッキングのため、受信が無ければ 1 tick 譲る
+    if (self->processPass() == 0) {
+      delay(1);
+    }
+  }
+  self->taskStopped = true;
+#ifdef ARDUINO_ARCH_ESP32
+  vTaskDelete(nullptr);
+#endif
+}
+
+/**
+ * コマンドを DNS タスクに渡す（タスク未起動時は呼び出し元で即座に適用）
+ */
+bool DNSFilterManager::submitCommand(const DNSCommand& command) {
+  if (!taskRunning) {
+    applyCommand(command);
+    publishSnapshot();
+    return true;
+  }
+  if (!commands.push(command)) {
+    LOG_WARN(LOG_TAG, "コマンドの待ち行列が満杯です");
+    return false;
+  }
+  return true;
+}
+
+void DNSFilterManager::applyCommands() {
+  DNSCommand command;
+  bool applied = false;
+  while (commands.pop(&command)) {
+    applyCommand(command);
+    applied = true;
+  }
+  if (applied) {
+    publishSnapshot();
+  }
+}
+
+void DNSFilterManager::applyCommand(const DNSCommand& command) {
+  switch (command.type) {
+    case DNS_COMMAND_SET_UPSTREAMS:
+      // 問い合わせ中のクエリは送信先のインデックスが変わるため破棄する
+      if (upstreams.setConfigured(command.servers, command.count)) {
+        clearPending();
+        upstreamTcp.close();
+        LOG_INFO(LOG_TAG, "上流 DNS: %s", upstreams.formatConfigured());
+      }
+      break;
+    case DNS_COMMAND_SET_DHCP_UPSTREAM:
+      // SET_UPSTREAMS と同じく、DHCP のリゾルバが変わればそのインデックス宛ての問い合わせを破棄する
+      if (upstreams.setDhcp(command.servers[0])) {
+        clearPending();
+        upstreamTcp.close();
+      }
+      LOG_INFO(LOG_TAG, "DHCP の DNS: %s", command.servers[0]);
+      break;
+    case DNS_COMMAND_SET_PREFILTER_BITS:
+      prefilterBitsPerEntry = command.value;
+      if (blocklist.isLoaded()) {
+        rebuildPrefilter();
+      }
+      break;
+    case DNS_COMMAND_INSTALL_BLOCKLIST:
+      // 旧リストは差し替えの瞬間まで有効（構築・統合は loop() 側で済んでいる）
+      if (swapBlocklist(command.blob, command.value, command.defaultLists, command.loadInfo,
+                        command.path ? command.path : "差分を統合したリスト")) {
+        for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+          blocklistInfo[list] = command.blocklists[list];
+        }
+        // 圧縮: 差分は新しいトライに含まれている（アップロードでは差分を残し、引き続き重ねて照合する）
+        // プレフィルタに残る追加分のビットは次の再構築まで偽陽性になるだけ
+        if (command.clearOverlay) {
+          overlay.clear();
+        }
+      } else if (command.path) {
+        restoreBlocklistBackup(command.path, command.previousPath);
+      }
+      blocklistSwapDone.store(command.sequence, std::memory_order_release);
+      break;
+    case DNS_COMMAND_EDIT_BLOCKLIST:
+      applyBlocklistEdit(blocklistEdit);
+      blocklistEditDone.store(command.value, std::memory_order_release);
+      publishSnapshot();
+      break;
+    case DNS_COMMAND_RESET_STATS:
+      traffic.clear();
+      publishTraffic();
+      stats = DNSStats();
+      stats.upstreamPending = pendingCount;
+      for (uint8_t i = 0; i < DNS_TCP_MAX_CONNECTIONS; i++) {
+        stats.tcpActive += tcpConnections[i].active ? 1 : 0;
+      }
+      updateCacheStats();
+      LOG_INFO(LOG_TAG, "統計情報をリセットしました");
+      break;
+  }
+}
+
+/**
+ * 他のタスクから読む状態を公開する（DNS タスク、またはタスク未起動時の呼び出し元のみ）
+ *
+ * seqlock: 書き込み中はシーケンス番号を奇数にし、読み手は前後の番号が一致するまで読み直す。
+ */
+void DNSFilterManager::publishSnapshot() {
+  uint32_t seq = snapshotSeq.load(std::memory_order_relaxed);
+  snapshotSeq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  snapshot.stats = stats;
+  snapshot.loadInfo = loadInfo;
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    snapshot.blocklists[list] = blocklistInfo[list];
+  }
+  snapshot.prefilterInfo.active = prefilter.isActive();
+  snapshot.prefilterInfo.bitsPerEntry = prefilterBitsPerEntry;
+  snapshot.prefilterInfo.hashCount = prefilter.getHashCount();
+  snapshot.prefilterInfo.sizeBytes = prefilter.getSizeBytes();
+  snapshot.prefilterInfo.estimatedFpr = prefilter.getEstimatedFalsePositiveRate();
+  snapshot.blocklistCount = blocklist.getDomainCount();
+  snapshot.blocklistBytes = blocklist.getSizeBytes();
+  snapshot.upstreamCount = upstreams.getCount();
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < snapshot.upstreamCount; i++) {
+    snapshot.upstreams[i] = upstreams.getInfo(i, now);
+  }
+  snapshot.upstreamTcp = upstreamTcp.getInfo(now);
+  snapshot.overlayAdded = overlay.getAddedCount();
+  snapshot.overlayRemoved = overlay.getRemovedCount();
+  snapshot.overlayFull = overlay.isFull();
+  snapshot.overlayBytes = overlay.getSizeBytes();
+
+  std::atomic_thread_fence(std::memory_order_release);
+  snapshotSeq.store(seq + 2, std::memory_order_release);
+  snapshotPublishedAt = now;
+}
+
+/**
+ * 上位ドメインとクライアント別の集計を公開する
+ *
+ * 表の並べ替えとコピーはクエリ処理の合間に一定間隔でのみ行う。
+ */
+void DNSFilterManager::publishTraffic() {
+  uint32_t seq = trafficSeq.load(std::memory_order_relaxed);
+  trafficSeq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (uint8_t list = 0; list < DNS_TOP_LIST_COUNT; list++) {
+    publishedTopCount[list] = traffic.getTopDomains((DNSTopList)list, publishedTop[list], DNS_TOP_DOMAINS_SHOWN);
+  }
+  publishedClientCount = publishedClients ? traffic.getClients(publishedClients, traffic.getClientCapacity()) : 0;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  trafficSeq.store(seq + 2, std::memory_order_release);
+  trafficDirty = false;
+  trafficPublishedAt = millis();
+}
+
+DNSStatusSnapshot DNSFilterManager::readSnapshot() const {
+  DNSStatusSnapshot copy;
+  uint32_t before;
+  uint32_t after;
+  do {
+    before = snapshotSeq.load(std::memory_order_acquire);
+    copy = snapshot;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = snapshotSeq.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return copy;
+}
+
+/**
+ * 保留中のコマンドを適用し、上流応答とクエリ（UDP・TCP）を 1 回分処理する（処理したクエリ数を返す）
+ */
+uint16_t DNSFilterManager::processPass() {
+  applyCommands();
   if (!enabled) {
+    return 0;
+  }
+
+  // 上流からの応答を返送し、期限切れの問い合わせを破棄（待機はしない）
+  handleUpstreamResponses();
+  handleUpstreamTcp();
+  expirePendingQueries();
+
+  // 到着済みのクエリを件数と時間の上限までまとめて処理する
+  // （Web サーバー等の処理を挟まずに連続したクエリを捌き、ソケットの受信バッファ溢れを防ぐ）
+  uint32_t startUs = micros();
+  uint16_t packets = 0;
+  bool exhausted = false;
+  while (true) {
+    if (packets >= DNS_MAX_PACKETS_PER_LOOP || micros() - startUs >= DNS_LOOP_BUDGET_US) {
+      exhausted = true;
+      break;
+    }
+    if (udp.parsePacket() == 0) {
+      break;  // パケット無し
+    }
+    handleQueryPacket();
+    packets++;
+  }
+  recordBatch(packets, exhausted, micros() - startUs);
+
+  // TCP の接続受け付けとクエリ（UDP の上限とは別に数える）
+  packets += handleTcpConnections();
+
+  // 統計の公開は一定間隔のみ（コマンド適用時は applyCommands() で即座に公開する）
+  if (millis() - snapshotPublishedAt >= DNS_STATUS_PUBLISH_INTERVAL) {
+    publishSnapshot();
+  }
+  if (trafficDirty && millis() - trafficPublishedAt >= DNS_TRAFFIC_PUBLISH_INTERVAL) {
+    publishTraffic();
+  }
+  return packets;
+}
+
+/**
+ * バッチ処理の統計を更新する
+ *
+ * 打ち切りが続いた間の処理件数を合計し、ソケットが空になった時点で
+ * バースト全体の待ち行列の深さとして記録する。
+ */
+void DNSFilterManager::recordBatch(uint16_t packets, bool exhausted, uint32_t elapsedUs) {
+  if (packets == 0) {
     return;
   }
 
-  int packetSize = udp.parsePacket();
-  if (packetSize == 0) {
-    return;  // パケット無し
+  stats.loopBatches++;
+  stats.loopBatchPackets += packets;
+  if (packets > stats.loopBatchMax) {
+    stats.loopBatchMax = packets;
+  }
+  if (elapsedUs > stats.loopBatchMaxUs) {
+    stats.loopBatchMaxUs = elapsedUs;
   }
 
-  // クライアント情報
-  IPAddress clientIP = udp.remoteIP();
-  uint16_t clientPort = udp.remotePort();
+  queueBacklog = queueBacklog + packets < 0xFFFF ? queueBacklog + packets : 0xFFFF;
+  if (queueBacklog > stats.queueDepthMax) {
+    stats.queueDepthMax = queueBacklog;
+  }
+  if (exhausted) {
+    stats.loopBudgetExhausted++;
+  } else {
+    queueBacklog = 0;
+  }
+}
+
+/**
+ * 応答時間をヒストグラムに記録する
+ *
+ * バケットは 2 のべき乗の境界で、先頭ゼロ数から求める（除算・ループなし）。
+ */
+void DNSFilterManager::recordLatency(DNSLatencyOutcome outcome, uint32_t startUs) {
+  uint32_t elapsedUs = micros() - startUs;
+  uint8_t bucket = 0;
+  if (elapsedUs > (1UL << DNS_LATENCY_MIN_SHIFT)) {
+    bucket = 32 - __builtin_clz(elapsedUs - 1) - DNS_LATENCY_MIN_SHIFT;
+    if (bucket > DNS_LATENCY_BUCKETS) {
+      bucket = DNS_LATENCY_BUCKETS;
+    }
+  }
+
+  DNSLatencyHistogram& histogram = stats.latency[outcome];
+  histogram.buckets[bucket]++;
+  histogram.count++;
+  histogram.sumUs += elapsedUs;
+}
+
+/**
+ * parsePacket() 済みのクエリ 1 件を処理する
+ */
+void DNSFilterManager::handleQueryPacket() {
+  uint32_t receivedUs = micros();
 
-  // DNS クエリパケットを読み込み
-  uint8_t packet[DNS_MAX_PACKET_SIZE];
-  int len = udp.read(packet, DNS_MAX_PACKET_SIZE);
+  // クライアント情報
+  DNSClientEndpoint client;
+  client.ip = udp.remoteIP();
+  client.port = udp.remotePort();
+  client.udpSize = 0;
+  client.tcpSlot = DNS_TCP_NONE;
+  client.tcpSerial = 0;
+
+  // DNS クエリパケットを読み込み（EDNS のクエリは 512 バイトを超えうる）
+  int len = udp.read(queryBuffer, sizeof(queryBuffer));
+  processQuery(queryBuffer, len > 0 ? len : 0, client, receivedUs);
+}
 
+/**
+ * クエリを 1 件処理する（UDP・TCP 共通）
+ *
+ * packet は DNS_EDNS_UDP_SIZE バイトのバッファで、上流への転送時に書き換わる。
+ * 応答は client に送るか、送らない場合は abandonClient() する。
+ */
+void DNSFilterManager::processQuery(uint8_t* packet, size_t len, DNSClientEndpoint client, uint32_t receivedUs) {
   if (len < DNS_HEADER_SIZE) {
-    Serial.println("DNSFilterManager: 不正な DNS パケット（サイズ不足）");
+    LOG_WARN(LOG_TAG, "不正な DNS パケット（サイズ不足）");
     stats.errorQueries++;
+    stats.droppedPackets++;
+    abandonClient(client);
     return;
   }
 
   stats.totalQueries++;
+  DNSClientStats* clientStats = traffic.recordClient(client.ip, millis());
+  if (clientStats) {
+    clientStats->queries++;
+  }
+  trafficDirty = true;
 
-  // ドメイン名を抽出
-  String domain = extractDomainFromDNSQuery(packet, len);
+  // 応答パケットや標準クエリ以外（NOTIFY, UPDATE 等）は扱わない
+  if ((packet[2] & DNS_FLAG_QR) || (packet[2] & DNS_OPCODE_MASK)) {
+    LOG_WARN(LOG_TAG, "標準クエリではないパケットを破棄");
+    stats.errorQueries++;
+    stats.droppedPackets++;
+    abandonClient(client);
+    return;
+  }
 
-  if (domain.length() == 0) {
-    Serial.println("DNSFilterManager: ドメイン抽出に失敗");
+  // 質問セクションをパケット内のラベル位置として解析（ヒープ確保なし）
+  DNSQuestion question;
+  if (!parseDNSQuestion(packet, len, &question)) {
+    LOG_WARN(LOG_TAG, "ドメイン抽出に失敗");
     stats.errorQueries++;
+    stats.droppedPackets++;
+    abandonClient(client);
     return;
   }
+  parseEdns(packet, len, &question);
+  if (question.ednsUdpSize) {
+    stats.ednsQueries++;
+  }
+  client.udpSize = question.ednsUdpSize;
+  const DNSName& name = question.name;
+  uint32_t nameHash = hashName(packet, name);
+  recordTraffic(DNS_TOP_QUERIED, packet, name, nameHash);
+
+  // ログ表示用の名前（スタック上のバッファ、デバッグログが無効なら作らない）
+  char domain[DNS_NAME_TEXT_BUFFER_SIZE];
+  domain[0] = '\0';
+  if (LOG_LEVEL_DEBUG <= LOG_COMPILE_LEVEL && logger.isEnabled(LOG_LEVEL_DEBUG)) {
+    formatDNSName(packet, name, domain, sizeof(domain));
+  }
 
-  Serial.printf("DNSFilterManager: %s からのクエリ: %s\n",
-                clientIP.toString().c_str(), domain.c_str());
+  LOG_DEBUG(LOG_TAG, "%s からのクエリ: %s type %u", client.ip, domain, question.qtype);
 
   // キャプティブポータルモード: すべてのクエリに自分(AP_IP)を返す
   if (captivePortalEnabled) {
     // 自分自身(micro-router.local)へのクエリは常に許可(正しいIPを返す)したいが、
     // mDNSはUDP 5353なのでここには来ない。
     // 通常のDNSクエリとして来た場合も、AP_IPを返せば設定画面が開くのでOK。
-    Serial.printf("CaptivePortal: %s -> %s\n", domain.c_str(), AP_IP.toString().c_str());
-    sendCustomIPResponse(packet, len, clientIP, clientPort, AP_IP);
+    LOG_DEBUG(LOG_TAG, "キャプティブポータル: %s -> %s", domain, AP_IP);
+    sendCaptivePortalResponse(packet, question, client);
+    recordLatency(DNS_LATENCY_CAPTIVE, receivedUs);
     return;
   }
 
   // ブロックリストと照合
-  if (isBlocked(domain)) {
-    Serial.printf("DNSFilterManager: ブロック %s\n", domain.c_str());
+  if (isBlocked(packet, name)) {
+    LOG_DEBUG(LOG_TAG, "ブロック %s", domain);
     stats.blockedQueries++;
-    sendCustomIPResponse(packet, len, clientIP, clientPort, DNS_BLOCKED_IP);
+    recordTraffic(DNS_TOP_BLOCKED, packet, name, nameHash);
+    if (clientStats) {
+      clientStats->blocked++;
+    }
+    sendBlockedResponse(packet, question, client);
+    recordLatency(DNS_LATENCY_BLOCKED, receivedUs);
   } else {
-    Serial.printf("DNSFilterManager: 許可 %s\n", domain.c_str());
+    LOG_DEBUG(LOG_TAG, "許可 %s", domain);
     stats.allowedQueries++;
-    forwardToUpstream(packet, len, clientIP, clientPort);
+
+    uint32_t questionHash = hashQuestion(nameHash, question);
+    if (answerFromCache(packet, len, question, questionHash, client)) {
+      recordLatency(DNS_LATENCY_CACHED, receivedUs);
+    } else {
+      forwardToUpstream(packet, len, question, questionHash, client, receivedUs);
+    }
   }
 }
 
-String DNSFilterManager::extractDomainFromDNSQuery(uint8_t* packet, size_t len) {
-  if (len < DNS_HEADER_SIZE) {
-    return "";
+/**
+ * ヘッダー直後の質問セクション（先頭の 1 問）を解析する
+ */
+bool DNSFilterManager::parseDNSQuestion(const uint8_t* packet, size_t len, DNSQuestion* question) {
+  uint16_t questionCount = ((uint16_t)packet[4] << 8) | packet[5];
+  if (questionCount == 0) {
+    return false;
   }
 
-  String domain = "";
-  uint8_t* ptr = packet + DNS_HEADER_SIZE;  // ヘッダーをスキップ
-  uint8_t* end = packet + len;
+  if (!parseDNSName(packet, len, DNS_HEADER_SIZE, &question->name)) {
+    return false;
+  }
 
-  while (ptr < end && *ptr != 0) {
-    uint8_t labelLen = *ptr++;
+  size_t pos = question->name.nameEnd;
+  if (pos + DNS_QUESTION_FIXED_SIZE > len) {
+    return false;
+  }
+  question->qtype = ((uint16_t)packet[pos] << 8) | packet[pos + 1];
+  question->qclass = ((uint16_t)packet[pos + 2] << 8) | packet[pos + 3];
+  question->end = pos + DNS_QUESTION_FIXED_SIZE;
+  question->ednsUdpSize = 0;
+  question->optOffset = 0;
+  question->dnssecFlags = (packet[3] & DNS_FLAG_CD) ? DNS_QUESTION_CD : 0;
+  return true;
+}
 
-    // 圧縮ポインタチェック（上位2ビットが11の場合）
-    if ((labelLen & DNS_COMPRESSION_POINTER_MASK) == DNS_COMPRESSION_POINTER_MASK) {
-      break;  // 圧縮ポインタは未対応（通常のクエリでは不要）
-    }
+/**
+ * クエリの OPT レコードから、クライアントが受け取れる UDP ペイロードサイズと DO ビットを読む
+ *
+ * 512 未満は 512 として扱い（RFC 6891 6.2.5）、DNS_EDNS_UDP_SIZE を超える値は
+ * DNS_EDNS_UDP_SIZE に抑える（それより大きな応答は上流からも受け取らない）。
+ */
+void DNSFilterManager::parseEdns(const uint8_t* packet, size_t len, DNSQuestion* question) {
+  size_t optOffset;
+  if (!dnsFindOpt(packet, len, &optOffset)) {
+    return;
+  }
+  uint16_t udpSize = ((uint16_t)packet[optOffset + 3] << 8) | packet[optOffset + 4];
+  if (udpSize < DNS_MAX_PACKET_SIZE) {
+    udpSize = DNS_MAX_PACKET_SIZE;
+  } else if (udpSize > DNS_EDNS_UDP_SIZE) {
+    udpSize = DNS_EDNS_UDP_SIZE;
+  }
+  question->ednsUdpSize = udpSize;
+  question->optOffset = optOffset;
+  if (packet[optOffset + 7] & DNS_EDNS_FLAG_DO) {
+    question->dnssecFlags |= DNS_QUESTION_DO;
+  }
+}
 
-    if (labelLen > DNS_LABEL_MAX_LENGTH || ptr + labelLen > end) {
-      return "";  // 不正なラベル長
+/**
+ * 応答キャッシュのアリーナを確保する
+ *
+ * DNS_CACHE_ARENA_SIZE を上限に、空きヒープが MIN_FREE_HEAP_WARNING を
+ * 下回らないよう余裕分の半分までに抑える（残りはブロックリストの構築用）。
+ */
+void DNSFilterManager::initCache() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  size_t arenaBytes = 0;
+  if (freeHeap > MIN_FREE_HEAP_WARNING) {
+    arenaBytes = (freeHeap - MIN_FREE_HEAP_WARNING) / 2;
+    if (arenaBytes > DNS_CACHE_ARENA_SIZE) {
+      arenaBytes = DNS_CACHE_ARENA_SIZE;
     }
+  }
 
-    if (domain.length() > 0) {
-      domain += ".";
-    }
+  if (!cache.init(arenaBytes)) {
+    LOG_ERROR(LOG_TAG, "応答キャッシュの確保に失敗しました（キャッシュ無効）");
+  }
+  LOG_INFO(LOG_TAG, "応答キャッシュ %u バイト", (unsigned)cache.getCapacityBytes());
+  updateCacheStats();
+}
 
-    for (int i = 0; i < labelLen; i++) {
-      domain += (char)*ptr++;
-    }
+/**
+ * キャッシュに有効な応答があればクライアントに返す
+ *
+ * ID と質問名（大文字小文字を含む）はクエリのものに置き換え、
+ * TTL は保存からの経過秒数だけ減らした値で返す。
+ * 期限の近いよく使われる応答は、同じクエリをバックグラウンドで上流に送り更新しておく
+ * （query は返送後に上流向けに書き換わる）。
+ */
+bool DNSFilterManager::answerFromCache(uint8_t* query, size_t len, const DNSQuestion& question,
+                                       uint32_t questionHash, const DNSClientEndpoint& client) {
+  if (!cache.isActive()) {
+    return false;
   }
 
-  domain.toLowerCase();
-  return domain;
-}
+  uint8_t* response = responseBuffer;
+  uint8_t hitFlags = 0;
+  size_t responseLen = cache.lookup(questionHash, response, sizeof(responseBuffer), millis(), &hitFlags);
 
-bool DNSFilterManager::isBlocked(const String& domain) {
-  for (const char* blocked : blocklist) {
-    size_t blockedLen = strlen(blocked);
-    size_t domainLen = domain.length();
+  if (!restoreCachedQuestion(response, responseLen, query, question)) {
+    stats.cacheMisses++;
+    updateCacheStats();
+    return false;
+  }
 
-    // 完全一致チェック
-    if (domain.equals(blocked)) {
-      return true;
-    }
+  memcpy(response, query, 2);  // ID
+  sendToClient(response, responseLen, client);
 
-    // サブドメイン一致チェック (例: example.com が ads.example.com にマッチ)
-    if (domainLen > blockedLen && domain.charAt(domainLen - blockedLen - 1) == '.') {
-      if (domain.endsWith(blocked)) {
-        return true;
-      }
-    }
+  stats.cacheHits++;
+  if (hitFlags & DNS_CACHE_HIT_PREFETCHED) {
+    stats.cachePrefetchHits++;
   }
-  return false;
+  updateCacheStats();
+
+  // refresh-ahead: 同じクエリを上流へ（ID は forwardToUpstream で書き換わる）
+  if (hitFlags & DNS_CACHE_HIT_REFRESH) {
+    forwardToUpstream(query, len, question, questionHash, client, micros(), true);
+  }
+  return true;
 }
 
-void DNSFilterManager::sendCustomIPResponse(uint8_t* query, size_t len,
-                                            IPAddress clientIP, uint16_t clientPort, IPAddress responseIP) {
-  // DNS 応答パケットを作成
-  uint8_t response[DNS_MAX_PACKET_SIZE];
-  memcpy(response, query, len);
+/**
+ * serve-stale: 期限切れを含むキャッシュ済み応答を、短い TTL でクライアントに返す
+ *
+ * query は質問の照合と名前の大文字小文字の復元にだけ使う（ID は clientId を返す）。
+ */
+bool DNSFilterManager::answerStale(const uint8_t* query, const DNSQuestion& question, uint32_t questionHash,
+                                   uint16_t clientId, const DNSClientEndpoint& client) {
+  if (!cache.isActive()) {
+    return false;
+  }
+
+  uint8_t* response = responseBuffer;
+  size_t responseLen = cache.lookupStale(questionHash, response, sizeof(responseBuffer), millis());
+  if (!restoreCachedQuestion(response, responseLen, query, question)) {
+    return false;
+  }
 
-  // フラグを設定（応答、権威あり、エラー無し）
-  response[2] = DNS_RESPONSE_FLAGS_BYTE2;  // QR=1, Opcode=0, AA=0, TC=0, RD=1
-  response[3] = DNS_RESPONSE_FLAGS_BYTE3;  // RA=1, Z=0, RCODE=0
+  response[0] = clientId >> 8;
+  response[1] = clientId & 0xFF;
+  sendToClient(response, responseLen, client);
 
-  // Answer Count = 1
-  response[6] = DNS_ANSWER_COUNT_HIGH_BYTE;
-  response[7] = DNS_ANSWER_COUNT_LOW_BYTE;
+  stats.cacheStaleServed++;
+  return true;
+}
 
-  // Answer Section を追加
-  size_t answerOffset = len;
+/**
+ * 問い合わせ中のエントリが保持するクエリで serve-stale を試みる
+ *
+ * クエリを保持していない（再送不可の）エントリは質問を照合できないため返さない。
+ */
+bool DNSFilterManager::answerStalePending(const DNSPendingQuery& entry, uint16_t clientId,
+                                          const DNSClientEndpoint& client) {
+  DNSQuestion question;
+  return entry.queryLength > 0 && parseDNSQuestion(entry.query, entry.queryLength, &question) &&
+         answerStale(entry.query, question, entry.questionHash, clientId, client);
+}
 
-  // Name: 圧縮ポインタ (DNS_COMPRESSION_POINTER_QUERY = Query Section の先頭を指す)
-  response[answerOffset++] = (DNS_COMPRESSION_POINTER_QUERY >> 8) & 0xFF;  // 上位バイト
-  response[answerOffset++] = DNS_COMPRESSION_POINTER_QUERY & 0xFF;         // 下位バイト
+/**
+ * キャッシュから取り出した応答の質問がクエリと一致するか確かめ、一致すれば名前をクエリのものに戻す
+ *
+ * ハッシュの衝突を除外するため、名前（大文字小文字を無視）・タイプ・クラスをすべて比較する。
+ */
+bool DNSFilterManager::restoreCachedQuestion(uint8_t* response, size_t responseLen, const uint8_t* query,
+                                             const DNSQuestion& question) {
+  DNSQuestion cached;
+  bool match = responseLen > 0 && parseDNSQuestion(response, responseLen, &cached) &&
+               cached.end == question.end && cached.qtype == question.qtype && cached.qclass == question.qclass;
+  for (size_t i = DNS_HEADER_SIZE; match && i < question.end; i++) {
+    match = tolower(response[i]) == tolower(query[i]);
+  }
 
-  // Type: A
-  response[answerOffset++] = (DNS_TYPE_A >> 8) & 0xFF;  // 上位バイト
-  response[answerOffset++] = DNS_TYPE_A & 0xFF;         // 下位バイト
+  if (match) {
+    memcpy(response + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE, question.end - DNS_HEADER_SIZE);
+  }
+  return match;
+}
 
-  // Class: IN
-  response[answerOffset++] = (DNS_CLASS_IN >> 8) & 0xFF;  // 上位バイト
-  response[answerOffset++] = DNS_CLASS_IN & 0xFF;         // 下位バイト
+void DNSFilterManager::updateCacheStats() {
+  stats.cacheBytesUsed = cache.getUsedBytes();
+  stats.cacheBytesTotal = cache.getCapacityBytes();
+  stats.cacheEntries = cache.getEntryCount();
+}
 
-  // TTL
-  response[answerOffset++] = (DNS_TTL_SECONDS >> 24) & 0xFF;
-  response[answerOffset++] = (DNS_TTL_SECONDS >> 16) & 0xFF;
-  response[answerOffset++] = (DNS_TTL_SECONDS >> 8) & 0xFF;
-  response[answerOffset++] = DNS_TTL_SECONDS & 0xFF;
+/**
+ * 質問（小文字化した名前・QTYPE・QCLASS・CD / DO）のハッシュ
+ *
+ * 上流へはクライアントのクエリのフラグのまま転送するため、CD / DO が異なる
+ * クエリにはキャッシュした応答を返さない。上流応答が送った質問に対するものかの
+ * 確認にも使う（応答の DO は上流によって異なるので、呼び出し側で送った値に揃える）。
+ */
+uint32_t DNSFilterManager::hashQuestion(const uint8_t* packet, const DNSQuestion& question) {
+  return hashQuestion(hashName(packet, question.name), question);
+}
 
-  // Data Length
-  response[answerOffset++] = DNS_DATA_LENGTH_HIGH_BYTE;
-  response[answerOffset++] = DNS_IPV4_ADDRESS_LENGTH;
+uint32_t DNSFilterManager::hashQuestion(uint32_t nameHash, const DNSQuestion& question) {
+  uint8_t key[DNS_QUESTION_FIXED_SIZE + 1] = {
+    (uint8_t)(question.qtype >> 8), (uint8_t)question.qtype,
+    (uint8_t)(question.qclass >> 8), (uint8_t)question.qclass,
+    question.dnssecFlags
+  };
+  return domainSuffixHash(nameHash, (const char*)key, sizeof(key));
+}
 
-  // Data: responseIP
-  response[answerOffset++] = responseIP[0];
-  response[answerOffset++] = responseIP[1];
-  response[answerOffset++] = responseIP[2];
-  response[answerOffset++] = responseIP[3];
+/**
+ * 名前（小文字化、ラベルは末尾から）のハッシュ
+ */
+uint32_t DNSFilterManager::hashName(const uint8_t* packet, const DNSName& name) {
+  char label[DNS_LABEL_BUFFER_SIZE];
+  uint32_t hash = DOMAIN_SUFFIX_HASH_SEED;
+  for (int i = name.labelCount - 1; i >= 0; i--) {
+    size_t len = foldLabel(packet, name, i, label);
+    hash = domainSuffixHash(hash, label, len);
+  }
+  return hash;
+}
 
-  // クライアントに送信
-  udp.beginPacket(clientIP, clientPort);
-  udp.write(response, answerOffset);
-  udp.endPacket();
+/**
+ * 上位ドメインの集計に 1 回加える（表に新しく入った場合のみ名前を文字列にする）
+ */
+void DNSFilterManager::recordTraffic(DNSTopList list, const uint8_t* packet, const DNSName& name, uint32_t nameHash) {
+  bool inserted;
+  DNSTopDomain* entry = traffic.recordDomain(list, nameHash, &inserted);
+  if (inserted) {
+    char text[DNS_TOP_DOMAIN_NAME_SIZE];
+    formatDNSName(packet, name, text, sizeof(text));
+    DNSTrafficStats::setName(entry, text);
+  }
 }
 
-void DNSFilterManager::forwardToUpstream(uint8_t* query, size_t len,
-                                          IPAddress clientIP, uint16_t clientPort) {
-  // 上流 DNS サーバーに転送
-  WiFiUDP upstreamUdp;
-  upstreamUdp.beginPacket(upstreamDNS, DNS_PORT);
-  upstreamUdp.write(query, len);
-  upstreamUdp.endPacket();
+/**
+ * パケット内の offset から始まる名前を解析し、各ラベルの位置を name に格納する
+ *
+ * - 圧縮ポインタは前方（既出の位置）への参照のみ、DNS_MAX_COMPRESSION_HOPS 回まで追跡
+ * - ラベル長 63 超、名前全体 255 バイト超、パケット外参照は不正として false
+ */
+bool DNSFilterManager::parseDNSName(const uint8_t* packet, size_t len, size_t offset, DNSName* name) {
+  size_t pos = offset;
+  size_t wireLength = 0;
+  int hops = 0;
 
-  // 応答を待つ
-  unsigned long startTime = millis();
-  while (millis() - startTime < DNS_FORWARD_TIMEOUT) {
-    int packetSize = upstreamUdp.parsePacket();
-    if (packetSize > 0) {
-      uint8_t response[DNS_MAX_PACKET_SIZE];
-      int responseLen = upstreamUdp.read(response, DNS_MAX_PACKET_SIZE);
-
-      // クライアントに転送
-      udp.beginPacket(clientIP, clientPort);
-      udp.write(response, responseLen);
-      udp.endPacket();
-
-      upstreamUdp.stop();
-      return;
+  name->labelCount = 0;
+  name->nameEnd = 0;
+
+  while (pos < len) {
+    uint8_t labelLen = packet[pos];
+
+    // 圧縮ポインタ（上位2ビットが11）
+    if ((labelLen & DNS_COMPRESSION_POINTER_MASK) == DNS_COMPRESSION_POINTER_MASK) {
+      if (pos + 1 >= len || ++hops > DNS_MAX_COMPRESSION_HOPS) {
+        return false;
+      }
+      size_t target = ((size_t)(labelLen & ~DNS_COMPRESSION_POINTER_MASK) << 8) | packet[pos + 1];
+      if (name->nameEnd == 0) {
+        name->nameEnd = pos + 2;
+      }
+      if (target >= pos) {
+        return false;  // 後方参照はループの恐れがあるため拒否
+      }
+      pos = target;
+      continue;
+    }
+
+    // 拡張ラベル（01/10）は未対応
+    if (labelLen & DNS_COMPRESSION_POINTER_MASK) {
+      return false;
+    }
+
+    // ルートラベルで終端
+    if (labelLen == 0) {
+      if (name->nameEnd == 0) {
+        name->nameEnd = pos + 1;
+      }
+      return name->labelCount > 0;
     }
-    delay(DNS_POLLING_INTERVAL);
+
+    wireLength += labelLen + 1;
+    if (labelLen > DNS_LABEL_MAX_LENGTH || pos + 1 + labelLen > len ||
+        wireLength >= DNS_MAX_NAME_WIRE_LENGTH || name->labelCount >= DNS_MAX_LABELS) {
+      return false;
+    }
+
+    name->labelOffset[name->labelCount] = pos + 1;
+    name->labelLength[name->labelCount] = labelLen;
+    name->labelCount++;
+    pos += 1 + labelLen;
   }
+  return false;  // 終端前にパケットが終わった
+}
 
-  // タイムアウト
-  Serial.println("DNSFilterManager: 上流 DNS タイムアウト");
-  upstreamUdp.stop();
+/**
+ * index 番目のラベルを小文字化して out（DNS_LABEL_BUFFER_SIZE バイト）にコピーし、長さを返す
+ */
+size_t DNSFilterManager::foldLabel(const uint8_t* packet, const DNSName& name, int index, char* out) {
+  const uint8_t* label = packet + name.labelOffset[index];
+  size_t len = name.labelLength[index];
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = label[i];
+    out[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+  }
+  return len;
 }
 
-bool DNSFilterManager::loadBlocklistFromFile(const char* filepath) {
-  if (!LittleFS.exists(filepath)) {
-    Serial.printf("DNSFilterManager: ブロックリストファイルが見つかりません: %s\n", filepath);
-    return false;
+/**
+ * ドット区切りの小文字文字列を out に書き出す（収まらない分は切り詰め）
+ *
+ * firstLabel を指定すると、そのラベルから末尾までのサフィックスを書き出す。
+ */
+void DNSFilterManager::formatDNSName(const uint8_t* packet, const DNSName& name, char* out, size_t size, int firstLabel) {
+  size_t used = 0;
+  char label[DNS_LABEL_BUFFER_SIZE];
+  for (int i = firstLabel; i < name.labelCount; i++) {
+    size_t len = foldLabel(packet, name, i, label);
+    if (used + (i > firstLabel ? 1 : 0) + len + 1 > size) {
+      break;
+    }
+    if (i > firstLabel) {
+      out[used++] = '.';
+    }
+    memcpy(out + used, label, len);
+    used += len;
   }
+  out[used] = '\0';
+}
 
-  File file = LittleFS.open(filepath, "r");
-  if (!file) {
-    Serial.println("DNSFilterManager: ブロックリストを開けませんでした");
+bool DNSFilterManager::isBlocked(const uint8_t* packet, const DNSName& name) {
+  if ((!blocklist.isLoaded() && overlay.getAddedCount() == 0) ||
+      enabledBlocklists.load(std::memory_order_relaxed) == 0) {
     return false;
   }
 
-  clearBlocklist();
+  char label[DNS_LABEL_BUFFER_SIZE];
+
+  // プレフィルタ: 各サフィックスのハッシュを末尾から確認し、
+  // どれも含まれていなければトライを辿らずに許可
+  if (prefilter.isActive()) {
+    bool candidate = false;
+    uint32_t hash = DOMAIN_SUFFIX_HASH_SEED;
+    for (int i = name.labelCount - 1; i >= 0; i--) {
+      size_t len = foldLabel(packet, name, i, label);
+      hash = domainSuffixHash(hash, label, len);
+      if (prefilter.mayContain(hash)) {
+        candidate = true;
+        break;
+      }
+    }
 
-  // バッファ割り当て
-  if (!blocklistBuffer) {
-    blocklistBuffer = (char*)malloc(BLOCKLIST_BUFFER_SIZE);
-    if (!blocklistBuffer) {
-      Serial.println("DNSFilterManager: メモリ割り当てに失敗しました");
-      file.close();
+    if (!candidate) {
+      stats.prefilterRejects++;
       return false;
     }
-    blocklistBufferSize = BLOCKLIST_BUFFER_SIZE;
-    blocklistBufferUsed = 0;
   }
 
-  int count = 0;
-  while (file.available() && count < MAX_BLOCKLIST_SIZE) {
-    String line = file.readStringUntil('\n');
-    line.trim();
-
-    // 空行とコメント行をスキップ
-    if (line.length() == 0 || line.startsWith("#")) {
-      continue;
-    }
-
-    // hosts 形式の場合は IP 部分を削除
-    if (line.startsWith("0.0.0.0 ") || line.startsWith("127.0.0.1 ")) {
-      int spaceIdx = line.indexOf(' ');
-      if (spaceIdx > 0) {
-        line = line.substring(spaceIdx + 1);
-        line.trim();
+  bool registered = false;
+  uint8_t matched = matchBlocklist(packet, name, &registered);
+  if (matched) {
+    for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+      if (matched & (1 << list)) {
+        stats.blocklistHits[list]++;
       }
     }
+    return true;
+  }
+
+  // 無効なリストや差分の墓標に一致しただけならプレフィルタの誤検出ではない
+  if (prefilter.isActive() && !registered) {
+    stats.prefilterFalsePositives++;
+  }
+  return false;
+}
 
-    // ブロックリストに追加
-    if (isValidDomain(line)) {
-      line.toLowerCase();
+/**
+ * 末尾のラベルから順にトライと差分を照合する（ads.example.com → com, example, ads）
+ *
+ * 途中で登録済みのドメインに到達すればサブドメインを含めて一致。
+ * トライの登録は差分の墓標で無効になり、差分で追加したドメインはトライに無くても一致する。
+ * 無効なリストにだけ属する登録は読み飛ばし、より長いサフィックスの照合を続ける。
+ * 一致した登録が属する有効なリストのビットを返す（差分の追加は custom、一致なしは 0）。
+ * registered には、有効・無効を問わずトライか差分の登録に一致したかを返す。
+ */
+uint8_t DNSFilterManager::matchBlocklist(const uint8_t* packet, const DNSName& name, bool* registered) {
+  uint8_t enabledLists = enabledBlocklists.load(std::memory_order_relaxed);
+  char label[DNS_LABEL_BUFFER_SIZE];
+  char suffix[DOMAIN_TRIE_MAX_NAME_SIZE];
+  bool inTrie = blocklist.isLoaded();
+  uint32_t node = blocklist.root();
+  uint32_t hash = DOMAIN_SUFFIX_HASH_SEED;
+  for (int i = name.labelCount - 1; i >= 0; i--) {
+    size_t len = foldLabel(packet, name, i, label);
+    inTrie = inTrie && blocklist.findChild(node, label, len, &node);
+    if (!inTrie && overlay.getAddedCount() == 0) {
+      break;
+    }
 
-      // 文字列プールに格納するための空き容量チェック
-      size_t domainLen = line.length() + 1;  // null終端を含む
-      if (blocklistBufferUsed + domainLen > blocklistBufferSize) {
-        Serial.println("DNSFilterManager: バッファが不足しています");
-        break;
+    // 差分は同じハッシュがある場合のみ名前を組み立てて確認する
+    BlocklistOverlayState state = BLOCKLIST_OVERLAY_NONE;
+    if (overlay.getCount() > 0) {
+      hash = domainSuffixHash(hash, label, len);
+      if (overlay.mayContain(hash)) {
+        formatDNSName(packet, name, suffix, sizeof(suffix), i);
+        state = overlay.find(hash, suffix, strlen(suffix));
       }
+    }
 
-      // 文字列プールにコピー
-      char* domainPtr = blocklistBuffer + blocklistBufferUsed;
-      strcpy(domainPtr, line.c_str());
-      blocklist.push_back(domainPtr);
+    uint8_t trieLists = inTrie ? blocklist.lists(node) : 0;
+    if (registered && (state != BLOCKLIST_OVERLAY_NONE || trieLists)) {
+      *registered = true;
+    }
 
-      blocklistBufferUsed += domainLen;
-      count++;
+    if (state == BLOCKLIST_OVERLAY_ADDED && (enabledLists & (1 << DNS_BLOCKLIST_CUSTOM))) {
+      return 1 << DNS_BLOCKLIST_CUSTOM;
+    }
+    uint8_t lists = state != BLOCKLIST_OVERLAY_REMOVED ? trieLists & enabledLists : 0;
+    if (lists) {
+      return lists;
     }
   }
-
-  file.close();
-  Serial.printf("DNSFilterManager: %s から %d ドメインを読み込みました\n", filepath, count);
-  Serial.printf("DNSFilterManager: バッファ使用量: %d / %d バイト (%.1f%%)\n",
-                blocklistBufferUsed, blocklistBufferSize,
-                (float)blocklistBufferUsed * 100.0 / blocklistBufferSize);
-  return true;
+  return 0;
 }
 
-bool DNSFilterManager::reloadBlocklist() {
-  Serial.println("DNSFilterManager: ブロックリストを再読み込み中...");
-  return loadBlocklistFromFile();
-}
+/**
+ * ブロックしたクエリに、設定中のポリシーで応答する
+ *
+ * NULL_IP でも A/AAAA 以外（HTTPS, MX 等）のクエリには型の合わない
+ * レコードを返さず NODATA とする。
+ */
+void DNSFilterManager::sendBlockedResponse(const uint8_t* query, const DNSQuestion& question,
+                                           const DNSClientEndpoint& client) {
+  DNSBlockPolicy policy = blockPolicy;
+  uint32_t ttl = blockTTL[policy];
 
-void DNSFilterManager::clearBlocklist() {
-  blocklist.clear();
-  blocklistBufferUsed = 0;  // バッファの使用量をリセット（再利用可能にする）
-}
+  if (policy == DNS_BLOCK_POLICY_NXDOMAIN) {
+    sendSyntheticResponse(query, question, client, DNS_RCODE_NXDOMAIN, nullptr, 0, ttl);
+    return;
+  }
 
-int DNSFilterManager::getBlocklistCount() const {
-  return blocklist.size();
-}
+  if (policy == DNS_BLOCK_POLICY_NULL_IP && question.qclass == DNS_CLASS_IN) {
+    if (question.qtype == DNS_TYPE_A) {
+      uint8_t address[DNS_IPV4_ADDRESS_LENGTH] = {
+        DNS_BLOCKED_IP[0], DNS_BLOCKED_IP[1], DNS_BLOCKED_IP[2], DNS_BLOCKED_IP[3]
+      };
+      sendSyntheticResponse(query, question, client, DNS_RCODE_NOERROR, address, sizeof(address), ttl);
+      return;
+    }
+    if (question.qtype == DNS_TYPE_AAAA) {
+      uint8_t address[DNS_IPV6_ADDRESS_LENGTH] = {0};  // ::
+      sendSyntheticResponse(query, question, client, DNS_RCODE_NOERROR, address, sizeof(address), ttl);
+      return;
+    }
+  }
 
-void DNSFilterManager::setCaptivePortal(bool enable) {
-  captivePortalEnabled = enable;
-  Serial.printf("DNSFilterManager: キャプティブポータルモード %s\n", captivePortalEnabled ? "有効" : "無効");
+  // NODATA（NULL_IP の A/AAAA 以外を含む）
+  sendSyntheticResponse(query, question, client, DNS_RCODE_NOERROR, nullptr, 0, ttl);
 }
 
-bool DNSFilterManager::isCaptivePortal() const {
-  return captivePortalEnabled;
+/**
+ * キャプティブポータルモードの応答（A には AP_IP、その他のタイプは NODATA）
+ */
+void DNSFilterManager::sendCaptivePortalResponse(const uint8_t* query, const DNSQuestion& question,
+                                                 const DNSClientEndpoint& client) {
+  if (question.qtype == DNS_TYPE_A && question.qclass == DNS_CLASS_IN) {
+    uint8_t address[DNS_IPV4_ADDRESS_LENGTH] = {AP_IP[0], AP_IP[1], AP_IP[2], AP_IP[3]};
+    sendSyntheticResponse(query, question, client, DNS_RCODE_NOERROR, address, sizeof(address), DNS_TTL_SECONDS);
+  } else {
+    sendSyntheticResponse(query, question, client, DNS_RCODE_NOERROR, nullptr, 0, DNS_TTL_SECONDS);
+  }
 }
 
-void DNSFilterManager::setEnabled(bool enable) {
-  enabled = enable;
-  Serial.printf("DNSFilterManager: %s\n", enabled ? "有効化" : "無効化");
+// ビッグエンディアンで書き込み
+static size_t putUint16(uint8_t* out, size_t offset, uint16_t value) {
+  out[offset] = (value >> 8) & 0xFF;
+  out[offset + 1] = value & 0xFF;
+  return offset + 2;
 }
 
-bool DNSFilterManager::isEnabled() const {
-  return enabled;
+static size_t putUint32(uint8_t* out, size_t offset, uint32_t value) {
+  offset = putUint16(out, offset, (value >> 16) & 0xFFFF);
+  return putUint16(out, offset, value & 0xFFFF);
 }
 
-DNSStats DNSFilterManager::getStats() const {
-  return stats;
+/**
+ * offset の位置に OPT レコード（UDP サイズ DNS_EDNS_UDP_SIZE、拡張フラグなし）を追加し、ARCOUNT を 1 増やす
+ *
+ * 呼び出し側で 1 + DNS_EDNS_OPT_FIXED_SIZE バイトの空きを確保しておく。
+ */
+size_t DNSFilterManager::appendOpt(uint8_t* response, size_t offset) {
+  uint16_t additional = ((uint16_t)response[10] << 8) | response[11];
+  putUint16(response, 10, additional + 1);
+
+  response[offset++] = 0;  // 名前: ルート
+  offset = putUint16(response, offset, DNS_TYPE_OPT);
+  offset = putUint16(response, offset, DNS_EDNS_UDP_SIZE);  // CLASS: UDP ペイロードサイズ
+  offset = putUint32(response, offset, 0);                  // TTL: 拡張 RCODE・バージョン・フラグ
+  return putUint16(response, offset, 0);                    // RDLENGTH
 }
 
-void DNSFilterManager::resetStats() {
-  stats = {0, 0, 0, 0};
-  Serial.println("DNSFilterManager: 統計情報をリセットしました");
+/**
+ * 応答をヘッダーと質問セクションのみに切り詰め、TC を立てる（RFC 2181 9）
+ *
+ * クライアントは TC を見て TCP で問い合わせ直す。EDNS のクライアントには OPT を付け直す。
+ */
+size_t DNSFilterManager::truncateResponse(uint8_t* response, size_t len, bool edns) {
+  DNSQuestion question;
+  bool hasQuestion = parseDNSQuestion(response, len, &question);
+  size_t end = hasQuestion ? question.end : DNS_HEADER_SIZE;
+
+  response[2] |= DNS_FLAG_TC;
+  size_t offset = putUint16(response, 4, hasQuestion ? 1 : 0);
+  offset = putUint16(response, offset, 0);
+  offset = putUint16(response, offset, 0);
+  putUint16(response, offset, 0);
+  return edns ? appendOpt(response, end) : end;
 }
 
-bool DNSFilterManager::isValidDomain(const String& domain) {
-  if (domain.length() < DOMAIN_NAME_MIN_LENGTH || domain.length() > DOMAIN_NAME_MAX_LENGTH) {
-    return false;
+/**
+ * クライアントの受け取れるサイズに合わせて応答を送る
+ *
+ * - EDNS のクライアント: OPT の UDP サイズを自分の値（DNS_EDNS_UDP_SIZE）に書き換え、
+ *   client.udpSize まで UDP で返す
+ * - EDNS を使わないクライアント: OPT を取り除き（RFC 6891 7）、512 バイトまで
+ * - 上限を超える場合のみ切り詰めて TC を立てる（TCP のクライアントは切り詰めない）
+ *
+ * response は複数のクライアントに配ることがあるため、内容を変える場合は responseBuffer に複製してから変える
+ * （OPT のサイズの書き換えはどのクライアントでも同じ値なのでその場で行う）。
+ */
+void DNSFilterManager::sendToClient(uint8_t* response, size_t len, const DNSClientEndpoint& client) {
+  bool tcp = client.tcpSlot != DNS_TCP_NONE;
+  size_t limit = tcp ? len : (client.udpSize ? client.udpSize : DNS_MAX_PACKET_SIZE);
+  size_t optOffset;
+  bool hasOpt = dnsFindOpt(response, len, &optOffset);
+  if (hasOpt && client.udpSize) {
+    putUint16(response, optOffset + 3, DNS_EDNS_UDP_SIZE);
+  }
+
+  if ((hasOpt && !client.udpSize) || len > limit) {
+    if (response != responseBuffer) {
+      memcpy(responseBuffer, response, len);
+      response = responseBuffer;
+    }
+    if (hasOpt && !client.udpSize) {
+      len = dnsRemoveOpt(response, len, optOffset);
+    }
+    if (len > limit) {
+      len = truncateResponse(response, len, client.udpSize != 0);
+      stats.truncatedResponses++;
+    }
+  }
+
+  if (tcp) {
+    sendTcpResponse(response, len, client);
+    return;
+  }
+  if (len > DNS_MAX_PACKET_SIZE) {
+    stats.largeResponses++;
+  }
+
+  udp.beginPacket(client.ip, client.port);
+  udp.write(response, len);
+  udp.endPacket();
+}
+
+/**
+ * 応答を返さずにクエリの処理を終える（TCP 接続の応答待ちの数を減らす）
+ */
+void DNSFilterManager::abandonClient(const DNSClientEndpoint& client) {
+  if (client.tcpSlot == DNS_TCP_NONE) {
+    return;
+  }
+  DNSTcpConnection& conn = tcpConnections[client.tcpSlot];
+  if (conn.active && conn.serial == client.tcpSerial && conn.outstanding > 0) {
+    conn.outstanding--;
+    conn.lastActivityMs = millis();  // アイドルタイムアウトはここから数える
+  }
+}
+
+/**
+ * ヘッダーと質問セクションを複製した応答を組み立てて送信する
+ *
+ * rdata が指定された場合は質問と同じ TYPE の回答レコードを 1 件、
+ * nullptr の場合は否定応答（NODATA / NXDOMAIN）として権威セクションに SOA を 1 件付ける。
+ * SERVFAIL 等のエラー応答はヘッダーと質問のみ。
+ * SOA の TTL と MINIMUM は ttl とし、クライアントのネガティブキャッシュ期間になる（RFC 2308）。
+ * クエリの追加セクションは複製せず、EDNS のクエリには自分の OPT を 1 件付ける。
+ */
+void DNSFilterManager::sendSyntheticResponse(const uint8_t* query, const DNSQuestion& question,
+                                             const DNSClientEndpoint& client, uint8_t rcode, const uint8_t* rdata, uint8_t rdataLength, uint32_t ttl) {
+  uint8_t* response = responseBuffer;
+  bool negative = !rdata && (rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN);
+  size_t recordLength = 0;  // 名前（圧縮ポインタ 2 バイト）を含むレコード長
+  if (rdata) {
+    recordLength = 2 + DNS_RR_FIXED_SIZE + rdataLength;
+  } else if (negative) {
+    recordLength = 2 + DNS_RR_FIXED_SIZE + DNS_SOA_RDATA_SIZE;
+  }
+  if (question.ednsUdpSize) {
+    recordLength += 1 + DNS_EDNS_OPT_FIXED_SIZE;
+  }
+  if (question.end + recordLength > sizeof(responseBuffer)) {
+    stats.errorQueries++;
+    abandonClient(client);
+    return;
+  }
+
+  // ヘッダーと質問セクションをそのまま複製（ID・大文字小文字を保持）
+  memcpy(response, query, question.end);
+
+  // フラグ: QR=1, RD はクエリから引き継ぎ, RA=1
+  response[2] = DNS_FLAG_QR | (query[2] & DNS_FLAG_RD);
+  response[3] = DNS_RESPONSE_FLAGS_BYTE3 | (rcode & 0x0F);
+
+  // QDCOUNT=1, ANCOUNT / NSCOUNT, ARCOUNT=0
+  size_t offset = putUint16(response, 4, 1);
+  offset = putUint16(response, offset, rdata ? 1 : 0);
+  offset = putUint16(response, offset, negative ? 1 : 0);
+  putUint16(response, offset, 0);
+
+  offset = question.end;
+
+  if (rdata || negative) {
+    // Name: 圧縮ポインタ (DNS_COMPRESSION_POINTER_QUERY = Query Section の先頭を指す)
+    offset = putUint16(response, offset, DNS_COMPRESSION_POINTER_QUERY);
+  }
+
+  if (rdata) {
+    // 回答: 質問と同じ TYPE / CLASS
+    offset = putUint16(response, offset, question.qtype);
+    offset = putUint16(response, offset, question.qclass);
+    offset = putUint32(response, offset, ttl);
+    offset = putUint16(response, offset, rdataLength);
+    memcpy(response + offset, rdata, rdataLength);
+    offset += rdataLength;
+  } else if (negative) {
+    // 権威: 質問名をゾーン頂点とする合成 SOA
+    offset = putUint16(response, offset, DNS_TYPE_SOA);
+    offset = putUint16(response, offset, DNS_CLASS_IN);
+    offset = putUint32(response, offset, ttl);
+    offset = putUint16(response, offset, DNS_SOA_RDATA_SIZE);
+    response[offset++] = 0;  // MNAME: ルート
+    response[offset++] = 0;  // RNAME: ルート
+    offset = putUint32(response, offset, DNS_SOA_SERIAL);
+    offset = putUint32(response, offset, DNS_SOA_REFRESH_SECONDS);
+    offset = putUint32(response, offset, DNS_SOA_RETRY_SECONDS);
+    offset = putUint32(response, offset, DNS_SOA_EXPIRE_SECONDS);
+    offset = putUint32(response, offset, ttl);  // MINIMUM（ネガティブキャッシュ TTL）
+  }
+
+  if (question.ednsUdpSize) {
+    offset = appendOpt(response, offset);
+  }
+
+  // クライアントに送信
+  sendToClient(response, offset, client);
+}
+
+/**
+ * TCP の接続を受け付け、各接続から届いたクエリを処理する（処理したクエリ数を返す）
+ *
+ * 読み込みはノンブロッキングで、受信済みのバイトだけを接続ごとのバッファに溜める。
+ * 送りきれなかった応答の残りは、読み込みの前に送信バッファの空いた分だけ送る。
+ * 応答待ちが無いまま DNS_TCP_IDLE_TIMEOUT を過ぎた接続（残りが送れないままの接続を含む）、
+ * 相手が閉じた接続は閉じる。
+ */
+uint16_t DNSFilterManager::handleTcpConnections() {
+  acceptTcpConnections();
+
+  uint16_t queries = 0;
+  unsigned long now = millis();
+  for (uint8_t slot = 0; slot < DNS_TCP_MAX_CONNECTIONS; slot++) {
+    DNSTcpConnection& conn = tcpConnections[slot];
+    if (!conn.active || !flushTcpResponse(slot)) {
+      continue;
+    }
+    queries += readTcpQueries(slot);
+    if (!conn.active) {
+      continue;  // 不正なメッセージで閉じた
+    }
+    if (!conn.client.connected() && conn.client.available() <= 0) {
+      closeTcpConnection(slot);
+    } else if (conn.outstanding == 0 && now - conn.lastActivityMs >= DNS_TCP_IDLE_TIMEOUT) {
+      LOG_DEBUG(LOG_TAG, "TCP 接続 %s をアイドルタイムアウトで閉じます", conn.client.remoteIP());
+      stats.tcpIdleClosed++;
+      closeTcpConnection(slot);
+    }
+  }
+  return queries;
+}
+
+/**
+ * 新しい接続を受け付ける（空きが無ければすぐに閉じる）
+ */
+void DNSFilterManager::acceptTcpConnections() {
+  while (true) {
+    WiFiClient incoming = tcpServer.accept();
+    if (!incoming) {
+      return;
+    }
+
+    uint8_t slot = DNS_TCP_NONE;
+    for (uint8_t i = 0; i < tcpConnectionLimit; i++) {
+      if (!tcpConnections[i].active) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot == DNS_TCP_NONE) {
+      LOG_WARN(LOG_TAG, "TCP 接続数が上限に達しています（%s を拒否）", incoming.remoteIP());
+      stats.tcpRefused++;
+      incoming.stop();
+      continue;
+    }
+
+    DNSTcpConnection& conn = tcpConnections[slot];
+    conn.client = incoming;
+    conn.client.setNoDelay(true);
+    conn.active = true;
+    conn.serial++;
+    conn.outstanding = 0;
+    conn.received = 0;
+    conn.lastActivityMs = millis();
+    stats.tcpConnections++;
+    stats.tcpActive++;
+    LOG_DEBUG(LOG_TAG, "TCP 接続を受け付けました: %s", conn.client.remoteIP());
+  }
+}
+
+/**
+ * 接続から届いた分だけ読み、揃ったクエリを順に処理する（パイプライン）
+ *
+ * 応答待ちが DNS_TCP_MAX_INFLIGHT 件に達したら、それ以上は読まずに応答を待つ。
+ */
+uint16_t DNSFilterManager::readTcpQueries(uint8_t slot) {
+  DNSTcpConnection& conn = tcpConnections[slot];
+  uint16_t queries = 0;
+
+  while (conn.outstanding < DNS_TCP_MAX_INFLIGHT) {
+    int available = conn.client.available();
+    if (available <= 0) {
+      break;
+    }
+
+    // 長さフィールド（2 バイト）が揃うまではそれだけを、揃ったらメッセージの残りを読む
+    size_t messageLength = 0;
+    size_t needed = DNS_TCP_LENGTH_SIZE;
+    if (conn.received >= DNS_TCP_LENGTH_SIZE) {
+      messageLength = ((size_t)conn.buffer[0] << 8) | conn.buffer[1];
+      needed += messageLength;
+    }
+    size_t chunk = needed - conn.received;
+    if (chunk > (size_t)available) {
+      chunk = available;
+    }
+    int n = conn.client.read(conn.buffer + conn.received, chunk);
+    if (n <= 0) {
+      break;
+    }
+    conn.received += n;
+    conn.lastActivityMs = millis();
+
+    if (conn.received == DNS_TCP_LENGTH_SIZE) {
+      messageLength = ((size_t)conn.buffer[0] << 8) | conn.buffer[1];
+      if (messageLength < DNS_HEADER_SIZE || messageLength > DNS_TCP_QUERY_SIZE) {
+        LOG_WARN(LOG_TAG, "TCP のクエリ長が不正です（%u バイト）", (unsigned)messageLength);
+        stats.errorQueries++;
+        closeTcpConnection(slot);
+        return queries;
+      }
+      continue;
+    }
+    if (conn.received < DNS_TCP_LENGTH_SIZE + messageLength) {
+      continue;
+    }
+
+    // 1 件揃った: 共通のクエリ処理へ（応答は処理が終わった順に返る）
+    DNSClientEndpoint client;
+    client.ip = conn.client.remoteIP();
+    client.port = conn.client.remotePort();
+    client.udpSize = 0;
+    client.tcpSlot = slot;
+    client.tcpSerial = conn.serial;
+
+    memcpy(queryBuffer, conn.buffer + DNS_TCP_LENGTH_SIZE, messageLength);
+    conn.received = 0;
+    conn.outstanding++;
+    stats.tcpQueries++;
+    queries++;
+    processQuery(queryBuffer, messageLength, client, micros());
+    if (!conn.active) {
+      break;  // 応答の送信に失敗して閉じた
+    }
+  }
+  return queries;
+}
+
+/**
+ * 送信バッファに入る分だけ送る（待たない）。送ったバイト数、接続が使えなければ -1 を返す
+ *
+ * WiFiClient::write() は送信バッファが満杯だと空くまで待つため、ソケットに直接送る。
+ */
+static int sendWithoutWaiting(WiFiClient& client, const uint8_t* data, size_t len) {
+  int sent = lwip_send(client.fd(), data, len, MSG_DONTWAIT);
+  if (sent < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+  return sent;
+}
+
+/**
+ * 長さフィールドを付けて TCP で応答を送る（DNS タスクを止めない）
+ *
+ * 接続が閉じられている（または同じ番号を別の接続が使っている）場合は捨てる。
+ * 送信バッファに入りきらない分は接続ごとに 1 件だけ保持し、flushTcpResponse() で送る。
+ * 前の応答の残りがまだ送れていない（クライアントが読んでいない）場合は接続を閉じる。
+ */
+void DNSFilterManager::sendTcpResponse(const uint8_t* response, size_t len, const DNSClientEndpoint& client) {
+  DNSTcpConnection& conn = tcpConnections[client.tcpSlot];
+  if (!conn.active || conn.serial != client.tcpSerial) {
+    return;
+  }
+  if (conn.outstanding > 0) {
+    conn.outstanding--;
+  }
+
+  if (conn.unsent) {
+    LOG_WARN(LOG_TAG, "TCP の応答を受け取らないクライアントを切断します（%s）", client.ip);
+    closeTcpConnection(client.tcpSlot);
+    return;
+  }
+
+  tcpFrame[0] = len >> 8;
+  tcpFrame[1] = len & 0xFF;
+  memcpy(tcpFrame + DNS_TCP_LENGTH_SIZE, response, len);
+  size_t frameLength = DNS_TCP_LENGTH_SIZE + len;
+  int sent = sendWithoutWaiting(conn.client, tcpFrame, frameLength);
+  if (sent < 0) {
+    LOG_WARN(LOG_TAG, "TCP の応答を送信できません（%s）", client.ip);
+    closeTcpConnection(client.tcpSlot);
+    return;
+  }
+  if ((size_t)sent < frameLength) {
+    conn.unsent = (uint8_t*)malloc(frameLength - sent);
+    if (!conn.unsent) {
+      LOG_WARN(LOG_TAG, "TCP の応答の残りを保持できません（%s）", client.ip);
+      closeTcpConnection(client.tcpSlot);
+      return;
+    }
+    memcpy(conn.unsent, tcpFrame + sent, frameLength - sent);
+    conn.unsentLength = frameLength - sent;
+    conn.unsentOffset = 0;
+  }
+  conn.lastActivityMs = millis();
+}
+
+/**
+ * 送りきれなかった応答の残りを、送信バッファに入る分だけ送る（接続を閉じた場合は false）
+ */
+bool DNSFilterManager::flushTcpResponse(uint8_t slot) {
+  DNSTcpConnection& conn = tcpConnections[slot];
+  if (!conn.unsent) {
+    return true;
+  }
+
+  int sent = sendWithoutWaiting(conn.client, conn.unsent + conn.unsentOffset, conn.unsentLength - conn.unsentOffset);
+  if (sent < 0) {
+    LOG_WARN(LOG_TAG, "TCP の応答を送信できません（%s）", conn.client.remoteIP());
+    closeTcpConnection(slot);
+    return false;
+  }
+  if (sent > 0) {
+    conn.unsentOffset += sent;
+    conn.lastActivityMs = millis();
+  }
+  if (conn.unsentOffset == conn.unsentLength) {
+    free(conn.unsent);
+    conn.unsent = nullptr;
+  }
+  return true;
+}
+
+void DNSFilterManager::closeTcpConnection(uint8_t slot) {
+  DNSTcpConnection& conn = tcpConnections[slot];
+  if (!conn.active) {
+    return;
+  }
+  conn.client.stop();
+  conn.active = false;
+  conn.outstanding = 0;
+  conn.received = 0;
+  free(conn.unsent);
+  conn.unsent = nullptr;
+  if (stats.tcpActive > 0) {
+    stats.tcpActive--;
+  }
+}
+
+/**
+ * クエリを上流 DNS に転送する（応答は待たない）
+ *
+ * トランザクション ID を未使用のランダム値に書き換えて送信し、
+ * 元の ID と返送先を問い合わせ中の表に記録する。
+ * 上流には EDNS で DNS_EDNS_UDP_SIZE を広告し、512 バイトを超える応答も UDP のまま受け取る
+ * （query は DNS_EDNS_UDP_SIZE バイトのバッファで、OPT を追加する場合がある）。
+ * 応答は handleUpstreamResponses() で受け取る。
+ * prefetch の場合、応答はキャッシュの更新にのみ使う。
+ */
+void DNSFilterManager::forwardToUpstream(uint8_t* query, size_t len, const DNSQuestion& question,
+                                          uint32_t questionHash, const DNSClientEndpoint& client,
+                                          uint32_t receivedUs, bool prefetch) {
+  // 同じ質問を問い合わせ中なら上流には送らず、その応答を待つ
+  uint16_t clientId = ((uint16_t)query[0] << 8) | query[1];
+  DNSPendingQuery* inFlight = findPendingQuestion(query, question, questionHash);
+  if (inFlight) {
+    if (prefetch || attachWaiter(inFlight, clientId, client, receivedUs)) {
+      return;
+    }
+  }
+
+  DNSPendingQuery* entry = allocatePending();
+  if (!entry) {
+    if (prefetch) {
+      cache.refreshFailed(questionHash);
+      return;
+    }
+    // 表が満杯: 期限切れの応答があればそれを、無ければ SERVFAIL を返してクライアントに再試行させる
+    LOG_WARN(LOG_TAG, "問い合わせ中のクエリが上限に達しました");
+    stats.upstreamOverflows++;
+    if (!answerStale(query, question, questionHash, clientId, client)) {
+      sendSyntheticResponse(query, question, client, DNS_RCODE_SERVFAIL, nullptr, 0, 0);
+    }
+    return;
+  }
+
+  entry->prefetch = prefetch;
+  entry->viaTcp = false;
+  entry->clientId = clientId;
+  entry->client = client;
+  entry->questionHash = questionHash;
+  entry->dnssecFlags = question.dnssecFlags;
+  entry->receivedAtUs = receivedUs;
+  entry->upstreamMask = 0;
+  entry->waiterCount = 0;
+
+  query[0] = entry->upstreamId >> 8;
+  query[1] = entry->upstreamId & 0xFF;
+
+  // クライアントの OPT はサイズを書き換え、OPT の無いクエリには追加する（追加セクションが空の場合のみ）
+  if (question.ednsUdpSize) {
+    putUint16(query, question.optOffset + 3, DNS_EDNS_UDP_SIZE);
+  } else if (query[10] == 0 && query[11] == 0 && len + 1 + DNS_EDNS_OPT_FIXED_SIZE <= DNS_EDNS_UDP_SIZE) {
+    len = appendOpt(query, len);
+  }
+
+  // 別のリゾルバへの再送用に保持（大きすぎるクエリは再送しない）
+  entry->queryLength = len <= DNS_PENDING_QUERY_SIZE ? len : 0;
+  memcpy(entry->query, query, entry->queryLength);
+
+  if (!sendToUpstreams(entry, query, len)) {
+    entry->active = false;
+    pendingCount--;
+    stats.upstreamPending = pendingCount;
+    if (!prefetch) {
+      abandonClient(client);
+    }
+    return;
+  }
+
+  if (prefetch) {
+    stats.cachePrefetches++;
+  }
+}
+
+/**
+ * 未送信のリゾルバから最良のもの（競争モードでは上位 2 つ）を選んで送信する
+ *
+ * タイムアウトは選んだリゾルバの RTT 推定から決める。
+ */
+bool DNSFilterManager::sendToUpstreams(DNSPendingQuery* entry, const uint8_t* query, size_t len, bool allowTcp) {
+  unsigned long now = millis();
+  int first = upstreams.select(entry->upstreamMask, now);
+  if (first == DNS_UPSTREAM_NONE) {
+    return false;
+  }
+
+  // TCP を優先する設定では、接続中のリゾルバが未送信ならそのまま使う（ハンドシェイクを省く）
+  if (allowTcp && upstreamTcpPreferred) {
+    int index = upstreamTcp.isConnected() ? upstreams.indexOf(upstreamTcp.getServer()) : DNS_UPSTREAM_NONE;
+    if (index == DNS_UPSTREAM_NONE || (entry->upstreamMask & (1 << index))) {
+      index = first;
+    }
+    if (sendViaTcp(entry, query, len, index)) {
+      return true;
+    }
+    stats.upstreamTcpFallbacks++;
+  }
+
+  uint8_t mask = 1 << first;
+  uint16_t timeoutMs = upstreams.getTimeoutMs(first);
+  if (upstreamRacing) {
+    int second = upstreams.select(entry->upstreamMask | mask, now);
+    if (second != DNS_UPSTREAM_NONE) {
+      mask |= 1 << second;
+      if (upstreams.getTimeoutMs(second) > timeoutMs) {
+        timeoutMs = upstreams.getTimeoutMs(second);
+      }
+    }
+  }
+
+  for (uint8_t i = 0; i < upstreams.getCount(); i++) {
+    if (mask & (1 << i)) {
+      upstreamUdp.beginPacket(upstreams.getAddress(i), DNS_PORT);
+      upstreamUdp.write(query, len);
+      upstreamUdp.endPacket();
+      upstreams.onQuery(i);
+    }
+  }
+
+  entry->viaTcp = false;
+  entry->upstreamMask |= mask;
+  entry->attemptMask = mask;
+  entry->timeoutMs = timeoutMs;
+  entry->sentAtUs = micros();
+  return true;
+}
+
+/**
+ * 上流への持続 TCP 接続でクエリを送る（接続が無ければ張る）
+ *
+ * 別のリゾルバに接続中なら切り替え、その接続で待っていたクエリは UDP で送り直す。
+ * バックオフ中・接続失敗・送信失敗の場合は false（呼び出し側で UDP を使う）。
+ */
+bool DNSFilterManager::sendViaTcp(DNSPendingQuery* entry, const uint8_t* query, size_t len, int upstreamIndex) {
+  if (len > DNS_UPSTREAM_TCP_QUERY_SIZE) {
+    return false;
+  }
+
+  unsigned long now = millis();
+  IPAddress server = upstreams.getAddress(upstreamIndex);
+  entry->viaTcp = false;
+  if (upstreamTcp.isConnected() && upstreamTcp.getServer() != server) {
+    upstreamTcp.close();
+    fallbackTcpPending();
+  }
+  if (!upstreamTcp.connect(server, DNS_PORT, now)) {
+    return false;
+  }
+  if (!upstreamTcp.send(query, len, now)) {
+    fallbackTcpPending();
+    return false;
+  }
+
+  upstreams.onQuery(upstreamIndex);
+  entry->viaTcp = true;
+  entry->upstreamMask |= 1 << upstreamIndex;
+  entry->attemptMask = 1 << upstreamIndex;
+  entry->timeoutMs = DNS_FORWARD_TIMEOUT;
+  entry->sentAtUs = micros();
+  return true;
+}
+
+/**
+ * TCP 接続で応答を待っていたクエリを、同じリゾルバに UDP で送り直す（接続が切れた場合）
+ *
+ * 保持していないクエリ（DNS_PENDING_QUERY_SIZE 超）はタイムアウトまで待つ。
+ */
+void DNSFilterManager::fallbackTcpPending() {
+  if (pendingCount == 0) {
+    return;
+  }
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    DNSPendingQuery& entry = pending[i];
+    if (!entry.active || !entry.viaTcp) {
+      continue;
+    }
+    entry.viaTcp = false;
+    entry.upstreamMask &= ~entry.attemptMask;
+    if (entry.queryLength > 0 && sendToUpstreams(&entry, entry.query, entry.queryLength, false)) {
+      stats.upstreamTcpFallbacks++;
+    }
+  }
+}
+
+/**
+ * まだ送っていないリゾルバに保持したクエリを再送する（フェイルオーバー）
+ */
+bool DNSFilterManager::retryPending(DNSPendingQuery* entry) {
+  if (entry->queryLength == 0 || !sendToUpstreams(entry, entry->query, entry->queryLength)) {
+    return false;
+  }
+  stats.upstreamFailovers++;
+  return true;
+}
+
+/**
+ * 到着済みの上流応答（UDP）をすべて処理する
+ */
+void DNSFilterManager::handleUpstreamResponses() {
+  while (upstreamUdp.parsePacket() > 0) {
+    uint8_t* response = upstreamBuffer;
+    int responseLen = upstreamUdp.read(response, sizeof(upstreamBuffer));
+
+    // 上流リゾルバ以外からのパケットは無視
+    int upstreamIndex = upstreams.indexOf(upstreamUdp.remoteIP());
+    if (upstreamIndex == DNS_UPSTREAM_NONE || upstreamUdp.remotePort() != DNS_PORT ||
+        responseLen < DNS_HEADER_SIZE) {
+      stats.upstreamUnmatched++;
+      continue;
+    }
+    handleUpstreamAnswer(response, responseLen, upstreamIndex, false);
+  }
+  stats.upstreamPending = pendingCount;
+}
+
+/**
+ * 上流への TCP 接続に届いた応答をすべて処理する
+ *
+ * 接続が切れていれば、TCP で応答を待っていたクエリを UDP で送り直す。
+ */
+void DNSFilterManager::handleUpstreamTcp() {
+  if (!upstreamTcp.isConnected()) {
+    fallbackTcpPending();
+    return;
+  }
+
+  uint8_t* response;
+  size_t responseLen;
+  while ((responseLen = upstreamTcp.receive(&response)) > 0) {
+    int upstreamIndex = upstreams.indexOf(upstreamTcp.getServer());
+    if (upstreamIndex == DNS_UPSTREAM_NONE || responseLen < DNS_HEADER_SIZE) {
+      stats.upstreamUnmatched++;
+      continue;
+    }
+    handleUpstreamAnswer(response, responseLen, upstreamIndex, true);
+  }
+  stats.upstreamPending = pendingCount;
+}
+
+/**
+ * 上流の応答を 1 件処理し、元の ID に戻してクライアントに返送する（UDP・TCP 共通）
+ *
+ * 切り詰められた（TC）UDP 応答は、TCP 接続が使えればそちらで問い合わせ直す。
+ */
+void DNSFilterManager::handleUpstreamAnswer(uint8_t* response, size_t responseLen, int upstreamIndex, bool viaTcp) {
+  uint16_t upstreamId = ((uint16_t)response[0] << 8) | response[1];
+  DNSPendingQuery* entry = findPending(upstreamId);
+
+  // ID・送信先・質問セクションがすべて一致した場合のみ受け付ける
+  DNSQuestion question;
+  if (!entry || !(entry->upstreamMask & (1 << upstreamIndex)) ||
+      !parseDNSQuestion(response, responseLen, &question)) {
+    stats.upstreamUnmatched++;
+    return;
+  }
+  question.dnssecFlags = entry->dnssecFlags;
+  if (hashQuestion(response, question) != entry->questionHash) {
+    stats.upstreamUnmatched++;
+    return;
+  }
+
+  bool truncated = response[2] & DNS_FLAG_TC;
+  if (entry->viaTcp && !viaTcp && truncated) {
+    return;  // TCP で問い合わせ直し中（競争モードのもう一方の切り詰められた応答）
+  }
+
+  // RTT は直近の送信先からの応答のみ計測する（各リゾルバへの送信は 1 回限り）。
+  // TCP の RTT は接続ごとに別に記録し、UDP の選択には使わない
+  bool sampled = !viaTcp && (entry->attemptMask & (1 << upstreamIndex));
+  upstreams.onResponse(upstreamIndex, sampled, micros() - entry->sentAtUs);
+  if (viaTcp) {
+    upstreamTcp.onResponse(micros() - entry->sentAtUs);
+  }
+
+  // 切り詰められた UDP 応答は同じリゾルバに TCP で問い合わせ直す（接続できなければそのまま返す）
+  if (!viaTcp && truncated && entry->queryLength > 0 &&
+      sendViaTcp(entry, entry->query, entry->queryLength, upstreamIndex)) {
+    stats.upstreamTcpRetries++;
+    return;
+  }
+
+  // SERVFAIL / REFUSED は別のリゾルバがあればそちらに問い合わせ直す
+  uint8_t rcode = response[3] & 0x0F;
+  if ((rcode == DNS_RCODE_SERVFAIL || rcode == DNS_RCODE_REFUSED) && retryPending(entry)) {
+    return;
+  }
+
+  // 次回以降の同じ質問に備えて保存（ID は返送時に書き換える）
+  bool stored = cache.store(entry->questionHash, response, responseLen, millis(),
+                            &stats.cacheEvictions, entry->prefetch);
+  if (stored) {
+    updateCacheStats();
+  }
+
+  if (entry->prefetch) {
+    if (!stored) {
+      cache.refreshFailed(entry->questionHash);
+    }
+  } else {
+    sendUpstreamAnswer(response, responseLen, question, rcode, entry->questionHash,
+                       entry->clientId, entry->client);
+    recordLatency(DNS_LATENCY_FORWARDED, entry->receivedAtUs);
+  }
+  releaseWaiters(entry, response, responseLen);
+
+  entry->active = false;
+  entry->viaTcp = false;
+  pendingCount--;
+}
+
+/**
+ * タイムアウトした問い合わせを処理する
+ *
+ * 未送信のリゾルバがあればそちらに再送する。
+ * すべて失敗した場合、期限切れでもキャッシュに応答が残っていれば短い TTL で返し（serve-stale）、
+ * 無ければ何も返さずクライアント側の再送に任せる。
+ */
+void DNSFilterManager::expirePendingQueries() {
+  if (pendingCount == 0) {
+    return;
+  }
+
+  unsigned long now = millis();
+  uint32_t nowUs = micros();
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    DNSPendingQuery& entry = pending[i];
+    if (!entry.active || (nowUs - entry.sentAtUs) / 1000 < entry.timeoutMs) {
+      continue;
+    }
+
+    // TCP 接続が応答しない: 接続を捨ててバックオフし、TCP で待っていたクエリを UDP で送り直す
+    // （UDP の RTT 推定には反映しない）
+    bool tcpTimeout = entry.viaTcp;
+    if (tcpTimeout) {
+      LOG_WARN(LOG_TAG, "上流 DNS の TCP 接続がタイムアウトしました");
+      upstreamTcp.fail(now);
+      fallbackTcpPending();
+      if ((micros() - entry.sentAtUs) / 1000 < entry.timeoutMs) {
+        continue;  // UDP で送り直した
+      }
+    }
+
+    for (uint8_t u = 0; u < upstreams.getCount() && !tcpTimeout; u++) {
+      if (entry.attemptMask & (1 << u)) {
+        upstreams.onTimeout(u, now);
+      }
+    }
+    if (retryPending(&entry)) {
+      continue;
+    }
+
+    LOG_WARN(LOG_TAG, "上流 DNS タイムアウト");
+    entry.active = false;
+    entry.viaTcp = false;
+    pendingCount--;
+    stats.upstreamTimeouts++;
+
+    if (entry.prefetch) {
+      cache.refreshFailed(entry.questionHash);
+    } else {
+      if (!answerStalePending(entry, entry.clientId, entry.client)) {
+        abandonClient(entry.client);
+      }
+      recordLatency(DNS_LATENCY_TIMEOUT, entry.receivedAtUs);
+    }
+    releaseWaiters(&entry, nullptr, 0);
+  }
+  stats.upstreamPending = pendingCount;
+}
+
+/**
+ * 問い合わせ中の表を空にする（応答は破棄され、クライアント側の再送に任せる）
+ */
+void DNSFilterManager::clearPending() {
+  // TCP クライアントは未応答数を戻す（戻さないと接続がアイドル扱いにならず、読み込みも再開しない）
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    if (pending[i].active && !pending[i].prefetch) {
+      abandonClient(pending[i].client);
+    }
+    pending[i].active = false;
+  }
+  for (int i = 0; i < DNS_MAX_QUERY_WAITERS; i++) {
+    if (waiters[i].active) {
+      abandonClient(waiters[i].client);
+    }
+    waiters[i].active = false;
+  }
+  pendingCount = 0;
+  stats.upstreamPending = 0;
+}
+
+/**
+ * 上流の応答をクライアントの ID に書き換えて返送する
+ *
+ * SERVFAIL の場合は期限切れの応答があればそちらを返す。
+ * response は ID と OPT の UDP サイズ以外は変更しない（相乗りしたクライアントにも同じ応答を配る）。
+ */
+void DNSFilterManager::sendUpstreamAnswer(uint8_t* response, size_t len, const DNSQuestion& question, uint8_t rcode,
+                                          uint32_t questionHash, uint16_t clientId, const DNSClientEndpoint& client) {
+  if (rcode == DNS_RCODE_SERVFAIL && answerStale(response, question, questionHash, clientId, client)) {
+    return;
+  }
+
+  response[0] = clientId >> 8;
+  response[1] = clientId & 0xFF;
+  sendToClient(response, len, client);
+}
+
+/**
+ * 同じ質問を問い合わせ中のエントリを探す
+ *
+ * 応答の質問セクションはそのまま返すため、大文字小文字を含めて完全に一致する場合のみ相乗りする
+ * （0x20 エンコーディングを使うクライアントの照合を壊さない）。上流の応答は最初のクライアントの
+ * CD / DO で問い合わせたものなので、これらも一致する必要がある。
+ */
+DNSPendingQuery* DNSFilterManager::findPendingQuestion(const uint8_t* query, const DNSQuestion& question,
+                                                       uint32_t questionHash) {
+  if (pendingCount == 0) {
+    return nullptr;
+  }
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    DNSPendingQuery& entry = pending[i];
+    if (entry.active && entry.questionHash == questionHash && entry.dnssecFlags == question.dnssecFlags &&
+        entry.queryLength >= question.end &&
+        memcmp(entry.query + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE, question.end - DNS_HEADER_SIZE) == 0) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * 問い合わせ中のエントリにクライアントを相乗りさせる（空きが無ければ false）
+ */
+bool DNSFilterManager::attachWaiter(DNSPendingQuery* entry, uint16_t clientId, const DNSClientEndpoint& client,
+                                    uint32_t receivedUs) {
+  for (int i = 0; i < DNS_MAX_QUERY_WAITERS; i++) {
+    DNSQueryWaiter& waiter = waiters[i];
+    if (!waiter.active) {
+      waiter.active = true;
+      waiter.pendingIndex = entry - pending;
+      waiter.clientId = clientId;
+      waiter.client = client;
+      waiter.attachedAtUs = receivedUs;
+      entry->waiterCount++;
+      stats.coalescedQueries++;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * 相乗りしたクライアントに応答を配る
+ *
+ * response が nullptr（タイムアウト）の場合は期限切れの応答があればそれを返し、無ければ何も返さない。
+ */
+void DNSFilterManager::releaseWaiters(DNSPendingQuery* entry, uint8_t* response, size_t len) {
+  if (entry->waiterCount == 0) {
+    return;
+  }
+
+  uint8_t pendingIndex = entry - pending;
+  uint8_t rcode = response ? response[3] & 0x0F : 0;
+  DNSQuestion question = {};
+  if (response) {
+    parseDNSQuestion(response, len, &question);  // handleUpstreamAnswer で検証済み
+  }
+  uint32_t nowUs = micros();
+  for (int i = 0; i < DNS_MAX_QUERY_WAITERS && entry->waiterCount > 0; i++) {
+    DNSQueryWaiter& waiter = waiters[i];
+    if (!waiter.active || waiter.pendingIndex != pendingIndex) {
+      continue;
+    }
+
+    bool answered = true;
+    if (response) {
+      sendUpstreamAnswer(response, len, question, rcode, entry->questionHash,
+                         waiter.clientId, waiter.client);
+    } else {
+      answered = answerStalePending(*entry, waiter.clientId, waiter.client);
+      if (!answered) {
+        abandonClient(waiter.client);
+      }
+    }
+
+    recordLatency(response ? DNS_LATENCY_FORWARDED : DNS_LATENCY_TIMEOUT, waiter.attachedAtUs);
+    if (answered) {
+      uint32_t waitUs = nowUs - waiter.attachedAtUs;
+      stats.coalescedAnswered++;
+      stats.coalescedWaitTotalUs += waitUs;
+      if (waitUs > stats.coalescedWaitMaxUs) {
+        stats.coalescedWaitMaxUs = waitUs;
+      }
+    }
+
+    waiter.active = false;
+    entry->waiterCount--;
+  }
+}
+
+DNSPendingQuery* DNSFilterManager::findPending(uint16_t upstreamId) {
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    if (pending[i].active && pending[i].upstreamId == upstreamId) {
+      return &pending[i];
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * 空きエントリを確保し、使用中の ID と重ならないランダムな上流 ID を割り当てる
+ */
+DNSPendingQuery* DNSFilterManager::allocatePending() {
+  DNSPendingQuery* entry = nullptr;
+  for (int i = 0; i < DNS_MAX_PENDING_QUERIES; i++) {
+    if (!pending[i].active) {
+      entry = &pending[i];
+      break;
+    }
+  }
+  if (!entry) {
+    return nullptr;
+  }
+
+  // 予測されにくいよう ID は乱数で選ぶ（ESP32 の random() はハードウェア乱数）
+  uint16_t id = 0;
+  for (int attempt = 0; attempt < DNS_UPSTREAM_ID_ATTEMPTS; attempt++) {
+    id = random(0x10000);
+    if (!findPending(id)) {
+      break;
+    }
+    if (attempt == DNS_UPSTREAM_ID_ATTEMPTS - 1) {
+      return nullptr;
+    }
+  }
+
+  entry->active = true;
+  entry->upstreamId = id;
+  pendingCount++;
+  stats.upstreamPending = pendingCount;
+  return entry;
+}
+
+/**
+ * 名前付きリストのファイルがあるか（有効なファイルか .bak）
+ */
+static bool blocklistFileExists(DNSBlocklistId list) {
+  return LittleFS.exists(BLOCKLIST_BINARY_PATHS[list]) || LittleFS.exists(BLOCKLIST_GZIP_PATHS[list]) ||
+         LittleFS.exists(BLOCKLIST_TEXT_PATHS[list]) || LittleFS.exists(BLOCKLIST_BINARY_BACKUP_PATHS[list]) ||
+         LittleFS.exists(BLOCKLIST_GZIP_BACKUP_PATHS[list]) || LittleFS.exists(BLOCKLIST_TEXT_BACKUP_PATHS[list]);
+}
+
+// トライの登録を統合先のビルダーに移す（リストごとのドメイン数も数える）
+struct BlocklistMerge {
+  DomainTrieBuilder* builder;
+  const BlocklistOverlay* overlay;  // nullptr 以外: 差分で削除した登録を除く
+  uint8_t keep;                     // 残すリストのビット
+  bool plain;                       // リストのビットを付けない（1 リストだけのファイルを作る）
+  uint32_t domains[DNS_BLOCKLIST_COUNT];
+};
+
+static void mergeDomain(const char* name, size_t len, uint8_t lists, void* context) {
+  BlocklistMerge* merge = static_cast<BlocklistMerge*>(context);
+  lists &= merge->keep;
+  if (lists == 0 ||
+      (merge->overlay && merge->overlay->find(domainNameHash(name, len), name, len) == BLOCKLIST_OVERLAY_REMOVED)) {
+    return;
+  }
+  merge->builder->add(name, len, merge->plain ? 0 : lists);
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    merge->domains[list] += (lists >> list) & 1;
+  }
+}
+
+// 差分で追加したドメインは custom リストに入れる
+static void mergeOverlayAdded(uint32_t /*hash*/, const char* name, size_t len, BlocklistOverlayState state, void* context) {
+  BlocklistMerge* merge = static_cast<BlocklistMerge*>(context);
+  if (state == BLOCKLIST_OVERLAY_ADDED && (merge->keep & (1 << DNS_BLOCKLIST_CUSTOM))) {
+    merge->builder->add(name, len, merge->plain ? 0 : 1 << DNS_BLOCKLIST_CUSTOM);
+    merge->domains[DNS_BLOCKLIST_CUSTOM]++;
+  }
+}
+
+/**
+ * リストごとのファイルを読み込み、1 つのトライに統合して現在のリストと差し替える（起動時）
+ *
+ * ファイルが 1 つだけならそのトライを統合せずに使う（登録にビットを付けず、既定のリストにする）。
+ * 複数ある場合は 1 つずつ読み込んで統合先に移すため、同時に持つ読み込み済みのトライは 1 つだけ。
+ */
+bool DNSFilterManager::loadBlocklists() {
+  unsigned long startTime = millis();
+  DNSBlocklistInfo infos[DNS_BLOCKLIST_COUNT];
+  uint8_t present = 0;
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    infos[list] = DNSBlocklistInfo();
+    if (blocklistFileExists((DNSBlocklistId)list)) {
+      present |= 1 << list;
+    }
+  }
+  if (present == 0) {
+    LOG_WARN(LOG_TAG, "ブロックリストファイルが見つかりません: %s", BLOCKLIST_TEXT_PATHS[DNS_BLOCKLIST_ADS]);
+    return false;
+  }
+
+  uint8_t* blob;
+  size_t size;
+  BlocklistLoadInfo info;
+  if ((present & (present - 1)) == 0) {
+    DNSBlocklistId list = DNS_BLOCKLIST_ADS;
+    while (!(present & (1 << list))) {
+      list = (DNSBlocklistId)(list + 1);
+    }
+    BlocklistParser parser;
+    if (!parseBlocklist(list, parser, &blob, &size, &info)) {
+      return false;
+    }
+    infos[list].file = info;
+    infos[list].domains = DomainTrie::getBlobDomainCount(blob);
+    if (!swapBlocklist(blob, size, 1 << list, info, getBlocklistName(list))) {
+      return false;
+    }
+  } else {
+    DomainTrieBuilder builder;
+    BlocklistMerge merge = {&builder, nullptr, DNS_BLOCKLIST_ALL, false, {0}};
+    BlocklistLoadInfo total = BlocklistLoadInfo();
+    for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+      if (!(present & (1 << list))) {
+        continue;
+      }
+      BlocklistParser parser;
+      if (!parseBlocklist((DNSBlocklistId)list, parser, &blob, &size, &info)) {
+        continue;
+      }
+      DomainTrie part;
+      if (!part.adopt(blob, size, 1 << list)) {
+        free(blob);
+        continue;
+      }
+      part.forEachDomain(mergeDomain, &merge);
+      infos[list].file = info;
+      total.fileBytes += info.fileBytes;
+      total.peakBytes = info.peakBytes > total.peakBytes ? info.peakBytes : total.peakBytes;
+    }
+    if (builder.getKeyCount() == 0) {
+      return false;
+    }
+
+    blob = builder.build(&size);
+    if (!blob) {
+      LOG_ERROR(LOG_TAG, "ブロックリストの統合に失敗しました（メモリ不足）");
+      return false;
+    }
+    // 作業メモリはリストごとの読み込みと統合の最大値の和（上限の目安）
+    total.peakBytes += builder.getPeakBytes();
+    total.durationMs = millis() - startTime;
+    for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+      infos[list].domains = merge.domains[list];
+    }
+    if (!swapBlocklist(blob, size, 0, total, "統合したリスト")) {
+      return false;
+    }
+  }
+
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    blocklistInfo[list] = infos[list];
+  }
+  return true;
+}
+
+/**
+ * 1 つのリストの有効なファイルを読み込む（読めない場合は .bak から読み込み、ファイルも元に戻す）
+ */
+bool DNSFilterManager::parseBlocklist(DNSBlocklistId list, BlocklistParser& parser, uint8_t** blob, size_t* size,
+                                      BlocklistLoadInfo* info) {
+  const char* filepath = getBlocklistPath(list);
+  if (parseBlocklistFile(filepath, parser, blob, size, info)) {
+    return true;
+  }
+
+  // アップロード前のファイルに戻す
+  const char* const candidates[] = {BLOCKLIST_BINARY_PATHS[list], BLOCKLIST_GZIP_PATHS[list], BLOCKLIST_TEXT_PATHS[list]};
+  for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+    const char* backup = getBlocklistBackupPath(candidates[i]);
+    if (!LittleFS.exists(backup)) {
+      continue;
+    }
+    LOG_WARN(LOG_TAG, "%s を読み込めないため %s に戻します", filepath, backup);
+    if (parseBlocklistFile(backup, parser, blob, size, info)) {
+      restoreBlocklistBackup(filepath, candidates[i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * ファイルをブロック単位で読み、そのままパーサーに渡してトライを構築する（gzip は展開しながら）
+ *
+ * 読み込み用のブロックは DNS タスクのスタックを使わないよう、読み込み中だけヒープに確保する。
+ */
+bool DNSFilterManager::parseBlocklistFile(const char* filepath, BlocklistParser& parser, uint8_t** blob, size_t* size,
+                                          BlocklistLoadInfo* info) {
+  unsigned long startTime = millis();
+  if (!LittleFS.exists(filepath)) {
+    LOG_WARN(LOG_TAG, "ブロックリストファイルが見つかりません: %s", filepath);
+    return false;
+  }
+
+  File file = LittleFS.open(filepath, "r");
+  if (!file) {
+    LOG_ERROR(LOG_TAG, "ブロックリストを開けませんでした");
+    return false;
+  }
+
+  uint8_t* chunk = (uint8_t*)malloc(BLOCKLIST_READ_CHUNK_SIZE);
+  if (!chunk) {
+    LOG_ERROR(LOG_TAG, "メモリ割り当てに失敗しました");
+    file.close();
+    return false;
+  }
+
+  size_t n;
+  size_t fileBytes = file.size();
+  parser.begin();
+  while ((n = file.read(chunk, BLOCKLIST_READ_CHUNK_SIZE)) > 0 && parser.feed(chunk, n)) {
+  }
+  file.close();
+  free(chunk);
+
+  *blob = parser.finish(size);
+  if (!*blob) {
+    LOG_ERROR(LOG_TAG, "%s: %s", filepath, parser.getError());
+    return false;
+  }
+
+  *info = BlocklistLoadInfo();
+  info->binary = parser.isBinary();
+  info->textFormat = parser.getTextFormat();
+  info->compressed = parser.isCompressed();
+  info->fileBytes = fileBytes;
+  info->durationMs = millis() - startTime;
+  info->peakBytes = parser.getPeakBytes();
+  LOG_INFO(LOG_TAG, "%s: %u ドメイン（%s 形式%s, %u バイト, %lu ms）", filepath,
+           (unsigned)DomainTrie::getBlobDomainCount(*blob), BlocklistParser::getFormatName(info->binary, info->textFormat),
+           info->compressed ? ", gzip" : "", (unsigned)fileBytes, (unsigned long)info->durationMs);
+  return true;
+}
+
+/**
+ * 構築済みのトライを現在のリストと差し替え、プレフィルタを作り直す
+ *
+ * DNS タスク（またはタスク起動前）で呼ぶため、クエリから見ると一度に切り替わる。
+ * 検証に失敗した場合は blob を解放し、現在のリストをそのまま使う。
+ */
+bool DNSFilterManager::swapBlocklist(uint8_t* blob, size_t size, uint8_t defaultLists, const BlocklistLoadInfo& info,
+                                     const char* source) {
+  if (!blocklist.adopt(blob, size, defaultLists)) {
+    free(blob);
+    LOG_ERROR(LOG_TAG, "ブロックリストの構造が不正です（現在のリストを継続）");
+    return false;
+  }
+
+  rebuildPrefilter();
+
+  loadInfo = info;
+  loadInfo.readyAtMs = millis();
+
+  LOG_INFO(LOG_TAG, "%s に差し替えました（%u ドメイン, ファイル %u バイト）",
+           source, (unsigned)blocklist.getDomainCount(), (unsigned)info.fileBytes);
+  uint32_t bytesPerDomainTenths = blocklist.getDomainCount() > 0 ?
+                                  (uint32_t)(blocklist.getSizeBytes() * 10 / blocklist.getDomainCount()) : 0;
+  LOG_INFO(LOG_TAG, "トライサイズ: %u バイト (%u.%u バイト/ドメイン)",
+           (unsigned)blocklist.getSizeBytes(), bytesPerDomainTenths / 10, bytesPerDomainTenths % 10);
+  LOG_INFO(LOG_TAG, "読み込み時間: %lu ms, ピーク作業メモリ: %u バイト",
+                (unsigned long)loadInfo.durationMs, (unsigned)loadInfo.peakBytes);
+  return true;
+}
+
+/**
+ * 置き換えたファイルを .bak から戻す（failedPath は削除）
+ */
+bool DNSFilterManager::restoreBlocklistBackup(const char* failedPath, const char* previousPath) {
+  const char* backup = getBlocklistBackupPath(previousPath);
+  LittleFS.remove(failedPath);
+  if (!LittleFS.exists(backup) || !LittleFS.rename(backup, previousPath)) {
+    LOG_ERROR(LOG_TAG, "%s を戻せませんでした", backup);
+    return false;
+  }
+  LOG_WARN(LOG_TAG, "%s を %s に戻しました", backup, previousPath);
+  return true;
+}
+
+/**
+ * list の有効なファイルを newPath で置き換える（旧ファイルは .bak、previousPath に旧ファイルのパス）
+ *
+ * テキストをアップロードした場合も古い .bin が優先されないよう、有効なファイルは形式によらず退避する。
+ */
+bool DNSFilterManager::replaceBlocklistFile(DNSBlocklistId list, const char* newPath, const char* target,
+                                            const char** previousPath) {
+  const char* previous = getBlocklistPath(list);
+  const char* backup = getBlocklistBackupPath(previous);
+  LittleFS.remove(backup);
+  if (LittleFS.exists(previous)) {
+    LittleFS.rename(previous, backup);
+  }
+  if (!LittleFS.rename(newPath, target)) {
+    LOG_ERROR(LOG_TAG, "%s を保存できませんでした", target);
+    LittleFS.remove(newPath);
+    restoreBlocklistBackup(target, previous);
+    return false;
+  }
+  *previousPath = previous;
+  return true;
+}
+
+/**
+ * アップロード中に構築した list のトライを他のリストと統合して差し替える（Web サーバーのタスクから呼ぶ）
+ *
+ * ファイルを先に入れ替え（旧ファイルは .bak）、トライは DNS タスクが次の処理の合間に
+ * 差し替える。それまでは旧リストでフィルタを続け、差し替えに失敗した場合はファイルを戻す。
+ * 他のリストに登録があれば、現在のトライから list 以外の登録を取り出して統合する
+ * （統合中は現在のトライ・アップロードしたトライ・統合先を同時に持つ）。
+ * 差分（追加・削除）とジャーナルはそのまま残し、引き続き重ねて照合する。
+ */
+bool DNSFilterManager::installBlocklist(DNSBlocklistId list, const char* uploadedPath, uint8_t* blob, size_t size,
+                                        const BlocklistLoadInfo& info) {
+  // 現在のトライと blocklistInfo は、前回の差し替えが終わっていれば DNS タスクから変更されない
+  if (!waitForBlocklistSwap()) {
+    free(blob);
+    LittleFS.remove(uploadedPath);
+    return false;
+  }
+
+  const char* target = info.compressed ? BLOCKLIST_GZIP_PATHS[list] :
+                       info.binary ? BLOCKLIST_BINARY_PATHS[list] : BLOCKLIST_TEXT_PATHS[list];
+  const char* previous;
+  if (!replaceBlocklistFile(list, uploadedPath, target, &previous)) {
+    free(blob);
+    return false;
+  }
+
+  DNSCommand command = DNSCommand();
+  command.type = DNS_COMMAND_INSTALL_BLOCKLIST;
+  command.loadInfo = info;
+  command.path = target;
+  command.previousPath = previous;
+  uint8_t others = 0;
+  for (uint8_t i = 0; i < DNS_BLOCKLIST_COUNT; i++) {
+    command.blocklists[i] = blocklistInfo[i];
+    if (i != list && blocklistInfo[i].domains > 0) {
+      others |= 1 << i;
+    }
+  }
+  command.blocklists[list].file = info;
+
+  if (others == 0) {
+    command.blob = blob;
+    command.value = size;
+    command.defaultLists = 1 << list;
+    command.blocklists[list].domains = DomainTrie::getBlobDomainCount(blob);
+  } else {
+    DomainTrie uploaded;
+    if (!uploaded.adopt(blob, size, 1 << list)) {
+      LOG_ERROR(LOG_TAG, "ブロックリストの構造が不正です（現在のリストを継続）");
+      free(blob);
+      restoreBlocklistBackup(target, previous);
+      return false;
+    }
+    unsigned long startTime = millis();
+    DomainTrieBuilder builder;
+    BlocklistMerge merge = {&builder, nullptr, others, false, {0}};
+    blocklist.forEachDomain(mergeDomain, &merge);
+    merge.keep = 1 << list;
+    uploaded.forEachDomain(mergeDomain, &merge);
+    uploaded.reset();
+
+    command.blob = builder.build(&size);
+    if (!command.blob) {
+      LOG_ERROR(LOG_TAG, "ブロックリストの統合に失敗しました（メモリ不足）");
+      restoreBlocklistBackup(target, previous);
+      return false;
+    }
+    command.value = size;
+    command.loadInfo.durationMs += millis() - startTime;
+    command.loadInfo.peakBytes = builder.getPeakBytes();
+    for (uint8_t i = 0; i < DNS_BLOCKLIST_COUNT; i++) {
+      command.blocklists[i].domains = merge.domains[i];
+    }
+  }
+
+  if (!submitBlocklistSwap(command)) {
+    free(command.blob);
+    restoreBlocklistBackup(target, previous);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * トライの差し替えを送る（完了は waitForBlocklistSwap() で待つ）
+ */
+bool DNSFilterManager::submitBlocklistSwap(DNSCommand& command) {
+  command.sequence = ++blocklistSwapSeq;
+  if (!submitCommand(command)) {
+    blocklistSwapSeq--;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * 送った差し替えを DNS タスクが処理し終えるまで待つ（loop() 側）
+ */
+bool DNSFilterManager::waitForBlocklistSwap() {
+  unsigned long startTime = millis();
+  while (blocklistSwapDone.load(std::memory_order_acquire) != blocklistSwapSeq) {
+    if (millis() - startTime >= BLOCKLIST_SWAP_TIMEOUT) {
+      LOG_WARN(LOG_TAG, "前回のブロックリストの差し替えが DNS タスクで処理されません");
+      return false;
+    }
+    delay(1);
+  }
+  return true;
+}
+
+// ========================================
+// ブロックリストの差分
+// ========================================
+
+/**
+ * 追加・削除・照会を 1 件処理する（DNS タスク、またはタスク起動前）
+ *
+ * トライは変更せず差分の表だけを更新するため、件数に関係なく数マイクロ秒で反映される。
+ */
+void DNSFilterManager::applyBlocklistEdit(DNSBlocklistEdit& edit) {
+  uint32_t startUs = micros();
+  edit.status = DNS_BLOCKLIST_EDIT_UNCHANGED;
+  if (edit.op == DNS_BLOCKLIST_EDIT_LOOKUP) {
+    lookupBlocklist(edit);
+  } else {
+    uint32_t hash = domainNameHash(edit.name, edit.length);
+    BlocklistOverlayState current = overlay.find(hash, edit.name, edit.length);
+    uint8_t lists = blocklist.contains(edit.name, edit.length);
+
+    // 追加は custom リストへ（既に custom にあれば差分の取り消し）。
+    // 削除はどのリストの登録も無効にする（トライに無いものの削除は差分の取り消し）
+    BlocklistOverlayState next;
+    if (edit.op == DNS_BLOCKLIST_EDIT_ADD) {
+      next = (lists & (1 << DNS_BLOCKLIST_CUSTOM)) ? BLOCKLIST_OVERLAY_NONE : BLOCKLIST_OVERLAY_ADDED;
+    } else {
+      next = lists ? BLOCKLIST_OVERLAY_REMOVED : BLOCKLIST_OVERLAY_NONE;
+    }
+
+    if (next != current) {
+      if (!overlay.set(hash, edit.name, edit.length, next)) {
+        edit.status = DNS_BLOCKLIST_EDIT_FULL;
+      } else {
+        edit.status = DNS_BLOCKLIST_EDIT_CHANGED;
+        if (next == BLOCKLIST_OVERLAY_ADDED && prefilter.isActive()) {
+          prefilter.add(hash);
+        }
+      }
+    }
+  }
+  edit.applyUs = micros() - startUs;
+}
+
+/**
+ * edit.name がブロック対象かを、一致したドメインとともに調べる
+ */
+void DNSFilterManager::lookupBlocklist(DNSBlocklistEdit& edit) {
+  edit.blocked = false;
+  edit.match[0] = '\0';
+  edit.matchAdded = false;
+  edit.matchLists = 0;
+
+  uint8_t enabledLists = enabledBlocklists.load(std::memory_order_relaxed);
+  bool inTrie = blocklist.isLoaded();
+  uint32_t node = blocklist.root();
+  uint32_t hash = DOMAIN_SUFFIX_HASH_SEED;
+  size_t end = edit.length;
+  while (end > 0) {
+    size_t start = end;
+    while (start > 0 && edit.name[start - 1] != '.') {
+      start--;
+    }
+    const char* label = edit.name + start;
+    inTrie = inTrie && blocklist.findChild(node, label, end - start, &node);
+    hash = domainSuffixHash(hash, label, end - start);
+    BlocklistOverlayState state = overlay.find(hash, label, edit.length - start);
+
+    bool added = state == BLOCKLIST_OVERLAY_ADDED && (enabledLists & (1 << DNS_BLOCKLIST_CUSTOM));
+    uint8_t lists = added ? 1 << DNS_BLOCKLIST_CUSTOM :
+                    inTrie && state != BLOCKLIST_OVERLAY_REMOVED ? blocklist.lists(node) & enabledLists : 0;
+    if (lists) {
+      edit.blocked = true;
+      edit.matchAdded = added;
+      edit.matchLists = lists;
+      memcpy(edit.match, label, edit.length - start);
+      edit.match[edit.length - start] = '\0';
+      break;
+    }
+    end = start > 0 ? start - 1 : 0;
+  }
+
+  edit.tombstone = overlay.find(domainNameHash(edit.name, edit.length), edit.name, edit.length) ==
+                   BLOCKLIST_OVERLAY_REMOVED;
+}
+
+/**
+ * ドメインを追加・削除・照会する（loop() から呼び、DNS タスクが処理するまで待つ）
+ *
+ * 反映した追加・削除はジャーナルに追記し、起動時に再適用する。
+ */
+DNSBlocklistEditStatus DNSFilterManager::editBlocklist(DNSBlocklistEditOp op, const String& domain,
+                                                       DNSBlocklistEdit* result) {
+  String name = domain;
+  name.trim();
+  name.toLowerCase();
+  if (!BlocklistParser::isValidDomain(name.c_str(), name.length())) {
+    return DNS_BLOCKLIST_EDIT_INVALID;
+  }
+
+  // 前回の要求がまだ処理されていない場合は受け付けない
+  if (blocklistEditDone.load(std::memory_order_acquire) != blocklistEditSeq) {
+    return DNS_BLOCKLIST_EDIT_TIMEOUT;
+  }
+  // 前回待ちきれなかった要求は、処理済みになった今ここで記録する
+  if (blocklistEditJournaled != blocklistEditSeq) {
+    recordBlocklistEdit(blocklistEdit);
+  }
+
+  blocklistEdit.op = op;
+  memcpy(blocklistEdit.name, name.c_str(), name.length() + 1);
+  blocklistEdit.length = name.length();
+
+  DNSCommand command = DNSCommand();
+  command.type = DNS_COMMAND_EDIT_BLOCKLIST;
+  command.value = ++blocklistEditSeq;
+  if (!submitCommand(command)) {
+    blocklistEditSeq--;
+    return DNS_BLOCKLIST_EDIT_TIMEOUT;
+  }
+
+  unsigned long startTime = millis();
+  while (blocklistEditDone.load(std::memory_order_acquire) != blocklistEditSeq) {
+    if (millis() - startTime >= BLOCKLIST_SWAP_TIMEOUT) {
+      LOG_WARN(LOG_TAG, "ブロックリストの編集が DNS タスクで処理されません");
+      return DNS_BLOCKLIST_EDIT_TIMEOUT;
+    }
+    delay(1);
+  }
+
+  recordBlocklistEdit(blocklistEdit);
+  if (result) {
+    *result = blocklistEdit;
+  }
+  return blocklistEdit.status;
+}
+
+/**
+ * 処理済みの追加・削除をジャーナルに追記する（loop() 側）
+ */
+void DNSFilterManager::recordBlocklistEdit(const DNSBlocklistEdit& edit) {
+  blocklistEditJournaled = blocklistEditSeq;
+  if (edit.op == DNS_BLOCKLIST_EDIT_LOOKUP) {
+    return;
+  }
+  if (edit.status == DNS_BLOCKLIST_EDIT_FULL) {
+    compactionRequested = true;
+    return;
+  }
+  if (edit.status != DNS_BLOCKLIST_EDIT_CHANGED) {
+    return;
+  }
+
+  lastEditApplyUs = edit.applyUs;
+  LOG_INFO(LOG_TAG, "%s: %s（%lu us）", edit.op == DNS_BLOCKLIST_EDIT_ADD ? "ブロックリストに追加" : "ブロックリストから削除",
+           edit.name, (unsigned long)edit.applyUs);
+
+  File file = LittleFS.open(BLOCKLIST_JOURNAL_PATH, "a");
+  if (!file) {
+    LOG_ERROR(LOG_TAG, "ジャーナルに書き込めませんでした（再起動で失われます）");
+    return;
+  }
+  file.write((uint8_t)(edit.op == DNS_BLOCKLIST_EDIT_ADD ? '+' : '-'));
+  file.write((const uint8_t*)edit.name, edit.length);
+  file.write((uint8_t)'\n');
+  file.close();
+
+  journalEntries++;
+  if (journalEntries >= BLOCKLIST_COMPACT_ENTRIES) {
+    compactionRequested = true;
+  }
+}
+
+/**
+ * 起動時にジャーナル（1 行 1 件: "+domain" / "-domain"）を読み込んだリストに再適用する
+ */
+void DNSFilterManager::replayBlocklistJournal() {
+  if (!LittleFS.exists(BLOCKLIST_JOURNAL_PATH)) {
+    return;
+  }
+  File file = LittleFS.open(BLOCKLIST_JOURNAL_PATH, "r");
+  if (!file) {
+    return;
+  }
+
+  uint16_t applied = 0;
+  journalEntries = 0;
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    line.trim();
+    if (line.length() < 2 || (line[0] != '+' && line[0] != '-') ||
+        !BlocklistParser::isValidDomain(line.c_str() + 1, line.length() - 1)) {
+      continue;
+    }
+    blocklistEdit.op = line[0] == '+' ? DNS_BLOCKLIST_EDIT_ADD : DNS_BLOCKLIST_EDIT_REMOVE;
+    memcpy(blocklistEdit.name, line.c_str() + 1, line.length());
+    blocklistEdit.length = line.length() - 1;
+    applyBlocklistEdit(blocklistEdit);
+    journalEntries++;
+    if (blocklistEdit.status == DNS_BLOCKLIST_EDIT_CHANGED) {
+      applied++;
+    } else if (blocklistEdit.status == DNS_BLOCKLIST_EDIT_FULL) {
+      LOG_WARN(LOG_TAG, "ジャーナルの適用中に差分の表が満杯になりました: %s", blocklistEdit.name);
+    }
+  }
+  file.close();
+
+  compactionRequested = journalEntries >= BLOCKLIST_COMPACT_ENTRIES || overlay.isFull();
+  LOG_INFO(LOG_TAG, "ジャーナルから %u 件を適用しました（追加 %u, 削除 %u）",
+           applied, overlay.getAddedCount(), overlay.getRemovedCount());
+}
+
+// 差分が変更したリストを集める（追加は custom、削除は登録が属するすべてのリスト）
+struct BlocklistChanges {
+  const DomainTrie* trie;
+  uint8_t lists;
+};
+
+static void collectChangedLists(uint32_t /*hash*/, const char* name, size_t len, BlocklistOverlayState state,
+                                void* context) {
+  BlocklistChanges* changes = static_cast<BlocklistChanges*>(context);
+  changes->lists |= state == BLOCKLIST_OVERLAY_ADDED ? 1 << DNS_BLOCKLIST_CUSTOM : changes->trie->contains(name, len);
+}
+
+/**
+ * 差分をトライに統合し、変更したリストをコンパイル済み形式で保存して差し替える（loop() から呼ぶ）
+ *
+ * トライと差分を変更するコマンドはすべて loop() から送るため、送ったコマンドを DNS タスクが
+ * 処理し終えていれば、ここで読んでいる間に書き換えられることはない。
+ * 待ちきれなかった追加・削除がまだ処理されていない場合は、editBlocklist() と同じく受け付けずに失敗とする。
+ * ジャーナルは再適用しても結果が変わらないため、途中で失敗した場合は残して次の機会に任せる。
+ * compactionRequested は成功した時にだけ下ろす（失敗時は compactBlocklistIfNeeded() が間隔を空けて再試行する）。
+ */
+bool DNSFilterManager::compactBlocklist() {
+  if (blocklistEditDone.load(std::memory_order_acquire) != blocklistEditSeq) {
+    LOG_WARN(LOG_TAG, "ブロックリストの編集が DNS タスクで処理されていないため圧縮を見送ります");
+    return false;
+  }
+  // 処理済みで未記録の追加・削除は、統合で消すジャーナルより先に記録しておく
+  if (blocklistEditJournaled != blocklistEditSeq) {
+    recordBlocklistEdit(blocklistEdit);
+  }
+
+  if (overlay.getCount() == 0) {
+    LittleFS.remove(BLOCKLIST_JOURNAL_PATH);
+    journalEntries = 0;
+    compactionRequested = false;
+    return true;
+  }
+  if (!waitForBlocklistSwap()) {
+    return false;
   }
 
-  if (domain.indexOf(' ') >= 0 || domain.indexOf("..") >= 0) {
+  unsigned long startTime = millis();
+  DomainTrieBuilder builder;
+  BlocklistMerge merge = {&builder, &overlay, DNS_BLOCKLIST_ALL, false, {0}};
+  blocklist.forEachDomain(mergeDomain, &merge);
+  overlay.forEach(mergeOverlayAdded, &merge);
+  if (builder.getKeyCount() == 0) {
+    LOG_WARN(LOG_TAG, "統合後のブロックリストが空になるため圧縮しません");
     return false;
   }
 
-  if (domain.indexOf('.') < 0) {
+  size_t size;
+  uint8_t* blob = builder.build(&size);
+  if (!blob) {
+    LOG_ERROR(LOG_TAG, "ブロックリストの圧縮に失敗しました（メモリ不足）");
     return false;
   }
 
-  for (unsigned int i = 0; i < domain.length(); i++) {
-    char c = domain.charAt(i);
-    if (!isalnum(c) && c != '.' && c != '-' && c != '_') {
+  DNSCommand command = DNSCommand();
+  command.type = DNS_COMMAND_INSTALL_BLOCKLIST;
+  command.blob = blob;
+  command.value = size;
+  command.clearOverlay = true;
+  command.loadInfo.binary = true;
+  command.loadInfo.peakBytes = builder.getPeakBytes();
+
+  BlocklistChanges changes = {&blocklist, 0};
+  overlay.forEach(collectChangedLists, &changes);
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    command.blocklists[list] = blocklistInfo[list];
+    if ((changes.lists & (1 << list)) && !compactBlocklistFile((DNSBlocklistId)list, &command.blocklists[list])) {
+      free(blob);
       return false;
     }
+    command.blocklists[list].domains = merge.domains[list];
+    command.loadInfo.fileBytes += command.blocklists[list].file.fileBytes;
+  }
+  command.loadInfo.durationMs = millis() - startTime;
+  if (!submitBlocklistSwap(command)) {
+    free(blob);
+    return false;
+  }
+
+  // 差分は差し替えと同時に捨てられる（ファイルには統合済み）
+  LittleFS.remove(BLOCKLIST_JOURNAL_PATH);
+  journalEntries = 0;
+  compactionRequested = false;
+  compactions++;
+  lastCompactionMs = millis() - startTime;
+  LOG_INFO(LOG_TAG, "ブロックリストの差分を統合しました（%lu ms）", (unsigned long)lastCompactionMs);
+  return true;
+}
+
+/**
+ * 差分を統合した list だけのトライを list の .bin に保存する（空になったリストはファイルを .bak に退避）
+ */
+bool DNSFilterManager::compactBlocklistFile(DNSBlocklistId list, DNSBlocklistInfo* info) {
+  unsigned long startTime = millis();
+  DomainTrieBuilder builder;
+  BlocklistMerge merge = {&builder, &overlay, (uint8_t)(1 << list), true, {0}};
+  blocklist.forEachDomain(mergeDomain, &merge);
+  overlay.forEach(mergeOverlayAdded, &merge);
+  if (builder.getKeyCount() == 0) {
+    const char* previous = getBlocklistPath(list);
+    const char* backup = getBlocklistBackupPath(previous);
+    LittleFS.remove(backup);
+    if (LittleFS.exists(previous)) {
+      LittleFS.rename(previous, backup);
+    }
+    *info = DNSBlocklistInfo();
+    return true;
+  }
+
+  size_t size;
+  uint8_t* blob = builder.build(&size);
+  if (!blob) {
+    LOG_ERROR(LOG_TAG, "ブロックリストの圧縮に失敗しました（メモリ不足）");
+    return false;
+  }
+
+  uint8_t header[DOMAIN_TRIE_FILE_HEADER_SIZE];
+  writeDomainTrieFileHeader(header, size, domainTrieCrc32(blob, size));
+  File file = LittleFS.open(BLOCKLIST_COMPACT_PATH, "w");
+  bool written = file && file.write(header, sizeof(header)) == sizeof(header) && file.write(blob, size) == size;
+  if (file) {
+    file.close();
+  }
+  free(blob);
+  if (!written) {
+    LOG_ERROR(LOG_TAG, "圧縮したブロックリストを保存できませんでした");
+    LittleFS.remove(BLOCKLIST_COMPACT_PATH);
+    return false;
   }
 
+  const char* previous;
+  if (!replaceBlocklistFile(list, BLOCKLIST_COMPACT_PATH, BLOCKLIST_BINARY_PATHS[list], &previous)) {
+    return false;
+  }
+  info->file = BlocklistLoadInfo();
+  info->file.binary = true;
+  info->file.fileBytes = sizeof(header) + size;
+  info->file.durationMs = millis() - startTime;
+  info->file.peakBytes = builder.getPeakBytes();
   return true;
 }
+
+/**
+ * 圧縮が要求されていれば実行する（loop() から呼ぶ）
+ *
+ * 失敗した場合は BLOCKLIST_COMPACT_BACKOFF_MIN から倍々に BLOCKLIST_COMPACT_BACKOFF_MAX まで間隔を空けて再試行する。
+ */
+void DNSFilterManager::compactBlocklistIfNeeded() {
+  unsigned long now = millis();
+  if (!compactionRequested || (compactionBackoffMs > 0 && now - compactionFailedAt < compactionBackoffMs)) {
+    return;
+  }
+
+  if (compactBlocklist()) {
+    compactionBackoffMs = 0;
+    return;
+  }
+
+  compactionFailedAt = millis();
+  if (compactionBackoffMs == 0) {
+    compactionBackoffMs = BLOCKLIST_COMPACT_BACKOFF_MIN;
+  } else if (compactionBackoffMs < BLOCKLIST_COMPACT_BACKOFF_MAX) {
+    compactionBackoffMs *= 2;
+    if (compactionBackoffMs > BLOCKLIST_COMPACT_BACKOFF_MAX) {
+      compactionBackoffMs = BLOCKLIST_COMPACT_BACKOFF_MAX;
+    }
+  }
+  LOG_WARN(LOG_TAG, "ブロックリストの圧縮を %lu ms 後に再試行します", (unsigned long)compactionBackoffMs);
+}
+
+DNSBlocklistDeltaInfo DNSFilterManager::getBlocklistDeltaInfo() const {
+  DNSStatusSnapshot current = readSnapshot();
+  DNSBlocklistDeltaInfo info;
+  info.added = current.overlayAdded;
+  info.removed = current.overlayRemoved;
+  info.full = current.overlayFull;
+  info.overlayBytes = current.overlayBytes;
+  info.journalEntries = journalEntries;
+  info.lastApplyUs = lastEditApplyUs;
+  info.compactions = compactions;
+  info.lastCompactionMs = lastCompactionMs;
+  return info;
+}
+
+void DNSFilterManager::clearBlocklist() {
+  prefilter.reset();
+  blocklist.reset();
+}
+
+static void addToPrefilter(uint32_t hash, void* context) {
+  static_cast<BloomFilter*>(context)->add(hash);
+}
+
+static void addOverlayToPrefilter(uint32_t hash, const char* /*name*/, size_t /*len*/, BlocklistOverlayState state, void* context) {
+  if (state == BLOCKLIST_OVERLAY_ADDED) {
+    static_cast<BloomFilter*>(context)->add(hash);
+  }
+}
+
+void DNSFilterManager::rebuildPrefilter() {
+  if (!prefilter.init(blocklist.getDomainCount() + overlay.getAddedCount(), prefilterBitsPerEntry)) {
+    LOG_WARN(LOG_TAG, "プレフィルタのメモリ割り当てに失敗しました（無効で継続）");
+    return;
+  }
+  if (!prefilter.isActive()) {
+    return;
+  }
+
+  blocklist.forEachDomainHash(addToPrefilter, &prefilter);
+  overlay.forEach(addOverlayToPrefilter, &prefilter);
+  uint32_t fprHundredths = (uint32_t)(prefilter.getEstimatedFalsePositiveRate() * 10000.0f);
+  LOG_INFO(LOG_TAG, "プレフィルタ %u バイト, ハッシュ %u 個, 理論偽陽性率 %u.%02u%%",
+           (unsigned)prefilter.getSizeBytes(), prefilter.getHashCount(), fprHundredths / 100, fprHundredths % 100);
+}
+
+void DNSFilterManager::setPrefilterBitsPerEntry(uint8_t bitsPerEntry) {
+  DNSCommand command = DNSCommand();
+  command.type = DNS_COMMAND_SET_PREFILTER_BITS;
+  command.value = bitsPerEntry;
+  submitCommand(command);
+}
+
+/**
+ * 上流リゾルバを設定する（形式の検証はここで行い、適用は DNS タスクで行う）
+ */
+bool DNSFilterManager::setUpstreams(const String& list) {
+  DNSCommand command = DNSCommand();
+  int count = DNSUpstreamSet::parseList(list, command.servers, DNS_MAX_CONFIGURED_UPSTREAMS);
+  if (count <= 0) {
+    return false;
+  }
+  command.type = DNS_COMMAND_SET_UPSTREAMS;
+  command.count = count;
+  return submitCommand(command);
+}
+
+String DNSFilterManager::getUpstreams() const {
+  DNSStatusSnapshot status = readSnapshot();
+  String text = "";
+  for (uint8_t i = 0; i < status.upstreamCount; i++) {
+    if (!status.upstreams[i].fromDhcp) {
+      if (text.length() > 0) {
+        text += ", ";
+      }
+      text += status.upstreams[i].address.toString();
+    }
+  }
+  return text;
+}
+
+void DNSFilterManager::setDhcpUpstream(IPAddress server) {
+  DNSCommand command = DNSCommand();
+  command.type = DNS_COMMAND_SET_DHCP_UPSTREAM;
+  command.count = 1;
+  command.servers[0] = server;
+  submitCommand(command);
+}
+
+void DNSFilterManager::setUpstreamRacing(bool enable) {
+  upstreamRacing = enable;
+}
+
+bool DNSFilterManager::isUpstreamRacing() const {
+  return upstreamRacing;
+}
+
+void DNSFilterManager::setUpstreamTcp(bool enable) {
+  upstreamTcpPreferred = enable;
+}
+
+bool DNSFilterManager::isUpstreamTcp() const {
+  return upstreamTcpPreferred;
+}
+
+DNSUpstreamTcpInfo DNSFilterManager::getUpstreamTcpInfo() const {
+  return readSnapshot().upstreamTcp;
+}
+
+uint8_t DNSFilterManager::getUpstreamCount() const {
+  return readSnapshot().upstreamCount;
+}
+
+DNSUpstreamInfo DNSFilterManager::getUpstreamInfo(uint8_t index) const {
+  return readSnapshot().upstreams[index];
+}
+
+void DNSFilterManager::setBlockPolicy(DNSBlockPolicy policy) {
+  if (policy < DNS_BLOCK_POLICY_COUNT) {
+    blockPolicy = policy;
+  }
+}
+
+DNSBlockPolicy DNSFilterManager::getBlockPolicy() const {
+  return blockPolicy;
+}
+
+void DNSFilterManager::setBlockTTL(DNSBlockPolicy policy, uint32_t ttl) {
+  if (policy < DNS_BLOCK_POLICY_COUNT) {
+    blockTTL[policy] = ttl > DNS_BLOCK_TTL_MAX ? DNS_BLOCK_TTL_MAX : ttl;
+  }
+}
+
+uint32_t DNSFilterManager::getBlockTTL(DNSBlockPolicy policy) const {
+  return policy < DNS_BLOCK_POLICY_COUNT ? blockTTL[policy].load() : 0;
+}
+
+const char* DNSFilterManager::getBlockPolicyName(DNSBlockPolicy policy) {
+  switch (policy) {
+    case DNS_BLOCK_POLICY_NULL_IP: return "ヌル IP（0.0.0.0 / ::）";
+    case DNS_BLOCK_POLICY_NODATA: return "NODATA（回答なし）";
+    case DNS_BLOCK_POLICY_NXDOMAIN: return "NXDOMAIN（存在しないドメイン）";
+    default: return "不明";
+  }
+}
+
+const char* DNSFilterManager::getLatencyOutcomeName(DNSLatencyOutcome outcome) {
+  switch (outcome) {
+    case DNS_LATENCY_BLOCKED: return "blocked";
+    case DNS_LATENCY_CAPTIVE: return "captive";
+    case DNS_LATENCY_CACHED: return "cached";
+    case DNS_LATENCY_FORWARDED: return "forwarded";
+    case DNS_LATENCY_TIMEOUT: return "timeout";
+    default: return "unknown";
+  }
+}
+
+uint32_t DNSFilterManager::getLatencyBucketUpperUs(uint8_t bucket) {
+  return 1UL << (DNS_LATENCY_MIN_SHIFT + bucket);
+}
+
+PrefilterInfo DNSFilterManager::getPrefilterInfo() const {
+  return readSnapshot().prefilterInfo;
+}
+
+int DNSFilterManager::getBlocklistCount() const {
+  return readSnapshot().blocklistCount;
+}
+
+size_t DNSFilterManager::getBlocklistBytes() const {
+  return readSnapshot().blocklistBytes;
+}
+
+BlocklistLoadInfo DNSFilterManager::getLoadInfo() const {
+  return readSnapshot().loadInfo;
+}
+
+DNSBlocklistInfo DNSFilterManager::getBlocklistInfo(DNSBlocklistId list) const {
+  return readSnapshot().blocklists[list];
+}
+
+const char* DNSFilterManager::getBlocklistPath(DNSBlocklistId list) {
+  if (LittleFS.exists(BLOCKLIST_BINARY_PATHS[list])) {
+    return BLOCKLIST_BINARY_PATHS[list];
+  }
+  return LittleFS.exists(BLOCKLIST_GZIP_PATHS[list]) ? BLOCKLIST_GZIP_PATHS[list] : BLOCKLIST_TEXT_PATHS[list];
+}
+
+const char* DNSFilterManager::getBlocklistBackupPath(const char* path) {
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    if (strcmp(path, BLOCKLIST_BINARY_PATHS[list]) == 0) {
+      return BLOCKLIST_BINARY_BACKUP_PATHS[list];
+    }
+    if (strcmp(path, BLOCKLIST_GZIP_PATHS[list]) == 0) {
+      return BLOCKLIST_GZIP_BACKUP_PATHS[list];
+    }
+    if (strcmp(path, BLOCKLIST_TEXT_PATHS[list]) == 0) {
+      return BLOCKLIST_TEXT_BACKUP_PATHS[list];
+    }
+  }
+  return BLOCKLIST_TEXT_BACKUP_PATHS[DNS_BLOCKLIST_ADS];
+}
+
+static const char* const BLOCKLIST_NAMES[DNS_BLOCKLIST_COUNT] = {"ads", "trackers", "malware", "custom"};
+
+const char* DNSFilterManager::getBlocklistName(DNSBlocklistId list) {
+  return list < DNS_BLOCKLIST_COUNT ? BLOCKLIST_NAMES[list] : "unknown";
+}
+
+bool DNSFilterManager::parseBlocklistName(const String& name, DNSBlocklistId* list) {
+  for (uint8_t i = 0; i < DNS_BLOCKLIST_COUNT; i++) {
+    if (name == BLOCKLIST_NAMES[i]) {
+      *list = (DNSBlocklistId)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * 照合に使うリストを切り替える（トライは作り直さず、次のクエリから反映）
+ */
+void DNSFilterManager::setEnabledBlocklists(uint8_t lists) {
+  enabledBlocklists.store(lists & DNS_BLOCKLIST_ALL, std::memory_order_relaxed);
+}
+
+uint8_t DNSFilterManager::getEnabledBlocklists() const {
+  return enabledBlocklists.load(std::memory_order_relaxed);
+}
+
+void DNSFilterManager::setCaptivePortal(bool enable) {
+  captivePortalEnabled = enable;
+  LOG_INFO(LOG_TAG, "キャプティブポータルモード %s", captivePortalEnabled ? "有効" : "無効");
+}
+
+bool DNSFilterManager::isCaptivePortal() const {
+  return captivePortalEnabled;
+}
+
+void DNSFilterManager::setEnabled(bool enable) {
+  enabled = enable;
+  LOG_INFO(LOG_TAG, "%s", enabled ? "有効化" : "無効化");
+}
+
+bool DNSFilterManager::isEnabled() const {
+  return enabled;
+}
+
+DNSStats DNSFilterManager::getStats() const {
+  return readSnapshot().stats;
+}
+
+void DNSFilterManager::resetStats() {
+  DNSCommand command = DNSCommand();
+  command.type = DNS_COMMAND_RESET_STATS;
+  submitCommand(command);
+}
+
+uint8_t DNSFilterManager::getTopDomains(DNSTopList list, DNSTopDomain* out, uint8_t maxCount) const {
+  uint8_t count;
+  uint32_t before;
+  uint32_t after;
+  do {
+    before = trafficSeq.load(std::memory_order_acquire);
+    count = publishedTopCount[list] < maxCount ? publishedTopCount[list] : maxCount;
+    memcpy(out, publishedTop[list], count * sizeof(DNSTopDomain));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = trafficSeq.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return count;
+}
+
+uint8_t DNSFilterManager::getClientStats(DNSClientStats* out, uint8_t maxCount) const {
+  uint8_t count;
+  uint32_t before;
+  uint32_t after;
+  do {
+    before = trafficSeq.load(std::memory_order_acquire);
+    count = publishedClientCount < maxCount ? publishedClientCount : maxCount;
+    for (uint8_t i = 0; i < count; i++) {
+      out[i] = publishedClients[i];
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = trafficSeq.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return count;
+}
+
+uint8_t DNSFilterManager::getClientCapacity() const {
+  return traffic.getClientCapacity();
+}
@@ -12,18 +12,176 @@
 #include <WiFi.h>
 #include <WiFiUdp.h>
 #include <LittleFS.h>
-#include <vector>
+#include <atomic>
+#include "DomainTrie.h"
+#include "BlocklistParser.h"
+#include "BlocklistOverlay.h"
+#include "BloomFilter.h"
+#include "DNSCache.h"
+#include "DNSUpstreamSet.h"
+#include "DNSUpstreamConnection.h"
+#include "DNSTrafficStats.h"
+#include "SPSCRing.h"
 
 // ===== DNS パケット定数 =====
 #define DNS_PORT 53
-#define DNS_MAX_PACKET_SIZE 512
+#define DNS_MAX_PACKET_SIZE 512         // EDNS を使わないクライアントへの UDP 応答の上限（RFC 1035）
+#define DNS_EDNS_UDP_SIZE 1232          // 上流に広告し、クライアントに返せる UDP ペイロードの上限（DNS Flag Day 2020）
 #define DNS_HEADER_SIZE 12
-#define MAX_BLOCKLIST_SIZE 5000
+
+// DNS 名前解析定数
+#define DNS_MAX_LABELS 127              // 255 バイトの名前に入る最大ラベル数
+#define DNS_MAX_NAME_WIRE_LENGTH 255    // ワイヤー形式の名前の最大長（RFC 1035）
+#define DNS_MAX_COMPRESSION_HOPS 8      // 圧縮ポインタの最大追跡回数
+#define DNS_LABEL_BUFFER_SIZE 64        // 小文字化したラベル 1 個分のバッファ
+#define DNS_NAME_TEXT_BUFFER_SIZE 256   // ログ表示用のドット区切り名前バッファ
 
 // DNS 応答パケット定数
-#define DNS_ANSWER_COUNT_HIGH_BYTE 0x00
-#define DNS_ANSWER_COUNT_LOW_BYTE 0x01
-#define DNS_DATA_LENGTH_HIGH_BYTE 0x00
+#define DNS_QUESTION_FIXED_SIZE 4       // 質問セクションの QTYPE + QCLASS
+#define DNS_RR_FIXED_SIZE 10            // リソースレコードの TYPE + CLASS + TTL + RDLENGTH
+#define DNS_SOA_RDATA_SIZE 22           // 合成 SOA の RDATA（MNAME/RNAME はルート、数値 5 個）
+#define DNS_FLAG_QR 0x80                // ヘッダー byte 2: 応答フラグ
+#define DNS_FLAG_RD 0x01                // ヘッダー byte 2: 再帰要求
+#define DNS_FLAG_TC 0x02                // ヘッダー byte 2: 切り詰め
+#define DNS_OPCODE_MASK 0x78            // ヘッダー byte 2: OPCODE
+#define DNS_FLAG_CD 0x10                // ヘッダー byte 3: DNSSEC 検証無効
+#define DNS_EDNS_FLAG_DO 0x80           // OPT の TTL の 3 バイト目: DNSSEC OK
+#define DNS_RCODE_NOERROR 0
+
+// 上流転送
+#define DNS_MAX_PENDING_QUERIES 16      // 同時に上流へ問い合わせ中にできるクエリ数
+#define DNS_UPSTREAM_ID_ATTEMPTS 8      // 未使用のトランザクション ID を探す試行回数
+#define DNS_PENDING_QUERY_SIZE 300      // フェイルオーバー再送用に保持するクエリの最大長
+#define DNS_MAX_QUERY_WAITERS 16        // 問い合わせ中の同じ質問に相乗りできるクライアント数
+
+// TCP（RFC 7766）
+#define DNS_TCP_MAX_CONNECTIONS 4       // 同時に受け付ける TCP 接続数（AP_MAX_CONNECTIONS の方が小さければそちら）
+#define DNS_TCP_QUERY_SIZE 512          // TCP で受け付けるクエリの最大長（超えたら接続を閉じる）
+#define DNS_TCP_LENGTH_SIZE 2           // メッセージ前の長さフィールド
+#define DNS_TCP_MAX_INFLIGHT 8          // 1 接続で同時に処理中にできるクエリ数（超えると応答を待ってから読む）
+#define DNS_TCP_NONE 0xFF               // UDP のクライアント
+
+// 応答時間のヒストグラム（バケット i の上限は 2^(DNS_LATENCY_MIN_SHIFT + i) マイクロ秒）
+#define DNS_LATENCY_BUCKETS 18          // 64 µs〜約 8.4 秒（これを超える分は最後の超過バケット）
+#define DNS_LATENCY_MIN_SHIFT 6         // 最初のバケットの上限 2^6 = 64 µs
+
+// DNS タスク
+#define DNS_COMMAND_QUEUE_SIZE 8        // Web UI 等から DNS タスクへのコマンドの待ち行列（2 のべき乗）
+
+// ===== 名前付きブロックリスト =====
+// リストごとのファイルを 1 つのトライに統合し、登録ごとに属するリストのビットを持つ
+enum DNSBlocklistId : uint8_t {
+  DNS_BLOCKLIST_ADS = 0,          // 広告（従来の /blocklist.*）
+  DNS_BLOCKLIST_TRACKERS,         // トラッカー
+  DNS_BLOCKLIST_MALWARE,          // マルウェア
+  DNS_BLOCKLIST_CUSTOM,           // 個別に追加したドメイン（差分の統合先）
+  DNS_BLOCKLIST_COUNT
+};
+#define DNS_BLOCKLIST_ALL ((1 << DNS_BLOCKLIST_COUNT) - 1)
+
+// ===== DNS 名前（ワイヤー形式のラベル位置） =====
+// パケット内のラベルを (オフセット, 長さ) の組で参照する。文字列は生成しない。
+struct DNSName {
+  uint8_t labelCount;                       // ラベル数
+  uint16_t nameEnd;                         // 名前の直後（QTYPE の位置）のオフセット
+  uint16_t labelOffset[DNS_MAX_LABELS];     // 各ラベル先頭（長さバイトの次）のオフセット
+  uint8_t labelLength[DNS_MAX_LABELS];      // 各ラベルの長さ
+};
+
+// ===== DNS 質問セクション =====
+struct DNSQuestion {
+  DNSName name;                             // QNAME
+  uint16_t qtype;                           // QTYPE
+  uint16_t qclass;                          // QCLASS
+  uint16_t end;                             // 質問セクションの直後のオフセット
+  uint16_t ednsUdpSize;                     // クライアントが広告した UDP ペイロードサイズ（0: EDNS なし）
+  uint16_t optOffset;                       // クエリの OPT レコードの位置（0: なし）
+  uint8_t dnssecFlags;                      // CD / DO（DNS_QUESTION_CD / DNS_QUESTION_DO、キャッシュのキーに含める）
+};
+
+#define DNS_QUESTION_CD 0x01                // dnssecFlags: ヘッダーの CD
+#define DNS_QUESTION_DO 0x02                // dnssecFlags: OPT の DO
+
+// ===== 応答の返送先 =====
+// UDP はアドレスとポート、TCP は接続の番号と世代（閉じた後に別の接続が使う番号には送らない）
+struct DNSClientEndpoint {
+  IPAddress ip;
+  uint16_t port;
+  uint16_t udpSize;                         // クライアントの EDNS UDP サイズ（0: EDNS なし）
+  uint8_t tcpSlot;                          // TCP 接続の番号（DNS_TCP_NONE: UDP）
+  uint8_t tcpSerial;                        // TCP 接続の世代
+};
+
+// ===== TCP 接続 =====
+// 長さ付きのクエリを順に読み、応答は処理が終わった順に返す（パイプライン、RFC 7766 6.2.1.1）
+struct DNSTcpConnection {
+  WiFiClient client;
+  bool active;
+  uint8_t serial;                           // 受け付けるたびに増やす世代
+  uint8_t outstanding;                      // 応答待ちのクエリ数（0 の間だけアイドルタイムアウトを数える）
+  uint16_t received;                        // buffer に読み込んだバイト数（長さフィールドを含む）
+  unsigned long lastActivityMs;             // 最後に読み書きした時刻
+  uint8_t* unsent;                          // 送信バッファに入りきらなかった応答の残り（nullptr: なし）
+  uint16_t unsentLength;
+  uint16_t unsentOffset;                    // unsent のうち送信済みのバイト数
+  uint8_t buffer[DNS_TCP_LENGTH_SIZE + DNS_TCP_QUERY_SIZE];
+};
+
+// ===== 上流に問い合わせ中のクエリ =====
+// 上流へは書き換えたトランザクション ID で送信し、応答の ID でこの表を引く
+struct DNSPendingQuery {
+  bool active;                              // 使用中
+  bool prefetch;                            // refresh-ahead（応答はキャッシュのみに保存）
+  bool viaTcp;                              // 直近の送信は上流への TCP 接続
+  uint16_t upstreamId;                      // 上流に送った（書き換え後の）ID
+  uint16_t clientId;                        // クライアントの元の ID
+  DNSClientEndpoint client;                 // 応答の送り先
+  uint32_t questionHash;                    // 質問（名前・タイプ・クラス・CD / DO）のハッシュ
+  uint8_t dnssecFlags;                      // 上流に送ったクエリの CD / DO（応答の照合に使う）
+  uint8_t upstreamMask;                     // 送信済みのリゾルバ（DNSUpstreamSet のインデックスのビット）
+  uint8_t attemptMask;                      // 直近の送信先
+  uint16_t timeoutMs;                       // 直近の送信のタイムアウト
+  uint32_t sentAtUs;                        // 直近の送信時刻（micros）
+  uint32_t receivedAtUs;                    // クライアントのクエリを受信した時刻（micros）
+  uint16_t queryLength;                     // 保持したクエリ長（0 は再送不可）
+  uint8_t query[DNS_PENDING_QUERY_SIZE];    // 上流 ID に書き換え済みのクエリ
+  uint8_t waiterCount;                      // 相乗りしているクライアント数
+};
+
+// ===== 問い合わせ中の質問に相乗りしたクライアント =====
+struct DNSQueryWaiter {
+  bool active;
+  uint8_t pendingIndex;                     // 相乗り先の DNSPendingQuery
+  uint16_t clientId;                        // クライアントの元の ID
+  DNSClientEndpoint client;
+  uint32_t attachedAtUs;                    // クエリを受信して相乗りした時刻（micros）
+};
+
+// ===== ブロック時の応答ポリシー =====
+enum DNSBlockPolicy : uint8_t {
+  DNS_BLOCK_POLICY_NULL_IP = 0,   // A/AAAA に 0.0.0.0 / :: を返す（その他のタイプは NODATA）
+  DNS_BLOCK_POLICY_NODATA,        // NOERROR・回答なし + SOA
+  DNS_BLOCK_POLICY_NXDOMAIN,      // NXDOMAIN + SOA
+  DNS_BLOCK_POLICY_COUNT
+};
+
+// ===== 応答時間を分類する処理経路 =====
+enum DNSLatencyOutcome : uint8_t {
+  DNS_LATENCY_BLOCKED = 0,        // ブロック応答
+  DNS_LATENCY_CAPTIVE,            // キャプティブポータル応答
+  DNS_LATENCY_CACHED,             // キャッシュから応答
+  DNS_LATENCY_FORWARDED,          // 上流の応答を返送（相乗りを含む）
+  DNS_LATENCY_TIMEOUT,            // 上流がすべてタイムアウト（期限切れ応答の返送・応答なし）
+  DNS_LATENCY_OUTCOME_COUNT
+};
+
+// ===== 応答時間のヒストグラム =====
+// クエリの受信から応答の送信（タイムアウトは諦めた時点）までの時間
+struct DNSLatencyHistogram {
+  uint32_t buckets[DNS_LATENCY_BUCKETS + 1];  // 累積ではない件数、最後は上限超過
+  uint32_t count;
+  uint64_t sumUs;
+};
 
 // ===== 統計情報構造体 =====
 struct DNSStats {
@@ -31,6 +189,155 @@ struct DNSStats {
   uint32_t blockedQueries;   // ブロック数
   uint32_t allowedQueries;   // 許可数
   uint32_t errorQueries;     // エラー数
+  uint32_t prefilterRejects;          // プレフィルタだけで許可と判定した数
+  uint32_t prefilterFalsePositives;   // プレフィルタ通過後にトライで不一致だった数
+  uint32_t upstreamTimeouts;          // 上流の応答待ちがタイムアウトした数
+  uint32_t upstreamOverflows;         // 問い合わせ中の表が満杯で SERVFAIL を返した数
+  uint32_t upstreamUnmatched;         // 表に該当しない（期限切れ・不正な）上流応答の数
+  uint8_t upstreamPending;            // 現在問い合わせ中のクエリ数
+  uint32_t upstreamFailovers;         // タイムアウト・SERVFAIL で別のリゾルバに再送した数
+  uint32_t coalescedQueries;          // 問い合わせ中の同じ質問に相乗りした数（節約した上流送信数）
+  uint32_t coalescedAnswered;         // 相乗りして応答を受け取った数
+  uint64_t coalescedWaitTotalUs;      // 相乗りしたクライアントの待ち時間の合計
+  uint32_t coalescedWaitMaxUs;        // 相乗りしたクライアントの待ち時間の最大
+  uint32_t cacheHits;                 // キャッシュから応答した数
+  uint32_t cacheMisses;               // キャッシュに無く上流へ転送した数
+  uint32_t cacheEvictions;            // 空き確保のために追い出した数
+  uint32_t cacheBytesUsed;            // 使用中のアリーナ（バイト）
+  uint32_t cacheBytesTotal;           // アリーナ全体（バイト、0 は無効）
+  uint16_t cacheEntries;              // 保存中の応答数
+  uint32_t cacheStaleServed;          // 上流失敗時に期限切れ応答で答えた数（serve-stale）
+  uint32_t loopBatches;               // 1 件以上のクエリを処理した handleClient() の回数
+  uint32_t loopBatchPackets;          // その合計パケット数（平均バッチサイズ = これ / loopBatches）
+  uint16_t loopBatchMax;              // 1 回で処理した最大パケット数
+  uint32_t loopBatchMaxUs;            // 1 回の処理に掛かった最大時間（マイクロ秒）
+  uint32_t loopBudgetExhausted;       // 件数・時間の上限で打ち切った回数（ソケットに残りがある可能性）
+  uint16_t queueDepthMax;             // 打ち切りが続いた間に処理した件数の最大（待ち行列の深さの推定）
+  uint32_t droppedPackets;            // 読み込んだが処理せず破棄したパケット数
+  uint32_t cachePrefetches;           // 期限前にバックグラウンドで再取得した数（refresh-ahead）
+  uint32_t cachePrefetchHits;         // 再取得した応答がクライアントに使われた数
+  uint32_t ednsQueries;               // EDNS（OPT 付き）のクエリ数
+  uint32_t largeResponses;            // 512 バイトを超えて UDP で返した応答数
+  uint32_t truncatedResponses;        // クライアントの上限を超えたため TC を立てて返した応答数
+  uint32_t tcpConnections;            // 受け付けた TCP 接続数
+  uint32_t tcpRefused;                // 上限に達していたため閉じた TCP 接続数
+  uint32_t tcpIdleClosed;             // アイドルタイムアウトで閉じた TCP 接続数
+  uint32_t tcpQueries;                // TCP で受け付けたクエリ数
+  uint8_t tcpActive;                  // 現在の TCP 接続数
+  uint32_t upstreamTcpRetries;        // 切り詰められた UDP 応答を TCP で問い合わせ直した数
+  uint32_t upstreamTcpFallbacks;      // 上流 TCP が使えず UDP で送った数
+  uint32_t blocklistHits[DNS_BLOCKLIST_COUNT];  // リストごとのブロック数（複数の有効なリストに属する場合はそれぞれ数える）
+  DNSLatencyHistogram latency[DNS_LATENCY_OUTCOME_COUNT];  // 処理経路ごとの応答時間
+};
+
+// ===== プレフィルタ情報 =====
+struct PrefilterInfo {
+  bool active;                  // プレフィルタ有効
+  uint8_t bitsPerEntry;         // 1 ドメインあたりのビット数
+  uint8_t hashCount;            // ハッシュ関数の数
+  size_t sizeBytes;             // メモリ使用量（バイト）
+  float estimatedFpr;           // 1 サフィックスあたりの理論偽陽性率
+};
+
+// ===== ブロックリスト読み込み情報 =====
+struct BlocklistLoadInfo {
+  bool binary;               // コンパイル済み形式（.bin）から読み込んだか
+  BlocklistTextFormat textFormat;  // テキストの場合の形式
+  bool compressed;           // gzip 圧縮したまま保存されているか
+  uint32_t fileBytes;        // フラッシュ上のファイルサイズ（バイト）
+  uint32_t durationMs;       // 読み込み所要時間（ミリ秒）
+  uint32_t peakBytes;        // 読み込み中の最大作業メモリ（バイト）
+  uint32_t readyAtMs;        // 起動からフィルタが利用可能になった時刻（ミリ秒）
+};
+
+// ===== 名前付きブロックリストごとの状態 =====
+struct DNSBlocklistInfo {
+  BlocklistLoadInfo file;    // 読み込んだファイル（fileBytes が 0 ならファイルなし）
+  uint32_t domains;          // 統合したトライでこのリストに属するドメイン数
+};
+
+// ===== ブロックリストの差分編集 =====
+// loop() が 1 件ずつ要求を書き、DNS タスクが処理して結果を書き戻す（loop() は完了まで待つ）
+enum DNSBlocklistEditOp : uint8_t {
+  DNS_BLOCKLIST_EDIT_ADD = 0,
+  DNS_BLOCKLIST_EDIT_REMOVE,
+  DNS_BLOCKLIST_EDIT_LOOKUP
+};
+
+enum DNSBlocklistEditStatus : uint8_t {
+  DNS_BLOCKLIST_EDIT_CHANGED = 0,   // 反映した（ジャーナルに記録する）
+  DNS_BLOCKLIST_EDIT_UNCHANGED,     // 既に登録済み・登録されていない（LOOKUP は常にこれ）
+  DNS_BLOCKLIST_EDIT_FULL,          // 差分の表が満杯（圧縮後に再試行）
+  DNS_BLOCKLIST_EDIT_INVALID,       // ドメイン名が不正
+  DNS_BLOCKLIST_EDIT_TIMEOUT        // DNS タスクが応答しない
+};
+
+struct DNSBlocklistEdit {
+  DNSBlocklistEditOp op;
+  char name[DOMAIN_TRIE_MAX_NAME_SIZE];   // 小文字化・検証済み
+  size_t length;
+  DNSBlocklistEditStatus status;
+  bool blocked;                           // LOOKUP: ブロック対象か
+  char match[DOMAIN_TRIE_MAX_NAME_SIZE];  // LOOKUP: 一致したドメイン（name 自身か親ドメイン）
+  bool matchAdded;                        // LOOKUP: 一致が差分で追加したドメインか
+  uint8_t matchLists;                     // LOOKUP: 一致したドメインが属する有効なリストのビット
+  bool tombstone;                         // LOOKUP: name がトライにあり、差分で削除済みか
+  uint32_t applyUs;                       // DNS タスクでの処理時間（マイクロ秒）
+};
+
+// ===== 差分の状態（Web UI 表示用） =====
+struct DNSBlocklistDeltaInfo {
+  uint16_t added;              // 差分で追加したドメイン数
+  uint16_t removed;            // 差分で削除した（墓標）ドメイン数
+  bool full;                   // 差分の表が満杯
+  size_t overlayBytes;         // 差分の表のメモリ使用量
+  uint16_t journalEntries;     // ジャーナルの記録数（圧縮で 0 に戻る）
+  uint32_t lastApplyUs;        // 直近の追加・削除の処理時間
+  uint32_t compactions;        // 圧縮した回数
+  uint32_t lastCompactionMs;   // 直近の圧縮の所要時間
+};
+
+// ===== DNS タスクへのコマンド =====
+// 複数の値をまとめて変更する設定や重い処理は、DNS タスクが次の処理の合間に適用する
+enum DNSCommandType : uint8_t {
+  DNS_COMMAND_SET_UPSTREAMS = 0,
+  DNS_COMMAND_SET_DHCP_UPSTREAM,
+  DNS_COMMAND_SET_PREFILTER_BITS,
+  DNS_COMMAND_INSTALL_BLOCKLIST,
+  DNS_COMMAND_EDIT_BLOCKLIST,
+  DNS_COMMAND_RESET_STATS
+};
+
+struct DNSCommand {
+  DNSCommandType type;
+  uint8_t count;                                        // servers の有効数
+  uint32_t value;
+  IPAddress servers[DNS_MAX_CONFIGURED_UPSTREAMS];
+  uint8_t* blob;                                        // 構築済みトライ（所有権は DNS タスクに移る）
+  uint8_t defaultLists;                                 // blob のビットの無い登録が属するリスト
+  bool clearOverlay;                                    // 差分は blob に統合済み（差し替えと同時に捨てる）
+  uint32_t sequence;                                    // 差し替えの完了を知らせる番号
+  BlocklistLoadInfo loadInfo;
+  DNSBlocklistInfo blocklists[DNS_BLOCKLIST_COUNT];     // 差し替え後のリストごとの状態
+  const char* path;                                     // blob の保存先と、置き換えたファイル（失敗時に戻す。nullptr: なし）
+  const char* previousPath;
+};
+
+// ===== 他のタスクから読む状態のスナップショット =====
+struct DNSStatusSnapshot {
+  DNSStats stats;
+  BlocklistLoadInfo loadInfo;
+  DNSBlocklistInfo blocklists[DNS_BLOCKLIST_COUNT];
+  PrefilterInfo prefilterInfo;
+  int blocklistCount;
+  size_t blocklistBytes;
+  uint8_t upstreamCount;
+  DNSUpstreamInfo upstreams[DNS_MAX_UPSTREAMS];
+  DNSUpstreamTcpInfo upstreamTcp;
+  uint16_t overlayAdded;
+  uint16_t overlayRemoved;
+  bool overlayFull;
+  size_t overlayBytes;
 };
 
 /**
@@ -49,7 +356,15 @@ public:
   void end();
 
   // ===== メインループ処理 =====
-  void handleClient();
+  void handleClient();          // 1 回分の処理（DNS タスクを使わない場合に loop() から呼ぶ）
+
+  // ===== DNS タスク =====
+  // 起動後は受信・判定・応答を専用タスクで行い、loop() の処理に左右されない。
+  // 起動中の設定変更はアトミック変数かコマンドの待ち行列経由、
+  // 統計等の読み出しはタスクが公開したスナップショットから行う。
+  bool startTask();
+  void stopTask();
+  bool isTaskRunning() const;
 
   // ===== 設定 =====
   void setEnabled(bool enabled);
@@ -59,37 +374,234 @@ public:
   bool isCaptivePortal() const;
 
   // ===== ブロックリスト管理 =====
-  bool loadBlocklistFromFile(const char* filepath = "/blocklist.txt");
-  bool reloadBlocklist();
+  // リストごとのファイルを読み込み、1 つのトライに統合する（読めないファイルは .bak に戻す）
+  bool loadBlocklists();
+  // list の構築済みトライを検証済みのファイルとともに差し替え、他のリストと統合する
+  // （uploadedPath を list の有効なファイルにし、旧ファイルは .bak へ）
+  bool installBlocklist(DNSBlocklistId list, const char* uploadedPath, uint8_t* blob, size_t size,
+                        const BlocklistLoadInfo& info);
   void clearBlocklist();
-  int getBlocklistCount() const;
+  int getBlocklistCount() const;           // 統合したトライのドメイン数（リスト間の重複は 1 件）
+  size_t getBlocklistBytes() const;
+  BlocklistLoadInfo getLoadInfo() const;   // 直近の読み込み・差し替え
+  DNSBlocklistInfo getBlocklistInfo(DNSBlocklistId list) const;
+  static const char* getBlocklistPath(DNSBlocklistId list);  // .bin があれば優先
+  static const char* getBlocklistBackupPath(const char* path);
+  static const char* getBlocklistName(DNSBlocklistId list);
+  static bool parseBlocklistName(const String& name, DNSBlocklistId* list);
+
+  // ===== リストの有効・無効（照合時のマスクだけを切り替え、読み込み直さない） =====
+  void setEnabledBlocklists(uint8_t lists);  // DNSBlocklistId のビット
+  uint8_t getEnabledBlocklists() const;
+
+  // ===== ブロックリストの差分（再構築せずに反映し、ジャーナルに記録） =====
+  DNSBlocklistEditStatus editBlocklist(DNSBlocklistEditOp op, const String& domain, DNSBlocklistEdit* result);
+  bool compactBlocklist();                 // 差分をトライに統合して変更したリストの .bin に保存し、ジャーナルを消す
+  void compactBlocklistIfNeeded();         // ジャーナルが溜まっていれば圧縮する（loop() から呼ぶ）
+  DNSBlocklistDeltaInfo getBlocklistDeltaInfo() const;
+
+  // ===== 上流 DNS =====
+  bool setUpstreams(const String& list);      // "8.8.8.8, 1.1.1.1" 形式（最大 DNS_MAX_CONFIGURED_UPSTREAMS 個）
+  String getUpstreams() const;
+  void setDhcpUpstream(IPAddress server);     // STA の DHCP で配布された DNS（0.0.0.0 で削除）
+  void setUpstreamRacing(bool enable);        // 上位 2 つのリゾルバに同時に問い合わせる
+  bool isUpstreamRacing() const;
+  void setUpstreamTcp(bool enable);           // 持続 TCP 接続で問い合わせる（使えない間は UDP）
+  bool isUpstreamTcp() const;
+  DNSUpstreamTcpInfo getUpstreamTcpInfo() const;
+  uint8_t getUpstreamCount() const;
+  DNSUpstreamInfo getUpstreamInfo(uint8_t index) const;
+
+  // ===== ブロック応答ポリシー =====
+  void setBlockPolicy(DNSBlockPolicy policy);
+  DNSBlockPolicy getBlockPolicy() const;
+  void setBlockTTL(DNSBlockPolicy policy, uint32_t ttl);  // 応答レコード（SOA 含む）の TTL（秒）
+  uint32_t getBlockTTL(DNSBlockPolicy policy) const;
+  static const char* getBlockPolicyName(DNSBlockPolicy policy);
+
+  // ===== 応答時間 =====
+  static const char* getLatencyOutcomeName(DNSLatencyOutcome outcome);  // メトリクスのラベル値
+  static uint32_t getLatencyBucketUpperUs(uint8_t bucket);               // バケットの上限（マイクロ秒）
+
+  // ===== プレフィルタ（Bloom フィルタ） =====
+  void setPrefilterBitsPerEntry(uint8_t bitsPerEntry);  // 0 で無効
+  PrefilterInfo getPrefilterInfo() const;
 
   // ===== 統計情報 =====
   DNSStats getStats() const;
   void resetStats();
 
+  // ===== クエリの多いドメイン・クライアント =====
+  // DNS_TRAFFIC_PUBLISH_INTERVAL ごとに公開した集計から、回数の多い順にコピーする
+  uint8_t getTopDomains(DNSTopList list, DNSTopDomain* out, uint8_t maxCount) const;  // 最大 DNS_TOP_DOMAINS_SHOWN 件
+  uint8_t getClientStats(DNSClientStats* out, uint8_t maxCount) const;
+  uint8_t getClientCapacity() const;                                                 // AP_MAX_CONNECTIONS
+
 private:
   WiFiUDP udp;                      // DNS サーバー用 UDP
-  bool enabled;                     // フィルタ有効フラグ
-  bool captivePortalEnabled;        // キャプティブポータルモード（全クエリに自分のIPを返す）
+  WiFiServer tcpServer;             // DNS サーバー用 TCP（TC の応答を受けたクライアントの再問い合わせ等）
+  DNSTcpConnection tcpConnections[DNS_TCP_MAX_CONNECTIONS];
+  uint8_t tcpConnectionLimit;       // DNS_TCP_MAX_CONNECTIONS と AP_MAX_CONNECTIONS の小さい方
+  std::atomic<bool> enabled;                // フィルタ有効フラグ
+  std::atomic<bool> captivePortalEnabled;   // キャプティブポータルモード（全クエリに自分のIPを返す）
+
+  // DNS タスク
+  std::atomic<bool> taskRunning;    // タスク動作中（false でタスクが終了する）
+  std::atomic<bool> taskStopped;    // タスクがループを抜けた
+  SPSCRing<DNSCommand, DNS_COMMAND_QUEUE_SIZE> commands;  // loop() → DNS タスク
+  DNSStatusSnapshot snapshot;       // DNS タスク → loop()（seqlock で保護）
+  std::atomic<uint32_t> snapshotSeq;  // 奇数: 書き込み中
+  unsigned long snapshotPublishedAt;
+
+  // ブロックリスト（全リストを統合した逆順ラベル DAFSA、単一のバイト配列）
+  DomainTrie blocklist;
+  BlocklistLoadInfo loadInfo;       // 最後の読み込み結果
+  DNSBlocklistInfo blocklistInfo[DNS_BLOCKLIST_COUNT];
+  std::atomic<uint8_t> enabledBlocklists;   // 照合に使うリストのビット
+  uint32_t blocklistSwapSeq;        // loop() が最後に送った差し替えの番号
+  std::atomic<uint32_t> blocklistSwapDone;  // DNS タスクが最後に処理した差し替えの番号
+  BloomFilter prefilter;            // ブロックリストのサフィックスに対するプレフィルタ
+  uint8_t prefilterBitsPerEntry;    // プレフィルタの 1 ドメインあたりビット数
+
+  // ブロックリストへの差分（DNS タスクが更新）と、その要求・ジャーナル（loop() 側）
+  BlocklistOverlay overlay;
+  DNSBlocklistEdit blocklistEdit;   // 処理中の要求と結果
+  uint32_t blocklistEditSeq;        // loop() が最後に送った要求の番号
+  std::atomic<uint32_t> blocklistEditDone;  // DNS タスクが最後に処理した要求の番号
+  uint32_t blocklistEditJournaled;  // ジャーナルに記録した要求の番号（待ちきれなかった要求も後で記録する）
+  uint16_t journalEntries;
+  bool compactionRequested;         // 圧縮が成功するまで立てたまま
+  unsigned long compactionFailedAt;
+  uint32_t compactionBackoffMs;     // 失敗後に圧縮を控える時間（0: なし）
+  uint32_t lastEditApplyUs;
+  uint32_t compactions;
+  uint32_t lastCompactionMs;
 
-  // メモリ効率の良いブロックリスト実装
-  char* blocklistBuffer;            // 文字列プール（単一バッファ）
-  size_t blocklistBufferSize;       // バッファの総サイズ
-  size_t blocklistBufferUsed;       // 使用済みサイズ
-  std::vector<const char*> blocklist;  // ドメイン文字列へのポインタリスト
+  std::atomic<DNSBlockPolicy> blockPolicy;                // ブロック時の応答ポリシー
+  std::atomic<uint32_t> blockTTL[DNS_BLOCK_POLICY_COUNT];  // ポリシーごとの TTL（秒）
 
   DNSStats stats;                   // 統計情報
-  IPAddress upstreamDNS;            // 上流 DNS サーバー
+
+  // 上流転送（単一ソケットで複数クエリ・複数リゾルバを並行して待つ）
+  DNSUpstreamSet upstreams;         // 上流リゾルバと RTT・損失率の推定
+  std::atomic<bool> upstreamRacing; // 2 つのリゾルバに同時に問い合わせる
+  WiFiUDP upstreamUdp;              // 上流 DNS 用 UDP（起動中は常にオープン）
+  DNSUpstreamConnection upstreamTcp;  // 上流 DNS への持続 TCP 接続（切り詰められた応答の再問い合わせ等）
+  std::atomic<bool> upstreamTcpPreferred;  // すべてのクエリを TCP 接続で送る
+  DNSPendingQuery pending[DNS_MAX_PENDING_QUERIES];
+  uint8_t pendingCount;
+  DNSQueryWaiter waiters[DNS_MAX_QUERY_WAITERS];
+  uint16_t queueBacklog;            // 打ち切りが続いている間に処理した件数
+
+  DNSCache cache;                   // 上流応答のキャッシュ
+
+  // パケットバッファ（DNS タスク内でのみ使用。関数ごとのスタック配列の代わりに役割ごとに 1 つずつ使い回す）
+  uint8_t queryBuffer[DNS_EDNS_UDP_SIZE];     // クライアントからのクエリ
+  uint8_t upstreamBuffer[DNS_EDNS_UDP_SIZE];  // 上流からの応答
+  uint8_t responseBuffer[DNS_UPSTREAM_TCP_MESSAGE_SIZE];  // キャッシュ・合成応答の組み立て（TCP の応答も入る大きさ）
+  uint8_t tcpFrame[DNS_TCP_LENGTH_SIZE + DNS_UPSTREAM_TCP_MESSAGE_SIZE];  // 長さフィールド付きの TCP 応答
+
+  // 上位ドメイン・クライアント別の集計（DNS タスクが更新し、一定間隔で公開）
+  DNSTrafficStats traffic;
+  DNSTopDomain publishedTop[DNS_TOP_LIST_COUNT][DNS_TOP_DOMAINS_SHOWN];
+  uint8_t publishedTopCount[DNS_TOP_LIST_COUNT];
+  DNSClientStats* publishedClients;   // traffic のクライアント表と同じ件数
+  uint8_t publishedClientCount;
+  std::atomic<uint32_t> trafficSeq;   // 奇数: 書き込み中
+  bool trafficDirty;                  // 前回の公開後に集計が変わった
+  unsigned long trafficPublishedAt;
+
+  // ===== DNS タスク =====
+  uint16_t processPass();
+  static void taskEntry(void* arg);
+  bool submitCommand(const DNSCommand& command);
+  void applyCommand(const DNSCommand& command);
+  void applyCommands();
+  void publishSnapshot();
+  DNSStatusSnapshot readSnapshot() const;
+  void publishTraffic();
+  void recordTraffic(DNSTopList list, const uint8_t* packet, const DNSName& name, uint32_t nameHash);
 
   // ===== DNS パケット処理 =====
-  String extractDomainFromDNSQuery(uint8_t* packet, size_t len);
-  bool isBlocked(const String& domain);
-  void sendCustomIPResponse(uint8_t* query, size_t len, IPAddress clientIP, uint16_t clientPort, IPAddress responseIP);
-  void forwardToUpstream(uint8_t* query, size_t len, IPAddress clientIP, uint16_t clientPort);
+  void handleQueryPacket();
+  void processQuery(uint8_t* packet, size_t len, DNSClientEndpoint client, uint32_t receivedUs);
+  void recordBatch(uint16_t packets, bool exhausted, uint32_t elapsedUs);
+  void recordLatency(DNSLatencyOutcome outcome, uint32_t startUs);
+  static bool parseDNSQuestion(const uint8_t* packet, size_t len, DNSQuestion* question);
+  static void parseEdns(const uint8_t* packet, size_t len, DNSQuestion* question);
+  void sendToClient(uint8_t* response, size_t len, const DNSClientEndpoint& client);
+  void abandonClient(const DNSClientEndpoint& client);
+  static size_t truncateResponse(uint8_t* response, size_t len, bool edns);
+  static size_t appendOpt(uint8_t* response, size_t offset);
+  static bool parseDNSName(const uint8_t* packet, size_t len, size_t offset, DNSName* name);
+  static size_t foldLabel(const uint8_t* packet, const DNSName& name, int index, char* out);
+  static void formatDNSName(const uint8_t* packet, const DNSName& name, char* out, size_t size, int firstLabel = 0);
+  bool isBlocked(const uint8_t* packet, const DNSName& name);
+  uint8_t matchBlocklist(const uint8_t* packet, const DNSName& name, bool* registered = nullptr);
+  void sendBlockedResponse(const uint8_t* query, const DNSQuestion& question, const DNSClientEndpoint& client);
+  void sendCaptivePortalResponse(const uint8_t* query, const DNSQuestion& question, const DNSClientEndpoint& client);
+  void sendSyntheticResponse(const uint8_t* query, const DNSQuestion& question, const DNSClientEndpoint& client,
+                             uint8_t rcode, const uint8_t* rdata, uint8_t rdataLength, uint32_t ttl);
+  static uint32_t hashName(const uint8_t* packet, const DNSName& name);
+  static uint32_t hashQuestion(const uint8_t* packet, const DNSQuestion& question);
+  static uint32_t hashQuestion(uint32_t nameHash, const DNSQuestion& question);
+
+  // ===== TCP =====
+  uint16_t handleTcpConnections();
+  void acceptTcpConnections();
+  uint16_t readTcpQueries(uint8_t slot);
+  void sendTcpResponse(const uint8_t* response, size_t len, const DNSClientEndpoint& client);
+  bool flushTcpResponse(uint8_t slot);
+  void closeTcpConnection(uint8_t slot);
+
+  // ===== 上流転送 =====
+  void forwardToUpstream(uint8_t* query, size_t len, const DNSQuestion& question, uint32_t questionHash,
+                         const DNSClientEndpoint& client, uint32_t receivedUs, bool prefetch = false);
+  void handleUpstreamResponses();
+  void handleUpstreamTcp();
+  void handleUpstreamAnswer(uint8_t* response, size_t len, int upstreamIndex, bool viaTcp);
+  void expirePendingQueries();
+  DNSPendingQuery* findPending(uint16_t upstreamId);
+  DNSPendingQuery* allocatePending();
+  bool sendToUpstreams(DNSPendingQuery* entry, const uint8_t* query, size_t len, bool allowTcp = true);
+  bool sendViaTcp(DNSPendingQuery* entry, const uint8_t* query, size_t len, int upstreamIndex);
+  void fallbackTcpPending();
+  bool retryPending(DNSPendingQuery* entry);
+  void clearPending();
+  DNSPendingQuery* findPendingQuestion(const uint8_t* query, const DNSQuestion& question, uint32_t questionHash);
+  bool attachWaiter(DNSPendingQuery* entry, uint16_t clientId, const DNSClientEndpoint& client, uint32_t receivedUs);
+  void sendUpstreamAnswer(uint8_t* response, size_t len, const DNSQuestion& question, uint8_t rcode,
+                          uint32_t questionHash, uint16_t clientId, const DNSClientEndpoint& client);
+  void releaseWaiters(DNSPendingQuery* entry, uint8_t* response, size_t len);
+
+  // ===== 応答キャッシュ =====
+  void initCache();
+  bool answerFromCache(uint8_t* query, size_t len, const DNSQuestion& question, uint32_t questionHash,
+                       const DNSClientEndpoint& client);
+  bool answerStale(const uint8_t* query, const DNSQuestion& question, uint32_t questionHash,
+                   uint16_t clientId, const DNSClientEndpoint& client);
+  bool answerStalePending(const DNSPendingQuery& entry, uint16_t clientId, const DNSClientEndpoint& client);
+  bool restoreCachedQuestion(uint8_t* response, size_t responseLen, const uint8_t* query,
+                             const DNSQuestion& question);
+  void updateCacheStats();
 
-  // ===== ユーティリティ =====
-  bool isValidDomain(const String& domain);
+  // ===== ブロックリスト読み込み =====
+  bool parseBlocklistFile(const char* filepath, BlocklistParser& parser, uint8_t** blob, size_t* size,
+                          BlocklistLoadInfo* info);
+  bool parseBlocklist(DNSBlocklistId list, BlocklistParser& parser, uint8_t** blob, size_t* size,
+                      BlocklistLoadInfo* info);
+  bool swapBlocklist(uint8_t* blob, size_t size, uint8_t defaultLists, const BlocklistLoadInfo& info,
+                     const char* source);
+  bool restoreBlocklistBackup(const char* failedPath, const char* previousPath);
+  bool compactBlocklistFile(DNSBlocklistId list, DNSBlocklistInfo* info);
+  bool replaceBlocklistFile(DNSBlocklistId list, const char* newPath, const char* target, const char** previousPath);
+  bool submitBlocklistSwap(DNSCommand& command);
+  bool waitForBlocklistSwap();
+  void applyBlocklistEdit(DNSBlocklistEdit& edit);
+  void lookupBlocklist(DNSBlocklistEdit& edit);
+  void replayBlocklistJournal();
+  void recordBlocklistEdit(const DNSBlocklistEdit& edit);
+  void rebuildPrefilter();
 };
 
 #endif // DNS_FILTER_MANAGER_H
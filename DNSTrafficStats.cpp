@@ -0,0 +1,154 @@
+/*
+ * DNSTrafficStats.cpp - 上位ドメインとクライアント別のクエリ集計の実装
+ */
+
+#include "DNSTrafficStats.h"
+#include <new>
+
+/**
+ * items から key の大きい順に最大 maxCount 件を out にコピーする（挿入ソート、同数は先勝ち）
+ */
+template <typename T, typename Key>
+static uint8_t copyTop(const T* items, uint8_t count, T* out, uint8_t maxCount, Key key) {
+  uint8_t filled = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (filled == maxCount && (maxCount == 0 || key(items[i]) <= key(out[filled - 1]))) {
+      continue;
+    }
+    if (filled < maxCount) {
+      filled++;
+    }
+    uint8_t pos = filled - 1;
+    while (pos > 0 && key(out[pos - 1]) < key(items[i])) {
+      out[pos] = out[pos - 1];
+      pos--;
+    }
+    out[pos] = items[i];
+  }
+  return filled;
+}
+
+DNSTrafficStats::DNSTrafficStats()
+  : clients(nullptr),
+    clientCapacity(0),
+    clientCount(0) {
+  for (uint8_t list = 0; list < DNS_TOP_LIST_COUNT; list++) {
+    domainCount[list] = 0;
+  }
+}
+
+DNSTrafficStats::~DNSTrafficStats() {
+  delete[] clients;
+}
+
+bool DNSTrafficStats::init(uint8_t capacity) {
+  // IPAddress を含むため malloc ではなく new で構築する
+  delete[] clients;
+  clients = new (std::nothrow) DNSClientStats[capacity];
+  clientCapacity = clients ? capacity : 0;
+  clear();
+  return clients != nullptr;
+}
+
+void DNSTrafficStats::clear() {
+  for (uint8_t list = 0; list < DNS_TOP_LIST_COUNT; list++) {
+    domainCount[list] = 0;
+  }
+  clientCount = 0;
+}
+
+/**
+ * Space-Saving の更新
+ *
+ * 表が埋まるまでは新しいエントリを追加し、埋まった後は最小カウントのエントリを置き換える。
+ */
+DNSTopDomain* DNSTrafficStats::recordDomain(DNSTopList list, uint32_t hash, bool* inserted) {
+  DNSTopDomain* table = domains[list];
+  uint8_t count = domainCount[list];
+  uint8_t minIndex = 0;
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (table[i].hash == hash) {
+      table[i].count++;
+      *inserted = false;
+      return &table[i];
+    }
+    if (table[i].count < table[minIndex].count) {
+      minIndex = i;
+    }
+  }
+
+  DNSTopDomain* entry;
+  if (count < DNS_TOP_DOMAINS_TRACKED) {
+    entry = &table[count];
+    domainCount[list] = count + 1;
+    entry->error = 0;
+    entry->count = 1;
+  } else {
+    entry = &table[minIndex];
+    entry->error = entry->count;
+    entry->count++;
+  }
+  entry->hash = hash;
+  entry->name[0] = '\0';
+  *inserted = true;
+  return entry;
+}
+
+/**
+ * 表示用の名前を設定する
+ *
+ * HTML・JSON にそのまま埋め込めるよう、英数字と '.', '-', '_' 以外は '?' に置き換える。
+ */
+void DNSTrafficStats::setName(DNSTopDomain* entry, const char* name) {
+  size_t i = 0;
+  for (; name[i] != '\0' && i < DNS_TOP_DOMAIN_NAME_SIZE - 1; i++) {
+    char c = name[i];
+    bool safe = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_';
+    entry->name[i] = safe ? c : '?';
+  }
+  entry->name[i] = '\0';
+}
+
+DNSClientStats* DNSTrafficStats::recordClient(IPAddress address, unsigned long now) {
+  if (clientCapacity == 0) {
+    return nullptr;
+  }
+
+  uint8_t oldest = 0;
+  for (uint8_t i = 0; i < clientCount; i++) {
+    if (clients[i].address == address) {
+      clients[i].lastSeenMs = now;
+      return &clients[i];
+    }
+    if (now - clients[i].lastSeenMs > now - clients[oldest].lastSeenMs) {
+      oldest = i;
+    }
+  }
+
+  // 表が満杯なら最も長くクエリの無いクライアント（切断済みの可能性が高い）を置き換える
+  DNSClientStats* client = clientCount < clientCapacity ? &clients[clientCount++] : &clients[oldest];
+  client->address = address;
+  client->queries = 0;
+  client->blocked = 0;
+  client->lastSeenMs = now;
+  return client;
+}
+
+uint8_t DNSTrafficStats::getTopDomains(DNSTopList list, DNSTopDomain* out, uint8_t maxCount) const {
+  return copyTop(domains[list], domainCount[list], out, maxCount,
+                 [](const DNSTopDomain& entry) { return entry.count; });
+}
+
+uint8_t DNSTrafficStats::getClients(DNSClientStats* out, uint8_t maxCount) const {
+  return copyTop(clients, clientCount, out, maxCount,
+                 [](const DNSClientStats& client) { return client.queries; });
+}
+
+uint8_t DNSTrafficStats::getClientCapacity() const {
+  return clientCapacity;
+}
+
+size_t DNSTrafficStats::getSizeBytes() const {
+  return sizeof(domains) + clientCapacity * sizeof(DNSClientStats);
+}
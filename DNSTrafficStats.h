@@ -0,0 +1,85 @@
+/*
+ * DNSTrafficStats.h - 上位ドメインとクライアント別のクエリ集計
+ *
+ * クエリ数・ブロック数の多いドメインを Space-Saving アルゴリズムで追跡し、
+ * AP クライアントごとのクエリ数を IP アドレスで集計します。
+ * どちらも固定サイズの表で、クエリ数やドメインの種類が増えてもメモリは増えません。
+ *
+ * Space-Saving（Metwally ら）:
+ * - 監視中のドメインならカウントを 1 増やす
+ * - そうでなければ最小カウントのエントリを置き換え、そのカウント + 1 から始める
+ *   （引き継いだカウントを error として記録）
+ * - 出現頻度が 全体 / DNS_TOP_DOMAINS_TRACKED を超えるドメインは必ず表に残り、
+ *   count - error 以上、count 以下の回数クエリされている
+ */
+
+#ifndef DNS_TRAFFIC_STATS_H
+#define DNS_TRAFFIC_STATS_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+#define DNS_TOP_DOMAINS_TRACKED 32       // 1 リストあたりの監視エントリ数
+#define DNS_TOP_DOMAINS_SHOWN 10         // Web UI・JSON に出す上位件数
+#define DNS_TOP_DOMAIN_NAME_SIZE 64      // 表示用に保持する名前（超える分は切り詰め）
+
+// ===== 集計するリスト =====
+enum DNSTopList : uint8_t {
+  DNS_TOP_QUERIED = 0,    // クエリされたドメイン
+  DNS_TOP_BLOCKED,        // ブロックしたドメイン
+  DNS_TOP_LIST_COUNT
+};
+
+// ===== 上位ドメインのエントリ =====
+struct DNSTopDomain {
+  uint32_t hash;                          // 名前（小文字化）のハッシュ
+  uint32_t count;                         // 推定回数（真の回数以上）
+  uint32_t error;                         // 過大評価の上限
+  char name[DNS_TOP_DOMAIN_NAME_SIZE];    // 表示用の名前
+};
+
+// ===== クライアント別の集計 =====
+struct DNSClientStats {
+  IPAddress address;
+  uint32_t queries;                       // クエリ数
+  uint32_t blocked;                       // ブロックしたクエリ数
+  unsigned long lastSeenMs;               // 最後のクエリの時刻（millis）
+};
+
+/**
+ * DNSTrafficStats クラス
+ *
+ * DNS タスクからのみ更新します。クライアント表は init() で
+ * 指定した件数（AP の最大接続数）だけ確保し、満杯の場合は最も長く
+ * クエリの無いクライアントを置き換えます。
+ */
+class DNSTrafficStats {
+public:
+  DNSTrafficStats();
+  ~DNSTrafficStats();
+
+  bool init(uint8_t clientCapacity);
+  void clear();
+
+  // ドメインを 1 回数える。新たに表に入った場合は inserted = true になり、呼び出し側が setName() する
+  DNSTopDomain* recordDomain(DNSTopList list, uint32_t hash, bool* inserted);
+  static void setName(DNSTopDomain* entry, const char* name);
+
+  // クライアントのエントリ（表に無ければ作る）。表が確保されていなければ nullptr
+  DNSClientStats* recordClient(IPAddress address, unsigned long now);
+
+  // 回数の多い順にコピーし、件数を返す
+  uint8_t getTopDomains(DNSTopList list, DNSTopDomain* out, uint8_t maxCount) const;
+  uint8_t getClients(DNSClientStats* out, uint8_t maxCount) const;
+  uint8_t getClientCapacity() const;
+  size_t getSizeBytes() const;
+
+private:
+  DNSTopDomain domains[DNS_TOP_LIST_COUNT][DNS_TOP_DOMAINS_TRACKED];
+  uint8_t domainCount[DNS_TOP_LIST_COUNT];
+  DNSClientStats* clients;
+  uint8_t clientCapacity;
+  uint8_t clientCount;
+};
+
+#endif // DNS_TRAFFIC_STATS_H
@@ -0,0 +1,279 @@
+/*
+ * DNSUpstreamConnection.cpp - 上流 DNS リゾルバへの持続 TCP 接続の実装
+ */
+
+#include "DNSUpstreamConnection.h"
+#include "Config.h"
+#include "Logger.h"
+#include <lwip/sockets.h>
+
+#define SRTT_GAIN_SHIFT 3            // SRTT の平滑化係数 1/8（RFC 6298）
+
+static const char LOG_TAG[] = "DNSUpstreamTcp";
+
+DNSUpstreamConnection::DNSUpstreamConnection()
+  : connected(false),
+    pendingSocket(-1),
+    connectStartedAt(0),
+    received(0),
+    discard(0),
+    failedAt(0),
+    backoffMs(0),
+    handshakes(0),
+    connectFailures(0),
+    queries(0),
+    responses(0),
+    oversized(0),
+    srttUs(0),
+    lastRttUs(0) {
+}
+
+bool DNSUpstreamConnection::inBackoff(unsigned long now) const {
+  return backoffMs > 0 && now - failedAt < backoffMs;
+}
+
+/**
+ * server への接続を用意する
+ *
+ * 接続済みならそのまま使い、バックオフ中は接続を試みない。
+ * 未接続ならハンドシェイクを始めるだけで待たない（完了までは false）。
+ */
+bool DNSUpstreamConnection::connect(IPAddress address, uint16_t port, unsigned long now) {
+  if (isConnected()) {
+    if (server == address) {
+      return true;
+    }
+    close();
+  }
+  if (pendingSocket >= 0 && server != address) {
+    close();
+  }
+  if (pendingSocket < 0 && (inBackoff(now) || !startConnect(address, port, now))) {
+    return false;
+  }
+  return finishConnect(now);
+}
+
+/**
+ * ノンブロッキングのソケットで接続を始める
+ */
+bool DNSUpstreamConnection::startConnect(IPAddress address, uint16_t port, unsigned long now) {
+  server = address;
+  int sock = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    connectFailed(now);
+    return false;
+  }
+  lwip_fcntl(sock, F_SETFL, lwip_fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t)address;
+  if (lwip_connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    lwip_close(sock);
+    connectFailed(now);
+    return false;
+  }
+
+  pendingSocket = sock;
+  connectStartedAt = now;
+  return true;
+}
+
+/**
+ * ハンドシェイクが終わっていれば WiFiClient に引き渡す（待たない）
+ */
+bool DNSUpstreamConnection::finishConnect(unsigned long now) {
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(pendingSocket, &writable);
+  struct timeval noWait = {0, 0};
+  int ready = lwip_select(pendingSocket + 1, nullptr, &writable, nullptr, &noWait);
+  if (ready == 0) {
+    if (now - connectStartedAt < DNS_UPSTREAM_TCP_CONNECT_TIMEOUT) {
+      return false;
+    }
+    connectFailed(now);
+    return false;
+  }
+
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (ready < 0 || lwip_getsockopt(pendingSocket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+    connectFailed(now);
+    return false;
+  }
+
+  // 以降の読み書きは WiFiClient の接続と同じブロッキングのソケットで行う
+  lwip_fcntl(pendingSocket, F_SETFL, lwip_fcntl(pendingSocket, F_GETFL, 0) & ~O_NONBLOCK);
+  client = WiFiClient(pendingSocket);
+  pendingSocket = -1;
+  client.setNoDelay(true);
+  connected = true;
+  received = 0;
+  discard = 0;
+  handshakes++;
+  LOG_INFO(LOG_TAG, "%s に TCP で接続しました（%lu ms）", server, (unsigned long)(now - connectStartedAt));
+  return true;
+}
+
+void DNSUpstreamConnection::connectFailed(unsigned long now) {
+  LOG_WARN(LOG_TAG, "%s に TCP で接続できません", server);
+  connectFailures++;
+  fail(now);
+}
+
+/**
+ * 接続中か（相手が閉じた場合は受信済みのデータを読み終えてから切断扱いにする）
+ *
+ * ハンドシェイク中なら完了したかをここでも確かめる。
+ */
+bool DNSUpstreamConnection::isConnected() {
+  if (pendingSocket >= 0) {
+    finishConnect(millis());
+  }
+  if (connected && !client.connected() && client.available() <= 0) {
+    LOG_DEBUG(LOG_TAG, "%s が TCP 接続を閉じました", server);
+    close();
+  }
+  return connected;
+}
+
+IPAddress DNSUpstreamConnection::getServer() const {
+  return server;
+}
+
+bool DNSUpstreamConnection::send(const uint8_t* query, size_t len, unsigned long now) {
+  if (!connected) {
+    return false;
+  }
+  // 長さフィールドとクエリを 1 回の書き込みで送る（Nagle 無効でも 1 セグメントにする）
+  uint8_t frame[DNS_UPSTREAM_TCP_LENGTH_SIZE + DNS_UPSTREAM_TCP_QUERY_SIZE];
+  if (len > DNS_UPSTREAM_TCP_QUERY_SIZE) {
+    return false;
+  }
+  frame[0] = len >> 8;
+  frame[1] = len & 0xFF;
+  memcpy(frame + DNS_UPSTREAM_TCP_LENGTH_SIZE, query, len);
+  if (client.write(frame, DNS_UPSTREAM_TCP_LENGTH_SIZE + len) != DNS_UPSTREAM_TCP_LENGTH_SIZE + len) {
+    LOG_WARN(LOG_TAG, "%s への TCP 送信に失敗しました", server);
+    fail(now);
+    return false;
+  }
+  queries++;
+  return true;
+}
+
+/**
+ * 受信済みのバイトだけを読み（待たない）、応答が 1 件揃えば返す
+ */
+size_t DNSUpstreamConnection::receive(uint8_t** message) {
+  while (connected) {
+    int available = client.available();
+    if (available <= 0) {
+      return 0;
+    }
+
+    // 大きすぎる応答は長さ分だけ読み捨てる
+    if (discard > 0) {
+      uint8_t scratch[64];
+      size_t chunk = discard < sizeof(scratch) ? discard : sizeof(scratch);
+      int n = client.read(scratch, chunk < (size_t)available ? chunk : available);
+      if (n <= 0) {
+        return 0;
+      }
+      discard -= n;
+      continue;
+    }
+
+    size_t messageLength = 0;
+    size_t needed = DNS_UPSTREAM_TCP_LENGTH_SIZE;
+    if (received >= DNS_UPSTREAM_TCP_LENGTH_SIZE) {
+      messageLength = ((size_t)buffer[0] << 8) | buffer[1];
+      needed += messageLength;
+    }
+    size_t chunk = needed - received;
+    if (chunk > (size_t)available) {
+      chunk = available;
+    }
+    int n = client.read(buffer + received, chunk);
+    if (n <= 0) {
+      return 0;
+    }
+    received += n;
+
+    if (received == DNS_UPSTREAM_TCP_LENGTH_SIZE) {
+      messageLength = ((size_t)buffer[0] << 8) | buffer[1];
+      if (messageLength > DNS_UPSTREAM_TCP_MESSAGE_SIZE) {
+        LOG_WARN(LOG_TAG, "TCP の応答が大きすぎます（%u バイト）", (unsigned)messageLength);
+        oversized++;
+        discard = messageLength;
+        received = 0;
+      }
+      continue;
+    }
+    if (received < DNS_UPSTREAM_TCP_LENGTH_SIZE + messageLength) {
+      continue;
+    }
+
+    received = 0;
+    *message = buffer + DNS_UPSTREAM_TCP_LENGTH_SIZE;
+    return messageLength;
+  }
+  return 0;
+}
+
+void DNSUpstreamConnection::close() {
+  if (pendingSocket >= 0) {
+    lwip_close(pendingSocket);
+    pendingSocket = -1;
+  }
+  if (connected) {
+    client.stop();
+  }
+  connected = false;
+  received = 0;
+  discard = 0;
+}
+
+void DNSUpstreamConnection::fail(unsigned long now) {
+  close();
+  if (backoffMs == 0) {
+    backoffMs = DNS_UPSTREAM_TCP_BACKOFF_MIN;
+  } else if (backoffMs < DNS_UPSTREAM_TCP_BACKOFF_MAX) {
+    backoffMs *= 2;
+    if (backoffMs > DNS_UPSTREAM_TCP_BACKOFF_MAX) {
+      backoffMs = DNS_UPSTREAM_TCP_BACKOFF_MAX;
+    }
+  }
+  failedAt = now;
+  LOG_INFO(LOG_TAG, "TCP 接続を %lu ms 控えます", (unsigned long)backoffMs);
+}
+
+void DNSUpstreamConnection::onResponse(uint32_t rttUs) {
+  responses++;
+  backoffMs = 0;
+  lastRttUs = rttUs;
+  if (srttUs == 0) {
+    srttUs = rttUs;
+  } else {
+    srttUs = srttUs - (srttUs >> SRTT_GAIN_SHIFT) + (rttUs >> SRTT_GAIN_SHIFT);
+  }
+}
+
+DNSUpstreamTcpInfo DNSUpstreamConnection::getInfo(unsigned long now) const {
+  DNSUpstreamTcpInfo info;
+  info.server = server;
+  info.connected = connected;
+  info.connecting = pendingSocket >= 0;
+  info.handshakes = handshakes;
+  info.connectFailures = connectFailures;
+  info.queries = queries;
+  info.responses = responses;
+  info.oversized = oversized;
+  info.srttUs = srttUs;
+  info.lastRttUs = lastRttUs;
+  info.backoffMs = inBackoff(now) ? backoffMs - (now - failedAt) : 0;
+  return info;
+}
@@ -0,0 +1,95 @@
+/*
+ * DNSUpstreamConnection.h - 上流 DNS リゾルバへの持続 TCP 接続
+ *
+ * 1 本の TCP 接続を使い回し、複数のクエリを応答を待たずに続けて送ります（パイプライン、RFC 7766）。
+ * 応答は届いた順に取り出し、呼び出し側がトランザクション ID で問い合わせ中の表と照合します。
+ *
+ * - 接続は必要になった時点で張り、相手が閉じるまで保持する（ハンドシェイクはその 1 回のみ）
+ * - 接続はノンブロッキングで始め、完了するまでの問い合わせは UDP で行う（DNS タスクを止めない）
+ * - 接続・送信の失敗とタイムアウトでは接続を捨て、次の接続まで待つ時間を
+ *   DNS_UPSTREAM_TCP_BACKOFF_MIN から倍々に DNS_UPSTREAM_TCP_BACKOFF_MAX まで延ばす
+ *   （その間の問い合わせは UDP で行う）
+ * - 応答を受け取った時点でバックオフを解除する
+ */
+
+#ifndef DNS_UPSTREAM_CONNECTION_H
+#define DNS_UPSTREAM_CONNECTION_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define DNS_UPSTREAM_TCP_MESSAGE_SIZE 4096   // 受け取る応答の最大長（超える応答は読み捨てる）
+#define DNS_UPSTREAM_TCP_QUERY_SIZE 512      // TCP で送るクエリの最大長（超えるクエリは UDP で送る）
+#define DNS_UPSTREAM_TCP_LENGTH_SIZE 2       // メッセージ前の長さフィールド
+
+// ===== 接続の状態（Web UI 表示用） =====
+struct DNSUpstreamTcpInfo {
+  IPAddress server;              // 接続先（未接続なら最後の接続先）
+  bool connected;
+  bool connecting;               // ハンドシェイク中
+  uint32_t handshakes;           // 接続した回数（TCP ハンドシェイク）
+  uint32_t connectFailures;      // 接続に失敗した回数
+  uint32_t queries;              // 送信したクエリ数
+  uint32_t responses;            // 受け取った応答数
+  uint32_t oversized;            // 大きすぎて読み捨てた応答数
+  uint32_t srttUs;               // クエリごとの RTT の平滑値（マイクロ秒、0 は未計測）
+  uint32_t lastRttUs;            // 直近の RTT
+  uint32_t backoffMs;            // 残りのバックオフ（0: すぐに接続できる）
+};
+
+/**
+ * DNSUpstreamConnection クラス
+ *
+ * DNS タスクからのみ使います。connect() は待たずに戻り、ハンドシェイクの完了は
+ * 以降の connect() / isConnected() で確かめます。DNS_UPSTREAM_TCP_CONNECT_TIMEOUT までに
+ * 完了しなければ失敗として扱い、バックオフ中は呼び出しても接続を試みません。
+ */
+class DNSUpstreamConnection {
+public:
+  DNSUpstreamConnection();
+
+  // server に接続済みなら true。未接続なら接続を始めて false（ハンドシェイク中も false）。
+  // 別のサーバーに接続中なら閉じてから接続する
+  bool connect(IPAddress server, uint16_t port, unsigned long now);
+  bool isConnected();
+  IPAddress getServer() const;
+
+  // 長さフィールドを付けて送る（最大 DNS_UPSTREAM_TCP_QUERY_SIZE、送信に失敗した場合は fail() 済み）
+  bool send(const uint8_t* query, size_t len, unsigned long now);
+
+  // 受信済みのバイトを読み、揃った応答を 1 件返す（長さ、無ければ 0）。
+  // message は次の receive() まで有効で、呼び出し側が書き換えてよい
+  size_t receive(uint8_t** message);
+
+  void close();                        // 正常な切断（バックオフなし）
+  void fail(unsigned long now);        // 失敗として切断し、バックオフを延ばす
+  void onResponse(uint32_t rttUs);     // 応答を受け取った（RTT を記録し、バックオフを解除）
+
+  DNSUpstreamTcpInfo getInfo(unsigned long now) const;
+
+private:
+  WiFiClient client;
+  IPAddress server;
+  bool connected;
+  int pendingSocket;                 // ハンドシェイク中のソケット（-1: なし）
+  unsigned long connectStartedAt;    // ハンドシェイクを始めた時刻
+  uint16_t received;                 // buffer に読み込んだバイト数（長さフィールドを含む）
+  uint16_t discard;                  // 読み捨て中の残りバイト数
+  unsigned long failedAt;            // 最後に失敗した時刻
+  uint32_t backoffMs;                // 失敗後に接続を控える時間（0: なし）
+  uint32_t handshakes;
+  uint32_t connectFailures;
+  uint32_t queries;
+  uint32_t responses;
+  uint32_t oversized;
+  uint32_t srttUs;
+  uint32_t lastRttUs;
+  uint8_t buffer[DNS_UPSTREAM_TCP_LENGTH_SIZE + DNS_UPSTREAM_TCP_MESSAGE_SIZE];
+
+  bool inBackoff(unsigned long now) const;
+  bool startConnect(IPAddress address, uint16_t port, unsigned long now);
+  bool finishConnect(unsigned long now);
+  void connectFailed(unsigned long now);
+};
+
+#endif // DNS_UPSTREAM_CONNECTION_H
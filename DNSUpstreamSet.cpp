@@ -0,0 +1,258 @@
+/*
+ * DNSUpstreamSet.cpp - 上流 DNS リゾルバの集合と選択の実装
+ */
+
+#include "DNSUpstreamSet.h"
+#include "Config.h"
+
+#define LOSS_PERMILLE_MAX 1000
+
+DNSUpstreamSet::DNSUpstreamSet()
+  : configuredCount(0),
+    count(0) {
+  for (int i = 0; i < DNS_MAX_UPSTREAMS; i++) {
+    resetUpstream(upstreams[i], IPAddress(), false);
+  }
+}
+
+void DNSUpstreamSet::resetUpstream(Upstream& upstream, IPAddress address, bool fromDhcp) {
+  upstream.address = address;
+  upstream.fromDhcp = fromDhcp;
+  upstream.srttUs = 0;
+  upstream.rttvarUs = 0;
+  upstream.lossPermille = 0;
+  upstream.consecutiveFailures = 0;
+  upstream.downSince = 0;
+  upstream.selectedAt = 0;
+  upstream.queries = 0;
+  upstream.responses = 0;
+  upstream.timeouts = 0;
+}
+
+/**
+ * 設定済みリゾルバを置き換える（DHCP のリゾルバは末尾に残す）
+ */
+bool DNSUpstreamSet::setConfigured(const IPAddress* servers, uint8_t serverCount) {
+  if (serverCount == 0 || serverCount > DNS_MAX_CONFIGURED_UPSTREAMS) {
+    return false;
+  }
+
+  IPAddress dhcp;
+  if (count > configuredCount) {
+    dhcp = upstreams[configuredCount].address;
+  }
+
+  for (uint8_t i = 0; i < serverCount; i++) {
+    resetUpstream(upstreams[i], servers[i], false);
+  }
+  configuredCount = serverCount;
+  count = serverCount;
+
+  if (dhcp != IPAddress()) {
+    setDhcp(dhcp);
+  }
+  return true;
+}
+
+/**
+ * DHCP で配布された DNS を設定する
+ *
+ * 設定済みリゾルバと同じアドレス、AP 自身、0.0.0.0 の場合は追加しない。
+ * 既存の DHCP のリゾルバを外した・置き換えた・新たに追加した場合に true を返す。
+ */
+bool DNSUpstreamSet::setDhcp(IPAddress server) {
+  bool hasDhcp = count > configuredCount;
+  if (hasDhcp && upstreams[configuredCount].address == server) {
+    return false;  // 変化なし（統計を保持）
+  }
+
+  count = configuredCount;
+  if (server == IPAddress() || server == AP_IP) {
+    return hasDhcp;
+  }
+  for (uint8_t i = 0; i < configuredCount; i++) {
+    if (upstreams[i].address == server) {
+      return hasDhcp;
+    }
+  }
+
+  resetUpstream(upstreams[count], server, true);
+  count++;
+  return true;
+}
+
+int DNSUpstreamSet::parseList(const String& text, IPAddress* out, uint8_t maxCount) {
+  int found = 0;
+  int start = 0;
+  int length = text.length();
+
+  while (start <= length) {
+    int end = start;
+    while (end < length && text[end] != ',' && text[end] != ' ' && text[end] != '\n') {
+      end++;
+    }
+
+    String token = text.substring(start, end);
+    token.trim();
+    if (token.length() > 0) {
+      IPAddress address;
+      if (found >= maxCount || !address.fromString(token) || address == IPAddress()) {
+        return -1;
+      }
+      out[found++] = address;
+    }
+    start = end + 1;
+  }
+  return found;
+}
+
+String DNSUpstreamSet::formatConfigured() const {
+  String text = "";
+  for (uint8_t i = 0; i < configuredCount; i++) {
+    if (i > 0) {
+      text += ", ";
+    }
+    text += upstreams[i].address.toString();
+  }
+  return text;
+}
+
+uint8_t DNSUpstreamSet::getCount() const {
+  return count;
+}
+
+IPAddress DNSUpstreamSet::getAddress(uint8_t index) const {
+  return upstreams[index].address;
+}
+
+int DNSUpstreamSet::indexOf(IPAddress address) const {
+  for (uint8_t i = 0; i < count; i++) {
+    if (upstreams[i].address == address) {
+      return i;
+    }
+  }
+  return DNS_UPSTREAM_NONE;
+}
+
+bool DNSUpstreamSet::isHealthy(const Upstream& upstream, unsigned long now) const {
+  return upstream.consecutiveFailures < DNS_UPSTREAM_MAX_FAILURES ||
+         now - upstream.downSince >= DNS_UPSTREAM_RETRY_INTERVAL;
+}
+
+/**
+ * 選択用の評価値（小さいほど良い）: SRTT + 損失率 × タイムアウト
+ *
+ * 未計測のリゾルバは 0 とし、一度は必ず試す。
+ */
+uint32_t DNSUpstreamSet::score(const Upstream& upstream) const {
+  if (upstream.responses == 0 && upstream.timeouts == 0) {
+    return 0;
+  }
+  uint32_t timeoutUs = (uint32_t)DNS_FORWARD_TIMEOUT * 1000;
+  return upstream.srttUs + (uint64_t)timeoutUs * upstream.lossPermille / LOSS_PERMILLE_MAX;
+}
+
+/**
+ * 問い合わせ先を選ぶ
+ *
+ * 健全なリゾルバのうち DNS_UPSTREAM_PROBE_INTERVAL の間選ばれていないものがあれば、
+ * 評価値に関係なく最も長く選ばれていないものを 1 回選ぶ（回復したリゾルバの SRTT を計測し直す）。
+ */
+int DNSUpstreamSet::select(uint8_t excludeMask, unsigned long now) {
+  int best = DNS_UPSTREAM_NONE;
+  int fallback = DNS_UPSTREAM_NONE;
+  int probe = DNS_UPSTREAM_NONE;
+  for (uint8_t i = 0; i < count; i++) {
+    if (excludeMask & (1 << i)) {
+      continue;
+    }
+    if (fallback == DNS_UPSTREAM_NONE || score(upstreams[i]) < score(upstreams[fallback])) {
+      fallback = i;
+    }
+    if (!isHealthy(upstreams[i], now)) {
+      continue;
+    }
+    if (best == DNS_UPSTREAM_NONE || score(upstreams[i]) < score(upstreams[best])) {
+      best = i;
+    }
+    if (now - upstreams[i].selectedAt >= DNS_UPSTREAM_PROBE_INTERVAL &&
+        (probe == DNS_UPSTREAM_NONE || now - upstreams[i].selectedAt > now - upstreams[probe].selectedAt)) {
+      probe = i;
+    }
+  }
+
+  // 健全な候補が無い場合も、除外されていないリゾルバがあれば最良のものを使う
+  int chosen = probe != DNS_UPSTREAM_NONE ? probe : best != DNS_UPSTREAM_NONE ? best : fallback;
+  if (chosen != DNS_UPSTREAM_NONE) {
+    upstreams[chosen].selectedAt = now;
+  }
+  return chosen;
+}
+
+/**
+ * 問い合わせタイムアウト: SRTT + 4 × RTTVAR（未計測は DNS_FORWARD_TIMEOUT）
+ */
+uint16_t DNSUpstreamSet::getTimeoutMs(uint8_t index) const {
+  const Upstream& upstream = upstreams[index];
+  if (upstream.responses == 0) {
+    return DNS_FORWARD_TIMEOUT;
+  }
+  uint32_t timeoutMs = (upstream.srttUs + 4 * upstream.rttvarUs) / 1000;
+  if (timeoutMs < DNS_UPSTREAM_MIN_TIMEOUT) {
+    timeoutMs = DNS_UPSTREAM_MIN_TIMEOUT;
+  } else if (timeoutMs > DNS_FORWARD_TIMEOUT) {
+    timeoutMs = DNS_FORWARD_TIMEOUT;
+  }
+  return timeoutMs;
+}
+
+void DNSUpstreamSet::onQuery(uint8_t index) {
+  upstreams[index].queries++;
+}
+
+void DNSUpstreamSet::onResponse(uint8_t index, bool sampled, uint32_t rttUs) {
+  Upstream& upstream = upstreams[index];
+  upstream.responses++;
+  upstream.consecutiveFailures = 0;
+  upstream.lossPermille -= upstream.lossPermille >> 3;
+
+  if (!sampled) {
+    return;  // 再送後の応答はどの送信に対するものか分からないため計測しない
+  }
+  if (upstream.responses == 1 || upstream.srttUs == 0) {
+    upstream.srttUs = rttUs;
+    upstream.rttvarUs = rttUs / 2;
+  } else {
+    uint32_t delta = upstream.srttUs > rttUs ? upstream.srttUs - rttUs : rttUs - upstream.srttUs;
+    upstream.rttvarUs = upstream.rttvarUs - (upstream.rttvarUs >> 2) + (delta >> 2);
+    upstream.srttUs = upstream.srttUs - (upstream.srttUs >> 3) + (rttUs >> 3);
+  }
+}
+
+void DNSUpstreamSet::onTimeout(uint8_t index, unsigned long now) {
+  Upstream& upstream = upstreams[index];
+  upstream.timeouts++;
+  upstream.lossPermille = upstream.lossPermille - (upstream.lossPermille >> 3) + (LOSS_PERMILLE_MAX >> 3);
+  if (upstream.consecutiveFailures < 0xFF) {
+    upstream.consecutiveFailures++;
+  }
+  // しきい値到達時、または停止中の再試行が失敗した時に停止期間を開始
+  if (upstream.consecutiveFailures >= DNS_UPSTREAM_MAX_FAILURES) {
+    upstream.downSince = now;
+  }
+}
+
+DNSUpstreamInfo DNSUpstreamSet::getInfo(uint8_t index, unsigned long now) const {
+  const Upstream& upstream = upstreams[index];
+  DNSUpstreamInfo info;
+  info.address = upstream.address;
+  info.fromDhcp = upstream.fromDhcp;
+  info.healthy = isHealthy(upstream, now);
+  info.srttUs = upstream.srttUs;
+  info.timeoutMs = getTimeoutMs(index);
+  info.lossPermille = upstream.lossPermille;
+  info.queries = upstream.queries;
+  info.responses = upstream.responses;
+  info.timeouts = upstream.timeouts;
+  return info;
+}
@@ -0,0 +1,92 @@
+/*
+ * DNSUpstreamSet.h - 上流 DNS リゾルバの集合と選択
+ *
+ * Web UI で設定したリゾルバと、STA の DHCP で配布された DNS を保持し、
+ * 応答時間（平滑化 RTT）と損失率の推定から問い合わせ先を選びます。
+ *
+ * - RTT は RFC 6298 と同じ SRTT / RTTVAR の指数平滑化（マイクロ秒）
+ * - 問い合わせごとのタイムアウトは SRTT + 4 × RTTVAR を上下限で丸めた値
+ * - 連続 DNS_UPSTREAM_MAX_FAILURES 回タイムアウトしたリゾルバは
+ *   DNS_UPSTREAM_RETRY_INTERVAL の間候補から外す（全滅時は最良のものを使う）
+ * - DNS_UPSTREAM_PROBE_INTERVAL の間選ばれていないリゾルバには 1 回送り、RTT を計測し直す
+ */
+
+#ifndef DNS_UPSTREAM_SET_H
+#define DNS_UPSTREAM_SET_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+#define DNS_MAX_UPSTREAMS 4              // リゾルバ数の上限（DHCP 分を含む）
+#define DNS_MAX_CONFIGURED_UPSTREAMS 3   // Web UI で設定できる数
+#define DNS_UPSTREAM_NONE -1
+
+// ===== リゾルバの状態（Web UI 表示用） =====
+struct DNSUpstreamInfo {
+  IPAddress address;
+  bool fromDhcp;               // STA の DHCP で配布された DNS
+  bool healthy;                // 候補として使用中
+  uint32_t srttUs;             // 平滑化 RTT（マイクロ秒、0 は未計測）
+  uint16_t timeoutMs;          // 現在の問い合わせタイムアウト
+  uint16_t lossPermille;       // 損失率の推定（‰）
+  uint32_t queries;            // 送信数
+  uint32_t responses;          // 応答数
+  uint32_t timeouts;           // タイムアウト数
+};
+
+/**
+ * DNSUpstreamSet クラス
+ *
+ * インデックスはビットマスク（uint8_t）で扱えるよう DNS_MAX_UPSTREAMS 未満。
+ * 設定済みリゾルバが先頭、DHCP のリゾルバは末尾に置きます。
+ */
+class DNSUpstreamSet {
+public:
+  DNSUpstreamSet();
+
+  bool setConfigured(const IPAddress* servers, uint8_t count);
+  bool setDhcp(IPAddress server);  // 0.0.0.0 で削除。集合が変わった場合は true
+
+  // "8.8.8.8, 1.1.1.1" 形式を解析。不正な場合は -1
+  static int parseList(const String& text, IPAddress* out, uint8_t maxCount);
+  String formatConfigured() const;
+
+  uint8_t getCount() const;
+  IPAddress getAddress(uint8_t index) const;
+  int indexOf(IPAddress address) const;
+
+  // excludeMask のリゾルバを除いて最も良いものを選ぶ。候補が無ければ DNS_UPSTREAM_NONE
+  int select(uint8_t excludeMask, unsigned long now);
+  uint16_t getTimeoutMs(uint8_t index) const;
+
+  void onQuery(uint8_t index);
+  void onResponse(uint8_t index, bool sampled, uint32_t rttUs);  // sampled=false: RTT を計測しない
+  void onTimeout(uint8_t index, unsigned long now);
+
+  DNSUpstreamInfo getInfo(uint8_t index, unsigned long now) const;
+
+private:
+  struct Upstream {
+    IPAddress address;
+    bool fromDhcp;
+    uint32_t srttUs;
+    uint32_t rttvarUs;
+    uint16_t lossPermille;
+    uint8_t consecutiveFailures;
+    unsigned long downSince;       // 候補から外した時刻（millis）
+    unsigned long selectedAt;      // 最後に選んだ時刻（millis）
+    uint32_t queries;
+    uint32_t responses;
+    uint32_t timeouts;
+  };
+
+  Upstream upstreams[DNS_MAX_UPSTREAMS];
+  uint8_t configuredCount;
+  uint8_t count;
+
+  static void resetUpstream(Upstream& upstream, IPAddress address, bool fromDhcp);
+  bool isHealthy(const Upstream& upstream, unsigned long now) const;
+  uint32_t score(const Upstream& upstream) const;
+};
+
+#endif // DNS_UPSTREAM_SET_H
@@ -0,0 +1,889 @@
+/*
+ * DomainTrie.cpp - ブロックリスト用の逆順ラベル DAFSA の実装
+ */
+
+#include "DomainTrie.h"
+#include "Config.h"
+#include <algorithm>
+
+// キー内のラベル区切り文字（ラベルに使える文字より小さい値にすることで、
+// "example" が "example-x" より先、かつ "example\x01..." の直前に整列される）
+static const char KEY_SEPARATOR = 0x01;
+static const uint32_t U24_LIMIT = 1u << 24;
+static const uint32_t INITIAL_TABLE_SIZE = 256;
+
+// ===== バイト列ヘルパー =====
+
+static uint32_t readU24(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+static void writeU24(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+}
+
+static uint32_t readU32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void writeU32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+// varint（LEB128）を読み込み、消費したバイト数を返す（不正時は 0）
+static size_t readVarint(const uint8_t* p, const uint8_t* end, uint32_t* value) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < 5 && p + i < end; i++) {
+    result |= (uint32_t)(p[i] & 0x7F) << (7 * i);
+    if ((p[i] & 0x80) == 0) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+static size_t writeVarint(uint8_t* p, uint32_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    p[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  p[n++] = value;
+  return n;
+}
+
+static uint32_t hashBytes(const uint8_t* data, size_t len) {
+  // FNV-1a (32 ビット)
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// 必要に応じて配列を 1.5 倍ずつ拡張する（余剰領域を抑えてピークメモリを下げる）
+static bool ensureCapacity(void** buf, size_t* capacity, size_t need, size_t elemSize) {
+  if (need <= *capacity) {
+    return true;
+  }
+  size_t newCapacity = *capacity ? *capacity : 64;
+  while (newCapacity < need) {
+    newCapacity += newCapacity / 2;
+  }
+  void* p = realloc(*buf, newCapacity * elemSize);
+  if (!p) {
+    return false;
+  }
+  *buf = p;
+  *capacity = newCapacity;
+  return true;
+}
+
+// ========================================
+// ファイル形式
+// ========================================
+
+bool parseDomainTrieFileHeader(const uint8_t* header, uint32_t* payloadSize, uint32_t* crc) {
+  if (memcmp(header, DOMAIN_TRIE_FILE_MAGIC, DOMAIN_TRIE_FILE_MAGIC_SIZE) != 0) {
+    return false;
+  }
+  uint16_t version = (uint16_t)header[4] | ((uint16_t)header[5] << 8);
+  if (version != DOMAIN_TRIE_FILE_VERSION) {
+    return false;
+  }
+  *payloadSize = readU32(header + 8);
+  *crc = readU32(header + 12);
+  return true;
+}
+
+void writeDomainTrieFileHeader(uint8_t* header, uint32_t payloadSize, uint32_t crc) {
+  memcpy(header, DOMAIN_TRIE_FILE_MAGIC, DOMAIN_TRIE_FILE_MAGIC_SIZE);
+  header[4] = DOMAIN_TRIE_FILE_VERSION & 0xFF;
+  header[5] = DOMAIN_TRIE_FILE_VERSION >> 8;
+  header[6] = 0;
+  header[7] = 0;
+  writeU32(header + 8, payloadSize);
+  writeU32(header + 12, crc);
+}
+
+uint32_t domainTrieCrc32(const uint8_t* data, size_t len, uint32_t crc) {
+  // 4 ビット単位のテーブル（64 バイト）で計算
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  crc ^= 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+uint32_t domainSuffixHash(uint32_t parentHash, const char* label, size_t len) {
+  // FNV-1a をラベル + 区切りで継続
+  uint32_t hash = parentHash;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)label[i];
+    hash *= 16777619u;
+  }
+  hash ^= '.';
+  hash *= 16777619u;
+  return hash;
+}
+
+uint32_t domainNameHash(const char* name, size_t len) {
+  uint32_t hash = DOMAIN_SUFFIX_HASH_SEED;
+  size_t end = len;
+  while (end > 0) {
+    size_t start = end;
+    while (start > 0 && name[start - 1] != '.') {
+      start--;
+    }
+    hash = domainSuffixHash(hash, name + start, end - start);
+    end = start > 0 ? start - 1 : 0;
+  }
+  return hash;
+}
+
+// ========================================
+// DomainTrie
+// ========================================
+
+DomainTrie::DomainTrie()
+  : blob(nullptr),
+    blobSize(0),
+    labels(nullptr),
+    nodes(nullptr),
+    labelSize(0),
+    nodeSize(0),
+    rootOffset(0),
+    domainCount(0),
+    defaultLists(0) {
+}
+
+DomainTrie::~DomainTrie() {
+  reset();
+}
+
+/**
+ * セクションサイズと構造を先頭から 1 回走査して検証する
+ *
+ * - ラベル・ノードはそれぞれのセクションに隙間なく並び、末尾を越えない
+ * - エッジのラベルはラベルセクション内、子ノードは親より前（ビルダーは子を先に書き出す）
+ *   にあるため、辿るたびにオフセットが小さくなり循環しない
+ * - 子の無いノードは登録済み（空のトライのルートを除く）、ルートは最後のノード
+ * CRC が一致していても構造が壊れたファイル（照合やプレフィルタ構築が停止しうる）はここで拒否する。
+ */
+bool DomainTrie::isValidBlob(const uint8_t* data, size_t size) {
+  if (!data || size < DOMAIN_TRIE_HEADER_SIZE) {
+    return false;
+  }
+
+  uint32_t labelSize = readU32(data);
+  uint32_t nodeSize = readU32(data + 4);
+  uint32_t root = readU32(data + 8);
+  if ((uint64_t)DOMAIN_TRIE_HEADER_SIZE + labelSize + nodeSize != size || nodeSize == 0 || root >= nodeSize) {
+    return false;
+  }
+
+  const uint8_t* labelData = data + DOMAIN_TRIE_HEADER_SIZE;
+  for (uint32_t pos = 0; pos < labelSize; pos += 1 + labelData[pos]) {
+    if (labelData[pos] == 0 || (uint64_t)pos + 1 + labelData[pos] > labelSize) {
+      return false;
+    }
+  }
+
+  const uint8_t* nodeData = labelData + labelSize;
+  const uint8_t* end = nodeData + nodeSize;
+  uint32_t last = 0;
+  for (uint32_t pos = 0; pos < nodeSize;) {
+    uint32_t count;
+    size_t varintLen = readVarint(nodeData + pos + 1, end, &count);
+    if (varintLen == 0 || (uint64_t)pos + 1 + varintLen + (uint64_t)count * DOMAIN_TRIE_EDGE_SIZE > nodeSize ||
+        (count == 0 && !(nodeData[pos] & DOMAIN_TRIE_FLAG_TERMINAL) && pos + 1 + varintLen < nodeSize)) {
+      return false;
+    }
+    const uint8_t* edge = nodeData + pos + 1 + varintLen;
+    for (uint32_t i = 0; i < count; i++, edge += DOMAIN_TRIE_EDGE_SIZE) {
+      uint32_t labelOffset = readU24(edge);
+      if (labelOffset >= labelSize || labelOffset + 1 + labelData[labelOffset] > labelSize ||
+          readU24(edge + 3) >= pos) {
+        return false;
+      }
+    }
+    last = pos;
+    pos = edge - nodeData;
+  }
+  return root == last;
+}
+
+uint32_t DomainTrie::getBlobDomainCount(const uint8_t* data) {
+  return readU32(data + 12);
+}
+
+bool DomainTrie::adopt(uint8_t* data, size_t size, uint8_t lists) {
+  if (!isValidBlob(data, size)) {
+    return false;
+  }
+
+  uint32_t newLabelSize = readU32(data);
+  uint32_t newNodeSize = readU32(data + 4);
+  uint32_t newRoot = readU32(data + 8);
+
+  reset();
+  blob = data;
+  blobSize = size;
+  labelSize = newLabelSize;
+  nodeSize = newNodeSize;
+  rootOffset = newRoot;
+  domainCount = readU32(data + 12);
+  defaultLists = lists;
+  labels = data + DOMAIN_TRIE_HEADER_SIZE;
+  nodes = labels + labelSize;
+  return true;
+}
+
+void DomainTrie::reset() {
+  if (blob) {
+    free(blob);
+  }
+  blob = nullptr;
+  blobSize = 0;
+  labels = nullptr;
+  nodes = nullptr;
+  labelSize = 0;
+  nodeSize = 0;
+  rootOffset = 0;
+  domainCount = 0;
+  defaultLists = 0;
+}
+
+bool DomainTrie::isLoaded() const {
+  return blob != nullptr;
+}
+
+uint32_t DomainTrie::root() const {
+  return rootOffset;
+}
+
+uint8_t DomainTrie::flags(uint32_t node) const {
+  return node < nodeSize ? nodes[node] : 0;
+}
+
+uint8_t DomainTrie::lists(uint32_t node) const {
+  uint8_t nodeFlags = flags(node);
+  if (!(nodeFlags & DOMAIN_TRIE_FLAG_TERMINAL)) {
+    return 0;
+  }
+  uint8_t bits = nodeFlags >> DOMAIN_TRIE_LIST_SHIFT;
+  return bits ? bits : defaultLists;
+}
+
+bool DomainTrie::readNode(uint32_t node, uint32_t* count, const uint8_t** edges) const {
+  if (node >= nodeSize) {
+    return false;
+  }
+
+  const uint8_t* end = nodes + nodeSize;
+  size_t varintLen = readVarint(nodes + node + 1, end, count);
+  if (varintLen == 0) {
+    return false;
+  }
+
+  *edges = nodes + node + 1 + varintLen;
+  return (size_t)(end - *edges) >= (size_t)*count * DOMAIN_TRIE_EDGE_SIZE;
+}
+
+bool DomainTrie::findChild(uint32_t node, const char* label, size_t len, uint32_t* child) const {
+  uint32_t count = 0;
+  const uint8_t* edges;
+  if (!readNode(node, &count, &edges)) {
+    return false;
+  }
+
+  // エッジはラベル順に整列されているので二分探索
+  uint32_t lo = 0;
+  uint32_t hi = count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const uint8_t* edge = edges + mid * DOMAIN_TRIE_EDGE_SIZE;
+    uint32_t labelOffset = readU24(edge);
+    if (labelOffset >= labelSize || labelOffset + 1 + labels[labelOffset] > labelSize) {
+      return false;
+    }
+
+    size_t edgeLen = labels[labelOffset];
+    int cmp = memcmp(label, labels + labelOffset + 1, len < edgeLen ? len : edgeLen);
+    if (cmp == 0) {
+      cmp = (len < edgeLen) ? -1 : (len > edgeLen ? 1 : 0);
+    }
+
+    if (cmp == 0) {
+      uint32_t childOffset = readU24(edge + 3);
+      if (childOffset >= node) {  // 子は親より前（検証済み。ずれたオフセットでも循環させない）
+        return false;
+      }
+      *child = childOffset;
+      return true;
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return false;
+}
+
+void DomainTrie::forEachDomainHash(void (*callback)(uint32_t hash, void* context), void* context) const {
+  if (!blob) {
+    return;
+  }
+
+  // 明示的なスタックで深さ優先探索（共有された部分木は経路ごとに訪問される）
+  struct Frame {
+    const uint8_t* edges;
+    uint32_t count;
+    uint32_t next;
+    uint32_t node;
+    uint32_t hash;
+  };
+  Frame stack[DOMAIN_TRIE_MAX_LABELS + 1];
+  int depth = 0;
+
+  if (!readNode(rootOffset, &stack[0].count, &stack[0].edges)) {
+    return;
+  }
+  stack[0].next = 0;
+  stack[0].node = rootOffset;
+  stack[0].hash = DOMAIN_SUFFIX_HASH_SEED;
+
+  while (depth >= 0) {
+    Frame& frame = stack[depth];
+    if (frame.next >= frame.count) {
+      depth--;
+      continue;
+    }
+
+    const uint8_t* edge = frame.edges + frame.next++ * DOMAIN_TRIE_EDGE_SIZE;
+    uint32_t labelOffset = readU24(edge);
+    uint32_t child = readU24(edge + 3);
+    if (labelOffset >= labelSize || labelOffset + 1 + labels[labelOffset] > labelSize || child >= frame.node) {
+      continue;  // 不正なエッジは無視（子は親より前にあるため、深くなるほどオフセットが小さくなる）
+    }
+
+    uint32_t hash = domainSuffixHash(frame.hash, (const char*)labels + labelOffset + 1, labels[labelOffset]);
+    if (nodes[child] & DOMAIN_TRIE_FLAG_TERMINAL) {
+      callback(hash, context);
+    }
+
+    if (depth + 1 < DOMAIN_TRIE_MAX_LABELS) {
+      Frame& next = stack[depth + 1];
+      if (readNode(child, &next.count, &next.edges) && next.count > 0) {
+        next.next = 0;
+        next.node = child;
+        next.hash = hash;
+        depth++;
+      }
+    }
+  }
+}
+
+/**
+ * name（小文字化済み）がそのまま登録されていれば属するリストのビットを返す（サブドメインとしての一致は含まない）
+ */
+uint8_t DomainTrie::contains(const char* name, size_t len) const {
+  if (!blob) {
+    return 0;
+  }
+  uint32_t node = rootOffset;
+  size_t end = len;
+  while (true) {
+    size_t start = end;
+    while (start > 0 && name[start - 1] != '.') {
+      start--;
+    }
+    if (!findChild(node, name + start, end - start, &node)) {
+      return 0;
+    }
+    if (start == 0) {
+      return lists(node);
+    }
+    end = start - 1;
+  }
+}
+
+void DomainTrie::forEachDomain(void (*callback)(const char* name, size_t len, uint8_t lists, void* context),
+                               void* context) const {
+  if (!blob) {
+    return;
+  }
+
+  // forEachDomainHash と同じ深さ優先探索で、経路上のラベルから名前を組み立てる
+  struct Frame {
+    const uint8_t* edges;
+    uint32_t count;
+    uint32_t next;
+    uint32_t node;
+    uint32_t label;                 // このフレームに入ったエッジのラベル
+  };
+  Frame stack[DOMAIN_TRIE_MAX_LABELS + 1];
+  char name[DOMAIN_TRIE_MAX_NAME_SIZE];
+  int depth = 0;
+
+  if (!readNode(rootOffset, &stack[0].count, &stack[0].edges)) {
+    return;
+  }
+  stack[0].next = 0;
+  stack[0].node = rootOffset;
+
+  while (depth >= 0) {
+    Frame& frame = stack[depth];
+    if (frame.next >= frame.count) {
+      depth--;
+      continue;
+    }
+
+    const uint8_t* edge = frame.edges + frame.next++ * DOMAIN_TRIE_EDGE_SIZE;
+    uint32_t labelOffset = readU24(edge);
+    uint32_t child = readU24(edge + 3);
+    if (labelOffset >= labelSize || labelOffset + 1 + labels[labelOffset] > labelSize || child >= frame.node) {
+      continue;  // 不正なエッジは無視（子は親より前にあるため、深くなるほどオフセットが小さくなる）
+    }
+
+    if (nodes[child] & DOMAIN_TRIE_FLAG_TERMINAL) {
+      // 深いラベルから順に連結（ads . example . com）
+      size_t used = 0;
+      bool fits = true;
+      for (int d = depth; d >= 0 && fits; d--) {
+        uint32_t offset = d == depth ? labelOffset : stack[d + 1].label;
+        size_t len = labels[offset];
+        fits = used + len + 1 < sizeof(name);
+        if (fits) {
+          memcpy(name + used, labels + offset + 1, len);
+          used += len;
+          name[used++] = '.';
+        }
+      }
+      if (fits && used > 0) {
+        callback(name, used - 1, lists(child), context);
+      }
+    }
+
+    if (depth + 1 < DOMAIN_TRIE_MAX_LABELS) {
+      Frame& next = stack[depth + 1];
+      if (readNode(child, &next.count, &next.edges) && next.count > 0) {
+        next.next = 0;
+        next.node = child;
+        next.label = labelOffset;
+        depth++;
+      }
+    }
+  }
+}
+
+uint32_t DomainTrie::getDomainCount() const {
+  return domainCount;
+}
+
+size_t DomainTrie::getSizeBytes() const {
+  return blobSize;
+}
+
+// ========================================
+// DomainTrieBuilder
+// ========================================
+
+DomainTrieBuilder::DomainTrieBuilder()
+  : pool(nullptr),
+    poolUsed(0),
+    poolCapacity(0),
+    keys(nullptr),
+    keyCount(0),
+    keyCapacity(0),
+    labelOut(nullptr),
+    labelUsed(0),
+    labelCapacity(0),
+    nodeOut(nullptr),
+    nodeUsed(0),
+    nodeCapacity(0),
+    edgeStack(nullptr),
+    edgeStackUsed(0),
+    edgeStackCapacity(0),
+    labelTable(nullptr),
+    labelTableMask(0),
+    labelTableCount(0),
+    nodeTable(nullptr),
+    nodeTableMask(0),
+    nodeTableCount(0),
+    terminalCount(0),
+    peakBytes(0),
+    failed(false) {
+}
+
+DomainTrieBuilder::~DomainTrieBuilder() {
+  clear();
+}
+
+void DomainTrieBuilder::clear() {
+  free(pool);
+  pool = nullptr;
+  poolUsed = 0;
+  poolCapacity = 0;
+  free(keys);
+  keys = nullptr;
+  keyCount = 0;
+  keyCapacity = 0;
+  failed = false;
+  peakBytes = 0;
+  releaseWork();
+}
+
+void DomainTrieBuilder::releaseWork() {
+  free(labelOut);
+  labelOut = nullptr;
+  labelUsed = 0;
+  labelCapacity = 0;
+  free(nodeOut);
+  nodeOut = nullptr;
+  nodeUsed = 0;
+  nodeCapacity = 0;
+  free(edgeStack);
+  edgeStack = nullptr;
+  edgeStackUsed = 0;
+  edgeStackCapacity = 0;
+  free(labelTable);
+  labelTable = nullptr;
+  labelTableMask = 0;
+  labelTableCount = 0;
+  free(nodeTable);
+  nodeTable = nullptr;
+  nodeTableMask = 0;
+  nodeTableCount = 0;
+  terminalCount = 0;
+}
+
+uint32_t DomainTrieBuilder::getKeyCount() const {
+  return keyCount;
+}
+
+size_t DomainTrieBuilder::getPeakBytes() const {
+  return peakBytes;
+}
+
+void DomainTrieBuilder::updatePeak(size_t extra) {
+  size_t current = poolCapacity + keyCapacity * sizeof(uint32_t) +
+                   labelCapacity + nodeCapacity + edgeStackCapacity * sizeof(uint32_t) + extra;
+  if (labelTable) {
+    current += ((size_t)labelTableMask + 1) * sizeof(uint32_t);
+  }
+  if (nodeTable) {
+    current += ((size_t)nodeTableMask + 1) * sizeof(uint32_t);
+  }
+  if (current > peakBytes) {
+    peakBytes = current;
+  }
+}
+
+bool DomainTrieBuilder::add(const char* domain, size_t len, uint8_t lists) {
+  if (failed || len == 0 || len > DOMAIN_NAME_MAX_LENGTH) {
+    return false;
+  }
+
+  if (!ensureCapacity((void**)&pool, &poolCapacity, poolUsed + len + 2, 1) ||
+      !ensureCapacity((void**)&keys, &keyCapacity, (size_t)keyCount + 1, sizeof(uint32_t))) {
+    failed = true;
+    return false;
+  }
+  updatePeak(0);
+
+  // ラベルを末尾から順に書き出す（ads.example.com → com\x01example\x01ads）
+  char* out = pool + poolUsed;
+  size_t end = len;
+  int labelCount = 0;
+  while (true) {
+    size_t start = end;
+    while (start > 0 && domain[start - 1] != '.') {
+      start--;
+    }
+    if (start == end || ++labelCount > DOMAIN_TRIE_MAX_LABELS) {
+      return false;  // 空ラベルまたはラベル数超過
+    }
+
+    // コピーしながら小文字化する
+    for (size_t i = start; i < end; i++) {
+      char c = domain[i];
+      *out++ = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    if (start == 0) {
+      break;
+    }
+    *out++ = KEY_SEPARATOR;
+    end = start - 1;
+  }
+  *out++ = '\0';
+  *out = lists;
+
+  keys[keyCount++] = poolUsed;
+  poolUsed += len + 2;
+  return true;
+}
+
+uint8_t* DomainTrieBuilder::build(size_t* outSize) {
+  if (failed) {
+    clear();
+    return nullptr;
+  }
+
+  // キーを整列し重複を除去（リストのビットは残すキーにまとめる）
+  const char* base = pool;
+  std::sort(keys, keys + keyCount, [base](uint32_t a, uint32_t b) {
+    return strcmp(base + a, base + b) < 0;
+  });
+  uint32_t unique = 0;
+  for (uint32_t i = 0; i < keyCount; i++) {
+    if (unique == 0 || strcmp(pool + keys[unique - 1], pool + keys[i]) != 0) {
+      keys[unique++] = keys[i];
+    } else {
+      size_t keyLen = strlen(pool + keys[i]);
+      pool[keys[unique - 1] + keyLen + 1] |= pool[keys[i] + keyLen + 1];
+    }
+  }
+  keyCount = unique;
+
+  // キー領域を実サイズまで縮小してから出力領域を確保する
+  char* shrunkPool = (char*)realloc(pool, poolUsed ? poolUsed : 1);
+  if (shrunkPool) {
+    pool = shrunkPool;
+    poolCapacity = poolUsed;
+  }
+  uint32_t* shrunkKeys = (uint32_t*)realloc(keys, (keyCount ? keyCount : 1) * sizeof(uint32_t));
+  if (shrunkKeys) {
+    keys = shrunkKeys;
+    keyCapacity = keyCount;
+  }
+
+  labelTable = (uint32_t*)calloc(INITIAL_TABLE_SIZE, sizeof(uint32_t));
+  nodeTable = (uint32_t*)calloc(INITIAL_TABLE_SIZE, sizeof(uint32_t));
+  if (!labelTable || !nodeTable) {
+    clear();
+    return nullptr;
+  }
+  labelTableMask = INITIAL_TABLE_SIZE - 1;
+  nodeTableMask = INITIAL_TABLE_SIZE - 1;
+
+  uint32_t rootOffset;
+  if (!emitNode(0, keyCount, 0, &rootOffset) || failed) {
+    clear();
+    return nullptr;
+  }
+
+  // キーと重複排除表はもう不要なので、出力配列の確保前に解放してピークを抑える
+  free(pool);
+  pool = nullptr;
+  poolUsed = 0;
+  poolCapacity = 0;
+  free(keys);
+  keys = nullptr;
+  keyCapacity = 0;
+  free(labelTable);
+  labelTable = nullptr;
+  free(nodeTable);
+  nodeTable = nullptr;
+  free(edgeStack);
+  edgeStack = nullptr;
+  edgeStackCapacity = 0;
+
+  size_t size = DOMAIN_TRIE_HEADER_SIZE + labelUsed + nodeUsed;
+  uint8_t* blob = (uint8_t*)malloc(size);
+  updatePeak(size);
+  size_t peak = peakBytes;
+  if (blob) {
+    writeU32(blob, labelUsed);
+    writeU32(blob + 4, nodeUsed);
+    writeU32(blob + 8, rootOffset);
+    writeU32(blob + 12, terminalCount);
+    memcpy(blob + DOMAIN_TRIE_HEADER_SIZE, labelOut, labelUsed);
+    memcpy(blob + DOMAIN_TRIE_HEADER_SIZE + labelUsed, nodeOut, nodeUsed);
+    *outSize = size;
+  }
+
+  clear();
+  peakBytes = peak;
+  return blob;
+}
+
+/**
+ * keys[lo, hi) が共有する先頭 prefixLen バイトに対応するノードを出力する
+ *
+ * 子ノードを先に出力（後順）し、同一内容のノードは既存のものを再利用する。
+ */
+bool DomainTrieBuilder::emitNode(uint32_t lo, uint32_t hi, size_t prefixLen, uint32_t* outOffset) {
+  size_t edgeBase = edgeStackUsed;
+  uint8_t nodeFlags = 0;
+  uint32_t i = lo;
+
+  // 整列順ではこのノードで終わるキーが範囲の先頭に来る（終端の直後がリストのビット）
+  if (prefixLen > 0 && pool[keys[lo] + prefixLen - 1] == '\0') {
+    nodeFlags |= DOMAIN_TRIE_FLAG_TERMINAL | (uint8_t)(pool[keys[lo] + prefixLen] << DOMAIN_TRIE_LIST_SHIFT);
+    terminalCount++;
+    i++;
+  }
+
+  while (i < hi) {
+    const char* label = pool + keys[i] + prefixLen;
+    size_t len = 0;
+    while (label[len] != KEY_SEPARATOR && label[len] != '\0') {
+      len++;
+    }
+
+    // 同じラベルを持つキーの範囲を求める
+    uint32_t j = i + 1;
+    while (j < hi) {
+      const char* other = pool + keys[j] + prefixLen;
+      if (strncmp(label, other, len) != 0 || (other[len] != KEY_SEPARATOR && other[len] != '\0')) {
+        break;
+      }
+      j++;
+    }
+
+    uint32_t childOffset;
+    if (!emitNode(i, j, prefixLen + len + 1, &childOffset)) {
+      return false;
+    }
+    uint32_t labelOffset = internLabel(label, len);
+    if (failed) {
+      return false;
+    }
+
+    if (!ensureCapacity((void**)&edgeStack, &edgeStackCapacity, edgeStackUsed + 2, sizeof(uint32_t))) {
+      failed = true;
+      return false;
+    }
+    edgeStack[edgeStackUsed++] = labelOffset;
+    edgeStack[edgeStackUsed++] = childOffset;
+    i = j;
+  }
+
+  // ノードを書き出す
+  uint32_t childCount = (edgeStackUsed - edgeBase) / 2;
+  size_t start = nodeUsed;
+  if (!ensureCapacity((void**)&nodeOut, &nodeCapacity,
+                      nodeUsed + 1 + 5 + (size_t)childCount * DOMAIN_TRIE_EDGE_SIZE, 1)) {
+    failed = true;
+    return false;
+  }
+  nodeOut[nodeUsed++] = nodeFlags;
+  nodeUsed += writeVarint(nodeOut + nodeUsed, childCount);
+  for (uint32_t c = 0; c < childCount; c++) {
+    writeU24(nodeOut + nodeUsed, edgeStack[edgeBase + c * 2]);
+    writeU24(nodeOut + nodeUsed + 3, edgeStack[edgeBase + c * 2 + 1]);
+    nodeUsed += DOMAIN_TRIE_EDGE_SIZE;
+  }
+  edgeStackUsed = edgeBase;
+
+  if (nodeUsed >= U24_LIMIT) {
+    failed = true;  // u24 オフセットで表現できないサイズ
+    return false;
+  }
+
+  *outOffset = dedupeNode(start);
+  updatePeak(0);
+  return !failed;
+}
+
+uint32_t DomainTrieBuilder::internLabel(const char* label, size_t len) {
+  uint32_t hash = hashBytes((const uint8_t*)label, len);
+  uint32_t pos = hash & labelTableMask;
+
+  while (labelTable[pos] != 0) {
+    uint32_t offset = labelTable[pos] - 1;
+    if (labelOut[offset] == len && memcmp(labelOut + offset + 1, label, len) == 0) {
+      return offset;
+    }
+    pos = (pos + 1) & labelTableMask;
+  }
+
+  if (!ensureCapacity((void**)&labelOut, &labelCapacity, labelUsed + 1 + len, 1) ||
+      labelUsed + 1 + len >= U24_LIMIT) {
+    failed = true;
+    return 0;
+  }
+
+  uint32_t offset = labelUsed;
+  labelOut[labelUsed++] = len;
+  memcpy(labelOut + labelUsed, label, len);
+  labelUsed += len;
+
+  labelTable[pos] = offset + 1;
+  if (++labelTableCount * 10 > (labelTableMask + 1) * 7 && !growTable(&labelTable, &labelTableMask, false)) {
+    failed = true;
+  }
+  return offset;
+}
+
+uint32_t DomainTrieBuilder::dedupeNode(size_t start) {
+  size_t len = nodeUsed - start;
+  uint32_t hash = hashBytes(nodeOut + start, len);
+  uint32_t pos = hash & nodeTableMask;
+
+  while (nodeTable[pos] != 0) {
+    uint32_t offset = nodeTable[pos] - 1;
+    if (nodeLength(offset) == len && memcmp(nodeOut + offset, nodeOut + start, len) == 0) {
+      nodeUsed = start;  // 同一の部分木が既にあるので書き出した分を取り消す
+      return offset;
+    }
+    pos = (pos + 1) & nodeTableMask;
+  }
+
+  nodeTable[pos] = start + 1;
+  if (++nodeTableCount * 10 > (nodeTableMask + 1) * 7 && !growTable(&nodeTable, &nodeTableMask, true)) {
+    failed = true;
+  }
+  return start;
+}
+
+size_t DomainTrieBuilder::nodeLength(uint32_t offset) const {
+  uint32_t count = 0;
+  size_t varintLen = readVarint(nodeOut + offset + 1, nodeOut + nodeUsed, &count);
+  return 1 + varintLen + (size_t)count * DOMAIN_TRIE_EDGE_SIZE;
+}
+
+bool DomainTrieBuilder::growTable(uint32_t** table, uint32_t* mask, bool nodeEntries) {
+  uint32_t oldSize = *mask + 1;
+  uint32_t newSize = oldSize * 2;
+  uint32_t* newTable = (uint32_t*)calloc(newSize, sizeof(uint32_t));
+  if (!newTable) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < oldSize; i++) {
+    uint32_t entry = (*table)[i];
+    if (entry == 0) {
+      continue;
+    }
+    uint32_t offset = entry - 1;
+    uint32_t hash = nodeEntries
+      ? hashBytes(nodeOut + offset, nodeLength(offset))
+      : hashBytes(labelOut + offset + 1, labelOut[offset]);
+    uint32_t pos = hash & (newSize - 1);
+    while (newTable[pos] != 0) {
+      pos = (pos + 1) & (newSize - 1);
+    }
+    newTable[pos] = entry;
+  }
+
+  free(*table);
+  *table = newTable;
+  *mask = newSize - 1;
+  return true;
+}
@@ -0,0 +1,192 @@
+/*
+ * DomainTrie.h - ブロックリスト用の逆順ラベル DAFSA
+ *
+ * ドメイン名をラベル単位で逆順（com → example → ads）に並べた
+ * 最小化オートマトンを、ポインタを含まない単一のバイト配列に格納します。
+ * 共通サフィックス（.doubleclick.net や .com など）と同一の部分木は
+ * 一度だけ格納されます。
+ *
+ * バイト配列のレイアウト（数値はすべてリトルエンディアン）:
+ *
+ *   ヘッダー (DOMAIN_TRIE_HEADER_SIZE バイト)
+ *     u32 labelSize    ラベルセクションのバイト数
+ *     u32 nodeSize     ノードセクションのバイト数
+ *     u32 rootOffset   ルートノードのオフセット（ノードセクション内）
+ *     u32 domainCount  登録ドメイン数
+ *   ラベルセクション
+ *     [u8 長さ][ラベル文字列] の並び（重複なし、小文字）
+ *   ノードセクション
+ *     ノード = [u8 flags][varint 子の数][エッジ × 子の数]
+ *     flags  = bit 0: 登録済み、bit 1〜7: 登録済みのドメインが属するリストのビット
+ *              （0 はトライ全体の既定のリスト。1 つのリストから作ったトライは常に 0）
+ *     エッジ = [u24 ラベルオフセット][u24 子ノードオフセット]
+ *     エッジはラベル順（バイト比較、短い方が先）に整列済み
+ *
+ * コンパイル済みブロックリストファイル（/blocklist.bin）は上記バイト配列の前に
+ * 以下のファイルヘッダーを付けたもので、tools/compile_blocklist.py が生成します。
+ *
+ *   u8[4] magic        "MRBL"
+ *   u16   version      DOMAIN_TRIE_FILE_VERSION
+ *   u16   reserved     0
+ *   u32   payloadSize  バイト配列のサイズ
+ *   u32   crc32        バイト配列の CRC-32（IEEE 802.3）
+ */
+
+#ifndef DOMAIN_TRIE_H
+#define DOMAIN_TRIE_H
+
+#include <Arduino.h>
+
+#define DOMAIN_TRIE_HEADER_SIZE 16
+#define DOMAIN_TRIE_EDGE_SIZE 6
+#define DOMAIN_TRIE_FLAG_TERMINAL 0x01   // このノードまでのドメインが登録済み
+#define DOMAIN_TRIE_LIST_SHIFT 1         // flags のリストのビットの位置
+#define DOMAIN_TRIE_MAX_LISTS 7          // 1 つのトライに統合できるリスト数
+#define DOMAIN_TRIE_MAX_LABELS 32        // 1 ドメインあたりの最大ラベル数（構築時の再帰深さ上限）
+#define DOMAIN_TRIE_MAX_NAME_SIZE 256    // 列挙時に組み立てる名前のバッファ（253 文字 + 終端）
+
+// コンパイル済みファイル形式
+#define DOMAIN_TRIE_FILE_MAGIC "MRBL"
+#define DOMAIN_TRIE_FILE_MAGIC_SIZE 4
+#define DOMAIN_TRIE_FILE_HEADER_SIZE 16
+#define DOMAIN_TRIE_FILE_VERSION 1
+
+/**
+ * ファイルヘッダーを検証し、後続のバイト配列サイズと CRC を取り出す
+ */
+bool parseDomainTrieFileHeader(const uint8_t* header, uint32_t* payloadSize, uint32_t* crc);
+void writeDomainTrieFileHeader(uint8_t* header, uint32_t payloadSize, uint32_t crc);
+
+/**
+ * CRC-32（IEEE 802.3、反転多項式 0xEDB88320。gzip と同じ）
+ *
+ * 分割したデータは前回の戻り値を crc に渡して続けて計算できる。
+ */
+uint32_t domainTrieCrc32(const uint8_t* data, size_t len, uint32_t crc = 0);
+
+/**
+ * サフィックスハッシュ
+ *
+ * 末尾のラベルから 1 ラベルずつ連鎖させて計算します
+ * （h(com) = f(SEED, "com")、h(example.com) = f(h(com), "example")）。
+ * クエリ側とトライ列挙側で同じ値になるため、プレフィルタのキーに使用します。
+ */
+#define DOMAIN_SUFFIX_HASH_SEED 2166136261u
+uint32_t domainSuffixHash(uint32_t parentHash, const char* label, size_t len);
+uint32_t domainNameHash(const char* name, size_t len);  // ドット区切りの名前全体のサフィックスハッシュ
+
+/**
+ * DomainTrie クラス
+ *
+ * 構築済みバイト配列を参照して照合を行います。
+ * バイト配列の所有権を持ち、reset() またはデストラクタで解放します。
+ * 複数のリストを統合したトライでは、登録済みのノードごとに属するリストのビットを持ちます。
+ */
+class DomainTrie {
+public:
+  DomainTrie();
+  ~DomainTrie();
+
+  // 検証に成功した場合のみ所有権を取得（失敗時は元の配列のまま）。defaultLists はビットの無い登録のリスト
+  bool adopt(uint8_t* blob, size_t size, uint8_t defaultLists = 1);
+  static bool isValidBlob(const uint8_t* blob, size_t size);
+  static uint32_t getBlobDomainCount(const uint8_t* blob);  // 検証済みのバイト配列の登録ドメイン数
+  void reset();
+
+  bool isLoaded() const;
+  uint32_t root() const;
+  bool findChild(uint32_t node, const char* label, size_t len, uint32_t* child) const;
+  uint8_t flags(uint32_t node) const;
+  uint8_t lists(uint32_t node) const;      // 登録済みのノードが属するリストのビット（未登録は 0）
+
+  uint32_t getDomainCount() const;
+  size_t getSizeBytes() const;
+
+  uint8_t contains(const char* name, size_t len) const;  // 登録済みのドメインそのものなら属するリストのビット（無ければ 0）
+
+  // 登録済みドメインごとにサフィックスハッシュを通知する（深さは DOMAIN_TRIE_MAX_LABELS まで）
+  void forEachDomainHash(void (*callback)(uint32_t hash, void* context), void* context) const;
+  // 登録済みドメインの名前（ドット区切り、NUL 終端なし）と属するリストのビットを通知する
+  void forEachDomain(void (*callback)(const char* name, size_t len, uint8_t lists, void* context),
+                     void* context) const;
+
+private:
+  uint8_t* blob;
+  size_t blobSize;
+  const uint8_t* labels;
+  const uint8_t* nodes;
+  uint32_t labelSize;
+  uint32_t nodeSize;
+  uint32_t rootOffset;
+  uint32_t domainCount;
+  uint8_t defaultLists;
+
+  bool readNode(uint32_t node, uint32_t* count, const uint8_t** edges) const;
+
+  DomainTrie(const DomainTrie&) = delete;
+  DomainTrie& operator=(const DomainTrie&) = delete;
+};
+
+/**
+ * DomainTrieBuilder クラス
+ *
+ * ドメインを逆順ラベルのキーとして蓄積し、整列後に
+ * 部分木を共有しながら DomainTrie のバイト配列を生成します。
+ * 同じドメインを複数回追加した場合はリストのビットを合わせた 1 件になります。
+ * 構築用の作業領域は build() の完了時にすべて解放されます。
+ */
+class DomainTrieBuilder {
+public:
+  DomainTrieBuilder();
+  ~DomainTrieBuilder();
+
+  // 検証済みのドメインを追加（大文字は小文字にして格納）。lists は属するリストのビット（0: 付けない）
+  bool add(const char* domain, size_t len, uint8_t lists = 0);
+  uint8_t* build(size_t* outSize);           // 成功時は malloc された配列を返す
+  void clear();
+
+  uint32_t getKeyCount() const;
+  size_t getPeakBytes() const;               // 構築中の作業メモリ最大値（出力配列を含む）
+
+private:
+  // キー（逆順ラベルを区切り文字 0x01 で連結し NUL 終端、直後にリストのビット 1 バイト）
+  char* pool;
+  size_t poolUsed;
+  size_t poolCapacity;
+  uint32_t* keys;
+  uint32_t keyCount;
+  size_t keyCapacity;
+
+  // 構築用作業領域
+  uint8_t* labelOut;
+  size_t labelUsed;
+  size_t labelCapacity;
+  uint8_t* nodeOut;
+  size_t nodeUsed;
+  size_t nodeCapacity;
+  uint32_t* edgeStack;              // (ラベルオフセット, 子ノードオフセット) の組
+  size_t edgeStackUsed;
+  size_t edgeStackCapacity;
+  uint32_t* labelTable;             // ラベル重複排除用ハッシュ表（オフセット + 1）
+  uint32_t labelTableMask;
+  uint32_t labelTableCount;
+  uint32_t* nodeTable;              // ノード重複排除（部分木の共有）用ハッシュ表
+  uint32_t nodeTableMask;
+  uint32_t nodeTableCount;
+  uint32_t terminalCount;
+  size_t peakBytes;
+  bool failed;
+
+  bool emitNode(uint32_t lo, uint32_t hi, size_t prefixLen, uint32_t* outOffset);
+  uint32_t internLabel(const char* label, size_t len);
+  uint32_t dedupeNode(size_t start);
+  size_t nodeLength(uint32_t offset) const;
+  bool growTable(uint32_t** table, uint32_t* mask, bool nodes);
+  void releaseWork();
+  void updatePeak(size_t extra);
+
+  DomainTrieBuilder(const DomainTrieBuilder&) = delete;
+  DomainTrieBuilder& operator=(const DomainTrieBuilder&) = delete;
+};
+
+#endif // DOMAIN_TRIE_H
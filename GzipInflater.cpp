@@ -0,0 +1,592 @@
+/*
+ * GzipInflater.cpp - gzip の逐次展開の実装
+ */
+
+#include "GzipInflater.h"
+#include "DomainTrie.h"
+
+#define WINDOW_MASK (GZIP_WINDOW_SIZE - 1)
+
+// gzip ヘッダー（RFC 1952）
+#define GZIP_ID1 0x1F
+#define GZIP_ID2 0x8B
+#define GZIP_METHOD_DEFLATE 8
+#define GZIP_FLAG_HCRC 0x02
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+#define GZIP_FLAG_RESERVED 0xE0
+
+enum GzipStage : uint8_t {
+  STAGE_HEADER = 0,
+  STAGE_OPTIONAL_HEADER,
+  STAGE_BLOCK_HEADER,
+  STAGE_STORED,
+  STAGE_CODES,
+  STAGE_TRAILER,
+  STAGE_DONE,
+  STAGE_ERROR
+};
+
+// 長さ符号 257〜285 と距離符号 0〜29 の基数と追加ビット数
+static const uint16_t LENGTH_BASE[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t LENGTH_EXTRA[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DISTANCE_BASE[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DISTANCE_EXTRA[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// 符号長の符号の並び順
+static const uint8_t CODE_LENGTH_ORDER[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+GzipInflater::GzipInflater()
+  : work(nullptr),
+    stage(STAGE_HEADER),
+    flags(0),
+    extraLengthKnown(false),
+    lastBlock(false),
+    error(nullptr),
+    inputUsed(0),
+    inputPos(0),
+    bitBuffer(0),
+    bitCount(0),
+    underflow(false),
+    remaining(0),
+    windowPos(0),
+    flushedPos(0),
+    outputSize(0),
+    crc(0),
+    sink(nullptr),
+    sinkContext(nullptr) {
+}
+
+GzipInflater::~GzipInflater() {
+  end();
+}
+
+bool GzipInflater::begin() {
+  end();
+  stage = STAGE_HEADER;
+  flags = 0;
+  extraLengthKnown = false;
+  lastBlock = false;
+  error = nullptr;
+  inputUsed = 0;
+  inputPos = 0;
+  bitBuffer = 0;
+  bitCount = 0;
+  remaining = 0;
+  windowPos = 0;
+  flushedPos = 0;
+  outputSize = 0;
+  crc = 0;
+
+  work = (Workspace*)malloc(sizeof(Workspace));
+  if (!work) {
+    fail("展開用のメモリ割り当てに失敗しました");
+    return false;
+  }
+  return true;
+}
+
+void GzipInflater::end() {
+  free(work);
+  work = nullptr;
+}
+
+void GzipInflater::fail(const char* reason) {
+  if (stage != STAGE_ERROR) {
+    stage = STAGE_ERROR;
+    error = reason;
+  }
+}
+
+bool GzipInflater::feed(const uint8_t* data, size_t len, Sink callback, void* context) {
+  if (stage == STAGE_ERROR || !work) {
+    return false;
+  }
+  sink = callback;
+  sinkContext = context;
+
+  while (len > 0 && stage != STAGE_DONE) {
+    // 処理済みの入力を詰めてから追加する
+    if (inputPos > 0) {
+      memmove(work->input, work->input + inputPos, inputUsed - inputPos);
+      inputUsed -= inputPos;
+      inputPos = 0;
+    }
+    size_t take = GZIP_INPUT_BUFFER_SIZE - inputUsed;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(work->input + inputUsed, data, take);
+    inputUsed += take;
+    data += take;
+    len -= take;
+
+    // 入力が尽きるまで 1 記号ずつ処理（尽きた記号は先頭に戻して次の入力を待つ）
+    while (stage != STAGE_DONE && stage != STAGE_ERROR) {
+      size_t savedPos = inputPos;
+      uint32_t savedBuffer = bitBuffer;
+      uint8_t savedCount = bitCount;
+      underflow = false;
+      if (!step()) {
+        break;
+      }
+      if (underflow) {
+        inputPos = savedPos;
+        bitBuffer = savedBuffer;
+        bitCount = savedCount;
+        break;
+      }
+    }
+    if (stage != STAGE_ERROR) {
+      flush();
+    }
+    if (stage == STAGE_ERROR) {
+      return false;
+    }
+  }
+  return true;  // STAGE_DONE 以降の余分な入力は無視する
+}
+
+bool GzipInflater::finish() {
+  bool done = stage == STAGE_DONE;
+  if (stage != STAGE_ERROR && !done) {
+    fail("gzip データが途中で終わっています");
+  }
+  end();
+  return done;
+}
+
+const char* GzipInflater::getError() const {
+  return error;
+}
+
+uint32_t GzipInflater::getOutputSize() const {
+  return outputSize;
+}
+
+size_t GzipInflater::getWorkspaceBytes() {
+  return sizeof(Workspace);
+}
+
+/**
+ * 下位ビットから count ビット（16 以下）を読む。入力が足りなければ underflow を立てて 0 を返す
+ */
+uint32_t GzipInflater::bits(uint8_t count) {
+  while (bitCount < count) {
+    if (inputPos >= inputUsed) {
+      underflow = true;
+      return 0;
+    }
+    bitBuffer |= (uint32_t)work->input[inputPos++] << bitCount;
+    bitCount += 8;
+  }
+  uint32_t value = bitBuffer & ((1u << count) - 1);
+  bitBuffer >>= count;
+  bitCount -= count;
+  return value;
+}
+
+/**
+ * 正規ハフマン符号を 1 ビットずつ辿って記号を返す（-1: 入力不足, -2: 不正な符号）
+ *
+ * 最長の符号（15 ビット）以上を先にビットバッファへ読み込み、バッファの写しの上で辿る。
+ */
+int GzipInflater::decode(const Huffman& table) {
+  while (bitCount <= 24 && inputPos < inputUsed) {
+    bitBuffer |= (uint32_t)work->input[inputPos++] << bitCount;
+    bitCount += 8;
+  }
+
+  uint32_t buffer = bitBuffer;
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  int len = 1;
+  for (; len < 16 && len <= bitCount; len++) {
+    code |= buffer & 1;
+    buffer >>= 1;
+    int count = table.counts[len];
+    if (code - first < count) {
+      bitBuffer >>= len;
+      bitCount -= len;
+      return table.symbols[index + code - first];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  if (len < 16) {
+    underflow = true;
+    return -1;
+  }
+  return -2;
+}
+
+void GzipInflater::buildHuffman(Huffman& table, const uint8_t* lengths, uint16_t count) {
+  uint16_t offsets[16];
+  memset(table.counts, 0, sizeof(table.counts));
+  for (uint16_t i = 0; i < count; i++) {
+    table.counts[lengths[i]]++;
+  }
+  table.counts[0] = 0;
+
+  offsets[1] = 0;
+  for (int len = 1; len < 15; len++) {
+    offsets[len + 1] = offsets[len] + table.counts[len];
+  }
+  for (uint16_t i = 0; i < count; i++) {
+    if (lengths[i] != 0) {
+      table.symbols[offsets[lengths[i]]++] = i;
+    }
+  }
+}
+
+void GzipInflater::put(uint8_t value) {
+  work->window[windowPos++] = value;
+  outputSize++;
+  if (windowPos == GZIP_WINDOW_SIZE) {
+    flush();
+    windowPos = 0;
+    flushedPos = 0;
+  }
+}
+
+/**
+ * 窓に溜まった未出力の展開結果を sink に渡す
+ */
+void GzipInflater::flush() {
+  if (windowPos == flushedPos || stage == STAGE_ERROR) {
+    return;
+  }
+  const uint8_t* data = work->window + flushedPos;
+  size_t len = windowPos - flushedPos;
+  flushedPos = windowPos;
+  crc = domainTrieCrc32(data, len, crc);
+  if (!sink(data, len, sinkContext)) {
+    fail(nullptr);
+  }
+}
+
+/**
+ * 現在の段階を 1 単位進める（false: 形式エラー）
+ */
+bool GzipInflater::step() {
+  switch (stage) {
+    case STAGE_HEADER:
+      return readHeader();
+    case STAGE_OPTIONAL_HEADER:
+      return readOptionalHeader();
+    case STAGE_BLOCK_HEADER:
+      return readBlockHeader();
+    case STAGE_STORED:
+      return readStored();
+    case STAGE_CODES:
+      return readCodes();
+    case STAGE_TRAILER:
+      return readTrailer();
+    default:
+      return false;
+  }
+}
+
+bool GzipInflater::readHeader() {
+  uint32_t id1 = bits(8);
+  uint32_t id2 = bits(8);
+  uint32_t method = bits(8);
+  uint32_t headerFlags = bits(8);
+  bits(16);  // MTIME
+  bits(16);
+  bits(16);  // XFL, OS
+  if (underflow) {
+    return true;
+  }
+  if (id1 != GZIP_ID1 || id2 != GZIP_ID2) {
+    fail("gzip 形式ではありません");
+    return false;
+  }
+  if (method != GZIP_METHOD_DEFLATE || (headerFlags & GZIP_FLAG_RESERVED)) {
+    fail("未対応の gzip 形式です");
+    return false;
+  }
+  flags = headerFlags & (GZIP_FLAG_HCRC | GZIP_FLAG_EXTRA | GZIP_FLAG_NAME | GZIP_FLAG_COMMENT);
+  stage = STAGE_OPTIONAL_HEADER;
+  return true;
+}
+
+/**
+ * 拡張フィールド・ファイル名・コメント・ヘッダー CRC を 1 バイトずつ読み飛ばす
+ */
+bool GzipInflater::readOptionalHeader() {
+  if (flags & GZIP_FLAG_EXTRA) {
+    if (!extraLengthKnown) {
+      uint32_t length = bits(16);
+      if (!underflow) {
+        remaining = length;
+        extraLengthKnown = true;
+      }
+    } else if (remaining > 0) {
+      bits(8);
+      if (!underflow) {
+        remaining--;
+      }
+    } else {
+      flags &= ~GZIP_FLAG_EXTRA;
+    }
+  } else if (flags & (GZIP_FLAG_NAME | GZIP_FLAG_COMMENT)) {
+    uint32_t c = bits(8);
+    if (!underflow && c == 0) {
+      flags &= (flags & GZIP_FLAG_NAME) ? ~GZIP_FLAG_NAME : ~GZIP_FLAG_COMMENT;
+    }
+  } else if (flags & GZIP_FLAG_HCRC) {
+    bits(16);
+    if (!underflow) {
+      flags &= ~GZIP_FLAG_HCRC;
+    }
+  } else {
+    stage = STAGE_BLOCK_HEADER;
+  }
+  return true;
+}
+
+bool GzipInflater::readBlockHeader() {
+  uint32_t final = bits(1);
+  uint32_t type = bits(2);
+  if (underflow) {
+    return true;
+  }
+
+  switch (type) {
+    case 0: {
+      // 格納ブロック: バイト境界に揃えて長さを読む
+      bitBuffer >>= bitCount & 7;
+      bitCount -= bitCount & 7;
+      uint32_t length = bits(16);
+      uint32_t inverted = bits(16);
+      if (underflow) {
+        return true;
+      }
+      if ((length ^ 0xFFFF) != inverted) {
+        fail("gzip データが破損しています（格納ブロックの長さ）");
+        return false;
+      }
+      remaining = length;
+      stage = STAGE_STORED;
+      break;
+    }
+    case 1: {
+      // 固定ハフマン符号
+      uint8_t* lengths = work->lengths;
+      memset(lengths, 8, 144);
+      memset(lengths + 144, 9, 112);
+      memset(lengths + 256, 7, 24);
+      memset(lengths + 280, 8, 8);
+      buildHuffman(work->literals, lengths, 288);
+      memset(lengths, 5, 30);
+      buildHuffman(work->distances, lengths, 30);
+      stage = STAGE_CODES;
+      break;
+    }
+    case 2:
+      if (!readDynamicTables()) {
+        return false;
+      }
+      if (underflow) {
+        return true;
+      }
+      stage = STAGE_CODES;
+      break;
+    default:
+      fail("gzip データが破損しています（ブロック種別）");
+      return false;
+  }
+  lastBlock = final;
+  return true;
+}
+
+/**
+ * 動的ハフマン符号の表を読む（途中で入力が尽きた場合はブロックヘッダーから読み直す）
+ */
+bool GzipInflater::readDynamicTables() {
+  uint16_t literalCount = bits(5) + 257;
+  uint16_t distanceCount = bits(5) + 1;
+  uint8_t codeLengthCount = bits(4) + 4;
+  if (underflow) {
+    return true;
+  }
+  if (literalCount > 286 || distanceCount > 30) {
+    fail("gzip データが破損しています（符号数）");
+    return false;
+  }
+
+  // 符号長を符号化するための表（距離の表を一時的に使う）
+  uint8_t* lengths = work->lengths;
+  memset(lengths, 0, 19);
+  for (uint8_t i = 0; i < codeLengthCount; i++) {
+    lengths[CODE_LENGTH_ORDER[i]] = bits(3);
+  }
+  if (underflow) {
+    return true;
+  }
+  buildHuffman(work->distances, lengths, 19);
+
+  uint16_t total = literalCount + distanceCount;
+  uint16_t count = 0;
+  while (count < total) {
+    int symbol = decode(work->distances);
+    if (symbol == -1) {
+      return true;
+    }
+    if (symbol < 0) {
+      fail("gzip データが破損しています（符号長）");
+      return false;
+    }
+    if (symbol < 16) {
+      lengths[count++] = symbol;
+      continue;
+    }
+
+    uint8_t value = 0;
+    uint16_t repeat;
+    if (symbol == 16) {
+      if (count == 0) {
+        fail("gzip データが破損しています（符号長）");
+        return false;
+      }
+      value = lengths[count - 1];
+      repeat = 3 + bits(2);
+    } else if (symbol == 17) {
+      repeat = 3 + bits(3);
+    } else {
+      repeat = 11 + bits(7);
+    }
+    if (underflow) {
+      return true;
+    }
+    if (count + repeat > total) {
+      fail("gzip データが破損しています（符号長）");
+      return false;
+    }
+    memset(lengths + count, value, repeat);
+    count += repeat;
+  }
+
+  buildHuffman(work->literals, lengths, literalCount);
+  buildHuffman(work->distances, lengths + literalCount, distanceCount);
+  return true;
+}
+
+bool GzipInflater::readStored() {
+  if (remaining == 0) {
+    stage = lastBlock ? STAGE_TRAILER : STAGE_BLOCK_HEADER;
+    return true;
+  }
+
+  // 符号の読み取りで先読みしたバイトが残っていれば先に出力する
+  if (bitCount >= 8) {
+    put(bits(8));
+    remaining--;
+    return stage != STAGE_ERROR;
+  }
+
+  // バイト境界に揃っているため、入力をそのまま窓に写す
+  size_t available = inputUsed - inputPos;
+  if (available == 0) {
+    underflow = true;
+    return true;
+  }
+  if (available > remaining) {
+    available = remaining;
+  }
+  for (size_t i = 0; i < available; i++) {
+    put(work->input[inputPos + i]);
+  }
+  inputPos += available;
+  remaining -= available;
+  return stage != STAGE_ERROR;
+}
+
+/**
+ * リテラル 1 個、または長さと距離の組 1 個を展開する
+ */
+bool GzipInflater::readCodes() {
+  int symbol = decode(work->literals);
+  if (symbol == -1) {
+    return true;
+  }
+  if (symbol < 0 || symbol > 285) {
+    fail("gzip データが破損しています（リテラル符号）");
+    return false;
+  }
+  if (symbol < 256) {
+    put(symbol);
+    return stage != STAGE_ERROR;
+  }
+  if (symbol == 256) {
+    stage = lastBlock ? STAGE_TRAILER : STAGE_BLOCK_HEADER;
+    return true;
+  }
+
+  symbol -= 257;
+  uint32_t length = LENGTH_BASE[symbol] + bits(LENGTH_EXTRA[symbol]);
+  int distanceSymbol = decode(work->distances);
+  if (underflow) {
+    return true;
+  }
+  if (distanceSymbol < 0 || distanceSymbol >= 30) {
+    fail("gzip データが破損しています（距離符号）");
+    return false;
+  }
+  uint32_t distance = DISTANCE_BASE[distanceSymbol] + bits(DISTANCE_EXTRA[distanceSymbol]);
+  if (underflow) {
+    return true;
+  }
+  if (distance > outputSize) {
+    fail("gzip データが破損しています（参照距離）");
+    return false;
+  }
+
+  // 窓の中の過去の出力を複製する（重なっていても 1 バイトずつなら正しく展開される）
+  uint32_t source = (windowPos - distance) & WINDOW_MASK;
+  for (uint32_t i = 0; i < length; i++) {
+    put(work->window[source]);
+    source = (source + 1) & WINDOW_MASK;
+  }
+  return stage != STAGE_ERROR;
+}
+
+bool GzipInflater::readTrailer() {
+  bitBuffer >>= bitCount & 7;
+  bitCount -= bitCount & 7;
+  uint32_t expectedCrc = bits(16);
+  expectedCrc |= bits(16) << 16;
+  uint32_t expectedSize = bits(16);
+  expectedSize |= bits(16) << 16;
+  if (underflow) {
+    return true;
+  }
+
+  flush();  // 検証前に残りを出力して CRC を確定する
+  if (stage == STAGE_ERROR) {
+    return false;
+  }
+  if (expectedCrc != crc || expectedSize != outputSize) {
+    fail("gzip データが破損しています（CRC 不一致）");
+    return false;
+  }
+  stage = STAGE_DONE;
+  return true;
+}
@@ -0,0 +1,99 @@
+/*
+ * GzipInflater.h - gzip（RFC 1952 / deflate RFC 1951）の逐次展開
+ *
+ * 任意の大きさに区切られた圧縮データを順に受け取り、展開したバイト列を
+ * コールバックに渡します。展開中は 32 KB のスライド窓と入力バッファ・符号表を
+ * 1 回だけ確保し、展開後のデータ全体をメモリに置くことはありません。
+ *
+ * - 符号は 1 記号（リテラル、または長さ + 距離）単位で処理し、途中で入力が
+ *   尽きた場合は記号の先頭まで戻して次の入力を待つ
+ * - 末尾の CRC-32 と展開後サイズを検証する
+ */
+
+#ifndef GZIP_INFLATER_H
+#define GZIP_INFLATER_H
+
+#include <Arduino.h>
+
+#define GZIP_WINDOW_SIZE 32768        // deflate の参照距離の上限（2 のべき乗）
+#define GZIP_INPUT_BUFFER_SIZE 1024   // 入力の持ち越し（動的ハフマン表のヘッダー全体が収まる大きさ）
+
+/**
+ * GzipInflater クラス
+ *
+ * begin() → feed() × n → finish() の順に呼びます。
+ * sink が false を返すと展開を中止し、以降の feed() は false を返します。
+ */
+class GzipInflater {
+public:
+  typedef bool (*Sink)(const uint8_t* data, size_t len, void* context);
+
+  GzipInflater();
+  ~GzipInflater();
+
+  bool begin();                                               // 作業領域を確保する
+  bool feed(const uint8_t* data, size_t len, Sink sink, void* context);
+  bool finish();                                              // 末尾まで展開・検証できたか（作業領域を解放）
+  void end();                                                 // 作業領域を解放する
+
+  const char* getError() const;                               // 失敗の理由（sink の失敗は nullptr）
+  uint32_t getOutputSize() const;
+  static size_t getWorkspaceBytes();
+
+private:
+  struct Huffman {
+    uint16_t counts[16];        // 符号長ごとの符号数
+    uint16_t symbols[288];      // 符号順の記号
+  };
+  struct Workspace {
+    uint8_t window[GZIP_WINDOW_SIZE];
+    uint8_t input[GZIP_INPUT_BUFFER_SIZE];
+    uint8_t lengths[288 + 32];  // 動的ハフマン表の符号長
+    Huffman literals;
+    Huffman distances;
+  };
+
+  Workspace* work;
+  uint8_t stage;
+  uint8_t flags;                // gzip ヘッダーの未処理の任意フィールド
+  bool extraLengthKnown;
+  bool lastBlock;
+  const char* error;
+
+  size_t inputUsed;
+  size_t inputPos;
+  uint32_t bitBuffer;
+  uint8_t bitCount;
+  bool underflow;               // 処理中の記号の途中で入力が尽きた
+
+  uint32_t remaining;           // 格納ブロック・拡張フィールドの残りバイト数
+  uint32_t windowPos;
+  uint32_t flushedPos;
+  uint32_t outputSize;
+  uint32_t crc;
+
+  Sink sink;
+  void* sinkContext;
+
+  uint32_t bits(uint8_t count);
+  int decode(const Huffman& table);
+  void put(uint8_t value);
+  void flush();
+  void fail(const char* reason);
+
+  bool step();
+  bool readHeader();
+  bool readOptionalHeader();
+  bool readBlockHeader();
+  bool readDynamicTables();
+  bool readStored();
+  bool readCodes();
+  bool readTrailer();
+
+  static void buildHuffman(Huffman& table, const uint8_t* lengths, uint16_t count);
+
+  GzipInflater(const GzipInflater&) = delete;
+  GzipInflater& operator=(const GzipInflater&) = delete;
+};
+
+#endif // GZIP_INFLATER_H
@@ -0,0 +1,294 @@
+/*
+ * Logger.cpp - 非同期ログ出力の実装
+ */
+
+#include "Logger.h"
+
+static const char LEVEL_CHARS[] = {'-', 'E', 'W', 'I', 'D'};
+
+Logger::Logger()
+  : head(0),
+    tail(0),
+    runtimeLevel(LOG_LEVEL_INFO),
+    async(false),
+    dropped(0),
+    written(0),
+    lineLength(0),
+    lineSent(0) {
+#ifdef ARDUINO_ARCH_ESP32
+  lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+}
+
+void Logger::lockRing() {
+#ifdef ARDUINO_ARCH_ESP32
+  portENTER_CRITICAL(&lock);
+#else
+  lock.lock();
+#endif
+}
+
+void Logger::unlockRing() {
+#ifdef ARDUINO_ARCH_ESP32
+  portEXIT_CRITICAL(&lock);
+#else
+  lock.unlock();
+#endif
+}
+
+void Logger::setLevel(uint8_t level) {
+  runtimeLevel = level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level;
+}
+
+uint8_t Logger::getLevel() const {
+  return runtimeLevel;
+}
+
+/**
+ * 非同期出力の切り替え（無効にする場合は溜まっているレコードを先に出力する）
+ */
+void Logger::setAsync(bool enable) {
+  if (!enable) {
+    flush();
+  }
+  async = enable;
+}
+
+const char* Logger::getLevelName(uint8_t level) {
+  switch (level) {
+    case LOG_LEVEL_NONE:
+      return "なし";
+    case LOG_LEVEL_ERROR:
+      return "エラー";
+    case LOG_LEVEL_WARN:
+      return "警告";
+    case LOG_LEVEL_INFO:
+      return "情報";
+    case LOG_LEVEL_DEBUG:
+      return "デバッグ（クエリごと）";
+    default:
+      return "不明";
+  }
+}
+
+void Logger::addArg(LogRecord& record, LogArgType type, uint32_t value) {
+  if (record.argCount >= LOG_MAX_ARGS) {
+    return;
+  }
+  record.args[record.argCount] = value;
+  record.argTypes[record.argCount] = type;
+  record.argCount++;
+}
+
+/**
+ * 文字列引数をレコード内にコピーする（領域が足りなければ切り詰める）
+ */
+void Logger::addText(LogRecord& record, const char* text) {
+  if (record.argCount >= LOG_MAX_ARGS) {
+    return;
+  }
+  size_t offset = record.textLength < LOG_TEXT_SIZE ? record.textLength : LOG_TEXT_SIZE - 1;
+  size_t room = LOG_TEXT_SIZE - offset - 1;
+  size_t length = 0;
+  if (text) {
+    while (length < room && text[length] != '\0') {
+      length++;
+    }
+    memcpy(record.text + offset, text, length);
+  }
+  record.text[offset + length] = '\0';
+  record.textLength = offset + length + 1;
+  addArg(record, LOG_ARG_TEXT, offset);
+}
+
+/**
+ * レコードをリングバッファに積む（満杯なら破棄）
+ *
+ * 同期モードでは呼び出し元で整形して出力する。
+ */
+void Logger::enqueue(const LogRecord& record) {
+  if (!async) {
+    char text[LOG_LINE_SIZE];
+    size_t length = formatRecord(record, text, sizeof(text));
+    Serial.write((const uint8_t*)text, length);
+    written++;
+    return;
+  }
+
+  lockRing();
+  bool full = head - tail >= LOG_RING_SIZE;
+  if (!full) {
+    ring[head & (LOG_RING_SIZE - 1)] = record;
+    head++;
+  }
+  unlockRing();
+
+  if (full) {
+    dropped++;
+  } else {
+    written++;
+  }
+}
+
+bool Logger::pop(LogRecord* record) {
+  lockRing();
+  bool available = tail != head;
+  if (available) {
+    *record = ring[tail & (LOG_RING_SIZE - 1)];
+    tail++;
+  }
+  unlockRing();
+  return available;
+}
+
+/**
+ * 溜まっているレコードを整形して出力する
+ *
+ * シリアルの送信バッファに入る分だけ書き込み、待ちは発生させない。
+ * 出力しきれなかった行は次回の呼び出しで続きを送る。
+ */
+uint16_t Logger::process(uint16_t maxRecords) {
+  uint16_t records = 0;
+  while (true) {
+    if (lineSent < lineLength) {
+      int room = Serial.availableForWrite();
+      if (room <= 0) {
+        break;
+      }
+      size_t chunk = lineLength - lineSent;
+      if (chunk > (size_t)room) {
+        chunk = room;
+      }
+      Serial.write((const uint8_t*)line + lineSent, chunk);
+      lineSent += chunk;
+      continue;
+    }
+
+    LogRecord record;
+    if (records >= maxRecords || !pop(&record)) {
+      break;
+    }
+    lineLength = formatRecord(record, line, sizeof(line));
+    lineSent = 0;
+    records++;
+  }
+  return records;
+}
+
+/**
+ * process() が送りきれなかった行の残りを送る
+ *
+ * loop() で Serial に直接書く処理（Web サーバーのハンドラ、定期ステータス表示）の前に呼ぶ。
+ * 待つのは分割された 1 行の残りの分だけ。
+ */
+void Logger::finishLine() {
+  if (lineSent < lineLength) {
+    Serial.write((const uint8_t*)line + lineSent, lineLength - lineSent);
+    lineSent = lineLength;
+  }
+}
+
+void Logger::flush() {
+  finishLine();
+  LogRecord record;
+  while (pop(&record)) {
+    lineLength = formatRecord(record, line, sizeof(line));
+    Serial.write((const uint8_t*)line, lineLength);
+    lineSent = lineLength;
+  }
+}
+
+uint32_t Logger::getDropped() const {
+  return dropped;
+}
+
+uint32_t Logger::getWritten() const {
+  return written;
+}
+
+uint16_t Logger::getQueued() {
+  lockRing();
+  uint16_t queued = head - tail;
+  unlockRing();
+  return queued;
+}
+
+/**
+ * レコードを 1 行に整形する（"12.345 I タグ: メッセージ\n"）
+ *
+ * 書式指定子ごとに次の引数を取り出し、型に合わせて snprintf に渡す。
+ * 長さ修飾子（l, h, z）は無視する（引数はすべて 32 ビットで保存されている）。
+ */
+size_t Logger::formatRecord(const LogRecord& record, char* out, size_t size) {
+  size_t pos = snprintf(out, size, "%lu.%03lu %c %s: ",
+                        (unsigned long)(record.timeMs / 1000), (unsigned long)(record.timeMs % 1000),
+                        LEVEL_CHARS[record.level <= LOG_LEVEL_DEBUG ? record.level : 0], record.tag);
+  uint8_t argIndex = 0;
+  const char* p = record.format;
+
+  while (*p && pos < size - 2) {
+    if (*p != '%') {
+      out[pos++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      out[pos++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // 書式指定子を取り出す（長さ修飾子は除く）
+    char spec[16];
+    size_t specLength = 0;
+    spec[specLength++] = *p++;
+    while (*p && strchr("-+ #0123456789.", *p) && specLength < sizeof(spec) - 2) {
+      spec[specLength++] = *p++;
+    }
+    while (*p == 'l' || *p == 'h' || *p == 'z') {
+      p++;
+    }
+    char conversion = *p ? *p++ : 's';
+
+    if (argIndex >= record.argCount) {
+      out[pos++] = '?';
+      continue;
+    }
+    uint32_t value = record.args[argIndex];
+    LogArgType type = (LogArgType)record.argTypes[argIndex];
+    argIndex++;
+
+    int n = 0;
+    if (type == LOG_ARG_TEXT || type == LOG_ARG_IPV4) {
+      char address[16];
+      const char* text = record.text + value;
+      if (type == LOG_ARG_IPV4) {
+        snprintf(address, sizeof(address), "%u.%u.%u.%u",
+                 (unsigned)(value & 0xFF), (unsigned)((value >> 8) & 0xFF),
+                 (unsigned)((value >> 16) & 0xFF), (unsigned)(value >> 24));
+        text = address;
+      }
+      spec[specLength++] = 's';
+      spec[specLength] = '\0';
+      n = snprintf(out + pos, size - pos, spec, text);
+    } else if (conversion == 'd' || conversion == 'i' || conversion == 'c' ||
+               (conversion == 's' && type == LOG_ARG_INT)) {
+      spec[specLength++] = conversion == 's' ? 'd' : conversion;
+      spec[specLength] = '\0';
+      n = snprintf(out + pos, size - pos, spec, (int)(int32_t)value);
+    } else {
+      spec[specLength++] = (conversion == 'x' || conversion == 'X') ? conversion : 'u';
+      spec[specLength] = '\0';
+      n = snprintf(out + pos, size - pos, spec, (unsigned)value);
+    }
+    if (n > 0) {
+      pos += n;
+      if (pos > size - 2) {
+        pos = size - 2;
+      }
+    }
+  }
+
+  out[pos++] = '\n';
+  out[pos] = '\0';
+  return pos;
+}
@@ -0,0 +1,169 @@
+/*
+ * Logger.h - 非同期ログ出力
+ *
+ * ログは書式文字列のポインタと引数をそのまま固定長のレコードとしてリングバッファに積み、
+ * 整形とシリアル出力は loop() の空き時間に process() でまとめて行います。
+ * DNS クエリ処理などのホットパスでは printf の整形も 115200 baud の送信待ちも発生しません。
+ *
+ * - LOG_COMPILE_LEVEL より詳細なログはコンパイル時に除去（引数も評価されない）
+ * - 実行時のレベルは setLevel() で変更（Web UI から設定）
+ * - リングバッファが満杯の場合は破棄し、破棄数を数える
+ * - 送信バッファの空きに合わせて行を分割して送るため、loop() で Serial に直接書く前に
+ *   finishLine() で出力途中の行を送り終える（行の途中に他の出力が割り込まないように）
+ *
+ * 書式は printf と同じ（%d %u %x %c %s、幅・精度指定可）。%s には文字列・String・IPAddress を渡せます。
+ * 文字列引数はレコード内に LOG_TEXT_SIZE バイトまでコピーされ、超えた分は切り詰められます。
+ * 書式文字列とタグは静的な文字列（リテラル）でなければなりません。
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+#include <atomic>
+#include <type_traits>
+#ifndef ARDUINO_ARCH_ESP32
+#include <mutex>
+#endif
+
+// ===== ログレベル =====
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// これより詳細なレベルのログ呼び出しはコンパイル時に除去される（ビルドフラグで上書き可）
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// ===== レコード定数 =====
+#define LOG_RING_SIZE 64          // リングバッファのレコード数（2 のべき乗）
+#define LOG_MAX_ARGS 6            // 1 レコードの引数の最大数
+#define LOG_TEXT_SIZE 64          // 文字列引数をコピーする領域（全引数の合計）
+#define LOG_LINE_SIZE 224         // 整形後の 1 行の最大長
+
+enum LogArgType : uint8_t {
+  LOG_ARG_INT = 0,
+  LOG_ARG_UINT,
+  LOG_ARG_TEXT,                   // args は text 内のオフセット
+  LOG_ARG_IPV4
+};
+
+// ===== 固定長のログレコード =====
+struct LogRecord {
+  uint32_t timeMs;                // 記録時刻（millis）
+  const char* tag;                // モジュール名
+  const char* format;             // 書式文字列（整形は出力時）
+  uint32_t args[LOG_MAX_ARGS];
+  uint8_t argTypes[LOG_MAX_ARGS];
+  uint8_t level;
+  uint8_t argCount;
+  uint8_t textLength;             // text の使用バイト数
+  char text[LOG_TEXT_SIZE];       // 文字列引数（NUL 区切り）
+};
+
+/**
+ * Logger クラス
+ *
+ * write() は複数のタスク（DNS タスク、loop()、WiFi イベント）から呼ばれるため、
+ * レコードのコピーのみを短いクリティカルセクションで保護します。
+ * process() / flush() は loop() からのみ呼びます。
+ */
+class Logger {
+public:
+  Logger();
+
+  // ===== 設定 =====
+  void setLevel(uint8_t level);           // LOG_LEVEL_NONE〜LOG_LEVEL_DEBUG
+  uint8_t getLevel() const;
+  bool isEnabled(uint8_t level) const {
+    return level <= runtimeLevel.load(std::memory_order_relaxed);
+  }
+  void setAsync(bool enable);             // false: 呼び出し元で即座に出力（setup() 中）
+  static const char* getLevelName(uint8_t level);
+
+  // ===== 記録 =====
+  template <typename... Args>
+  void write(uint8_t level, const char* tag, const char* format, const Args&... args) {
+    LogRecord record;
+    record.timeMs = millis();
+    record.tag = tag;
+    record.format = format;
+    record.level = level;
+    record.argCount = 0;
+    record.textLength = 0;
+    int expand[] = {0, (capture(record, args), 0)...};
+    (void)expand;
+    enqueue(record);
+  }
+
+  // ===== 出力（loop() から呼ぶ） =====
+  uint16_t process(uint16_t maxRecords);  // シリアルの送信バッファに空きがある分だけ出力
+  void finishLine();                      // 出力途中の行の残りを送る（送信待ちあり、最大 1 行）
+  void flush();                           // 残りをすべて出力（送信待ちあり）
+
+  // ===== 統計 =====
+  uint32_t getDropped() const;
+  uint32_t getWritten() const;
+  uint16_t getQueued();
+
+private:
+  LogRecord ring[LOG_RING_SIZE];
+  uint32_t head;                  // 次に書き込む位置
+  uint32_t tail;                  // 次に出力する位置
+  std::atomic<uint8_t> runtimeLevel;
+  std::atomic<bool> async;
+  std::atomic<uint32_t> dropped;
+  std::atomic<uint32_t> written;
+
+  // 出力途中の行（送信バッファの空きに合わせて分割送信）
+  char line[LOG_LINE_SIZE];
+  size_t lineLength;
+  size_t lineSent;
+
+#ifdef ARDUINO_ARCH_ESP32
+  portMUX_TYPE lock;
+#else
+  std::mutex lock;
+#endif
+  void lockRing();
+  void unlockRing();
+
+  void enqueue(const LogRecord& record);
+  bool pop(LogRecord* record);
+  static size_t formatRecord(const LogRecord& record, char* out, size_t size);
+  static void addArg(LogRecord& record, LogArgType type, uint32_t value);
+  static void addText(LogRecord& record, const char* text);
+
+  template <typename T>
+  static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+  capture(LogRecord& record, const T& value) {
+    addArg(record, std::is_signed<T>::value ? LOG_ARG_INT : LOG_ARG_UINT, (uint32_t)value);
+  }
+  static void capture(LogRecord& record, const char* text) { addText(record, text); }
+  static void capture(LogRecord& record, const String& text) { addText(record, text.c_str()); }
+  static void capture(LogRecord& record, const IPAddress& address) {
+    addArg(record, LOG_ARG_IPV4, (uint32_t)address);
+  }
+};
+
+extern Logger logger;
+
+// ===== ログマクロ =====
+// 無効なレベルでは引数を評価しない
+#define LOG_AT(level, tag, ...) \
+  do { \
+    if ((level) <= LOG_COMPILE_LEVEL && logger.isEnabled(level)) { \
+      logger.write((level), (tag), __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define LOG_ERROR(tag, ...) LOG_AT(LOG_LEVEL_ERROR, tag, __VA_ARGS__)
+#define LOG_WARN(tag, ...) LOG_AT(LOG_LEVEL_WARN, tag, __VA_ARGS__)
+#define LOG_INFO(tag, ...) LOG_AT(LOG_LEVEL_INFO, tag, __VA_ARGS__)
+#define LOG_DEBUG(tag, ...) LOG_AT(LOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+
+#endif // LOGGER_H
@@ -0,0 +1,61 @@
+/*
+ * SPSCRing.h - 単一生産者・単一消費者のロックフリーリングバッファ
+ *
+ * 1 つのタスクだけが push()、別の 1 つのタスクだけが pop() する場合に限り、
+ * ロックなしで要素を受け渡します。要素はコピーで格納されるため、
+ * 固定サイズの構造体（コマンド、ログレコード等）を想定しています。
+ *
+ * 容量は 2 のべき乗。インデックスは単調増加させ、差で使用数を求めます。
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <Arduino.h>
+#include <atomic>
+
+template <typename T, uint16_t Capacity>
+class SPSCRing {
+  static_assert((Capacity & (Capacity - 1)) == 0, "Capacity は 2 のべき乗");
+
+public:
+  SPSCRing() : head(0), tail(0) {}
+
+  // 生産者側: 満杯なら false
+  bool push(const T& item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= Capacity) {
+      return false;
+    }
+    slots[h & (Capacity - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // 消費者側: 空なら false
+  bool pop(T* item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = slots[t & (Capacity - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // どちらの側からも呼べる（目安の値）
+  uint16_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+private:
+  T slots[Capacity];
+  std::atomic<uint32_t> head;    // 次に書き込む位置（生産者のみ更新）
+  std::atomic<uint32_t> tail;    // 次に読み出す位置（消費者のみ更新）
+};
+
+#endif // SPSC_RING_H
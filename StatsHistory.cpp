@@ -0,0 +1,114 @@
+/*
+ * StatsHistory.cpp - クエリ数と空きヒープの 1 分ごとの推移の実装
+ */
+
+#include "StatsHistory.h"
+
+StatsHistory::StatsHistory()
+  : head(0),
+    count(0),
+    started(false),
+    minuteStartMs(0),
+    minuteMinHeap(UINT32_MAX),
+    minuteTotal(0),
+    minuteBlocked(0),
+    minuteAllowed(0),
+    minuteErrors(0),
+    lastTotal(0),
+    lastBlocked(0),
+    lastAllowed(0),
+    lastErrors(0) {
+}
+
+/**
+ * 前回の update() からのカウンタの増分（統計がリセットされて減った場合はリセット後の値）
+ */
+uint32_t StatsHistory::delta(uint32_t current, uint32_t last) {
+  return current >= last ? current - last : current;
+}
+
+/**
+ * value を parts 個に均等に分けたうちの index 番目（合計が value に一致するよう端数を配る）
+ */
+uint32_t StatsHistory::share(uint32_t value, uint16_t index, uint16_t parts) {
+  return (uint64_t)value * (index + 1) / parts - (uint64_t)value * index / parts;
+}
+
+uint32_t StatsHistory::saturate(uint32_t value, uint32_t max) {
+  return value < max ? value : max;
+}
+
+void StatsHistory::remember(const DNSStats& stats) {
+  lastTotal = stats.totalQueries;
+  lastBlocked = stats.blockedQueries;
+  lastAllowed = stats.allowedQueries;
+  lastErrors = stats.errorQueries;
+}
+
+void StatsHistory::update(unsigned long now, uint32_t freeHeap, const DNSStats& stats) {
+  if (freeHeap < minuteMinHeap) {
+    minuteMinHeap = freeHeap;
+  }
+  if (!started) {
+    started = true;
+    minuteStartMs = now;
+    remember(stats);
+    return;
+  }
+
+  // 増分は呼び出しごとに積算する（途中で統計がリセットされても、それまでの分は失われない）
+  uint32_t total = delta(stats.totalQueries, lastTotal);
+  uint32_t blocked = delta(stats.blockedQueries, lastBlocked);
+  uint32_t allowed = delta(stats.allowedQueries, lastAllowed);
+  uint32_t errors = delta(stats.errorQueries, lastErrors);
+  remember(stats);
+
+  unsigned long elapsed = (now - minuteStartMs) / STATS_HISTORY_INTERVAL_MS;
+  if (elapsed == 0) {
+    minuteTotal += total;
+    minuteBlocked += blocked;
+    minuteAllowed += allowed;
+    minuteErrors += errors;
+    return;
+  }
+
+  // loop() が長く止まった場合、前回からの増分は確定する分に均等に割り振る（最大 24 時間分）
+  uint16_t closing = elapsed < STATS_HISTORY_MINUTES ? elapsed : STATS_HISTORY_MINUTES;
+  uint32_t heapKb = minuteMinHeap / 1024;
+  for (uint16_t i = 0; i < closing; i++) {
+    StatsHistorySample sample;
+    sample.total = saturate(minuteTotal + share(total, i, closing), STATS_HISTORY_MAX_COUNT);
+    sample.blocked = saturate(minuteBlocked + share(blocked, i, closing), STATS_HISTORY_MAX_COUNT);
+    sample.allowed = saturate(minuteAllowed + share(allowed, i, closing), STATS_HISTORY_MAX_COUNT);
+    sample.errors = saturate(minuteErrors + share(errors, i, closing), STATS_HISTORY_MAX_ERRORS);
+    sample.minHeapKb = saturate(heapKb, STATS_HISTORY_MAX_HEAP_KB);
+    push(sample);
+
+    minuteTotal = 0;
+    minuteBlocked = 0;
+    minuteAllowed = 0;
+    minuteErrors = 0;
+  }
+  minuteStartMs = elapsed < STATS_HISTORY_MINUTES ? minuteStartMs + elapsed * STATS_HISTORY_INTERVAL_MS : now;
+  minuteMinHeap = freeHeap;
+}
+
+void StatsHistory::push(const StatsHistorySample& sample) {
+  samples[head] = sample;
+  head = (head + 1) % STATS_HISTORY_MINUTES;
+  if (count < STATS_HISTORY_MINUTES) {
+    count++;
+  }
+}
+
+uint16_t StatsHistory::getCount() const {
+  return count;
+}
+
+const StatsHistorySample& StatsHistory::getSample(uint16_t index) const {
+  return samples[(head + STATS_HISTORY_MINUTES - count + index) % STATS_HISTORY_MINUTES];
+}
+
+unsigned long StatsHistory::getLastSampleMs() const {
+  return minuteStartMs;
+}
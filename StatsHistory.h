@@ -0,0 +1,74 @@
+/*
+ * StatsHistory.h - クエリ数と空きヒープの 1 分ごとの推移
+ *
+ * 1 分間のクエリ数（総数・ブロック・許可・エラー）とその間の最小空きヒープを
+ * 8 バイトのサンプルにまとめ、24 時間分を固定サイズのリングバッファに保持します。
+ * 値は 1 分間の増分なので、統計のリセットの影響を受けません（リングは RAM 上にあり、再起動で消えます）。
+ *
+ * - クエリ数は 65535 / 分（約 1000 qps）、エラー数は 127 / 分で飽和
+ * - loop() が止まって複数の分をまとめて確定する場合、その間の増分は各分に均等に割り振る
+ * - 空きヒープは KB 単位（511 KB で飽和）
+ */
+
+#ifndef STATS_HISTORY_H
+#define STATS_HISTORY_H
+
+#include <Arduino.h>
+#include "DNSFilterManager.h"
+
+#define STATS_HISTORY_MINUTES 1440           // 保持する分数（24 時間）
+#define STATS_HISTORY_INTERVAL_MS 60000UL    // 1 サンプルの期間（ミリ秒）
+#define STATS_HISTORY_MAX_COUNT 0xFFFF
+#define STATS_HISTORY_MAX_ERRORS 0x7F
+#define STATS_HISTORY_MAX_HEAP_KB 0x1FF
+
+// ===== 1 分間のサンプル（8 バイト） =====
+struct StatsHistorySample {
+  uint16_t total;             // 総クエリ数
+  uint16_t blocked;           // ブロック数
+  uint16_t allowed;           // 許可数
+  uint16_t errors : 7;        // エラー数
+  uint16_t minHeapKb : 9;     // 最小空きヒープ（KB）
+};
+
+/**
+ * StatsHistory クラス
+ *
+ * loop() から update() を定期的に（1 分より十分短い間隔で）呼びます。
+ * 読み出しも loop() から行うため排他制御はありません。
+ */
+class StatsHistory {
+public:
+  StatsHistory();
+
+  // 空きヒープを記録し、1 分経過していればサンプルを確定する
+  void update(unsigned long now, uint32_t freeHeap, const DNSStats& stats);
+
+  uint16_t getCount() const;
+  const StatsHistorySample& getSample(uint16_t index) const;  // 0 が最も古い
+  unsigned long getLastSampleMs() const;                      // 最新のサンプルの終了時刻（millis）
+
+private:
+  StatsHistorySample samples[STATS_HISTORY_MINUTES];
+  uint16_t head;                  // 次に書き込む位置
+  uint16_t count;
+  bool started;
+  unsigned long minuteStartMs;    // 集計中の 1 分の開始時刻
+  uint32_t minuteMinHeap;         // 集計中の 1 分の最小空きヒープ
+  uint32_t minuteTotal;           // 集計中の 1 分の増分
+  uint32_t minuteBlocked;
+  uint32_t minuteAllowed;
+  uint32_t minuteErrors;
+  uint32_t lastTotal;             // 前回の update() 時点のカウンタ
+  uint32_t lastBlocked;
+  uint32_t lastAllowed;
+  uint32_t lastErrors;
+
+  void push(const StatsHistorySample& sample);
+  void remember(const DNSStats& stats);
+  static uint32_t delta(uint32_t current, uint32_t last);
+  static uint32_t share(uint32_t value, uint16_t index, uint16_t parts);
+  static uint32_t saturate(uint32_t value, uint32_t max);
+};
+
+#endif // STATS_HISTORY_H
@@ -8,6 +8,8 @@
 #include "Config.h"
 #include "ConfigManager.h"
 #include "DNSFilterManager.h"  // Phase 8
+#include "Logger.h"
+#include "StatsHistory.h"
 #include <WiFi.h>
 #include <Arduino.h>
 #include <ESP.h>
@@ -120,26 +122,231 @@ DNS フィルタを有効にする
 <li>総クエリ数: <strong>%TOTAL_QUERIES%</strong></li>
 <li>ブロック数: <strong>%BLOCKED_QUERIES%</strong>%BLOCKED_PERCENT%</li>
 <li>許可数: <strong>%ALLOWED_QUERIES%</strong>%ALLOWED_PERCENT%</li>
-<li>ブロックリスト登録数: <strong>%BLOCKLIST_COUNT% ドメイン</strong></li>
+<li>ブロックリスト登録数: <strong>%BLOCKLIST_COUNT% ドメイン</strong> (%BLOCKLIST_KB% KB)</li>
+<li>プレフィルタ: <strong>%PREFILTER_STATUS%</strong></li>
+<li>プレフィルタ判定: 即時許可 %PREFILTER_REJECTS% 件 / 偽陽性 %PREFILTER_FP% 件</li>
+<li>応答キャッシュ: ヒット率 <strong>%CACHE_HIT_RATE%</strong> / %CACHE_ENTRIES% 件 / %CACHE_USED_KB% / %CACHE_TOTAL_KB% KB / 追い出し %CACHE_EVICTIONS% 件</li>
+<li>キャッシュによる待ち時間回避: 期限切れ応答 %CACHE_STALE% 件 / 先行更新 %CACHE_PREFETCHES% 回（利用 %CACHE_PREFETCH_HITS% 件）</li>
+<li>上流問い合わせ: 処理中 %UPSTREAM_PENDING% 件 / タイムアウト %UPSTREAM_TIMEOUTS% 件 / 満杯 %UPSTREAM_OVERFLOWS% 件 / 別サーバーへ再送 %UPSTREAM_FAILOVERS% 件</li>
+<li>ループあたりの処理: 平均 %LOOP_BATCH_AVG% / 最大 %LOOP_BATCH_MAX% パケット (最長 %LOOP_BATCH_MAX_US% µs) / 上限で打ち切り %LOOP_EXHAUSTED% 回 / 推定待ち行列 最大 %QUEUE_DEPTH_MAX% 件 / 破棄 %DROPPED_PACKETS% 件</li>
+<li>同一クエリの相乗り: 節約した上流送信 %COALESCED_QUERIES% 件 / 待ち時間 平均 %COALESCED_WAIT_AVG% ms・最大 %COALESCED_WAIT_MAX% ms</li>
+<li>EDNS: クエリ %EDNS_QUERIES% 件 / 512 バイト超の UDP 応答 %LARGE_RESPONSES% 件 / 切り詰め（TC） %TRUNCATED_RESPONSES% 件</li>
+<li>TCP: 接続中 %TCP_ACTIVE% / 受け付け %TCP_CONNECTIONS% 件 / 上限で拒否 %TCP_REFUSED% 件 / アイドル切断 %TCP_IDLE_CLOSED% 件 / クエリ %TCP_QUERIES% 件</li>
+<li>ブロックリスト読み込み（直近）: ファイル %LOAD_FILE_KB% KB / %LOAD_MS% ms / ピーク作業メモリ %LOAD_PEAK_KB% KB</li>
+<li>起動からフィルタ利用可能まで: <strong>%READY_MS% ms</strong></li>
+<li>ブロックリストの差分: 追加 %DELTA_ADDED% 件 / 削除 %DELTA_REMOVED% 件%DELTA_FULL% / ジャーナル %DELTA_JOURNAL% 件 / 直近の反映 %DELTA_APPLY_US% µs / 統合 %DELTA_COMPACTIONS% 回（直近 %DELTA_COMPACTION_MS% ms）</li>
 </ul>
 </div>
 <div class='status'>
+<h2>推移（24 時間）</h2>
+<canvas id='trend' width='560' height='160' style='width:100%;'></canvas>
+<canvas id='heap' width='560' height='60' style='width:100%;'></canvas>
+<p id='trend-note'>読み込み中...</p>
+<script>
+fetch('/dns-history.json').then(function(r){return r.json();}).then(function(h){
+var note=document.getElementById('trend-note');
+if(!h.total.length){note.textContent='データ収集中（1 分ごとに記録）';return;}
+function plot(id,series,colors){
+var c=document.getElementById(id),g=c.getContext('2d'),n=series[0].length,max=1;
+series.forEach(function(s){s.forEach(function(v){if(v>max)max=v;});});
+series.forEach(function(s,k){g.strokeStyle=colors[k];g.beginPath();
+s.forEach(function(v,i){var x=n>1?i*(c.width-1)/(n-1):0,y=c.height-1-v*(c.height-12)/max;if(i)g.lineTo(x,y);else g.moveTo(x,y);});
+g.stroke();});
+g.fillStyle='#555';g.fillText(String(max),2,10);}
+plot('trend',[h.total,h.blocked],['#007bff','#dc3545']);
+plot('heap',[h.min_heap_kb],['#28a745']);
+note.textContent='直近 '+h.total.length+' 分（青: 総クエリ/分、赤: ブロック/分、緑: 最小空きヒープ KB）';
+});
+</script>
+</div>
+<div class='status'>
+<h2>クエリの多いドメイン・クライアント</h2>
+<p>固定サイズの表で上位のドメインを推定します（回数は実際の回数以上、誤差上限以内）。<a href='/dns-traffic.json' style='color:#007bff;'>JSON</a></p>
+<h3>クエリ</h3>
+<table style='border-collapse:collapse;margin-bottom:10px;'>
+<tr><th>ドメイン</th><th>回数</th><th>誤差上限</th></tr>
+%TOP_QUERIED_ROWS%
+</table>
+<h3>ブロック</h3>
+<table style='border-collapse:collapse;margin-bottom:10px;'>
+<tr><th>ドメイン</th><th>回数</th><th>誤差上限</th></tr>
+%TOP_BLOCKED_ROWS%
+</table>
+<h3>クライアント（最大 %CLIENT_MAX% 台）</h3>
+<table style='border-collapse:collapse;margin-bottom:10px;'>
+<tr><th>IP アドレス</th><th>クエリ</th><th>ブロック</th><th>最終クエリ</th></tr>
+%CLIENT_ROWS%
+</table>
+</div>
+<div class='status'>
+<h2>プレフィルタ設定</h2>
+<p>ブロックリスト照合の前に Bloom フィルタで未登録ドメインを除外します。ビット数を増やすと偽陽性率が下がり、メモリ使用量が増えます。</p>
+<form method='POST' action='/dns-prefilter'>
+<select name='bits'>%PREFILTER_OPTIONS%</select>
+<button type='submit'>保存</button>
+</form>
+</div>
+<div class='status'>
+<h2>上流 DNS サーバー</h2>
+<p>応答時間と損失率から最も速いサーバーを選び、タイムアウトや SERVFAIL の場合は別のサーバーに問い合わせ直します。WiFi 接続先の DHCP で配布された DNS も自動的に候補に加わります。</p>
+<table style='border-collapse:collapse;margin-bottom:10px;'>
+<tr><th>サーバー</th><th>状態</th><th>平滑化 RTT</th><th>損失率</th><th>タイムアウト</th><th>送信 / 応答 / タイムアウト</th></tr>
+%UPSTREAM_ROWS%
+</table>
+<p>TCP 接続: %UPSTREAM_TCP_STATE% / ハンドシェイク %UPSTREAM_TCP_HANDSHAKES% 回（失敗 %UPSTREAM_TCP_FAILURES%） / 送信 %UPSTREAM_TCP_QUERIES% / 応答 %UPSTREAM_TCP_RESPONSES% / 平滑化 RTT %UPSTREAM_TCP_SRTT% / 直近 RTT %UPSTREAM_TCP_LAST_RTT% / TC 再問い合わせ %UPSTREAM_TCP_RETRIES% 件 / UDP へ切り替え %UPSTREAM_TCP_FALLBACKS% 件</p>
+<form method='POST' action='/dns-upstreams'>
+<div class='form-group'>
+<label>サーバー（カンマ区切り、最大 %UPSTREAM_MAX% 個）:</label>
+<input type='text' name='servers' value='%UPSTREAM_LIST%' required>
+</div>
+<label>
+<input type='checkbox' name='race' %UPSTREAM_RACE_CHECKED%>
+上位 2 つのサーバーに同時に問い合わせる（速い方の応答を使用）
+</label><br>
+<label>
+<input type='checkbox' name='tcp' %UPSTREAM_TCP_CHECKED%>
+持続 TCP 接続で問い合わせる（接続できない間は UDP）
+</label><br><br>
+<button type='submit'>保存</button>
+</form>
+</div>
+<div class='status'>
+<h2>ブロック時の応答</h2>
+<p>ヌル IP は A/AAAA に 0.0.0.0 / :: を返し、その他のタイプ（HTTPS 等）は回答なしにします。NODATA と NXDOMAIN は SOA を付けるため、クライアントは TTL の間ネガティブキャッシュします。</p>
+<form method='POST' action='/dns-block-policy'>
+<div class='form-group'>
+<label>応答ポリシー:</label>
+<select name='policy'>%BLOCK_POLICY_OPTIONS%</select>
+</div>
+<div class='form-group'>
+<label>TTL（秒、0〜%BLOCK_TTL_MAX%）:</label>
+ヌル IP <input type='number' name='ttl_null' min='0' max='%BLOCK_TTL_MAX%' value='%TTL_NULL_IP%' style='width:80px;'>
+NODATA <input type='number' name='ttl_nodata' min='0' max='%BLOCK_TTL_MAX%' value='%TTL_NODATA%' style='width:80px;'>
+NXDOMAIN <input type='number' name='ttl_nx' min='0' max='%BLOCK_TTL_MAX%' value='%TTL_NXDOMAIN%' style='width:80px;'>
+</div>
+<button type='submit'>保存</button>
+</form>
+</div>
+<div class='status'>
+<h2>ログ</h2>
+<p>ログはバッファに記録し、空き時間にシリアルへ出力します。「デバッグ」ではクエリごとのログを出力します（負荷が増えます）。</p>
+<ul>
+<li>出力待ち: %LOG_QUEUED% 件 / 記録: %LOG_WRITTEN% 件 / バッファ満杯で破棄: <strong>%LOG_DROPPED%</strong> 件</li>
+</ul>
+<form method='POST' action='/log-level'>
+<select name='level'>%LOG_LEVEL_OPTIONS%</select>
+<button type='submit'>保存</button>
+</form>
+</div>
+<div class='status'>
 <h2>ブロックリスト管理</h2>
-<form method='POST' action='/upload-blocklist' enctype='multipart/form-data'>
-<label>domain.txt をアップロード:</label><br>
-<input type='file' name='blocklist' accept='.txt' required><br><br>
-<button type='submit'>アップロード</button>
+<p>リストごとに domain.txt（Adblock Plus / hosts 形式も可）、コンパイル済み .bin、またはそれらを gzip 圧縮した .gz をアップロードします。すべてのリストを 1 つのインデックスに統合して照合し、無効にしたリストは読み込み直さずに照合から外れます。</p>
+<table style='border-collapse:collapse;margin-bottom:10px;'>
+<tr><th>有効</th><th>リスト</th><th>ドメイン</th><th>ブロック</th><th>ファイル</th><th>アップロード</th></tr>
+%BLOCKLIST_ROWS%
+</table>
+<form id='blocklist-lists' method='POST' action='/blocklist-lists'>
+<button type='submit'>有効なリストを保存</button>
+</form>
+<h3>ドメインを個別に追加・削除</h3>
+<p style='font-size:12px;color:#666;'>リストを作り直さずに即時反映します（サブドメインを含む）。追加したドメインは custom リストに入り、削除はすべてのリストに効きます。変更が溜まると自動で統合して各リストの .bin に保存します。</p>
+<form method='POST' action='/blocklist-add' style='display:inline;'>
+<input type='text' name='domain' placeholder='ads.example.com' required>
+<button type='submit'>追加</button>
+</form>
+<form method='POST' action='/blocklist-remove' style='display:inline;'>
+<input type='text' name='domain' placeholder='ads.example.com' required>
+<button type='submit'>削除</button>
+</form>
+<form method='GET' action='/blocklist-lookup' style='display:inline;'>
+<input type='text' name='domain' placeholder='ads.example.com' required>
+<button type='submit'>照会</button>
 </form>
-<p style='margin-top:15px;'>
-<a href='/download-blocklist' style='color:#007bff;'>現在のリストをダウンロード</a>
-</p>
 </div>
 </body></html>
 )rawliteral";
 
+// プレフィルタの選択肢（ビット数と理論偽陽性率の目安）
+struct PrefilterBitChoice {
+  uint8_t bits;
+  const char* label;
+};
+static const PrefilterBitChoice PREFILTER_BIT_CHOICES[] = {
+  {0, "無効"},
+  {4, "4 ビット/ドメイン（偽陽性率 約 15%）"},
+  {6, "6 ビット/ドメイン（偽陽性率 約 6%）"},
+  {8, "8 ビット/ドメイン（偽陽性率 約 2%）"},
+  {10, "10 ビット/ドメイン（偽陽性率 約 1%）"},
+  {12, "12 ビット/ドメイン（偽陽性率 約 0.3%）"},
+  {16, "16 ビット/ドメイン（偽陽性率 約 0.05%）"},
+};
+
+// /metrics で出力する DNSStats のカウンタ（Prometheus のメトリクス名は microrouter_ を付ける）
+struct StatsMetric {
+  const char* name;
+  const char* type;
+  const char* help;
+  uint32_t DNSStats::*field;
+};
+static const StatsMetric STATS_METRICS[] = {
+  {"dns_queries_total", "counter", "DNS queries received", &DNSStats::totalQueries},
+  {"dns_blocked_total", "counter", "Queries answered by the blocklist", &DNSStats::blockedQueries},
+  {"dns_allowed_total", "counter", "Queries allowed through the blocklist", &DNSStats::allowedQueries},
+  {"dns_errors_total", "counter", "Malformed or unsupported queries", &DNSStats::errorQueries},
+  {"dns_dropped_packets_total", "counter", "Packets read but not answered", &DNSStats::droppedPackets},
+  {"dns_prefilter_rejects_total", "counter", "Queries allowed by the Bloom prefilter alone", &DNSStats::prefilterRejects},
+  {"dns_prefilter_false_positives_total", "counter", "Prefilter hits not found in the trie", &DNSStats::prefilterFalsePositives},
+  {"dns_cache_hits_total", "counter", "Queries answered from the cache", &DNSStats::cacheHits},
+  {"dns_cache_misses_total", "counter", "Queries forwarded after a cache miss", &DNSStats::cacheMisses},
+  {"dns_cache_evictions_total", "counter", "Cache entries evicted for space", &DNSStats::cacheEvictions},
+  {"dns_cache_stale_served_total", "counter", "Expired answers served after upstream failure", &DNSStats::cacheStaleServed},
+  {"dns_cache_prefetches_total", "counter", "Refresh-ahead queries sent upstream", &DNSStats::cachePrefetches},
+  {"dns_cache_bytes_used", "gauge", "Cache arena bytes in use", &DNSStats::cacheBytesUsed},
+  {"dns_cache_bytes_total", "gauge", "Cache arena size in bytes", &DNSStats::cacheBytesTotal},
+  {"dns_upstream_timeouts_total", "counter", "Upstream queries that timed out on every resolver", &DNSStats::upstreamTimeouts},
+  {"dns_upstream_overflows_total", "counter", "Queries refused because the pending table was full", &DNSStats::upstreamOverflows},
+  {"dns_upstream_unmatched_total", "counter", "Upstream responses with no matching query", &DNSStats::upstreamUnmatched},
+  {"dns_upstream_failovers_total", "counter", "Queries resent to another resolver", &DNSStats::upstreamFailovers},
+  {"dns_upstream_tcp_retries_total", "counter", "Truncated UDP answers retried over upstream TCP", &DNSStats::upstreamTcpRetries},
+  {"dns_upstream_tcp_fallbacks_total", "counter", "Queries sent over UDP because upstream TCP was unavailable", &DNSStats::upstreamTcpFallbacks},
+  {"dns_coalesced_total", "counter", "Queries attached to an identical in-flight query", &DNSStats::coalescedQueries},
+  {"dns_edns_queries_total", "counter", "Queries carrying an EDNS OPT record", &DNSStats::ednsQueries},
+  {"dns_large_responses_total", "counter", "UDP responses larger than 512 bytes", &DNSStats::largeResponses},
+  {"dns_truncated_responses_total", "counter", "Responses truncated to fit the client UDP size", &DNSStats::truncatedResponses},
+  {"dns_tcp_connections_total", "counter", "TCP connections accepted", &DNSStats::tcpConnections},
+  {"dns_tcp_refused_total", "counter", "TCP connections closed because all slots were busy", &DNSStats::tcpRefused},
+  {"dns_tcp_idle_closed_total", "counter", "TCP connections closed by the idle timeout", &DNSStats::tcpIdleClosed},
+  {"dns_tcp_queries_total", "counter", "Queries received over TCP", &DNSStats::tcpQueries},
+  {"dns_loop_budget_exhausted_total", "counter", "Processing passes cut off by the packet or time budget", &DNSStats::loopBudgetExhausted},
+};
+
 // グローバル変数の extern 宣言
 extern DNSFilterManager dnsFilter;  // Phase 8
 extern Preferences preferences;
+extern StatsHistory statsHistory;
+
+// ブロックリストのアップロード（チャンクごとに解析し、完了時に差し替える）
+static BlocklistParser uploadParser;
+static String uploadError;          // 空: 成功
+static DNSBlocklistId uploadList;   // 差し替えるリスト（?list=、省略時は ads）
+static unsigned long uploadStartMs;
+
+/**
+ * 上位ドメインの表の行を生成する（名前は DNSTrafficStats で英数字と記号に限定済み）
+ */
+static String formatTopDomainRows(DNSTopList list) {
+  DNSTopDomain top[DNS_TOP_DOMAINS_SHOWN];
+  uint8_t count = dnsFilter.getTopDomains(list, top, DNS_TOP_DOMAINS_SHOWN);
+  if (count == 0) {
+    return "<tr><td colspan='3'>まだありません</td></tr>";
+  }
+  String rows = "";
+  for (uint8_t i = 0; i < count; i++) {
+    rows += String("<tr><td>") + top[i].name + "</td><td>" + String(top[i].count) +
+            "</td><td>" + String(top[i].error) + "</td></tr>";
+  }
+  return rows;
+}
 
 /**
  * Web サーバーのセットアップ
@@ -151,10 +358,30 @@ void setupWebServer() {
 
   // DNS フィルタエンドポイント（Phase 8）
   server.on("/dns-filter", handleDNSFilter);
+  server.on("/dns-traffic.json", HTTP_GET, handleDNSTrafficJson);
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  server.on("/dns-history.json", HTTP_GET, handleStatsHistoryJson);
   server.on("/dns-filter-toggle", HTTP_POST, handleDNSFilterToggle);
+  server.on("/dns-prefilter", HTTP_POST, handleDNSPrefilter);
+  server.on("/dns-block-policy", HTTP_POST, handleDNSBlockPolicy);
+  server.on("/dns-upstreams", HTTP_POST, handleDNSUpstreams);
+  server.on("/log-level", HTTP_POST, handleLogLevel);
   server.on("/download-blocklist", HTTP_GET, handleDownloadBlocklist);
+  server.on("/blocklist-add", HTTP_POST, handleBlocklistAdd);
+  server.on("/blocklist-remove", HTTP_POST, handleBlocklistRemove);
+  server.on("/blocklist-lookup", HTTP_GET, handleBlocklistLookup);
+  server.on("/blocklist-lists", HTTP_POST, handleBlocklistLists);
   server.on("/upload-blocklist", HTTP_POST,
     []() {
+      if (uploadError.length() > 0) {
+        server.send(HTTP_STATUS_BAD_REQUEST, "text/html",
+          "<!DOCTYPE html><html><head><meta charset='UTF-8'></head><body>"
+          "<h2>アップロード失敗</h2>"
+          "<p>" + uploadError + "。現在のブロックリストをそのまま使用します。</p>"
+          "<a href='/dns-filter'>戻る</a>"
+          "</body></html>");
+        return;
+      }
       server.send(HTTP_STATUS_OK, "text/html",
         "<!DOCTYPE html><html><head><meta charset='UTF-8'></head><body>"
         "<h2>アップロード成功</h2>"
@@ -344,6 +571,174 @@ void handleDNSFilter() {
   html.replace("%BLOCKED_QUERIES%", String(stats.blockedQueries));
   html.replace("%ALLOWED_QUERIES%", String(stats.allowedQueries));
   html.replace("%BLOCKLIST_COUNT%", String(blocklistCount));
+  html.replace("%BLOCKLIST_KB%", String((uint32_t)dnsFilter.getBlocklistBytes() / BYTES_TO_KB_DIVISOR));
+
+  // ブロックリスト読み込み情報
+  BlocklistLoadInfo loadInfo = dnsFilter.getLoadInfo();
+  html.replace("%LOAD_FILE_KB%", String(loadInfo.fileBytes / BYTES_TO_KB_DIVISOR));
+  html.replace("%LOAD_MS%", String(loadInfo.durationMs));
+  html.replace("%LOAD_PEAK_KB%", String(loadInfo.peakBytes / BYTES_TO_KB_DIVISOR));
+  html.replace("%READY_MS%", String(loadInfo.readyAtMs));
+
+  // 名前付きブロックリスト（有効のチェックは表の外のフォームに属する）
+  uint8_t enabledLists = dnsFilter.getEnabledBlocklists();
+  String listRows = "";
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    DNSBlocklistInfo info = dnsFilter.getBlocklistInfo((DNSBlocklistId)list);
+    String name = DNSFilterManager::getBlocklistName((DNSBlocklistId)list);
+    listRows += "<tr><td><input type='checkbox' form='blocklist-lists' name='list_" + name + "'" +
+                ((enabledLists & (1 << list)) ? " checked" : "") + "></td>";
+    listRows += "<td>" + name + "</td><td>" + String(info.domains) + "</td><td>" + String(stats.blocklistHits[list]) + "</td><td>";
+    if (info.file.fileBytes > 0) {
+      listRows += String(BlocklistParser::getFormatName(info.file.binary, info.file.textFormat)) + " 形式" +
+                  (info.file.compressed ? "（gzip）" : "") + " / " + String(info.file.fileBytes / BYTES_TO_KB_DIVISOR) + " KB";
+      listRows += " <a href='/download-blocklist?list=" + name + "' style='color:#007bff;'>ダウンロード</a>";
+    } else {
+      listRows += "-";
+    }
+    listRows += "</td><td><form method='POST' action='/upload-blocklist?list=" + name + "' enctype='multipart/form-data'>";
+    listRows += "<input type='file' name='blocklist' accept='.txt,.bin,.gz' required> <button type='submit'>アップロード</button></form></td></tr>";
+  }
+  html.replace("%BLOCKLIST_ROWS%", listRows);
+
+  // ブロックリストの差分
+  DNSBlocklistDeltaInfo delta = dnsFilter.getBlocklistDeltaInfo();
+  html.replace("%DELTA_ADDED%", String(delta.added));
+  html.replace("%DELTA_REMOVED%", String(delta.removed));
+  html.replace("%DELTA_FULL%", delta.full ? "（満杯、統合待ち）" : "");
+  html.replace("%DELTA_JOURNAL%", String(delta.journalEntries));
+  html.replace("%DELTA_APPLY_US%", String(delta.lastApplyUs));
+  html.replace("%DELTA_COMPACTIONS%", String(delta.compactions));
+  html.replace("%DELTA_COMPACTION_MS%", String(delta.lastCompactionMs));
+
+  // プレフィルタ情報
+  PrefilterInfo prefilter = dnsFilter.getPrefilterInfo();
+  String prefilterStatus = "無効";
+  if (prefilter.active) {
+    prefilterStatus = String(prefilter.sizeBytes / BYTES_TO_KB_DIVISOR) + " KB, " +
+                      String(prefilter.bitsPerEntry) + " ビット/ドメイン, 偽陽性率 " +
+                      String(prefilter.estimatedFpr * PERCENTAGE_MULTIPLIER, 2) + "%";
+  }
+  html.replace("%PREFILTER_STATUS%", prefilterStatus);
+  html.replace("%PREFILTER_REJECTS%", String(stats.prefilterRejects));
+  html.replace("%PREFILTER_FP%", String(stats.prefilterFalsePositives));
+  uint32_t cacheLookups = stats.cacheHits + stats.cacheMisses;
+  html.replace("%CACHE_HIT_RATE%", cacheLookups > 0 ? String(stats.cacheHits * PERCENTAGE_MULTIPLIER / cacheLookups) + "%" : String("-"));
+  html.replace("%CACHE_ENTRIES%", String(stats.cacheEntries));
+  html.replace("%CACHE_USED_KB%", String(stats.cacheBytesUsed / BYTES_TO_KB_DIVISOR));
+  html.replace("%CACHE_TOTAL_KB%", String(stats.cacheBytesTotal / BYTES_TO_KB_DIVISOR));
+  html.replace("%CACHE_EVICTIONS%", String(stats.cacheEvictions));
+  html.replace("%CACHE_STALE%", String(stats.cacheStaleServed));
+  html.replace("%CACHE_PREFETCHES%", String(stats.cachePrefetches));
+  html.replace("%CACHE_PREFETCH_HITS%", String(stats.cachePrefetchHits));
+  html.replace("%UPSTREAM_PENDING%", String(stats.upstreamPending));
+  html.replace("%UPSTREAM_TIMEOUTS%", String(stats.upstreamTimeouts));
+  html.replace("%UPSTREAM_OVERFLOWS%", String(stats.upstreamOverflows));
+  html.replace("%UPSTREAM_FAILOVERS%", String(stats.upstreamFailovers));
+  html.replace("%LOOP_BATCH_AVG%", stats.loopBatches > 0 ?
+               String((float)stats.loopBatchPackets / stats.loopBatches, 1) : String("-"));
+  html.replace("%LOOP_BATCH_MAX%", String(stats.loopBatchMax));
+  html.replace("%LOOP_BATCH_MAX_US%", String(stats.loopBatchMaxUs));
+  html.replace("%LOOP_EXHAUSTED%", String(stats.loopBudgetExhausted));
+  html.replace("%QUEUE_DEPTH_MAX%", String(stats.queueDepthMax));
+  html.replace("%DROPPED_PACKETS%", String(stats.droppedPackets));
+  html.replace("%COALESCED_QUERIES%", String(stats.coalescedQueries));
+  html.replace("%COALESCED_WAIT_AVG%", stats.coalescedAnswered > 0 ?
+               String(stats.coalescedWaitTotalUs / stats.coalescedAnswered / 1000.0, 1) : String("-"));
+  html.replace("%COALESCED_WAIT_MAX%", String(stats.coalescedWaitMaxUs / 1000.0, 1));
+  html.replace("%EDNS_QUERIES%", String(stats.ednsQueries));
+  html.replace("%LARGE_RESPONSES%", String(stats.largeResponses));
+  html.replace("%TRUNCATED_RESPONSES%", String(stats.truncatedResponses));
+  html.replace("%TCP_ACTIVE%", String(stats.tcpActive));
+  html.replace("%TCP_CONNECTIONS%", String(stats.tcpConnections));
+  html.replace("%TCP_REFUSED%", String(stats.tcpRefused));
+  html.replace("%TCP_IDLE_CLOSED%", String(stats.tcpIdleClosed));
+  html.replace("%TCP_QUERIES%", String(stats.tcpQueries));
+
+  // クエリの多いドメイン・クライアント
+  html.replace("%TOP_QUERIED_ROWS%", formatTopDomainRows(DNS_TOP_QUERIED));
+  html.replace("%TOP_BLOCKED_ROWS%", formatTopDomainRows(DNS_TOP_BLOCKED));
+  uint8_t clientCapacity = dnsFilter.getClientCapacity();
+  DNSClientStats* clients = new DNSClientStats[clientCapacity > 0 ? clientCapacity : 1];
+  uint8_t clientCount = dnsFilter.getClientStats(clients, clientCapacity);
+  unsigned long now = millis();
+  String rows = "";
+  for (uint8_t i = 0; i < clientCount; i++) {
+    rows += "<tr><td>" + clients[i].address.toString() + "</td><td>" + String(clients[i].queries) + "</td>";
+    rows += "<td>" + String(clients[i].blocked) + "</td>";
+    rows += "<td>" + String((now - clients[i].lastSeenMs) / MILLISECONDS_TO_SECONDS_DIVISOR) + " 秒前</td></tr>";
+  }
+  delete[] clients;
+  html.replace("%CLIENT_ROWS%", clientCount > 0 ? rows : String("<tr><td colspan='4'>まだありません</td></tr>"));
+  html.replace("%CLIENT_MAX%", String(clientCapacity));
+
+  // 上流 DNS サーバー
+  rows = "";
+  for (uint8_t i = 0; i < dnsFilter.getUpstreamCount(); i++) {
+    DNSUpstreamInfo info = dnsFilter.getUpstreamInfo(i);
+    rows += "<tr><td>" + info.address.toString() + (info.fromDhcp ? "（DHCP）" : "") + "</td>";
+    rows += String("<td>") + (info.healthy ? "使用中" : "停止中") + "</td>";
+    rows += "<td>" + (info.srttUs > 0 ? String(info.srttUs / 1000.0, 1) + " ms" : String("-")) + "</td>";
+    rows += "<td>" + String(info.lossPermille / 10.0, 1) + "%</td>";
+    rows += "<td>" + String(info.timeoutMs) + " ms</td>";
+    rows += "<td>" + String(info.queries) + " / " + String(info.responses) + " / " + String(info.timeouts) + "</td></tr>";
+  }
+  html.replace("%UPSTREAM_ROWS%", rows);
+  html.replace("%UPSTREAM_MAX%", String(DNS_MAX_CONFIGURED_UPSTREAMS));
+  html.replace("%UPSTREAM_LIST%", dnsFilter.getUpstreams());
+  html.replace("%UPSTREAM_RACE_CHECKED%", dnsFilter.isUpstreamRacing() ? "checked" : "");
+  html.replace("%UPSTREAM_TCP_CHECKED%", dnsFilter.isUpstreamTcp() ? "checked" : "");
+
+  DNSUpstreamTcpInfo tcpInfo = dnsFilter.getUpstreamTcpInfo();
+  String tcpState = tcpInfo.connected ? tcpInfo.server.toString() + " に接続中"
+                    : tcpInfo.connecting ? tcpInfo.server.toString() + " とハンドシェイク中" : String("未接続");
+  if (tcpInfo.backoffMs > 0) {
+    tcpState += "（再接続まで " + String(tcpInfo.backoffMs / MILLISECONDS_TO_SECONDS_DIVISOR) + " 秒）";
+  }
+  html.replace("%UPSTREAM_TCP_STATE%", tcpState);
+  html.replace("%UPSTREAM_TCP_HANDSHAKES%", String(tcpInfo.handshakes));
+  html.replace("%UPSTREAM_TCP_FAILURES%", String(tcpInfo.connectFailures));
+  html.replace("%UPSTREAM_TCP_QUERIES%", String(tcpInfo.queries));
+  html.replace("%UPSTREAM_TCP_RESPONSES%", String(tcpInfo.responses));
+  html.replace("%UPSTREAM_TCP_SRTT%", tcpInfo.srttUs > 0 ? String(tcpInfo.srttUs / 1000.0, 1) + " ms" : String("-"));
+  html.replace("%UPSTREAM_TCP_LAST_RTT%", tcpInfo.lastRttUs > 0 ? String(tcpInfo.lastRttUs / 1000.0, 1) + " ms" : String("-"));
+  html.replace("%UPSTREAM_TCP_RETRIES%", String(stats.upstreamTcpRetries));
+  html.replace("%UPSTREAM_TCP_FALLBACKS%", String(stats.upstreamTcpFallbacks));
+
+  String options = "";
+  for (size_t i = 0; i < sizeof(PREFILTER_BIT_CHOICES) / sizeof(PREFILTER_BIT_CHOICES[0]); i++) {
+    uint8_t bits = PREFILTER_BIT_CHOICES[i].bits;
+    options += "<option value='" + String(bits) + "'" + (bits == prefilter.bitsPerEntry ? " selected" : "") + ">";
+    options += PREFILTER_BIT_CHOICES[i].label;
+    options += "</option>";
+  }
+  html.replace("%PREFILTER_OPTIONS%", options);
+
+  // ブロック応答ポリシー
+  DNSBlockPolicy blockPolicy = dnsFilter.getBlockPolicy();
+  options = "";
+  for (uint8_t i = 0; i < DNS_BLOCK_POLICY_COUNT; i++) {
+    options += "<option value='" + String(i) + "'" + (i == blockPolicy ? " selected" : "") + ">";
+    options += DNSFilterManager::getBlockPolicyName((DNSBlockPolicy)i);
+    options += "</option>";
+  }
+  html.replace("%BLOCK_POLICY_OPTIONS%", options);
+  html.replace("%BLOCK_TTL_MAX%", String(DNS_BLOCK_TTL_MAX));
+  html.replace("%TTL_NULL_IP%", String(dnsFilter.getBlockTTL(DNS_BLOCK_POLICY_NULL_IP)));
+  html.replace("%TTL_NODATA%", String(dnsFilter.getBlockTTL(DNS_BLOCK_POLICY_NODATA)));
+  html.replace("%TTL_NXDOMAIN%", String(dnsFilter.getBlockTTL(DNS_BLOCK_POLICY_NXDOMAIN)));
+
+  // ログ
+  options = "";
+  for (uint8_t level = LOG_LEVEL_NONE; level <= LOG_LEVEL_DEBUG; level++) {
+    options += "<option value='" + String(level) + "'" + (level == logger.getLevel() ? " selected" : "") + ">";
+    options += Logger::getLevelName(level);
+    options += "</option>";
+  }
+  html.replace("%LOG_LEVEL_OPTIONS%", options);
+  html.replace("%LOG_QUEUED%", String(logger.getQueued()));
+  html.replace("%LOG_WRITTEN%", String(logger.getWritten()));
+  html.replace("%LOG_DROPPED%", String(logger.getDropped()));
 
   // パーセント計算
   String blockedPercent = "";
@@ -358,6 +753,166 @@ void handleDNSFilter() {
   server.send(HTTP_STATUS_OK, "text/html", html);
 }
 
+/**
+ * 上位ドメインとクライアント別の集計（GET /dns-traffic.json）
+ */
+void handleDNSTrafficJson() {
+  static const char* const LIST_KEYS[DNS_TOP_LIST_COUNT] = {"top_queried", "top_blocked"};
+  DNSStats stats = dnsFilter.getStats();
+
+  String json = "{\"total\":" + String(stats.totalQueries) + ",\"blocked\":" + String(stats.blockedQueries);
+  for (uint8_t list = 0; list < DNS_TOP_LIST_COUNT; list++) {
+    DNSTopDomain top[DNS_TOP_DOMAINS_SHOWN];
+    uint8_t count = dnsFilter.getTopDomains((DNSTopList)list, top, DNS_TOP_DOMAINS_SHOWN);
+    json += String(",\"") + LIST_KEYS[list] + "\":[";
+    for (uint8_t i = 0; i < count; i++) {
+      json += String(i > 0 ? "," : "") + "{\"name\":\"" + top[i].name + "\",\"count\":" + String(top[i].count) +
+              ",\"error\":" + String(top[i].error) + "}";
+    }
+    json += "]";
+  }
+
+  uint8_t clientCapacity = dnsFilter.getClientCapacity();
+  DNSClientStats* clients = new DNSClientStats[clientCapacity > 0 ? clientCapacity : 1];
+  uint8_t clientCount = dnsFilter.getClientStats(clients, clientCapacity);
+  unsigned long now = millis();
+  json += ",\"clients\":[";
+  for (uint8_t i = 0; i < clientCount; i++) {
+    json += String(i > 0 ? "," : "") + "{\"ip\":\"" + clients[i].address.toString() + "\",\"queries\":" +
+            String(clients[i].queries) + ",\"blocked\":" + String(clients[i].blocked) +
+            ",\"idle_ms\":" + String(now - clients[i].lastSeenMs) + "}";
+  }
+  delete[] clients;
+  json += "]}";
+
+  server.send(HTTP_STATUS_OK, "application/json", json);
+}
+
+/**
+ * メトリクス 1 個分の HELP / TYPE と値を追加する
+ */
+static void appendMetric(String& out, const char* name, const char* type, const char* help, const String& value) {
+  out += String("# HELP microrouter_") + name + " " + help + "\n";
+  out += String("# TYPE microrouter_") + name + " " + type + "\n";
+  out += String("microrouter_") + name + " " + value + "\n";
+}
+
+/**
+ * マイクロ秒を秒の文字列にする（浮動小数点を使わない）
+ */
+static String formatSeconds(uint64_t us) {
+  char text[24];
+  snprintf(text, sizeof(text), "%lu.%06lu", (unsigned long)(us / 1000000), (unsigned long)(us % 1000000));
+  return String(text);
+}
+
+/**
+ * Prometheus 形式のメトリクス（GET /metrics）
+ *
+ * 応答時間のヒストグラムは処理経路ごとに outcome ラベルを付ける。
+ * ヒストグラムは大きいため、チャンク転送で経路ごとに送信する。
+ */
+void handleMetrics() {
+  DNSStats stats = dnsFilter.getStats();
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(HTTP_STATUS_OK, "text/plain; version=0.0.4", "");
+
+  String out = "";
+  appendMetric(out, "uptime_seconds", "gauge", "Seconds since boot", String(millis() / MILLISECONDS_TO_SECONDS_DIVISOR));
+  appendMetric(out, "heap_free_bytes", "gauge", "Free heap", String(ESP.getFreeHeap()));
+  appendMetric(out, "heap_min_free_bytes", "gauge", "Lowest free heap since boot", String(ESP.getMinFreeHeap()));
+  appendMetric(out, "ap_clients", "gauge", "Stations connected to the AP", String(WiFi.softAPgetStationNum()));
+  appendMetric(out, "dns_filter_enabled", "gauge", "1 if DNS filtering is enabled", String(dnsFilter.isEnabled() ? 1 : 0));
+  appendMetric(out, "dns_blocklist_domains", "gauge", "Domains in the blocklist", String(dnsFilter.getBlocklistCount()));
+  appendMetric(out, "dns_blocklists_enabled", "gauge", "Bitmask of named blocklists used for matching",
+               String(dnsFilter.getEnabledBlocklists()));
+  appendMetric(out, "dns_upstream_pending", "gauge", "Queries waiting for an upstream answer", String(stats.upstreamPending));
+  appendMetric(out, "dns_cache_entries", "gauge", "Answers held in the cache", String(stats.cacheEntries));
+  appendMetric(out, "dns_tcp_connections", "gauge", "Open DNS-over-TCP client connections", String(stats.tcpActive));
+  DNSUpstreamTcpInfo tcpInfo = dnsFilter.getUpstreamTcpInfo();
+  appendMetric(out, "dns_upstream_tcp_connected", "gauge", "1 if the upstream TCP connection is open", String(tcpInfo.connected ? 1 : 0));
+  appendMetric(out, "dns_upstream_tcp_handshakes_total", "counter", "Upstream TCP connections opened", String(tcpInfo.handshakes));
+  appendMetric(out, "dns_upstream_tcp_queries_total", "counter", "Queries sent over upstream TCP", String(tcpInfo.queries));
+  appendMetric(out, "dns_upstream_tcp_srtt_seconds", "gauge", "Smoothed per-query RTT over upstream TCP", formatSeconds(tcpInfo.srttUs));
+  server.sendContent(out);
+
+  out = "";
+  for (size_t i = 0; i < sizeof(STATS_METRICS) / sizeof(STATS_METRICS[0]); i++) {
+    const StatsMetric& metric = STATS_METRICS[i];
+    appendMetric(out, metric.name, metric.type, metric.help, String(stats.*metric.field));
+  }
+  server.sendContent(out);
+
+  // 名前付きブロックリストごとの登録数とブロック数
+  String domains = "# HELP microrouter_dns_blocklist_list_domains Domains in each named blocklist\n"
+                   "# TYPE microrouter_dns_blocklist_list_domains gauge\n";
+  out = "# HELP microrouter_dns_blocklist_hits_total Queries blocked by each named blocklist\n"
+        "# TYPE microrouter_dns_blocklist_hits_total counter\n";
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    String label = String("{list=\"") + DNSFilterManager::getBlocklistName((DNSBlocklistId)list) + "\"} ";
+    domains += "microrouter_dns_blocklist_list_domains" + label +
+               String(dnsFilter.getBlocklistInfo((DNSBlocklistId)list).domains) + "\n";
+    out += "microrouter_dns_blocklist_hits_total" + label + String(stats.blocklistHits[list]) + "\n";
+  }
+  server.sendContent(domains + out);
+
+  out = "# HELP microrouter_dns_latency_seconds Time from receiving a query to sending its answer\n"
+        "# TYPE microrouter_dns_latency_seconds histogram\n";
+  for (uint8_t outcome = 0; outcome < DNS_LATENCY_OUTCOME_COUNT; outcome++) {
+    const DNSLatencyHistogram& histogram = stats.latency[outcome];
+    String label = String("outcome=\"") + DNSFilterManager::getLatencyOutcomeName((DNSLatencyOutcome)outcome) + "\"";
+    uint32_t cumulative = 0;
+    for (uint8_t bucket = 0; bucket < DNS_LATENCY_BUCKETS; bucket++) {
+      cumulative += histogram.buckets[bucket];
+      out += "microrouter_dns_latency_seconds_bucket{" + label + ",le=\"" +
+             formatSeconds(DNSFilterManager::getLatencyBucketUpperUs(bucket)) + "\"} " + String(cumulative) + "\n";
+    }
+    out += "microrouter_dns_latency_seconds_bucket{" + label + ",le=\"+Inf\"} " + String(histogram.count) + "\n";
+    out += "microrouter_dns_latency_seconds_sum{" + label + "} " + formatSeconds(histogram.sumUs) + "\n";
+    out += "microrouter_dns_latency_seconds_count{" + label + "} " + String(histogram.count) + "\n";
+    server.sendContent(out);
+    out = "";
+  }
+  server.sendContent("");
+}
+
+/**
+ * 1 分ごとの推移（GET /dns-history.json）
+ *
+ * 古い順の列ごとの配列で返す。グラフは Web UI 側で描画する。
+ * 24 時間分は大きいため、チャンク転送で列を分けて送信する。
+ */
+void handleStatsHistoryJson() {
+  static const char* const COLUMNS[] = {"total", "blocked", "allowed", "errors", "min_heap_kb"};
+  uint16_t count = statsHistory.getCount();
+
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(HTTP_STATUS_OK, "application/json", "");
+  server.sendContent("{\"interval_s\":" + String(STATS_HISTORY_INTERVAL_MS / MILLISECONDS_TO_SECONDS_DIVISOR) +
+                     ",\"age_s\":" + String((millis() - statsHistory.getLastSampleMs()) / MILLISECONDS_TO_SECONDS_DIVISOR));
+
+  for (uint8_t column = 0; column < sizeof(COLUMNS) / sizeof(COLUMNS[0]); column++) {
+    String out = String(",\"") + COLUMNS[column] + "\":[";
+    for (uint16_t i = 0; i < count; i++) {
+      const StatsHistorySample& sample = statsHistory.getSample(i);
+      uint16_t values[] = {sample.total, sample.blocked, sample.allowed, sample.errors, sample.minHeapKb};
+      if (i > 0) {
+        out += ',';
+      }
+      out += values[column];
+      if (out.length() >= 1024) {
+        server.sendContent(out);
+        out = "";
+      }
+    }
+    out += ']';
+    server.sendContent(out);
+  }
+  server.sendContent("}");
+  server.sendContent("");
+}
+
 /**
  * DNS フィルタ ON/OFF 切り替え（POST /dns-filter-toggle）
  */
@@ -378,8 +933,238 @@ void handleDNSFilterToggle() {
   server.send(HTTP_STATUS_SEE_OTHER);
 }
 
+/**
+ * 1 ドメインの追加・削除を反映してリダイレクトする
+ */
+static void sendBlocklistEditResult(DNSBlocklistEditOp op) {
+  String domain = server.arg("domain");
+  DNSBlocklistEditStatus status = dnsFilter.editBlocklist(op, domain, nullptr);
+  switch (status) {
+    case DNS_BLOCKLIST_EDIT_INVALID:
+      server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正なドメイン名です");
+      return;
+    case DNS_BLOCKLIST_EDIT_FULL:
+      server.send(HTTP_STATUS_SERVICE_UNAVAILABLE, "text/plain", "変更が多すぎます。統合後に再試行してください");
+      return;
+    case DNS_BLOCKLIST_EDIT_TIMEOUT:
+      server.send(HTTP_STATUS_SERVICE_UNAVAILABLE, "text/plain", "DNS タスクが応答しません");
+      return;
+    default:
+      break;
+  }
+
+  Serial.printf("ブロックリスト%s: %s\n", op == DNS_BLOCKLIST_EDIT_ADD ? "追加" : "削除", domain.c_str());
+
+  // リダイレクト
+  server.sendHeader("Location", "/dns-filter");
+  server.send(HTTP_STATUS_SEE_OTHER);
+}
+
+/**
+ * ブロックリストへのドメイン追加（POST /blocklist-add）
+ */
+void handleBlocklistAdd() {
+  sendBlocklistEditResult(DNS_BLOCKLIST_EDIT_ADD);
+}
+
+/**
+ * ブロックリストからのドメイン削除（POST /blocklist-remove）
+ */
+void handleBlocklistRemove() {
+  sendBlocklistEditResult(DNS_BLOCKLIST_EDIT_REMOVE);
+}
+
+/**
+ * ドメインの照合結果を JSON で返す（GET /blocklist-lookup）
+ */
+void handleBlocklistLookup() {
+  DNSBlocklistEdit edit;
+  DNSBlocklistEditStatus status = dnsFilter.editBlocklist(DNS_BLOCKLIST_EDIT_LOOKUP, server.arg("domain"), &edit);
+  if (status == DNS_BLOCKLIST_EDIT_INVALID) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正なドメイン名です");
+    return;
+  }
+  if (status == DNS_BLOCKLIST_EDIT_TIMEOUT) {
+    server.send(HTTP_STATUS_SERVICE_UNAVAILABLE, "text/plain", "DNS タスクが応答しません");
+    return;
+  }
+
+  String json = String("{\"domain\":\"") + edit.name + "\",\"blocked\":" + (edit.blocked ? "true" : "false");
+  if (edit.blocked) {
+    json += String(",\"match\":\"") + edit.match + "\",\"source\":\"" + (edit.matchAdded ? "added" : "list") + "\"";
+    json += ",\"lists\":[";
+    for (uint8_t list = 0, count = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+      if (edit.matchLists & (1 << list)) {
+        json += String(count++ > 0 ? "," : "") + "\"" + DNSFilterManager::getBlocklistName((DNSBlocklistId)list) + "\"";
+      }
+    }
+    json += "]";
+  }
+  json += String(",\"removed\":") + (edit.tombstone ? "true" : "false") + ",\"lookup_us\":" + String(edit.applyUs) + "}";
+  server.send(HTTP_STATUS_OK, "application/json", json);
+}
+
+/**
+ * 有効なブロックリストの変更（POST /blocklist-lists）
+ *
+ * 照合時のマスクを切り替えるだけで、リストは読み込み直さない。
+ */
+void handleBlocklistLists() {
+  uint8_t lists = 0;
+  String names = "";
+  for (uint8_t list = 0; list < DNS_BLOCKLIST_COUNT; list++) {
+    const char* name = DNSFilterManager::getBlocklistName((DNSBlocklistId)list);
+    if (server.hasArg(String("list_") + name)) {
+      lists |= 1 << list;
+      names += (names.length() > 0 ? ", " : "") + String(name);
+    }
+  }
+
+  // 設定を保存
+  preferences.begin(PREF_NAMESPACE, false);
+  preferences.putUChar(PREF_KEY_DNS_BLOCKLISTS, lists);
+  preferences.end();
+
+  dnsFilter.setEnabledBlocklists(lists);
+
+  Serial.printf("有効なブロックリスト変更: %s\n", names.length() > 0 ? names.c_str() : "なし");
+
+  // リダイレクト
+  server.sendHeader("Location", "/dns-filter");
+  server.send(HTTP_STATUS_SEE_OTHER);
+}
+
+/**
+ * プレフィルタ設定変更（POST /dns-prefilter）
+ */
+void handleDNSPrefilter() {
+  int bits = server.arg("bits").toInt();
+  bool valid = false;
+  for (size_t i = 0; i < sizeof(PREFILTER_BIT_CHOICES) / sizeof(PREFILTER_BIT_CHOICES[0]); i++) {
+    if (PREFILTER_BIT_CHOICES[i].bits == bits) {
+      valid = true;
+    }
+  }
+  if (!valid) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正なビット数です");
+    return;
+  }
+
+  // 設定を保存
+  preferences.begin(PREF_NAMESPACE, false);
+  preferences.putUChar(PREF_KEY_DNS_PREFILTER_BITS, bits);
+  preferences.end();
+
+  dnsFilter.setPrefilterBitsPerEntry(bits);
+
+  Serial.printf("プレフィルタ設定変更: %d ビット/ドメイン\n", bits);
+
+  // リダイレクト
+  server.sendHeader("Location", "/dns-filter");
+  server.send(HTTP_STATUS_SEE_OTHER);
+}
+
+/**
+ * ブロック応答ポリシー設定変更（POST /dns-block-policy）
+ */
+void handleDNSBlockPolicy() {
+  int policy = server.arg("policy").toInt();
+  long ttlNullIP = server.arg("ttl_null").toInt();
+  long ttlNodata = server.arg("ttl_nodata").toInt();
+  long ttlNxdomain = server.arg("ttl_nx").toInt();
+
+  if (policy < 0 || policy >= DNS_BLOCK_POLICY_COUNT) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正な応答ポリシーです");
+    return;
+  }
+  if (ttlNullIP < 0 || ttlNullIP > (long)DNS_BLOCK_TTL_MAX ||
+      ttlNodata < 0 || ttlNodata > (long)DNS_BLOCK_TTL_MAX ||
+      ttlNxdomain < 0 || ttlNxdomain > (long)DNS_BLOCK_TTL_MAX) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正な TTL です");
+    return;
+  }
+
+  // 設定を保存
+  preferences.begin(PREF_NAMESPACE, false);
+  preferences.putUChar(PREF_KEY_DNS_BLOCK_POLICY, policy);
+  preferences.putULong(PREF_KEY_DNS_TTL_NULL_IP, ttlNullIP);
+  preferences.putULong(PREF_KEY_DNS_TTL_NODATA, ttlNodata);
+  preferences.putULong(PREF_KEY_DNS_TTL_NXDOMAIN, ttlNxdomain);
+  preferences.end();
+
+  dnsFilter.setBlockPolicy((DNSBlockPolicy)policy);
+  dnsFilter.setBlockTTL(DNS_BLOCK_POLICY_NULL_IP, ttlNullIP);
+  dnsFilter.setBlockTTL(DNS_BLOCK_POLICY_NODATA, ttlNodata);
+  dnsFilter.setBlockTTL(DNS_BLOCK_POLICY_NXDOMAIN, ttlNxdomain);
+
+  Serial.printf("ブロック応答ポリシー変更: %s (TTL %ld / %ld / %ld 秒)\n",
+                DNSFilterManager::getBlockPolicyName((DNSBlockPolicy)policy), ttlNullIP, ttlNodata, ttlNxdomain);
+
+  // リダイレクト
+  server.sendHeader("Location", "/dns-filter");
+  server.send(HTTP_STATUS_SEE_OTHER);
+}
+
+/**
+ * 上流 DNS サーバー設定変更（POST /dns-upstreams）
+ */
+void handleDNSUpstreams() {
+  String servers = server.arg("servers");
+  bool race = server.hasArg("race");
+  bool tcp = server.hasArg("tcp");
+
+  if (!dnsFilter.setUpstreams(servers)) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正な DNS サーバーの指定です");
+    return;
+  }
+
+  // 設定を保存（適用は DNS タスクで行われるため、検証済みの入力をそのまま保存）
+  preferences.begin(PREF_NAMESPACE, false);
+  preferences.putString(PREF_KEY_DNS_UPSTREAMS, servers);
+  preferences.putBool(PREF_KEY_DNS_UPSTREAM_RACE, race);
+  preferences.putBool(PREF_KEY_DNS_UPSTREAM_TCP, tcp);
+  preferences.end();
+
+  dnsFilter.setUpstreamRacing(race);
+  dnsFilter.setUpstreamTcp(tcp);
+
+  Serial.printf("上流 DNS 設定変更: %s (同時問い合わせ %s, TCP %s)\n",
+                servers.c_str(), race ? "有効" : "無効", tcp ? "有効" : "無効");
+
+  // リダイレクト
+  server.sendHeader("Location", "/dns-filter");
+  server.send(HTTP_STATUS_SEE_OTHER);
+}
+
+/**
+ * ログレベル変更（POST /log-level）
+ */
+void handleLogLevel() {
+  int level = server.arg("level").toInt();
+  if (level < LOG_LEVEL_NONE || level > LOG_LEVEL_DEBUG) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正なログレベルです");
+    return;
+  }
+
+  // 設定を保存
+  preferences.begin(PREF_NAMESPACE, false);
+  preferences.putUChar(PREF_KEY_LOG_LEVEL, level);
+  preferences.end();
+
+  logger.setLevel(level);
+
+  Serial.printf("ログレベル変更: %s\n", Logger::getLevelName(level));
+
+  // リダイレクト
+  server.sendHeader("Location", "/dns-filter");
+  server.send(HTTP_STATUS_SEE_OTHER);
+}
+
 /**
  * ブロックリストアップロード処理（POST /upload-blocklist）
+ *
+ * 受け取ったチャンクを一時ファイルに書くと同時にパーサーに渡し、新しいトライを組み立てる。
+ * 終了時に検証できた場合のみファイルとトライを差し替える（それまでは旧リストで動作）。
  */
 void handleUploadBlocklist() {
   static File uploadFile;
@@ -387,48 +1172,97 @@ void handleUploadBlocklist() {
 
   if (upload.status == UPLOAD_FILE_START) {
     Serial.printf("アップロード開始: %s\n", upload.filename.c_str());
-    uploadFile = LittleFS.open("/blocklist.txt.tmp", "w");
+    uploadError = "";
+    uploadList = DNS_BLOCKLIST_ADS;
+    if (server.hasArg("list") && !DNSFilterManager::parseBlocklistName(server.arg("list"), &uploadList)) {
+      uploadError = "不正なリスト名です";
+      return;
+    }
+    uploadStartMs = millis();
+    uploadParser.begin();
+    uploadFile = LittleFS.open(BLOCKLIST_UPLOAD_PATH, "w");
     if (!uploadFile) {
-      Serial.println("一時ファイルのオープンに失敗");
+      uploadError = "一時ファイルを開けませんでした";
     }
   }
   else if (upload.status == UPLOAD_FILE_WRITE) {
-    if (uploadFile) {
-      uploadFile.write(upload.buf, upload.currentSize);
+    if (uploadError.length() > 0) {
+      return;
+    }
+    if (uploadFile.write(upload.buf, upload.currentSize) != upload.currentSize) {
+      uploadError = "フラッシュへの書き込みに失敗しました";
+    } else if (!uploadParser.feed(upload.buf, upload.currentSize)) {
+      uploadError = uploadParser.getError();
+    }
+    if (uploadError.length() > 0) {
+      uploadFile.close();
+      LittleFS.remove(BLOCKLIST_UPLOAD_PATH);
+      uploadParser.abort();
     }
   }
   else if (upload.status == UPLOAD_FILE_END) {
-    if (uploadFile) {
-      uploadFile.close();
-      Serial.printf("アップロード完了: %d バイト\n", upload.totalSize);
+    if (uploadError.length() > 0) {
+      Serial.printf("アップロード失敗: %s\n", uploadError.c_str());
+      return;
+    }
+    uploadFile.close();
+    Serial.printf("アップロード完了: %u バイト\n", (unsigned)upload.totalSize);
 
-      // バックアップして置換
-      LittleFS.remove("/blocklist.txt.bak");
-      if (LittleFS.exists("/blocklist.txt")) {
-        LittleFS.rename("/blocklist.txt", "/blocklist.txt.bak");
-      }
-      LittleFS.rename("/blocklist.txt.tmp", "/blocklist.txt");
+    size_t size = 0;
+    uint8_t* blob = uploadParser.finish(&size);
+    if (!blob) {
+      uploadError = uploadParser.getError();
+      LittleFS.remove(BLOCKLIST_UPLOAD_PATH);
+      Serial.printf("アップロード失敗: %s\n", uploadError.c_str());
+      return;
+    }
 
-      // リロード
-      dnsFilter.reloadBlocklist();
-      Serial.println("ブロックリストを更新しました");
+    BlocklistLoadInfo info = BlocklistLoadInfo();
+    info.binary = uploadParser.isBinary();
+    info.textFormat = uploadParser.getTextFormat();
+    info.compressed = uploadParser.isCompressed();
+    info.fileBytes = upload.totalSize;
+    info.durationMs = millis() - uploadStartMs;
+    info.peakBytes = uploadParser.getPeakBytes();
+    if (!dnsFilter.installBlocklist(uploadList, BLOCKLIST_UPLOAD_PATH, blob, size, info)) {
+      uploadError = "ブロックリストを差し替えられませんでした";
+      return;
     }
+    Serial.printf("ブロックリスト %s を更新しました（%s 形式%s）\n", DNSFilterManager::getBlocklistName(uploadList),
+                  BlocklistParser::getFormatName(info.binary, info.textFormat), info.compressed ? ", gzip" : "");
+  }
+  else if (upload.status == UPLOAD_FILE_ABORTED) {
+    uploadFile.close();
+    LittleFS.remove(BLOCKLIST_UPLOAD_PATH);
+    uploadParser.abort();
+    uploadError = "アップロードが中断されました";
   }
 }
 
 /**
- * ブロックリストダウンロード（GET /download-blocklist）
+ * ブロックリストダウンロード（GET /download-blocklist?list=名前、省略時は ads）
  */
 void handleDownloadBlocklist() {
-  if (!LittleFS.exists("/blocklist.txt")) {
+  DNSBlocklistId list = DNS_BLOCKLIST_ADS;
+  if (server.hasArg("list") && !DNSFilterManager::parseBlocklistName(server.arg("list"), &list)) {
+    server.send(HTTP_STATUS_BAD_REQUEST, "text/plain", "不正なリスト名です");
+    return;
+  }
+  const char* path = DNSFilterManager::getBlocklistPath(list);
+  if (!LittleFS.exists(path)) {
     server.send(HTTP_STATUS_NOT_FOUND, "text/plain", "ブロックリストが見つかりません");
     return;
   }
 
-  File file = LittleFS.open("/blocklist.txt", "r");
+  // gzip は圧縮したまま送る（streamFile は .gz のファイルに Content-Encoding: gzip を付けるため、
+  // ブラウザが展開して中身の名前で保存する）
+  bool compressed = strcmp(path, BLOCKLIST_GZIP_PATHS[list]) == 0;
+  bool binary = compressed ? dnsFilter.getBlocklistInfo(list).file.binary : strcmp(path, BLOCKLIST_BINARY_PATHS[list]) == 0;
+  const char* filename = compressed ? (binary ? BLOCKLIST_BINARY_PATHS[list] : BLOCKLIST_TEXT_PATHS[list]) : path;
+  File file = LittleFS.open(path, "r");
   if (file) {
-    server.sendHeader("Content-Disposition", "attachment; filename=blocklist.txt");
-    server.streamFile(file, "text/plain");
+    server.sendHeader("Content-Disposition", String("attachment; filename=") + (filename + 1));
+    server.streamFile(file, binary && !compressed ? "application/octet-stream" : "text/plain");
     file.close();
   } else {
     server.send(HTTP_STATUS_INTERNAL_ERROR, "text/plain", "ブロックリストを開けませんでした");
@@ -22,8 +22,19 @@ void handleSaveAPPassword();
 
 // DNS フィルタハンドラ（Phase 8）
 void handleDNSFilter();
+void handleDNSTrafficJson();
+void handleMetrics();
+void handleStatsHistoryJson();
 void handleDNSFilterToggle();
+void handleDNSPrefilter();
+void handleDNSBlockPolicy();
+void handleDNSUpstreams();
+void handleLogLevel();
 void handleUploadBlocklist();
 void handleDownloadBlocklist();
+void handleBlocklistAdd();
+void handleBlocklistRemove();
+void handleBlocklistLookup();
+void handleBlocklistLists();
 
 #endif // WEBUI_MANAGER_H
@@ -7,9 +7,12 @@
 #include "WiFiManager.h"
 #include "Config.h"
 #include "ConfigManager.h"
+#include "Logger.h"
 #include <Arduino.h>
 #include <esp_netif.h>
 
+static const char LOG_TAG[] = "WiFiManager";
+
 // NATManager からの extern 宣言
 extern bool natEnabled;
 extern bool needEnableNAT;
@@ -22,32 +25,27 @@ extern bool needEnableNAT;
  * - DHCP サーバーの自動起動
  */
 void setupAP() {
-  Serial.println("--- AP モード設定開始 ---");
+  LOG_INFO(LOG_TAG, "--- AP モード設定開始 ---");
 
   // AP の固定 IP アドレスを設定
   if (!WiFi.softAPConfig(AP_IP, AP_GATEWAY, AP_SUBNET)) {
-    Serial.println("エラー: AP IP 設定に失敗しました");
+    LOG_ERROR(LOG_TAG, "AP IP 設定に失敗しました");
     return;
   }
-  Serial.print("AP IP アドレス: ");
-  Serial.println(AP_IP);
+  LOG_INFO(LOG_TAG, "AP IP アドレス: %s", AP_IP);
 
   // AP モードを起動（config.ap_password を使用）
   // WiFi.softAP(ssid, password, channel, ssid_hidden, max_connection)
   if (!WiFi.softAP(AP_SSID, config.ap_password, AP_CHANNEL, WIFI_SSID_HIDDEN, AP_MAX_CONNECTIONS)) {
-    Serial.println("エラー: AP 起動に失敗しました");
+    LOG_ERROR(LOG_TAG, "AP 起動に失敗しました");
     return;
   }
 
-  Serial.println("AP モード起動成功");
-  Serial.print("SSID: ");
-  Serial.println(AP_SSID);
-  Serial.print("パスワード: ");
-  Serial.println(config.ap_password_set ? "カスタム設定済み" : "デフォルト");
-  Serial.print("チャンネル: ");
-  Serial.println(AP_CHANNEL);
-  Serial.print("最大接続数: ");
-  Serial.println(AP_MAX_CONNECTIONS);
+  LOG_INFO(LOG_TAG, "AP モード起動成功");
+  LOG_INFO(LOG_TAG, "SSID: %s", AP_SSID);
+  LOG_INFO(LOG_TAG, "パスワード: %s", config.ap_password_set ? "カスタム設定済み" : "デフォルト");
+  LOG_INFO(LOG_TAG, "チャンネル: %d", AP_CHANNEL);
+  LOG_INFO(LOG_TAG, "最大接続数: %d", AP_MAX_CONNECTIONS);
 
   // DHCP サーバーで DNS サーバーとして ESP32C6 自身を広告（Phase 8）
   esp_netif_t* ap_netif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
@@ -59,13 +57,12 @@ void setupAP() {
 
     esp_netif_set_dns_info(ap_netif, ESP_NETIF_DNS_MAIN, &dns_info);
 
-    Serial.printf("DHCP: ESP32C6 を DNS サーバーとして設定（%s）\n", AP_IP.toString().c_str());
+    LOG_INFO(LOG_TAG, "DHCP: ESP32C6 を DNS サーバーとして設定（%s）", AP_IP);
   } else {
-    Serial.println("警告: AP netif の取得に失敗しました");
+    LOG_WARN(LOG_TAG, "AP netif の取得に失敗しました");
   }
 
-  Serial.println("--- AP モード設定完了 ---");
-  Serial.println();
+  LOG_INFO(LOG_TAG, "--- AP モード設定完了 ---");
 }
 
 /**
@@ -75,11 +72,8 @@ void setupAP() {
  * - IP アドレスの取得（DHCP）
  */
 void setupSTA() {
-  Serial.println("--- STA モード設定開始 ---");
-
-  Serial.print("接続先: ");
-  Serial.println(config.sta_ssid);
-  Serial.print("接続中");
+  LOG_INFO(LOG_TAG, "--- STA モード設定開始 ---");
+  LOG_INFO(LOG_TAG, "接続先: %s", config.sta_ssid);
 
   WiFi.begin(config.sta_ssid, config.sta_password);
 
@@ -87,34 +81,24 @@ void setupSTA() {
   unsigned long startAttemptTime = millis();
   while (WiFi.status() != WL_CONNECTED &&
          millis() - startAttemptTime < STA_CONNECTION_TIMEOUT) {
-    Serial.print(".");
     delay(WIFI_CONNECTION_CHECK_DELAY);
   }
-  Serial.println();
 
   if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("STA 接続成功");
-    Serial.print("STA IP アドレス: ");
-    Serial.println(WiFi.localIP());
-    Serial.print("サブネットマスク: ");
-    Serial.println(WiFi.subnetMask());
-    Serial.print("ゲートウェイ: ");
-    Serial.println(WiFi.gatewayIP());
-    Serial.print("DNS サーバー: ");
-    Serial.println(WiFi.dnsIP());
+    LOG_INFO(LOG_TAG, "STA 接続成功（%lu ms）", millis() - startAttemptTime);
+    LOG_INFO(LOG_TAG, "STA IP アドレス: %s", WiFi.localIP());
+    LOG_INFO(LOG_TAG, "サブネットマスク: %s", WiFi.subnetMask());
+    LOG_INFO(LOG_TAG, "ゲートウェイ: %s", WiFi.gatewayIP());
+    LOG_INFO(LOG_TAG, "DNS サーバー: %s", WiFi.dnsIP());
 
     // NAT 機能は WiFi イベントハンドラで自動的に有効化されます
-    Serial.println();
-    Serial.println("WiFi イベント ARDUINO_EVENT_WIFI_STA_GOT_IP で NAT を有効化します");
+    LOG_INFO(LOG_TAG, "WiFi イベント ARDUINO_EVENT_WIFI_STA_GOT_IP で NAT を有効化します");
   } else {
-    Serial.print("エラー: STA 接続に失敗しました（");
-    Serial.print(STA_CONNECTION_TIMEOUT / 1000);
-    Serial.println("秒タイムアウト）");
-    Serial.println("AP モードは引き続き動作します");
+    LOG_ERROR(LOG_TAG, "STA 接続に失敗しました（%lu 秒タイムアウト）", STA_CONNECTION_TIMEOUT / 1000);
+    LOG_WARN(LOG_TAG, "AP モードは引き続き動作します");
   }
 
-  Serial.println("--- STA モード設定完了 ---");
-  Serial.println();
+  LOG_INFO(LOG_TAG, "--- STA モード設定完了 ---");
 }
 
 /**
@@ -126,33 +110,27 @@ void setupSTA() {
 void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
   switch (event) {
     case ARDUINO_EVENT_WIFI_STA_GOT_IP:
-      Serial.println();
-      Serial.println("=== WiFi イベント: STA が IP アドレスを取得 ===");
-      Serial.print("IP アドレス: ");
-      Serial.println(WiFi.localIP());
+      LOG_INFO(LOG_TAG, "=== WiFi イベント: STA が IP アドレスを取得 (%s) ===", WiFi.localIP());
 
       // NAT をまだ有効化していない場合、フラグを立てる
       // 実際の有効化は loop() から行う
       if (!natEnabled) {
-        Serial.println("NAT 有効化リクエストをセット（loop() で実行されます）");
+        LOG_INFO(LOG_TAG, "NAT 有効化リクエストをセット（loop() で実行されます）");
         needEnableNAT = true;
       }
       break;
 
     case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
-      Serial.println();
-      Serial.println("=== WiFi イベント: STA 切断 ===");
+      LOG_WARN(LOG_TAG, "=== WiFi イベント: STA 切断 ===");
       natEnabled = false;  // 切断時に NAT フラグをリセット
       break;
 
     case ARDUINO_EVENT_WIFI_AP_STACONNECTED:
-      Serial.println();
-      Serial.println("=== WiFi イベント: AP にクライアント接続 ===");
+      LOG_INFO(LOG_TAG, "=== WiFi イベント: AP にクライアント接続 ===");
       break;
 
     case ARDUINO_EVENT_WIFI_AP_STADISCONNECTED:
-      Serial.println();
-      Serial.println("=== WiFi イベント: AP からクライアント切断 ===");
+      LOG_INFO(LOG_TAG, "=== WiFi イベント: AP からクライアント切断 ===");
       break;
 
     default:
@@ -173,8 +151,7 @@ void checkAndReconnectSTA() {
 
   // STA が切断されている場合、再接続を試みる
   if (!staConnected && (now - lastReconnectAttempt > STA_RECONNECT_INTERVAL)) {
-    Serial.println();
-    Serial.println("STA 切断検知 - 再接続中...");
+    LOG_WARN(LOG_TAG, "STA 切断検知 - 再接続中...");
     WiFi.disconnect();
     WiFi.begin(config.sta_ssid, config.sta_password);
     lastReconnectAttempt = now;
@@ -183,9 +160,7 @@ void checkAndReconnectSTA() {
   // 切断から接続に変わった場合
   // WiFiイベントハンドラで自動的にNATが再有効化されます
   if (staConnected && !lastSTAConnected) {
-    Serial.println();
-    Serial.println("STA 再接続成功");
-    Serial.println("（WiFi イベントハンドラが NAT を再有効化します）");
+    LOG_INFO(LOG_TAG, "STA 再接続成功（WiFi イベントハンドラが NAT を再有効化します）");
   }
 
   lastSTAConnected = staConnected;
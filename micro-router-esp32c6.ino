@@ -34,6 +34,8 @@
 #include "NATManager.h"
 #include "WebUIManager.h"
 #include "DNSFilterManager.h"  // Phase 8
+#include "Logger.h"
+#include "StatsHistory.h"
 #include "Utils.h"
 
 // ===== 定数の実体定義 =====
@@ -50,6 +52,7 @@ const unsigned long STATUS_PRINT_INTERVAL = 10000;
 const unsigned long STA_CONNECTION_TIMEOUT = 30000;
 const unsigned long CONFIG_SAVE_DELAY = 5000;
 const unsigned long NAT_ENABLE_DELAY = 1000;
+const unsigned long STATS_HISTORY_UPDATE_INTERVAL = 1000;
 
 const uint32_t MIN_FREE_HEAP_WARNING = 50000;
 
@@ -86,6 +89,7 @@ const uint16_t HTTP_STATUS_SEE_OTHER = 303;
 const uint16_t HTTP_STATUS_BAD_REQUEST = 400;
 const uint16_t HTTP_STATUS_NOT_FOUND = 404;
 const uint16_t HTTP_STATUS_INTERNAL_ERROR = 500;
+const uint16_t HTTP_STATUS_SERVICE_UNAVAILABLE = 503;
 
 // ===== 単位換算定数 =====
 const uint32_t BYTES_TO_KB_DIVISOR = 1024;
@@ -94,37 +98,116 @@ const uint8_t PERCENTAGE_MULTIPLIER = 100;
 
 // ===== DNS 設定 =====
 const IPAddress DEFAULT_UPSTREAM_DNS(8, 8, 8, 8);
+const IPAddress DEFAULT_UPSTREAM_DNS_SECONDARY(1, 1, 1, 1);
 const uint16_t DNS_FORWARD_TIMEOUT = 2000;
-const unsigned long DNS_POLLING_INTERVAL = 10;
+const uint32_t DNS_TASK_STACK_SIZE = 8192;
+const uint8_t DNS_TASK_PRIORITY = 2;
+const uint8_t DNS_MAX_PACKETS_PER_LOOP = 16;
+const uint32_t DNS_LOOP_BUDGET_US = 5000;
+const uint32_t DNS_TCP_IDLE_TIMEOUT = 10000;
+const uint16_t DNS_UPSTREAM_TCP_CONNECT_TIMEOUT = 1000;
+const uint32_t DNS_UPSTREAM_TCP_BACKOFF_MIN = 1000;
+const uint32_t DNS_UPSTREAM_TCP_BACKOFF_MAX = 60000;
+const uint16_t DNS_UPSTREAM_MIN_TIMEOUT = 300;
+const uint8_t DNS_UPSTREAM_MAX_FAILURES = 3;
+const unsigned long DNS_UPSTREAM_RETRY_INTERVAL = 30000;
+const unsigned long DNS_UPSTREAM_PROBE_INTERVAL = 60000;
+const unsigned long DNS_STATUS_PUBLISH_INTERVAL = 100;
+const unsigned long DNS_TRAFFIC_PUBLISH_INTERVAL = 1000;
+const char* PREF_KEY_DNS_UPSTREAMS = "dns_upstreams";
+const char* PREF_KEY_DNS_UPSTREAM_RACE = "dns_up_race";
+const char* PREF_KEY_DNS_UPSTREAM_TCP = "dns_up_tcp";
 
 // ===== DNS パケット定数 =====
 const uint8_t DNS_COMPRESSION_POINTER_MASK = 0xC0;
 const uint8_t DNS_LABEL_MAX_LENGTH = 63;
-const uint8_t DNS_RESPONSE_FLAGS_BYTE2 = 0x81;
 const uint8_t DNS_RESPONSE_FLAGS_BYTE3 = 0x80;
 const uint16_t DNS_COMPRESSION_POINTER_QUERY = 0xC00C;
 const uint16_t DNS_TYPE_A = 0x0001;
+const uint16_t DNS_TYPE_AAAA = 0x001C;
+const uint16_t DNS_TYPE_SOA = 0x0006;
+const uint16_t DNS_TYPE_OPT = 41;
 const uint16_t DNS_CLASS_IN = 0x0001;
 const uint32_t DNS_TTL_SECONDS = 300;
 const uint8_t DNS_IPV4_ADDRESS_LENGTH = 4;
+const uint8_t DNS_IPV6_ADDRESS_LENGTH = 16;
+const uint8_t DNS_RCODE_SERVFAIL = 2;
+const uint8_t DNS_RCODE_NXDOMAIN = 3;
+const uint8_t DNS_RCODE_REFUSED = 5;
 const IPAddress DNS_BLOCKED_IP(0, 0, 0, 0);
 
+// ===== ブロック応答ポリシー設定 =====
+const char* PREF_KEY_DNS_BLOCK_POLICY = "dns_blk_policy";
+const char* PREF_KEY_DNS_TTL_NULL_IP = "dns_ttl_null";
+const char* PREF_KEY_DNS_TTL_NODATA = "dns_ttl_nodata";
+const char* PREF_KEY_DNS_TTL_NXDOMAIN = "dns_ttl_nx";
+const uint32_t DNS_NEGATIVE_TTL_SECONDS = 300;
+const uint32_t DNS_BLOCK_TTL_MAX = 86400;
+const uint32_t DNS_SOA_SERIAL = 1;
+const uint32_t DNS_SOA_REFRESH_SECONDS = 3600;
+const uint32_t DNS_SOA_RETRY_SECONDS = 600;
+const uint32_t DNS_SOA_EXPIRE_SECONDS = 86400;
+
+// ===== DNS キャッシュ設定 =====
+const size_t DNS_CACHE_ARENA_SIZE = 24576;
+const uint32_t DNS_CACHE_MAX_TTL = 86400;
+const uint32_t DNS_CACHE_STALE_TTL = 30;
+const uint32_t DNS_CACHE_STALE_MAX = 86400;
+const uint16_t DNS_CACHE_PREFETCH_MIN_HITS = 2;
+const uint8_t DNS_CACHE_PREFETCH_PERCENT = 10;
+
 // ===== ドメイン名検証定数 =====
 const size_t DOMAIN_NAME_MIN_LENGTH = 3;
 const size_t DOMAIN_NAME_MAX_LENGTH = 253;
 
-// ===== ブロックリストメモリ設定 =====
-const size_t BLOCKLIST_BUFFER_SIZE = 131072;  // 128KB（5000ドメイン×平均20文字×1.3倍の余裕）
+// ===== ブロックリストファイル =====
+const char* const BLOCKLIST_TEXT_PATHS[DNS_BLOCKLIST_COUNT] = {
+  "/blocklist.txt", "/blocklist-trackers.txt", "/blocklist-malware.txt", "/blocklist-custom.txt"
+};
+const char* const BLOCKLIST_BINARY_PATHS[DNS_BLOCKLIST_COUNT] = {
+  "/blocklist.bin", "/blocklist-trackers.bin", "/blocklist-malware.bin", "/blocklist-custom.bin"
+};
+const char* const BLOCKLIST_GZIP_PATHS[DNS_BLOCKLIST_COUNT] = {
+  "/blocklist.gz", "/blocklist-trackers.gz", "/blocklist-malware.gz", "/blocklist-custom.gz"
+};
+const char* const BLOCKLIST_TEXT_BACKUP_PATHS[DNS_BLOCKLIST_COUNT] = {
+  "/blocklist.txt.bak", "/blocklist-trackers.txt.bak", "/blocklist-malware.txt.bak", "/blocklist-custom.txt.bak"
+};
+const char* const BLOCKLIST_BINARY_BACKUP_PATHS[DNS_BLOCKLIST_COUNT] = {
+  "/blocklist.bin.bak", "/blocklist-trackers.bin.bak", "/blocklist-malware.bin.bak", "/blocklist-custom.bin.bak"
+};
+const char* const BLOCKLIST_GZIP_BACKUP_PATHS[DNS_BLOCKLIST_COUNT] = {
+  "/blocklist.gz.bak", "/blocklist-trackers.gz.bak", "/blocklist-malware.gz.bak", "/blocklist-custom.gz.bak"
+};
+const char* BLOCKLIST_UPLOAD_PATH = "/blocklist.txt.tmp";
+const char* BLOCKLIST_JOURNAL_PATH = "/blocklist.journal";
+const char* BLOCKLIST_COMPACT_PATH = "/blocklist.bin.tmp";
+const uint16_t BLOCKLIST_COMPACT_ENTRIES = 128;
+const uint32_t BLOCKLIST_COMPACT_BACKOFF_MIN = 10000;
+const uint32_t BLOCKLIST_COMPACT_BACKOFF_MAX = 600000;
+const unsigned long BLOCKLIST_SWAP_TIMEOUT = 5000;
+const char* PREF_KEY_DNS_BLOCKLISTS = "dns_lists";
+
+// ===== プレフィルタ設定 =====
+const char* PREF_KEY_DNS_PREFILTER_BITS = "dns_bloom_bits";
+const uint8_t DNS_PREFILTER_DEFAULT_BITS = 10;
+
+// ===== ログ設定 =====
+const char* PREF_KEY_LOG_LEVEL = "log_level";
+const uint8_t LOG_DRAIN_PER_LOOP = 8;
 
 // ===== グローバル変数 =====
 WebServer server(WEB_SERVER_PORT);
 Preferences preferences;
 WifiConfig config;
 DNSFilterManager dnsFilter;  // Phase 8
+Logger logger;
+StatsHistory statsHistory;
 
 // ===== 状態管理変数 =====
 unsigned long lastReconnectAttempt = 0;  // 最後の再接続試行時刻
 unsigned long lastStatusPrint = 0;       // 最後のステータス表示時刻
+unsigned long lastHistoryUpdate = 0;     // 最後の推移記録時刻
 bool lastSTAConnected = false;           // 前回の STA 接続状態
 bool natEnabled = false;                 // NAT 有効化済みフラグ
 bool needEnableNAT = false;              // NAT 有効化リクエストフラグ
@@ -137,6 +220,11 @@ void setup() {
   Serial.begin(115200);
   delay(SERIAL_STABILIZE_DELAY);  // シリアルの安定化を待つ
 
+  // ログレベルの読み込み（setup() 中は同期出力）
+  preferences.begin(PREF_NAMESPACE, true);
+  logger.setLevel(preferences.getUChar(PREF_KEY_LOG_LEVEL, LOG_LEVEL_INFO));
+  preferences.end();
+
   Serial.println();
   printSeparator("XIAO ESP32C6 マイクロ Wi-Fi ルーター");
   Serial.println();
@@ -189,6 +277,22 @@ void setup() {
   }
 
   // DNS フィルタの初期化（Phase 8）
+  // プレフィルタ設定はブロックリスト読み込み前に反映する
+  preferences.begin(PREF_NAMESPACE, true);
+  dnsFilter.setPrefilterBitsPerEntry(preferences.getUChar(PREF_KEY_DNS_PREFILTER_BITS, DNS_PREFILTER_DEFAULT_BITS));
+  dnsFilter.setBlockPolicy((DNSBlockPolicy)preferences.getUChar(PREF_KEY_DNS_BLOCK_POLICY, DNS_BLOCK_POLICY_NULL_IP));
+  dnsFilter.setBlockTTL(DNS_BLOCK_POLICY_NULL_IP, preferences.getULong(PREF_KEY_DNS_TTL_NULL_IP, DNS_TTL_SECONDS));
+  dnsFilter.setBlockTTL(DNS_BLOCK_POLICY_NODATA, preferences.getULong(PREF_KEY_DNS_TTL_NODATA, DNS_NEGATIVE_TTL_SECONDS));
+  dnsFilter.setBlockTTL(DNS_BLOCK_POLICY_NXDOMAIN, preferences.getULong(PREF_KEY_DNS_TTL_NXDOMAIN, DNS_NEGATIVE_TTL_SECONDS));
+  String upstreamList = preferences.getString(PREF_KEY_DNS_UPSTREAMS, "");
+  if (upstreamList.length() > 0) {
+    dnsFilter.setUpstreams(upstreamList);
+  }
+  dnsFilter.setUpstreamRacing(preferences.getBool(PREF_KEY_DNS_UPSTREAM_RACE, false));
+  dnsFilter.setUpstreamTcp(preferences.getBool(PREF_KEY_DNS_UPSTREAM_TCP, false));
+  dnsFilter.setEnabledBlocklists(preferences.getUChar(PREF_KEY_DNS_BLOCKLISTS, DNS_BLOCKLIST_ALL));
+  preferences.end();
+
   if (dnsFilter.begin()) {
     Serial.println("DNS フィルタを正常に起動しました");
 
@@ -204,7 +308,12 @@ void setup() {
     // 未設定 または 設定済みだが接続できていない場合は有効化
     if (!config.configured || WiFi.status() != WL_CONNECTED) {
       dnsFilter.setCaptivePortal(true);
+    } else {
+      dnsFilter.setDhcpUpstream(WiFi.dnsIP());
     }
+
+    // 受信・判定・応答は専用タスクで行う（loop() の処理で名前解決を止めない）
+    dnsFilter.startTask();
   } else {
     Serial.println("DNS フィルタの起動に失敗しました");
   }
@@ -212,20 +321,31 @@ void setup() {
   Serial.println();
   printSeparator("セットアップ完了");
   Serial.println();
+
+  // 以降のログは loop() の空き時間に出力する
+  logger.setAsync(true);
 }
 
 // ===== ループ処理 =====
 
 void loop() {
+  // 前回の loop() で送りきれなかったログの行を送り終える（以降の Serial への直接出力が行の途中に入らないように）
+  logger.finishLine();
+
   // NAT 有効化リクエストの処理
   processNATEnableRequest();
 
-  // DNS フィルタの処理（Phase 8）
-  dnsFilter.handleClient();
+  // DNS フィルタの処理（Phase 8、DNS タスクを起動できなかった場合のみ）
+  if (!dnsFilter.isTaskRunning()) {
+    dnsFilter.handleClient();
+  }
 
   // Web サーバーのリクエスト処理
   server.handleClient();
 
+  // ブロックリストの差分が溜まっていればトライに統合
+  dnsFilter.compactBlocklistIfNeeded();
+
   // STA 再接続処理
   checkAndReconnectSTA();
 
@@ -235,6 +355,7 @@ void loop() {
     bool currentlyConnected = (WiFi.status() == WL_CONNECTED);
     if (currentlyConnected && dnsFilter.isCaptivePortal()) {
       dnsFilter.setCaptivePortal(false);
+      dnsFilter.setDhcpUpstream(WiFi.dnsIP());  // ホームルーターが配布した DNS も上流候補にする
       Serial.println("Captive Portal: 無効化 (インターネット接続復帰)");
     } else if (!currentlyConnected && !dnsFilter.isCaptivePortal()) {
       dnsFilter.setCaptivePortal(true);
@@ -249,5 +370,14 @@ void loop() {
 
   // 定期的なステータス表示
   printPeriodicStatus();
+
+  // クエリ数と空きヒープの推移を記録
+  if (millis() - lastHistoryUpdate >= STATS_HISTORY_UPDATE_INTERVAL) {
+    lastHistoryUpdate = millis();
+    statsHistory.update(lastHistoryUpdate, ESP.getFreeHeap(), dnsFilter.getStats());
+  }
+
+  // 溜まったログをシリアルの送信バッファに入る分だけ出力
+  logger.process(LOG_DRAIN_PER_LOOP);
 }
 
@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+"""
+compile_blocklist.py
+
+ドメインリスト（1 行 1 ドメイン、hosts 形式、Adblock Plus の ||domain^ 形式）を
+ESP32C6 DNS フィルタリング用のコンパイル済みブロックリスト (blocklist.bin) に変換します。
+
+blocklist.bin は起動時に解析処理なしで読み込まれます。
+形式は DomainTrie.h のコメントを参照してください。
+
+使用方法:
+    python3 compile_blocklist.py <input.txt> <output.bin>
+
+例:
+    python3 compile_blocklist.py domain.txt blocklist.bin
+"""
+
+import struct
+import sys
+import zlib
+
+from convert_adblock_to_domains import extract_domain_from_adblock_rule, is_valid_domain
+
+FILE_MAGIC = b'MRBL'
+FILE_VERSION = 1
+FLAG_TERMINAL = 0x01
+KEY_SEPARATOR = b'\x01'
+MAX_LABELS = 32
+U24_LIMIT = 1 << 24
+
+
+def parse_line(line):
+    """1 行からドメイン名を取り出す（デバイス側の読み込み規則と同じ）"""
+    line = line.strip()
+    if not line or line.startswith('#') or line.startswith('!') or line.startswith('['):
+        return None
+
+    # hosts 形式
+    for prefix in ('0.0.0.0 ', '127.0.0.1 '):
+        if line.startswith(prefix):
+            line = line[len(prefix):].strip()
+
+    # Adblock Plus 形式
+    if '^' in line or line.startswith('|'):
+        line = extract_domain_from_adblock_rule(line)
+
+    if not line or not is_valid_domain(line) or line.startswith('.') or line.endswith('.'):
+        return None
+    return line.lower()
+
+
+def write_varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+class TrieBuilder:
+    """DomainTrieBuilder (DomainTrie.cpp) と同じ手順でバイト配列を生成する"""
+
+    def __init__(self, domains):
+        keys = set()
+        for domain in domains:
+            labels = domain.split('.')
+            if len(labels) <= MAX_LABELS and all(labels):
+                keys.add(KEY_SEPARATOR.join(l.encode('ascii') for l in reversed(labels)))
+        self.keys = sorted(keys)
+        self.labels = bytearray()
+        self.nodes = bytearray()
+        self.label_offsets = {}
+        self.node_offsets = {}
+        self.terminal_count = 0
+
+    def intern_label(self, label):
+        offset = self.label_offsets.get(label)
+        if offset is None:
+            offset = len(self.labels)
+            self.labels.append(len(label))
+            self.labels += label
+            self.label_offsets[label] = offset
+        return offset
+
+    def emit_node(self, lo, hi, prefix_len):
+        flags = 0
+        i = lo
+        if prefix_len > 0 and len(self.keys[lo]) == prefix_len - 1:
+            flags |= FLAG_TERMINAL
+            self.terminal_count += 1
+            i += 1
+
+        edges = []
+        while i < hi:
+            key = self.keys[i]
+            end = key.find(KEY_SEPARATOR, prefix_len)
+            label = key[prefix_len:] if end < 0 else key[prefix_len:end]
+
+            j = i + 1
+            while j < hi:
+                other = self.keys[j]
+                boundary = prefix_len + len(label)
+                if other[prefix_len:boundary] != label or \
+                        (len(other) > boundary and other[boundary:boundary + 1] != KEY_SEPARATOR):
+                    break
+                j += 1
+
+            child = self.emit_node(i, j, prefix_len + len(label) + 1)
+            edges.append((self.intern_label(label), child))
+            i = j
+
+        node = bytearray([flags]) + write_varint(len(edges))
+        for label_offset, child in edges:
+            node += struct.pack('<I', label_offset)[:3] + struct.pack('<I', child)[:3]
+
+        # 同一内容のノード（部分木）は共有する
+        node = bytes(node)
+        offset = self.node_offsets.get(node)
+        if offset is None:
+            offset = len(self.nodes)
+            self.nodes += node
+            self.node_offsets[node] = offset
+            if len(self.nodes) >= U24_LIMIT or len(self.labels) >= U24_LIMIT:
+                raise ValueError('blocklist too large for 24-bit offsets')
+        return offset
+
+    def build(self):
+        sys.setrecursionlimit(max(1000, MAX_LABELS * 4))
+        root = self.emit_node(0, len(self.keys), 0)
+        header = struct.pack('<IIII', len(self.labels), len(self.nodes), root, self.terminal_count)
+        return header + bytes(self.labels) + bytes(self.nodes)
+
+
+def compile_blocklist(input_file, output_file):
+    """ドメインリストをコンパイル済みブロックリストに変換"""
+    print(f"Reading from {input_file}...")
+
+    domains = []
+    with open(input_file, 'r', encoding='utf-8') as f:
+        for line in f:
+            domain = parse_line(line)
+            if domain:
+                domains.append(domain)
+
+    builder = TrieBuilder(domains)
+    payload = builder.build()
+    header = FILE_MAGIC + struct.pack('<HHII', FILE_VERSION, 0, len(payload), zlib.crc32(payload) & 0xFFFFFFFF)
+
+    with open(output_file, 'wb') as f:
+        f.write(header)
+        f.write(payload)
+
+    count = builder.terminal_count
+    size = len(header) + len(payload)
+    print(f"Done! {count} domains, {size} bytes ({size / max(count, 1):.1f} bytes/domain) written to {output_file}")
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("Usage: python3 compile_blocklist.py <input.txt> <output.bin>")
+        print("\nExample:")
+        print("  python3 compile_blocklist.py domain.txt blocklist.bin")
+        sys.exit(1)
+
+    input_file = sys.argv[1]
+    output_file = sys.argv[2]
+
+    try:
+        compile_blocklist(input_file, output_file)
+    except FileNotFoundError:
+        print(f"Error: File '{input_file}' not found")
+        sys.exit(1)
+    except Exception as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()